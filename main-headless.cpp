@@ -0,0 +1,331 @@
+/* Headless frontend, driven by a script.
+ *
+ *   one-headed-dog-headless [-z80|-6502] [-nojit] [-script FILE] [-record FILE]
+ *                           [-replay FILE] [-capture FILE] [-mathcycles N]
+ *                           [program.bin]
+ *
+ * Runs frames back to back without a window, reading commands from FILE or
+ * stdin, one per line:
+ *
+ *   type TEXT       queue keys, with \r \n \t \e \\ and \xHH escapes
+ *   expect REGEX    run until the screen text matches the POSIX extended REGEX
+ *   changed         run until the screen differs from when the command ran
+ *   match HASH      run until screen_hash() equals HASH
+ *   frames N        run N frames
+ *   timeout N       frames expect, changed and match wait before failing,
+ *                   default 1500
+ *   screen          print the screen text
+ *   hash            print screen_hash(), as match takes it
+ *   png FILE        write the rendered frame to FILE
+ *   dump ADDR LEN   hex dump memory, numbers in hex
+ *   quit [STATUS]   exit
+ *   # comment
+ *
+ * Keys reach CAT one per frame like typing. While a program runs, the next
+ * key is held until the guest has taken the previous one from the mailbox;
+ * F12 (\x01) always goes through.
+ * The screen text and hash are those of screen.h.
+ *
+ * A wait that times out prints the screen to stderr and exits with status 1, the
+ * end of the script exits with 0. The timer's MICROS register counts emulated
+ * time, so runs are repeatable.
+ */
+
+#include "src/breakpoints.h"
+#include "src/capture.h"
+#include "src/cerberus.h"
+#include "src/mathcop.h"
+#include "src/native.h"
+#include "src/ps2.h"
+#include "src/replay.h"
+#include "src/screen.h"
+#include <ctype.h>
+#include <deque>
+#include <regex.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+// stuff from cat.cpp
+extern void cat_setup();
+extern char* autoloadBinaryFilename;
+
+#define OUTBOX_FLAG 0x0200 // config_outbox_flag in cat.cpp
+
+#define DEFAULT_TIMEOUT 1500 // frames, 30 seconds
+
+static std::deque<uint8_t> keyQueue;
+
+static FILE* script;
+enum {
+    WAIT_NONE,
+    WAIT_TEXT, /* expect */
+    WAIT_CHANGE, /* changed */
+    WAIT_HASH, /* match */
+};
+
+static int frames_left; /* frames command */
+static int waiting = WAIT_NONE;
+static regex_t expect_re;
+static bool expect_compiled;
+static uint64_t wait_hash;
+static std::string wait_text; /* the command, for the timeout message */
+static int timeout = DEFAULT_TIMEOUT;
+static int wait_left;
+
+static char* screen()
+{
+    static char text[SCREEN_TEXT_SIZE];
+    screen_text(text);
+    return text;
+}
+
+static void wait_for(int what, const char* text)
+{
+    waiting = what;
+    wait_text = text;
+    wait_left = timeout;
+}
+
+/* the wait is over */
+static bool waited()
+{
+    switch (waiting) {
+    case WAIT_TEXT:
+        return regexec(&expect_re, screen(), 0, NULL, 0) == 0;
+    case WAIT_CHANGE:
+        return screen_hash() != wait_hash;
+    case WAIT_HASH:
+        return screen_hash() == wait_hash;
+    default:
+        return true;
+    }
+}
+
+static void dump(unsigned int addr, unsigned int len)
+{
+    for (unsigned int i = 0; i < len; i += 16) {
+        printf("%04X:", (addr + i) & 0xffff);
+        for (unsigned int j = i; j < i + 16 && j < len; j++)
+            printf(" %02X", cpeek(addr + j));
+        printf("\n");
+    }
+}
+
+static void type(const char* p)
+{
+    while (*p) {
+        if (*p != '\\' || !p[1]) {
+            keyQueue.push_back(*p++);
+            continue;
+        }
+        p++;
+        switch (*p) {
+        case 'r':
+            keyQueue.push_back('\r');
+            break;
+        case 'n':
+            keyQueue.push_back('\n');
+            break;
+        case 't':
+            keyQueue.push_back('\t');
+            break;
+        case 'e':
+            keyQueue.push_back(27);
+            break;
+        case 'x': {
+            int key = 0;
+            for (int i = 0; i < 2 && isxdigit((uint8_t)p[1]); i++, p++)
+                key = key << 4 | (isdigit((uint8_t)p[1]) ? p[1] - '0' : (tolower(p[1]) - 'a' + 10));
+            keyQueue.push_back(key);
+            break;
+        }
+        default:
+            keyQueue.push_back(*p);
+            break;
+        }
+        p++;
+    }
+}
+
+static void fail(const char* format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    fputs(screen(), stderr);
+    exit(1);
+}
+
+/* Run one command, false at the end of the script. */
+static bool command()
+{
+    char line[1024];
+    if (!fgets(line, sizeof line, script))
+        return false;
+    line[strcspn(line, "\r\n")] = '\0';
+    char* arg = line + strcspn(line, " ");
+    if (*arg)
+        *arg++ = '\0';
+
+    if (line[0] == '\0' || line[0] == '#') {
+    } else if (strcmp(line, "type") == 0) {
+        type(arg);
+    } else if (strcmp(line, "expect") == 0) {
+        if (expect_compiled)
+            regfree(&expect_re);
+        expect_compiled = regcomp(&expect_re, arg, REG_EXTENDED | REG_NOSUB) == 0;
+        if (!expect_compiled)
+            fail("bad expression: %s\n", arg);
+        wait_for(WAIT_TEXT, arg);
+    } else if (strcmp(line, "changed") == 0) {
+        wait_hash = screen_hash();
+        wait_for(WAIT_CHANGE, line);
+    } else if (strcmp(line, "match") == 0) {
+        wait_hash = strtoull(arg, NULL, 16);
+        wait_for(WAIT_HASH, arg);
+    } else if (strcmp(line, "frames") == 0) {
+        frames_left = atoi(arg);
+    } else if (strcmp(line, "timeout") == 0) {
+        timeout = atoi(arg);
+    } else if (strcmp(line, "screen") == 0) {
+        fputs(screen(), stdout);
+    } else if (strcmp(line, "hash") == 0) {
+        printf("%016llx\n", (unsigned long long)screen_hash());
+    } else if (strcmp(line, "png") == 0) {
+        if (!screen_write_png(arg))
+            fail("could not write %s\n", arg);
+    } else if (strcmp(line, "dump") == 0) {
+        char* end;
+        unsigned int addr = strtoul(arg, &end, 16);
+        dump(addr, strtoul(end, NULL, 16));
+    } else if (strcmp(line, "quit") == 0) {
+        exit(atoi(arg));
+    } else {
+        fail("unknown command: %s\n", line);
+    }
+    fflush(stdout);
+    return true;
+}
+
+/* One frame has passed, or CAT waited for a key: count down the wait and
+ * run commands until one has to wait. False once the script has ended. */
+static bool script_tick()
+{
+    if (frames_left > 0)
+        frames_left--;
+    if (waiting)
+        wait_left--;
+    for (;;) {
+        if (frames_left > 0)
+            return true;
+        if (waiting) {
+            if (!waited()) {
+                if (wait_left <= 0)
+                    fail("timed out: %s\n", wait_text.c_str());
+                return true;
+            }
+            waiting = WAIT_NONE;
+        }
+        if (!command())
+            return false;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const char* scriptFilename = NULL;
+    const char* recordFilename = NULL;
+    const char* replayFilename = NULL;
+    const char* captureFilename = NULL;
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-z80") == 0) {
+            mode = true;
+        } else if (strcmp(argv[arg], "-z80fast") == 0) {
+            mode = true;
+            cpu_z80fast = true;
+        } else if (strcmp(argv[arg], "-6502") == 0) {
+            mode = false;
+        } else if (strcmp(argv[arg], "-nojit") == 0) {
+            native_enabled = false;
+        } else if (strcmp(argv[arg], "-script") == 0 && arg + 1 < argc) {
+            scriptFilename = argv[++arg];
+        } else if (strcmp(argv[arg], "-record") == 0 && arg + 1 < argc) {
+            recordFilename = argv[++arg];
+        } else if (strcmp(argv[arg], "-replay") == 0 && arg + 1 < argc) {
+            replayFilename = argv[++arg];
+        } else if (strcmp(argv[arg], "-capture") == 0 && arg + 1 < argc) {
+            captureFilename = argv[++arg];
+        } else if (strcmp(argv[arg], "-mathcycles") == 0 && arg + 1 < argc) {
+            math_set_cycle_cost(atoi(argv[++arg]));
+        } else {
+            autoloadBinaryFilename = argv[arg];
+        }
+    }
+
+    script = scriptFilename && strcmp(scriptFilename, "-") != 0 ? fopen(scriptFilename, "r") : stdin;
+    if (!script) {
+        perror(scriptFilename);
+        return 1;
+    }
+    if (replayFilename && !replay_play(replayFilename)) {
+        fprintf(stderr, "could not replay %s\n", replayFilename);
+        return 1;
+    }
+    if (recordFilename && !replayFilename && !replay_record(recordFilename)) {
+        fprintf(stderr, "could not record to %s\n", recordFilename);
+        return 1;
+    }
+    if (captureFilename && !capture_start(captureFilename, false)) {
+        fprintf(stderr, "could not capture to %s\n", captureFilename);
+        return 1;
+    }
+    atexit(replay_close); // also on quit and failures
+    atexit(capture_stop);
+
+    cat_setup();
+    while (script_tick()) {
+        replay_next_frame();
+        if (!bp_stopped)
+            cpuInterrupt();
+        cat_loop();
+        cpu_clockcycles(fast ? 160000 : 80000);
+        capture_frame();
+    }
+    return 0;
+}
+
+int readKey()
+{
+    // one key at a time into the mailbox of a running program
+    if (keyQueue.empty() || (cpurunning && cpeek(OUTBOX_FLAG) && keyQueue.front() != PS2_F12))
+        return replay_key(0);
+    uint8_t key = keyQueue.front();
+    keyQueue.pop_front();
+    return replay_key(key);
+}
+
+void platform_delay(int ms)
+{
+    // CAT waits for a key, let the script go on
+    if (!script_tick())
+        exit(0);
+}
+
+uint64_t platform_micros()
+{
+    return cpu_cycles / (fast ? 8 : 4);
+}
+
+void debug_log(const char* format, ...)
+{
+#ifdef DEBUG
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+#endif /* DEBUG */
+}
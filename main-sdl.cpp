@@ -1,4 +1,14 @@
+#include "src/breakpoints.h"
+#include "src/capture.h"
 #include "src/cerberus.h"
+#include "src/gdbstub.h"
+#include "src/io.h"
+#include "src/mathcop.h"
+#include "src/metrics.h"
+#include "src/native.h"
+#include "src/replay.h"
+#include "src/screen.h"
+#include "src/trace.h"
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_render.h>
 #include <SDL2/SDL_video.h>
@@ -13,21 +23,14 @@ extern volatile bool fast;
 extern volatile bool mode;
 extern void runCode();
 extern char* autoloadBinaryFilename;
+extern const uint8_t chardefs[];
 
 static std::deque<uint8_t> keyQueue;
+static std::deque<uint64_t> keyTimes; /* metrics_ns() when each key was queued */
 static std::mutex keyQueueMutex;
+static bool hudVisible;
 
-const uint8_t cerb_color[8][3] = {
-    { 0, 255, 0 },
-    { 255, 0, 0 },
-    { 0, 0, 255 },
-    { 255, 255, 0 },
-    { 0, 255, 255 },
-    { 255, 0, 255 },
-    { 0, 0, 0 },
-    { 255, 255, 255 }
-};
-uint8_t buf[320 * 240 * 3];
+uint8_t buf[SCREEN_WIDTH * SCREEN_HEIGHT * 3];
 
 SDL_Window* window = NULL;
 
@@ -42,50 +45,124 @@ SDL_Rect calc_4_3_output_rect()
     }
 }
 
-void draw_screen(SDL_Renderer* renderer, SDL_Texture* tex)
+// lines of text over the screen from row on, in the built-in font
+static void draw_text(const char* text, int row, const uint8_t* color)
 {
-    memset(buf, 0, sizeof buf);
-    buf[0] = 0xff;
-
-    const uint8_t* bgcolor = cerb_color[6];
-
-    for (int scanLine = 0; scanLine < 240; scanLine++) {
-        for (int col = 0; col < 40; col++) {
-            // what tile?
-            uint8_t tile_num = cerb_ram[0xf800 + (scanLine / 8) * 40 + col];
-            // what line in the tile (0-7)
-            int tile_line = (scanLine & 0x7);
-            uint8_t tile_dat = cerb_ram[0xf000 + tile_num * 8 + tile_line];
-            const uint8_t* fgcolor = cerb_color[7];
-            if (tile_num >= 8 && tile_num < 32) {
-                fgcolor = cerb_color[(tile_num - 8) % 6];
-            }
-
-            for (int p = 0; p < 8; p++) {
-                const uint8_t* color = tile_dat & (0x80 >> p) ? fgcolor : bgcolor;
-                const int x = col * 8 + p;
-                memcpy((void*)&buf[scanLine * 320 * 3 + x * 3], (void*)color, 3);
-            }
+    int rows = 0;
+    for (const char* p = text; *p; p++)
+        rows += *p == '\n';
+    int col = 0;
+    memset(&buf[row * 8 * 320 * 3], 0x20, rows * 8 * 320 * 3);
+    for (const char* p = text; *p; p++) {
+        if (*p == '\n') {
+            row++;
+            col = 0;
+            continue;
+        }
+        if (col == 40)
+            continue;
+        for (int line = 0; line < 8; line++) {
+            uint8_t bits = chardefs[(uint8_t)*p * 8 + line];
+            for (int x = 0; x < 8; x++)
+                if (bits & (0x80 >> x))
+                    memcpy(&buf[((row * 8 + line) * 320 + col * 8 + x) * 3], color, 3);
         }
+        col++;
     }
+}
+
+// the stopped CPU's state over the bottom of the screen
+static void draw_debugger()
+{
+    char text[512];
+    {
+        std::lock_guard<std::mutex> lock(bp_machine_mutex);
+        bp_format_state(text, sizeof text - 32);
+    }
+    strcat(text, "F5 continue  F10 step  F9 stop\n");
+
+    int rows = 0;
+    for (const char* p = text; *p; p++)
+        rows += *p == '\n';
+    draw_text(text, SCREEN_ROWS - rows, screen_palette[3]);
+}
+
+// the last metrics window over the top of the screen
+static void draw_hud()
+{
+    metrics_window w;
+    char text[256];
+    if (!metrics_last(&w))
+        return;
+    metrics_format_hud(&w, text, sizeof text);
+    draw_text(text, 0, screen_palette[4]);
+}
+
+// F5, F9 and F10 drive the breakpoints (breakpoints.h), F8 shows the metrics
+static bool debugger_key(SDL_Keycode key)
+{
+    std::lock_guard<std::mutex> lock(bp_machine_mutex);
+    switch (key) {
+    case SDLK_F8:
+        hudVisible = !hudVisible;
+        metrics_start(METRICS_PERIOD_MS);
+        return true;
+    case SDLK_F5:
+        if (bp_stopped)
+            bp_resume(false);
+        return true;
+    case SDLK_F9:
+        bp_interrupt();
+        return true;
+    case SDLK_F10:
+        if (bp_stopped)
+            bp_resume(true);
+        return true;
+    default:
+        return false;
+    }
+}
+
+void draw_screen(SDL_Renderer* renderer, SDL_Texture* tex)
+{
+    uint64_t started = metrics_enabled ? metrics_ns() : 0;
+    screen_render(buf);
+
+    if (bp_stopped)
+        draw_debugger();
+    if (hudVisible)
+        draw_hud();
 
     SDL_Rect dest_rect = calc_4_3_output_rect();
 
-    SDL_UpdateTexture(tex, NULL, buf, 320 * 3);
+    SDL_UpdateTexture(tex, NULL, buf, SCREEN_WIDTH * 3);
     SDL_RenderClear(renderer);
     SDL_RenderCopy(renderer, tex, NULL, &dest_rect);
+    // not counting the wait for vsync
+    if (metrics_enabled)
+        metrics_render(metrics_ns() - started);
     SDL_RenderPresent(renderer);
 }
 
+static void queue_key(uint8_t key)
+{
+    keyQueue.push_back(key);
+    keyTimes.push_back(metrics_ns());
+}
+
 int readKey()
 {
     auto lock = std::unique_lock<std::mutex>(keyQueueMutex);
     if (keyQueue.empty()) {
-        return 0;
+        return replay_key(0);
     } else {
         uint8_t key = keyQueue.front();
         keyQueue.pop_front();
-        return key;
+        // a key for a running program goes to its mailbox now
+        if (metrics_enabled && cpurunning && key != PS2_F12 && replay_mode != REPLAY_PLAY)
+            metrics_key(metrics_ns() - keyTimes.front());
+        keyTimes.pop_front();
+        return replay_key(key);
     }
     return 0;
 }
@@ -95,9 +172,22 @@ static void loop()
     using namespace std::chrono_literals;
     auto t = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
     for (;;) {
-        cpuInterrupt();
-        cat_loop();
-        cpu_clockcycles(fast ? 160000 : 80000); // 8 mhz cycles in 0.02 seconds
+        uint64_t started = metrics_enabled ? metrics_ns() : 0;
+        uint64_t cycles, instructions;
+        {
+            std::lock_guard<std::mutex> lock(bp_machine_mutex);
+            cycles = cpu_cycles;
+            instructions = cpu_instructions;
+            replay_next_frame();
+            if (!bp_stopped)
+                cpuInterrupt();
+            cat_loop();
+            cpu_clockcycles(fast ? 160000 : 80000); // 8 mhz cycles in 0.02 seconds
+            capture_frame();
+            cycles = cpu_cycles - cycles;
+            instructions = cpu_instructions - instructions;
+        }
+        uint64_t worked = metrics_enabled ? metrics_ns() : 0;
         // 50Hz timer (every 0.02 seconds)
         typeof(t) now;
         for (;;) {
@@ -106,8 +196,9 @@ static void loop()
                 break;
             std::this_thread::sleep_for(1ms);
         }
-
-        // debug_log("CPU clock %.2f MHz\r\n", (fast ? 8.0 : 4.0) * 20000.0/ (now - t));
+        // started is 0 in the frame metrics were switched on in
+        if (metrics_enabled && started)
+            metrics_frame(worked - started, metrics_ns() - worked, cycles, instructions);
         t = now;
     }
 }
@@ -133,18 +224,77 @@ int main(int argc, char* argv[])
     SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
     SDL_Texture* tex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING, 320, 240);
 
+    const char* recordFilename = NULL;
+    const char* replayFilename = NULL;
+    const char* captureFilename = NULL;
+    const char* metricsTarget = NULL;
+    int metricsPeriod = METRICS_PERIOD_MS;
     for (int arg = 1; arg < argc; arg++) {
         if (strcmp(argv[arg], "-z80") == 0) {
             mode = true;
+        } else if (strcmp(argv[arg], "-z80fast") == 0) {
+            mode = true;
+            cpu_z80fast = true;
         } else if (strcmp(argv[arg], "-6502") == 0) {
             mode = false;
+        } else if (strcmp(argv[arg], "-nojit") == 0) {
+            native_enabled = false;
+        } else if (strcmp(argv[arg], "-trap") == 0 && arg + 1 < argc) {
+            trace_set_trap(strtol(argv[++arg], NULL, 16));
+        } else if (strcmp(argv[arg], "-dumpport") == 0 && arg + 1 < argc) {
+            io_set_regdump_port(strtol(argv[++arg], NULL, 16));
+        } else if (strcmp(argv[arg], "-mathcycles") == 0 && arg + 1 < argc) {
+            math_set_cycle_cost(atoi(argv[++arg]));
+        } else if ((strcmp(argv[arg], "-break") == 0 || strcmp(argv[arg], "-watch") == 0 || strcmp(argv[arg], "-rwatch") == 0 || strcmp(argv[arg], "-awatch") == 0) && arg + 1 < argc) {
+            int type = argv[arg][1] == 'b' ? BP_EXEC : argv[arg][1] == 'w' ? BP_WRITE : argv[arg][1] == 'r' ? BP_READ : BP_ACCESS;
+            if (!bp_parse(BP_USER, type, argv[arg + 1]))
+                fprintf(stderr, "bad breakpoint %s %s\n", argv[arg], argv[arg + 1]);
+            arg++;
+        } else if (strcmp(argv[arg], "-record") == 0 && arg + 1 < argc) {
+            recordFilename = argv[++arg];
+        } else if (strcmp(argv[arg], "-replay") == 0 && arg + 1 < argc) {
+            replayFilename = argv[++arg];
+        } else if (strcmp(argv[arg], "-capture") == 0 && arg + 1 < argc) {
+            captureFilename = argv[++arg];
+        } else if (strcmp(argv[arg], "-hud") == 0) {
+            hudVisible = true;
+        } else if (strcmp(argv[arg], "-metrics") == 0 && arg + 1 < argc) {
+            metricsTarget = argv[++arg];
+        } else if (strcmp(argv[arg], "-metricsperiod") == 0 && arg + 1 < argc) {
+            metricsPeriod = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "-gdb") == 0 && arg + 1 < argc) {
+            int port = atoi(argv[++arg]);
+            if (gdb_start(port))
+                fprintf(stderr, "GDB stub listening on localhost:%d\n", port);
+            else
+                fprintf(stderr, "could not listen on port %d for GDB\n", port);
         } else {
             fprintf(stderr, "Loading binary to $205: %s\n", argv[arg]);
             autoloadBinaryFilename = argv[arg];
         }
     }
 
+    if (replayFilename && !replay_play(replayFilename)) {
+        fprintf(stderr, "could not replay %s\n", replayFilename);
+        return 1;
+    }
+    if (recordFilename && !replayFilename && !replay_record(recordFilename)) {
+        fprintf(stderr, "could not record to %s\n", recordFilename);
+        return 1;
+    }
+    if (captureFilename && !capture_start(captureFilename, true)) {
+        fprintf(stderr, "could not capture to %s\n", captureFilename);
+        return 1;
+    }
+    if (hudVisible || metricsTarget)
+        metrics_start(metricsPeriod > 0 ? metricsPeriod : METRICS_PERIOD_MS);
+    if (metricsTarget && !metrics_export_start(metricsTarget)) {
+        fprintf(stderr, "could not export metrics to %s\n", metricsTarget);
+        return 1;
+    }
+
     cat_setup();
+    io_start_flush_thread();
     std::thread cpu_thread(loop);
 
     for (;;) {
@@ -155,34 +305,36 @@ int main(int argc, char* argv[])
             if (event.type == SDL_TEXTINPUT) {
                 auto lock = std::unique_lock<std::mutex>(keyQueueMutex);
                 for (size_t i = 0; i < strlen(event.text.text); i++) {
-                    keyQueue.push_back(event.text.text[i]);
+                    queue_key(event.text.text[i]);
                 }
                 break;
             }
+            if (event.type == SDL_KEYDOWN && debugger_key(event.key.keysym.sym))
+                continue;
             if (event.type == SDL_KEYDOWN) {
                 auto lock = std::unique_lock<std::mutex>(keyQueueMutex);
                 switch (event.key.keysym.sym) {
                 case SDLK_ESCAPE:
-                    keyQueue.push_back(27);
+                    queue_key(27);
                     break;
                 case SDLK_BACKSPACE:
                 case SDLK_LEFT:
-                    keyQueue.push_back(8);
+                    queue_key(8);
                     break;
                 case SDLK_RIGHT:
-                    keyQueue.push_back(21);
+                    queue_key(21);
                     break;
                 case SDLK_UP:
-                    keyQueue.push_back(11);
+                    queue_key(11);
                     break;
                 case SDLK_DOWN:
-                    keyQueue.push_back(10);
+                    queue_key(10);
                     break;
                 case SDLK_F12:
-                    keyQueue.push_back(1);
+                    queue_key(1);
                     break;
                 case SDLK_RETURN:
-                    keyQueue.push_back('\r');
+                    queue_key('\r');
                     break;
                 }
                 // ...
@@ -193,6 +345,14 @@ int main(int argc, char* argv[])
     }
 
 exit:
+    {
+        std::lock_guard<std::mutex> lock(bp_machine_mutex);
+        replay_close();
+        capture_stop();
+    }
+    gdb_stop();
+    metrics_export_stop();
+    io_stop_flush_thread();
     SDL_DestroyWindow(window);
     SDL_Quit();
 
@@ -220,3 +380,8 @@ void platform_delay(int ms)
 {
     SDL_Delay(ms);
 }
+
+uint64_t platform_micros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
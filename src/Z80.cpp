@@ -9,44 +9,37 @@
  */
 
 #include "Z80.h"
-
-#ifdef PLATFORM_SDL
-#include <stdio.h>
-#endif /* PLATFORM_SDL */
-
+#include "bus.h"
 #include "cerberus.h"
+#include "trace.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
 
 static inline int m_readByte(void* context, int addr)
 {
-    return cpeek(addr);
+    return bus_peek(addr);
 }
 static inline void m_writeByte(void* context, int addr, int value)
 {
-    cpoke(addr, value);
+    bus_poke(addr, value);
 }
 static inline int m_readWord(void* context, int addr)
 {
-    return cpeekW(addr);
+    return bus_peekW(addr);
 }
 static inline void m_writeWord(void* context, int addr, int value)
 {
-    cpokeW(addr, value);
+    bus_pokeW(addr, value);
+}
+static inline int m_readIO(void* context, int addr)
+{
+    return bus_in(addr);
 }
-static inline int m_readIO(void* context, int addr) { return 0; }
 static inline void m_writeIO(void* context, int addr, int value)
 {
-#ifdef PLATFORM_SDL
-    Z80* z80 = static_cast<Z80*>(context);
-    fprintf(stderr, "OUT($%02x) debug trigger: BC=%04x DE=%04x HL=%04x AF=%04x IX=%04x IY=%04x SP=%04x\n",
-        addr,
-        z80->readRegWord(Z80_BC),
-        z80->readRegWord(Z80_DE),
-        z80->readRegWord(Z80_HL),
-        z80->readRegWord(Z80_AF),
-        z80->readRegWord(Z80_IX),
-        z80->readRegWord(Z80_IY),
-        z80->readRegWord(Z80_SP));
-#endif
+    bus_out(addr, value);
 }
 
 #pragma GCC optimize("O2")
@@ -156,6 +149,31 @@ static inline void m_writeIO(void* context, int addr, int value)
         m_writeIO(m_context, (port), (x)); \
     }
 
+/* INIR, INDR, OTIR, and OTDR may run many iterations in one call. Their port
+ * accesses go through Z80_REPEAT_IO(), which moves cpu_cycles forward to the
+ * cycle the access would see if every iteration ran on its own. They stop
+ * repeating where cpu_clockcycles would service a device in between.
+ */
+
+#define Z80_REPEAT_IO(access)                          \
+    {                                                  \
+        int ahead = elapsed_cycles + bus_wait_cycles;  \
+        cpu_cycles += ahead;                           \
+        access;                                        \
+        cpu_cycles -= ahead;                           \
+    }
+
+#define Z80_REPEAT_IO_AGAIN()                                  \
+    (elapsed_cycles + bus_wait_cycles < m_cycle_limit          \
+        && cpu_cycles + elapsed_cycles + bus_wait_cycles < bus_next_event)
+
+/* Z80_BLOCK_HOOK() is called by stepBlock() before every instruction, with
+ * the number of cycles elapsed so far in the block. It counts the instruction
+ * and feeds the instruction trace.
+ */
+
+#define Z80_BLOCK_HOOK(cycles) (cpu_instructions++, trace_z80(*this, cpu_cycles + (cycles)))
+
 /* Some "instructions" handle two opcodes hence they need their encodings to
  * be able to distinguish them.
  */
@@ -170,9 +188,7 @@ static inline void m_writeIO(void* context, int addr, int value)
 
 #define OPCODE_RLD 0x6f
 
-#if defined(Z80_CATCH_RETI) && defined(Z80_CATCH_RETN)
 #define OPCODE_RETI 0x4d
-#endif
 
 #define OPCODE_INI 0xa2
 #define OPCODE_INIR 0xb2
@@ -395,6 +411,17 @@ enum {
 #define SYX_FLAGS (Z80_S_FLAG | Z80_Y_FLAG | Z80_X_FLAG)
 #define HC_FLAGS (Z80_H_FLAG | Z80_C_FLAG)
 
+/* x, or nothing if only the documented flags are emulated. */
+
+#define UNDOCUMENTED_FLAGS(x) (Policy::documented_flags_only ? 0 : (x))
+
+/* The flags f of an 8-bit arithmetic operation, without X and Y if only the
+ * documented flags are emulated, so that the result is the same with and
+ * without Z80_ALU_TABLES.
+ */
+
+#define ALU_FLAGS(f) (Policy::documented_flags_only ? (f) & ~YX_FLAGS : (f))
+
 #define A (state.registers.byte[Z80_A])
 #define F (state.registers.byte[Z80_F])
 #define B (state.registers.byte[Z80_B])
@@ -546,6 +573,52 @@ enum {
 
 /* 8-bit arithmetic and logic operations. */
 
+#ifdef Z80_ALU_TABLES
+
+#define ADD(x)                                  \
+    {                                           \
+        int a, z;                               \
+                                                \
+        a = A;                                  \
+        z = (x);                                \
+        F = ALU_FLAGS(ALU_TABLES.add[0][a][z]); \
+        A = a + z;                              \
+    }
+
+#define ADC(x)                                  \
+    {                                           \
+        int a, z, c;                            \
+                                                \
+        a = A;                                  \
+        z = (x);                                \
+        c = F & Z80_C_FLAG;                     \
+        F = ALU_FLAGS(ALU_TABLES.add[c][a][z]); \
+        A = a + z + c;                          \
+    }
+
+#define SUB(x)                                  \
+    {                                           \
+        int a, z;                               \
+                                                \
+        a = A;                                  \
+        z = (x);                                \
+        F = ALU_FLAGS(ALU_TABLES.sub[0][a][z]); \
+        A = a - z;                              \
+    }
+
+#define SBC(x)                                  \
+    {                                           \
+        int a, z, c;                            \
+                                                \
+        a = A;                                  \
+        z = (x);                                \
+        c = F & Z80_C_FLAG;                     \
+        F = ALU_FLAGS(ALU_TABLES.sub[c][a][z]); \
+        A = a - z - c;                          \
+    }
+
+#else
+
 #define ADD(x)                            \
     {                                     \
         int a, z, c, f;                   \
@@ -560,7 +633,7 @@ enum {
         f |= z >> (8 - Z80_C_FLAG_SHIFT); \
                                           \
         A = z;                            \
-        F = f;                            \
+        F = ALU_FLAGS(f);                 \
     }
 
 #define ADC(x)                            \
@@ -577,7 +650,7 @@ enum {
         f |= z >> (8 - Z80_C_FLAG_SHIFT); \
                                           \
         A = z;                            \
-        F = f;                            \
+        F = ALU_FLAGS(f);                 \
     }
 
 #define SUB(x)                             \
@@ -595,7 +668,7 @@ enum {
         f |= c >> (8 - Z80_C_FLAG_SHIFT);  \
                                            \
         A = z;                             \
-        F = f;                             \
+        F = ALU_FLAGS(f);                  \
     }
 
 #define SBC(x)                             \
@@ -613,9 +686,11 @@ enum {
         f |= c >> (8 - Z80_C_FLAG_SHIFT);  \
                                            \
         A = z;                             \
-        F = f;                             \
+        F = ALU_FLAGS(f);                  \
     }
 
+#endif
+
 #define AND(x)                                        \
     {                                                 \
         F = SZYXP_FLAGS_TABLE[A &= (x)] | Z80_H_FLAG; \
@@ -631,6 +706,37 @@ enum {
         F = SZYXP_FLAGS_TABLE[A ^= (x)]; \
     }
 
+#ifdef Z80_ALU_TABLES
+
+#define CP(x)                                               \
+    {                                                       \
+        int z;                                              \
+                                                            \
+        z = (x);                                            \
+        F = ALU_FLAGS((ALU_TABLES.sub[0][A][z] & ~YX_FLAGS) \
+            | (z & YX_FLAGS));                              \
+    }
+
+#define INC(x)                                               \
+    {                                                        \
+        int z;                                               \
+                                                             \
+        z = (x);                                             \
+        F = ALU_FLAGS((F & Z80_C_FLAG) | ALU_TABLES.inc[z]); \
+        (x) = z + 1;                                         \
+    }
+
+#define DEC(x)                                               \
+    {                                                        \
+        int z;                                               \
+                                                             \
+        z = (x);                                             \
+        F = ALU_FLAGS((F & Z80_C_FLAG) | ALU_TABLES.dec[z]); \
+        (x) = z - 1;                                         \
+    }
+
+#else
+
 #define CP(x)                                       \
     {                                               \
         int a, z, c, f;                             \
@@ -646,7 +752,7 @@ enum {
         f |= OVERFLOW_TABLE[c >> 7];                \
         f |= c >> (8 - Z80_C_FLAG_SHIFT);           \
                                                     \
-        F = f;                                      \
+        F = ALU_FLAGS(f);                           \
     }
 
 #define INC(x)                                \
@@ -662,7 +768,7 @@ enum {
         f |= OVERFLOW_TABLE[(c >> 7) & 0x03]; \
                                               \
         (x) = z;                              \
-        F = f;                                \
+        F = ALU_FLAGS(f);                     \
     }
 
 #define DEC(x)                                \
@@ -678,9 +784,11 @@ enum {
         f |= OVERFLOW_TABLE[(c >> 7) & 0x03]; \
                                               \
         (x) = z;                              \
-        F = f;                                \
+        F = ALU_FLAGS(f);                     \
     }
 
+#endif /* Z80_ALU_TABLES */
+
 /* 0xcb prefixed logical operations. */
 
 #define RLC(x)                               \
@@ -1633,7 +1741,7 @@ static const unsigned char ED_INSTRUCTION_TABLE[256] = {
 
 };
 
-static const unsigned char SZYX_FLAGS_TABLE[256] = {
+static constexpr unsigned char SZYX_FLAGS_TABLE[256] = {
 
     0x40,
     0x00,
@@ -1894,7 +2002,7 @@ static const unsigned char SZYX_FLAGS_TABLE[256] = {
 
 };
 
-static const unsigned char SZYXP_FLAGS_TABLE[256] = {
+static constexpr unsigned char SZYXP_FLAGS_TABLE[256] = {
 
     0x44,
     0x00,
@@ -2204,14 +2312,173 @@ static const int RST_TABLE[8] = {
  * significant bit is not zero.
  */
 
-static const int OVERFLOW_TABLE[4] = {
+static constexpr int OVERFLOW_TABLE[4] = {
     0,
     Z80_V_FLAG,
     Z80_V_FLAG,
     0,
 };
 
-void Z80::reset()
+#ifdef Z80_ALU_TABLES
+
+/* Flags of the 8-bit additions and subtractions, INC, DEC, and DAA, worked
+ * out at compile time from the definitions of the flags rather than with the
+ * carry tricks of the macros above.
+ */
+
+struct ALU_TABLES_TYPE {
+    unsigned char add[2][256][256]; /* [carry][a][x], ADD and ADC */
+    unsigned char sub[2][256][256]; /* [carry][a][x], SUB, SBC, and CP */
+    unsigned char inc[256]; /* [x], all but the carry */
+    unsigned char dec[256];
+    unsigned short daa[8][256]; /* [DAA_INDEX(F)][a], AF after DAA */
+};
+
+#define DAA_INDEX(f) (((f) & (Z80_C_FLAG | Z80_N_FLAG)) | ((f) & Z80_H_FLAG) >> 2)
+
+static constexpr int resultFlags(int z)
+{
+    z &= 0xff;
+    return (z & SYX_FLAGS) | (z ? 0 : Z80_Z_FLAG);
+}
+
+static constexpr int parityFlag(int z)
+{
+    int n = 0;
+    for (int i = 0; i < 8; i++)
+        n += (z >> i) & 1;
+    return n & 1 ? 0 : Z80_P_FLAG;
+}
+
+static constexpr int addFlags(int a, int x, int carry)
+{
+    int z = a + x + carry;
+    return resultFlags(z)
+        | ((a & 0x0f) + (x & 0x0f) + carry > 0x0f ? Z80_H_FLAG : 0)
+        | (~(a ^ x) & (a ^ z) & 0x80 ? Z80_V_FLAG : 0)
+        | (z > 0xff ? Z80_C_FLAG : 0);
+}
+
+static constexpr int subFlags(int a, int x, int carry)
+{
+    int z = a - x - carry;
+    return resultFlags(z) | Z80_N_FLAG
+        | ((a & 0x0f) - (x & 0x0f) - carry < 0 ? Z80_H_FLAG : 0)
+        | ((a ^ x) & (a ^ z) & 0x80 ? Z80_V_FLAG : 0)
+        | (z < 0 ? Z80_C_FLAG : 0);
+}
+
+/* DAA as tabulated in "The Undocumented Z80 Documented". */
+
+static constexpr int daa(int a, int f)
+{
+    int hi = a >> 4, lo = a & 0x0f, diff = 0, c = 0, h = 0;
+    if (f & Z80_C_FLAG || hi > 9 || (hi == 9 && lo > 9)) {
+        diff = 0x60;
+        c = Z80_C_FLAG;
+    }
+    if (f & Z80_H_FLAG || lo > 9)
+        diff += 0x06;
+    if (f & Z80_N_FLAG) {
+        a = (a - diff) & 0xff;
+        h = f & Z80_H_FLAG && lo < 6 ? Z80_H_FLAG : 0;
+    } else {
+        a = (a + diff) & 0xff;
+        h = lo > 9 ? Z80_H_FLAG : 0;
+    }
+    return a << 8 | resultFlags(a) | parityFlag(a) | h | (f & Z80_N_FLAG) | c;
+}
+
+static constexpr ALU_TABLES_TYPE makeAluTables()
+{
+    ALU_TABLES_TYPE t {};
+    for (int carry = 0; carry < 2; carry++)
+        for (int a = 0; a < 256; a++)
+            for (int x = 0; x < 256; x++) {
+                t.add[carry][a][x] = addFlags(a, x, carry);
+                t.sub[carry][a][x] = subFlags(a, x, carry);
+            }
+    for (int x = 0; x < 256; x++) {
+        t.inc[x] = addFlags(x, 1, 0) & ~Z80_C_FLAG;
+        t.dec[x] = subFlags(x, 1, 0) & ~Z80_C_FLAG;
+    }
+    for (int f = 0; f < 0x20; f++)
+        if (!(f & (Z80_X_FLAG | Z80_PV_FLAG)))
+            for (int a = 0; a < 256; a++)
+                t.daa[DAA_INDEX(f)][a] = daa(a, f);
+    return t;
+}
+
+static constexpr ALU_TABLES_TYPE ALU_TABLES = makeAluTables();
+
+/* Exhaustive check of the tables against the formulas they replace: the ADD,
+ * ADC, SUB, SBC, CP, INC, and DEC macros, and the DAA case of execute(). The
+ * 256 byte tables are checked against the definitions as well.
+ */
+
+static constexpr bool aluTablesMatch()
+{
+    for (int z = 0; z < 256; z++)
+        if (SZYX_FLAGS_TABLE[z] != resultFlags(z)
+            || SZYXP_FLAGS_TABLE[z] != (resultFlags(z) | parityFlag(z)))
+            return false;
+
+    for (int carry = 0; carry < 2; carry++)
+        for (int a = 0; a < 256; a++)
+            for (int x = 0; x < 256; x++) {
+                int z = a + x + carry;
+                int c = a ^ x ^ z;
+                int f = (c & Z80_H_FLAG) | SZYX_FLAGS_TABLE[z & 0xff]
+                    | OVERFLOW_TABLE[c >> 7] | z >> (8 - Z80_C_FLAG_SHIFT);
+                if (ALU_TABLES.add[carry][a][x] != f)
+                    return false;
+
+                z = a - x - carry;
+                c = a ^ x ^ z;
+                f = Z80_N_FLAG | (c & Z80_H_FLAG) | SZYX_FLAGS_TABLE[z & 0xff];
+                c &= 0x0180;
+                f |= OVERFLOW_TABLE[c >> 7] | c >> (8 - Z80_C_FLAG_SHIFT);
+                if (ALU_TABLES.sub[carry][a][x] != f)
+                    return false;
+            }
+
+    for (int x = 0; x < 256; x++) {
+        int z = x + 1, c = x ^ z;
+        if (ALU_TABLES.inc[x] != ((c & Z80_H_FLAG) | SZYX_FLAGS_TABLE[z & 0xff] | OVERFLOW_TABLE[(c >> 7) & 0x03]))
+            return false;
+        z = x - 1;
+        c = x ^ z;
+        if (ALU_TABLES.dec[x] != (Z80_N_FLAG | (c & Z80_H_FLAG) | SZYX_FLAGS_TABLE[z & 0xff] | OVERFLOW_TABLE[(c >> 7) & 0x03]))
+            return false;
+    }
+
+    for (int f = 0; f < 0x20; f++) {
+        if (f & (Z80_X_FLAG | Z80_PV_FLAG))
+            continue;
+        for (int a = 0; a < 256; a++) {
+            int c = 0, d = 0;
+            if (a > 0x99 || (f & Z80_C_FLAG)) {
+                c = Z80_C_FLAG;
+                d = 0x60;
+            } else
+                c = d = 0;
+            if ((a & 0x0f) > 0x09 || (f & Z80_H_FLAG))
+                d += 0x06;
+            int z = (a + (f & Z80_N_FLAG ? -d : +d)) & 0xff;
+            int af = z << 8 | SZYXP_FLAGS_TABLE[z] | ((z ^ a) & Z80_H_FLAG) | (f & Z80_N_FLAG) | c;
+            if (ALU_TABLES.daa[DAA_INDEX(f)][a] != af)
+                return false;
+        }
+    }
+    return true;
+}
+
+static_assert(aluTablesMatch(), "ALU flag tables differ from the formulas");
+
+#endif /* Z80_ALU_TABLES */
+
+template <class Policy>
+void Z80Core<Policy>::reset()
 {
     state.status = 0;
     AF = 0xffff;
@@ -2275,7 +2542,8 @@ void Z80::reset()
     state.fd_register_table[14] = &state.registers.word[Z80_IY];
 }
 
-int Z80::IRQ(int data_on_bus)
+template <class Policy>
+int Z80Core<Policy>::IRQ(int data_on_bus)
 {
     state.status = 0;
     if (state.iff1) {
@@ -2315,11 +2583,9 @@ int Z80::IRQ(int data_on_bus)
             Z80_WRITE_WORD_INTERRUPT(SP, state.pc);
             vector = state.i << 8 | data_on_bus;
 
-#ifdef Z80_MASK_IM2_VECTOR_ADDRESS
-
-            vector &= 0xfffe;
+            if (Policy::mask_im2_vector_address)
 
-#endif
+                vector &= 0xfffe;
 
             Z80_READ_WORD_INTERRUPT(vector, state.pc);
             return elapsed_cycles + 19;
@@ -2331,7 +2597,8 @@ int Z80::IRQ(int data_on_bus)
         return 0;
 }
 
-int Z80::NMI()
+template <class Policy>
+int Z80Core<Policy>::NMI()
 {
     int elapsed_cycles;
 
@@ -2349,8 +2616,10 @@ int Z80::NMI()
     return elapsed_cycles + 11;
 }
 
-int Z80::step()
+template <class Policy>
+int Z80Core<Policy>::step(int max_cycles)
 {
+    m_cycle_limit = max_cycles;
     state.status = 0;
     int elapsed_cycles = 0;
     int pc = state.pc;
@@ -2361,166 +2630,2491 @@ int Z80::step()
     return intemulate(opcode, elapsed_cycles);
 }
 
-/* Actual emulation function. opcode is the first opcode to emulate, this is
- * needed by Z80Interrupt() for interrupt mode 0.
+/* Number of iterations a block instruction with count iterations left runs
+ * before elapsed_cycles reaches limit. All but the last take 21 cycles.
  */
 
-int Z80::intemulate(int opcode, int elapsed_cycles)
+static inline int repeatCount(int count, int elapsed_cycles, int limit)
 {
-    int pc = state.pc;
-    int r = state.r & 0x7f;
+    int n = limit > elapsed_cycles ? (limit - elapsed_cycles + 20) / 21 : 1;
+    return n < count ? n : count;
+}
 
-    void** registers = state.register_table;
+/* Copy count bytes of RAM the way as many iterations of LDIR (d = +1) or
+ * LDDR (d = -1) do. They copy one byte at a time, so where the destination is
+ * less than count bytes ahead of the source, the bytes in between repeat.
+ */
 
-    int instruction = INSTRUCTION_TABLE[opcode];
+static void blockCopy(int hl, int de, int count, int d)
+{
+    while (count > 0) {
+
+        /* Split the copy where either address wraps. */
+
+        hl &= 0xffff;
+        de &= 0xffff;
+        int n = d > 0 ? 0x10000 - (hl > de ? hl : de) : (hl < de ? hl : de) + 1;
+        if (n > count)
+            n = count;
+
+        uint8_t* src = &cerb_ram[d > 0 ? hl : hl - n + 1];
+        uint8_t* dst = &cerb_ram[d > 0 ? de : de - n + 1];
+        int gap = (de - hl) * d;
+        if (gap <= 0 || gap >= n)
+            memmove(dst, src, n);
+        else if (gap == 1)
+            memset(dst, d > 0 ? src[0] : src[n - 1], n);
+        else
+            for (int i = 0; i < n; i += gap) {
+                int m = n - i < gap ? n - i : gap;
+                if (d > 0)
+                    memcpy(dst + i, src + i, m);
+                else
+                    memcpy(dst + n - i - m, src + n - i - m, m);
+            }
+        cpoke_written(dst - cerb_ram, n);
 
-    bool repeatLoop;
+        hl += d * n;
+        de += d * n;
+        count -= n;
+    }
+}
 
-    do {
+/* Return how many of the count bytes of RAM from hl on, stepping by d, come
+ * before the first one equal to a, or count if none is.
+ */
 
-        repeatLoop = false;
+static int blockScan(int hl, int count, int d, int a)
+{
+    int i = 0;
+    if (d > 0)
+        while (i < count) {
+            hl &= 0xffff;
+            int n = 0x10000 - hl;
+            if (n > count - i)
+                n = count - i;
+            const uint8_t* p = static_cast<const uint8_t*>(memchr(&cerb_ram[hl], a, n));
+            if (p)
+                return i + (p - &cerb_ram[hl]);
+            i += n;
+            hl += n;
+        }
+    else
+        for (; i < count && cerb_ram[hl & 0xffff] != a; i++)
+            hl--;
+    return i;
+}
 
-        elapsed_cycles += 4;
-        r++;
-        switch (instruction) {
+#ifdef Z80_BLOCK_CACHE
 
-            /* 8-bit load group. */
+/* I/O instructions only run first in a block, so a device sees cpu_cycles
+ * current and its wait cycles are charged before the next block.
+ */
 
-        case LD_R_R: {
+static bool isIO(int instruction)
+{
+    switch (instruction) {
+    case INIR_INDR:
+    case OTIR_OTDR:
+    case IN_A_N:
+    case IN_R_C:
+    case INI_IND:
+    case OUT_N_A:
+    case OUT_C_R:
+    case OUTI_OUTD:
+        return true;
+    default:
+        return false;
+    }
+}
 
-            R(Y(opcode)) = R(Z(opcode));
-            break;
-        }
+/* Instructions after which a block ends: anything that may not continue with
+ * the next instruction in memory or may change the interrupt state.
+ */
 
-        case LD_R_N: {
+static bool endsBlock(int instruction)
+{
+    if (isIO(instruction))
+        return true;
+    switch (instruction) {
+    case JP_NN:
+    case JP_CC_NN:
+    case JR_E:
+    case JR_DD_E:
+    case JP_HL:
+    case DJNZ_E:
+    case CALL_NN:
+    case CALL_CC_NN:
+    case RET:
+    case RET_CC:
+    case RETI_RETN:
+    case RST_P:
+    case HALT:
+    case DI:
+    case EI:
+    case LDIR_LDDR:
+    case CPIR_CPDR:
+    case ED_UNDEFINED:
+        return true;
+    default:
+        return false;
+    }
+}
 
-            READ_N(R(Y(opcode)));
-            break;
-        }
+/* Decode the prefixes and opcode at pc the same way intemulate() walks them.
+ * Runs of more than two prefixes are left to step().
+ */
 
-        case LD_R_INDIRECT_HL: {
+template <class Policy>
+bool Z80Core<Policy>::decode(int pc, Z80_DECODED* d)
+{
+    void** registers = state.register_table;
+    int elapsed_cycles = 0;
+    int r = 0;
+    int opcode, instruction;
 
-            if (registers == state.register_table) {
+    d->pc = pc;
+    Z80_FETCH_BYTE(pc, opcode);
+    pc++;
+    instruction = INSTRUCTION_TABLE[opcode];
 
-                READ_BYTE(HL, R(Y(opcode)));
+    for (int prefixes = 0;; prefixes++) {
 
-            } else {
+        if (prefixes > 2)
+            return false;
 
-                int d;
+        if (instruction == DD_PREFIX || instruction == FD_PREFIX) {
 
-                READ_D(d);
-                d += HL_IX_IY;
-                READ_BYTE(d, S(Y(opcode)));
+            registers = instruction == DD_PREFIX
+                ? state.dd_register_table
+                : state.fd_register_table;
+            Z80_FETCH_BYTE(pc, opcode);
+            pc++;
+            instruction = INSTRUCTION_TABLE[opcode];
 
-                elapsed_cycles += 5;
-            }
+        } else if (instruction == ED_PREFIX) {
+
+            registers = state.register_table;
+            Z80_FETCH_BYTE(pc, opcode);
+            pc++;
+            instruction = ED_INSTRUCTION_TABLE[opcode];
+            elapsed_cycles += 4;
+            r++;
             break;
-        }
 
-        case LD_INDIRECT_HL_R: {
+        } else if (instruction == CB_PREFIX) {
 
-            if (registers == state.register_table) {
+            /* 0xdd 0xcb d opcode: pc stays on the displacement. */
 
-                WRITE_BYTE(HL, R(Z(opcode)));
+            if (registers != state.register_table) {
+
+                Z80_FETCH_BYTE(pc + 1, opcode);
 
             } else {
 
-                int d;
+                Z80_FETCH_BYTE(pc, opcode);
+                pc++;
+                r++;
+            }
+            instruction = CB_INSTRUCTION_TABLE[opcode];
+            elapsed_cycles += 4;
+            break;
 
-                READ_D(d);
-                d += HL_IX_IY;
-                WRITE_BYTE(d, S(Z(opcode)));
+        } else
 
-                elapsed_cycles += 5;
-            }
             break;
-        }
 
-        case LD_INDIRECT_HL_N: {
+        elapsed_cycles += 4;
+        r++;
+    }
 
-            int n;
+    d->operand_pc = pc & 0xffff;
+    d->registers = registers;
+    d->instruction = instruction;
+    d->opcode = opcode;
+    d->prefix_cycles = elapsed_cycles;
+    d->prefix_r = r;
+    d->fast = false;
+    d->operand = 0;
+
+    /* Instructions executeFast() handles, with their immediate operand,
+     * address, branch target or index displacement decoded here. That is
+     * done with no prefix or a single one (0xcb, 0xed, 0xdd, 0xfd, or 0xdd
+     * 0xcb), so the bytes read are within the four blockUsesPage() covers.
+     * Indexed 0xcb instructions with a register target are left to execute().
+     */
 
-            if (registers == state.register_table) {
+    if (r > 1)
+        return true;
 
-                READ_N(n);
-                WRITE_BYTE(HL, n);
+    bool indexed = registers != state.register_table;
 
-            } else {
+    switch (instruction) {
 
-                int d;
+    case LD_R_N:
+    case ADD_N:
+    case ADC_N:
+    case SUB_N:
+    case SBC_N:
+    case AND_N:
+    case XOR_N:
+    case OR_N:
+    case CP_N:
+        Z80_FETCH_BYTE(pc, d->operand);
+        break;
 
-                READ_D(d);
-                d += HL_IX_IY;
-                READ_N(n);
-                WRITE_BYTE(d, n);
+    case JR_E:
+    case JR_DD_E:
+    case DJNZ_E: {
 
-                elapsed_cycles += 2;
-            }
+        int e;
 
-            break;
-        }
+        Z80_FETCH_BYTE(pc, e);
+        d->operand = (pc + ((signed char)e) + 1) & 0xffff;
+        break;
+    }
 
-        case LD_A_INDIRECT_BC: {
+    case LD_RR_NN:
+    case LD_A_INDIRECT_NN:
+    case LD_INDIRECT_NN_A:
+    case LD_HL_INDIRECT_NN:
+    case LD_INDIRECT_NN_HL:
+    case LD_RR_INDIRECT_NN:
+    case LD_INDIRECT_NN_RR:
+    case JP_NN:
+    case JP_CC_NN:
+    case CALL_NN:
+        Z80_FETCH_WORD(pc, d->operand);
+        break;
+
+    case LD_R_INDIRECT_HL:
+    case LD_INDIRECT_HL_R:
+    case ADD_INDIRECT_HL:
+    case ADC_INDIRECT_HL:
+    case SUB_INDIRECT_HL:
+    case SBC_INDIRECT_HL:
+    case AND_INDIRECT_HL:
+    case XOR_INDIRECT_HL:
+    case OR_INDIRECT_HL:
+    case CP_INDIRECT_HL:
+    case INC_INDIRECT_HL:
+    case DEC_INDIRECT_HL:
+    case RLC_INDIRECT_HL:
+    case RL_INDIRECT_HL:
+    case RRC_INDIRECT_HL:
+    case RR_INDIRECT_HL:
+    case SLA_INDIRECT_HL:
+    case SLL_INDIRECT_HL:
+    case SRA_INDIRECT_HL:
+    case SRL_INDIRECT_HL:
+    case BIT_B_INDIRECT_HL:
+    case SET_B_INDIRECT_HL:
+    case RES_B_INDIRECT_HL:
+        if (indexed) {
 
-            READ_BYTE(BC, A);
-            break;
+            int e;
+
+            Z80_FETCH_BYTE(pc, e);
+            d->operand = (signed char)e;
         }
+        break;
 
-        case LD_A_INDIRECT_DE: {
+    case LD_INDIRECT_HL_N: {
 
-            READ_BYTE(DE, A);
-            break;
-        }
+        /* The displacement, if any, in the low byte and n in the high one. */
 
-        case LD_A_INDIRECT_NN: {
+        int e, n;
 
-            int nn;
+        if (indexed) {
 
-            READ_NN(nn);
-            READ_BYTE(nn, A);
-            break;
-        }
+            Z80_FETCH_BYTE(pc, e);
+            Z80_FETCH_BYTE(pc + 1, n);
 
-        case LD_INDIRECT_BC_A: {
+        } else {
 
-            WRITE_BYTE(BC, A);
-            break;
+            e = 0;
+            Z80_FETCH_BYTE(pc, n);
         }
+        d->operand = (e & 0xff) | (n << 8);
+        break;
+    }
 
-        case LD_INDIRECT_DE_A: {
+    case RLC_R:
+    case RL_R:
+    case RRC_R:
+    case RR_R:
+    case SLA_R:
+    case SLL_R:
+    case SRA_R:
+    case SRL_R:
+    case BIT_B_R:
+    case SET_B_R:
+    case RES_B_R:
+        if (indexed)
+            return true;
+        break;
+
+    case LD_R_R:
+    case ADD_R:
+    case ADC_R:
+    case SUB_R:
+    case SBC_R:
+    case AND_R:
+    case XOR_R:
+    case OR_R:
+    case CP_R:
+    case INC_R:
+    case DEC_R:
+    case INC_RR:
+    case DEC_RR:
+    case ADD_HL_RR:
+    case ADC_HL_RR:
+    case SBC_HL_RR:
+    case LD_SP_HL:
+    case NEG:
+    case PUSH_SS:
+    case POP_SS:
+    case EX_DE_HL:
+    case RET:
+    case RET_CC:
+    case NOP:
+        break;
+
+    default:
+        return true;
+    }
+    d->fast = true;
+    return true;
+}
 
-            WRITE_BYTE(DE, A);
-            break;
-        }
+template <class Policy>
+int Z80Core<Policy>::executeDecoded(const Z80_DECODED* d)
+{
+    if (d->fast)
+        return executeFast(d);
+    state.status = 0;
+    state.pc = d->pc + 1;
+    return execute(d->instruction, d->opcode, d->registers, d->operand_pc,
+        (state.r + d->prefix_r) & 0x7f, d->prefix_cycles);
+}
 
-        case LD_INDIRECT_NN_A: {
+/* The common instructions, as execute() runs them but with the operand
+ * decoded in advance. Cycle counts and flags must match execute().
+ */
 
-            int nn;
+/* Address of the (HL) operand, or (IX + d) with the displacement decoded in
+ * d->operand. Counts the cycles and moves pc over d as READ_D() would.
+ */
 
-            READ_NN(nn);
-            WRITE_BYTE(nn, A);
-            break;
-        }
+#define DECODED_INDIRECT_HL(address)           \
+    {                                          \
+        if (registers == state.register_table) \
+                                               \
+            (address) = HL;                    \
+                                               \
+        else {                                 \
+                                               \
+            (address) = HL_IX_IY + d->operand; \
+            pc++;                              \
+            elapsed_cycles += 3;               \
+        }                                      \
+    }
 
-        case LD_A_I_LD_A_R: {
+/* The (HL) or (IX + d) operand of a 0xcb instruction: pc is on d, after it
+ * comes the opcode.
+ */
 
-            int a, f;
+#define DECODED_CB_INDIRECT_HL(address)          \
+    {                                            \
+        if (registers == state.register_table) { \
+                                                 \
+            (address) = HL;                      \
+            elapsed_cycles++;                    \
+                                                 \
+        } else {                                 \
+                                                 \
+            (address) = HL_IX_IY + d->operand;   \
+            pc += 2;                             \
+            elapsed_cycles += 5;                 \
+        }                                        \
+    }
 
-            a = opcode == OPCODE_LD_A_I
-                ? state.i
-                : (state.r & 0x80) | (r & 0x7f);
-            f = SZYX_FLAGS_TABLE[a];
+template <class Policy>
+int Z80Core<Policy>::executeFast(const Z80_DECODED* d)
+{
+    void** registers = d->registers;
+    int opcode = d->opcode;
+    int pc = d->operand_pc;
+    int elapsed_cycles = d->prefix_cycles + 4;
 
-            /* Note: On a real processor, if an interrupt
-             * occurs during the execution of either
-             * "LD A, I" or "LD A, R", the parity flag is
-             * reset. That can never happen here.
-             */
+    state.status = 0;
+    state.r = (state.r & 0x80) | ((state.r + d->prefix_r + 1) & 0x7f);
 
-            f |= state.iff2 << Z80_P_FLAG_SHIFT;
-            f |= F & Z80_C_FLAG;
+    switch (d->instruction) {
 
-            AF = (a << 8) | f;
+    case LD_R_R: {
+
+        R(Y(opcode)) = R(Z(opcode));
+        break;
+    }
+
+    case LD_R_N: {
+
+        R(Y(opcode)) = d->operand;
+        pc++;
+        elapsed_cycles += 3;
+        break;
+    }
+
+    case LD_R_INDIRECT_HL: {
+
+        if (registers == state.register_table) {
+
+            READ_BYTE(HL, R(Y(opcode)));
+
+        } else {
+
+            int address;
+
+            DECODED_INDIRECT_HL(address);
+            READ_BYTE(address, S(Y(opcode)));
+            elapsed_cycles += 5;
+        }
+        break;
+    }
+
+    case LD_INDIRECT_HL_R: {
+
+        if (registers == state.register_table) {
+
+            WRITE_BYTE(HL, R(Z(opcode)));
+
+        } else {
+
+            int address;
+
+            DECODED_INDIRECT_HL(address);
+            WRITE_BYTE(address, S(Z(opcode)));
+            elapsed_cycles += 5;
+        }
+        break;
+    }
+
+    case LD_INDIRECT_HL_N: {
+
+        int n = d->operand >> 8;
+
+        if (registers == state.register_table) {
+
+            pc++;
+            elapsed_cycles += 3;
+            WRITE_BYTE(HL, n);
+
+        } else {
+
+            int address = HL_IX_IY + (signed char)d->operand;
+
+            pc += 2;
+            elapsed_cycles += 8;
+            WRITE_BYTE(address, n);
+        }
+        break;
+    }
+
+    case LD_A_INDIRECT_NN: {
+
+        pc += 2;
+        elapsed_cycles += 6;
+        READ_BYTE(d->operand, A);
+        break;
+    }
+
+    case LD_INDIRECT_NN_A: {
+
+        pc += 2;
+        elapsed_cycles += 6;
+        WRITE_BYTE(d->operand, A);
+        break;
+    }
+
+    case LD_RR_NN: {
+
+        RR(P(opcode)) = d->operand;
+        pc += 2;
+        elapsed_cycles += 6;
+        break;
+    }
+
+    case PUSH_SS: {
+
+        PUSH(SS(P(opcode)));
+        elapsed_cycles++;
+        break;
+    }
+
+    case POP_SS: {
+
+        POP(SS(P(opcode)));
+        break;
+    }
+
+    case EX_DE_HL: {
+
+        EXCHANGE(DE, HL);
+        break;
+    }
+
+    case ADD_R: {
+
+        ADD(R(Z(opcode)));
+        break;
+    }
+
+    case ADD_N: {
+
+        int n = d->operand;
+
+        pc++;
+        elapsed_cycles += 3;
+        ADD(n);
+        break;
+    }
+
+    case ADD_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        ADD(x);
+        if (registers != state.register_table)
+            elapsed_cycles += 5;
+        break;
+    }
+
+    case ADC_R: {
+
+        ADC(R(Z(opcode)));
+        break;
+    }
+
+    case ADC_N: {
+
+        int n = d->operand;
+
+        pc++;
+        elapsed_cycles += 3;
+        ADC(n);
+        break;
+    }
+
+    case ADC_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        ADC(x);
+        if (registers != state.register_table)
+            elapsed_cycles += 5;
+        break;
+    }
+
+    case SUB_R: {
+
+        SUB(R(Z(opcode)));
+        break;
+    }
+
+    case SUB_N: {
+
+        int n = d->operand;
+
+        pc++;
+        elapsed_cycles += 3;
+        SUB(n);
+        break;
+    }
+
+    case SUB_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        SUB(x);
+        if (registers != state.register_table)
+            elapsed_cycles += 5;
+        break;
+    }
+
+    case SBC_R: {
+
+        SBC(R(Z(opcode)));
+        break;
+    }
+
+    case SBC_N: {
+
+        int n = d->operand;
+
+        pc++;
+        elapsed_cycles += 3;
+        SBC(n);
+        break;
+    }
+
+    case SBC_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        SBC(x);
+        if (registers != state.register_table)
+            elapsed_cycles += 5;
+        break;
+    }
+
+    case AND_R: {
+
+        AND(R(Z(opcode)));
+        break;
+    }
+
+    case AND_N: {
+
+        int n = d->operand;
+
+        pc++;
+        elapsed_cycles += 3;
+        AND(n);
+        break;
+    }
+
+    case AND_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        AND(x);
+        if (registers != state.register_table)
+            elapsed_cycles += 5;
+        break;
+    }
+
+    case XOR_R: {
+
+        XOR(R(Z(opcode)));
+        break;
+    }
+
+    case XOR_N: {
+
+        int n = d->operand;
+
+        pc++;
+        elapsed_cycles += 3;
+        XOR(n);
+        break;
+    }
+
+    case XOR_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        XOR(x);
+        if (registers != state.register_table)
+            elapsed_cycles += 5;
+        break;
+    }
+
+    case OR_R: {
+
+        OR(R(Z(opcode)));
+        break;
+    }
+
+    case OR_N: {
+
+        int n = d->operand;
+
+        pc++;
+        elapsed_cycles += 3;
+        OR(n);
+        break;
+    }
+
+    case OR_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        OR(x);
+        if (registers != state.register_table)
+            elapsed_cycles += 5;
+        break;
+    }
+
+    case CP_R: {
+
+        CP(R(Z(opcode)));
+        break;
+    }
+
+    case CP_N: {
+
+        int n = d->operand;
+
+        pc++;
+        elapsed_cycles += 3;
+        CP(n);
+        break;
+    }
+
+    case CP_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        CP(x);
+        if (registers != state.register_table)
+            elapsed_cycles += 5;
+        break;
+    }
+
+    case INC_R: {
+
+        INC(R(Y(opcode)));
+        break;
+    }
+
+    case DEC_R: {
+
+        DEC(R(Y(opcode)));
+        break;
+    }
+
+    case INC_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        INC(x);
+        WRITE_BYTE(address, x);
+        elapsed_cycles += registers == state.register_table ? 1 : 6;
+        break;
+    }
+
+    case DEC_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        DEC(x);
+        WRITE_BYTE(address, x);
+        elapsed_cycles += registers == state.register_table ? 1 : 6;
+        break;
+    }
+
+    case INC_RR: {
+
+        RR(P(opcode)) = RR(P(opcode)) + 1;
+        elapsed_cycles += 2;
+        break;
+    }
+
+    case DEC_RR: {
+
+        RR(P(opcode)) = RR(P(opcode)) - 1;
+        elapsed_cycles += 2;
+        break;
+    }
+
+    case LD_HL_INDIRECT_NN: {
+
+        pc += 2;
+        elapsed_cycles += 6;
+        READ_WORD(d->operand, HL_IX_IY);
+        break;
+    }
+
+    case LD_INDIRECT_NN_HL: {
+
+        pc += 2;
+        elapsed_cycles += 6;
+        WRITE_WORD(d->operand, HL_IX_IY);
+        break;
+    }
+
+    case LD_RR_INDIRECT_NN: {
+
+        pc += 2;
+        elapsed_cycles += 6;
+        READ_WORD(d->operand, RR(P(opcode)));
+        break;
+    }
+
+    case LD_INDIRECT_NN_RR: {
+
+        pc += 2;
+        elapsed_cycles += 6;
+        WRITE_WORD(d->operand, RR(P(opcode)));
+        break;
+    }
+
+    case LD_SP_HL: {
+
+        SP = HL_IX_IY;
+        elapsed_cycles += 2;
+        break;
+    }
+
+    case ADD_HL_RR: {
+
+        int x, y, z, f, c;
+
+        x = HL_IX_IY;
+        y = RR(P(opcode));
+        z = x + y;
+
+        c = x ^ y ^ z;
+        f = F & SZPV_FLAGS;
+
+        if (!Policy::documented_flags_only) {
+
+            f |= (z >> 8) & YX_FLAGS;
+            f |= (c >> 8) & Z80_H_FLAG;
+        }
+
+        f |= c >> (16 - Z80_C_FLAG_SHIFT);
+
+        HL_IX_IY = z;
+        F = f;
+
+        elapsed_cycles += 7;
+        break;
+    }
+
+    case ADC_HL_RR: {
+
+        int x, y, z, f, c;
+
+        x = HL;
+        y = RR(P(opcode));
+        z = x + y + (F & Z80_C_FLAG);
+
+        c = x ^ y ^ z;
+        f = z & 0xffff
+            ? (z >> 8) & SYX_FLAGS
+            : Z80_Z_FLAG;
+
+        if (!Policy::documented_flags_only) {
+
+            f |= (c >> 8) & Z80_H_FLAG;
+        }
+
+        f |= OVERFLOW_TABLE[c >> 15];
+        f |= z >> (16 - Z80_C_FLAG_SHIFT);
+
+        HL = z;
+        F = f;
+
+        elapsed_cycles += 7;
+        break;
+    }
+
+    case SBC_HL_RR: {
+
+        int x, y, z, f, c;
+
+        x = HL;
+        y = RR(P(opcode));
+        z = x - y - (F & Z80_C_FLAG);
+
+        c = x ^ y ^ z;
+        f = Z80_N_FLAG;
+        f |= z & 0xffff
+            ? (z >> 8) & SYX_FLAGS
+            : Z80_Z_FLAG;
+
+        if (!Policy::documented_flags_only) {
+
+            f |= (c >> 8) & Z80_H_FLAG;
+        }
+
+        c &= 0x018000;
+        f |= OVERFLOW_TABLE[c >> 15];
+        f |= c >> (16 - Z80_C_FLAG_SHIFT);
+
+        HL = z;
+        F = f;
+
+        elapsed_cycles += 7;
+        break;
+    }
+
+    case NEG: {
+
+        int a, f, z, c;
+
+        a = A;
+        z = -a;
+
+        c = a ^ z;
+        f = Z80_N_FLAG | (c & Z80_H_FLAG);
+        f |= SZYX_FLAGS_TABLE[z &= 0xff];
+        c &= 0x0180;
+        f |= OVERFLOW_TABLE[c >> 7];
+        f |= c >> (8 - Z80_C_FLAG_SHIFT);
+
+        A = z;
+        F = f;
+        break;
+    }
+
+    case RLC_R: {
+
+        RLC(R(Z(opcode)));
+        break;
+    }
+
+    case RL_R: {
+
+        RL(R(Z(opcode)));
+        break;
+    }
+
+    case RRC_R: {
+
+        RRC(R(Z(opcode)));
+        break;
+    }
+
+    case RR_R: {
+
+        RR_INSTRUCTION(R(Z(opcode)));
+        break;
+    }
+
+    case SLA_R: {
+
+        SLA(R(Z(opcode)));
+        break;
+    }
+
+    case SLL_R: {
+
+        SLL(R(Z(opcode)));
+        break;
+    }
+
+    case SRA_R: {
+
+        SRA(R(Z(opcode)));
+        break;
+    }
+
+    case SRL_R: {
+
+        SRL(R(Z(opcode)));
+        break;
+    }
+
+    case RLC_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_CB_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        RLC(x);
+        WRITE_BYTE(address, x);
+        break;
+    }
+
+    case RL_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_CB_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        RL(x);
+        WRITE_BYTE(address, x);
+        break;
+    }
+
+    case RRC_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_CB_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        RRC(x);
+        WRITE_BYTE(address, x);
+        break;
+    }
+
+    case RR_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_CB_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        RR_INSTRUCTION(x);
+        WRITE_BYTE(address, x);
+        break;
+    }
+
+    case SLA_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_CB_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        SLA(x);
+        WRITE_BYTE(address, x);
+        break;
+    }
+
+    case SLL_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_CB_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        SLL(x);
+        WRITE_BYTE(address, x);
+        break;
+    }
+
+    case SRA_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_CB_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        SRA(x);
+        WRITE_BYTE(address, x);
+        break;
+    }
+
+    case SRL_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_CB_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        SRL(x);
+        WRITE_BYTE(address, x);
+        break;
+    }
+
+    case BIT_B_R: {
+
+        int x;
+
+        x = R(Z(opcode)) & (1 << Y(opcode));
+        F = (x ? 0 : Z80_Z_FLAG | Z80_P_FLAG)
+
+            | UNDOCUMENTED_FLAGS(x & Z80_S_FLAG)
+            | UNDOCUMENTED_FLAGS(R(Z(opcode)) & YX_FLAGS)
+            | Z80_H_FLAG
+            | (F & Z80_C_FLAG);
+
+        break;
+    }
+
+    case BIT_B_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_CB_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        x &= 1 << Y(opcode);
+        F = (x ? 0 : Z80_Z_FLAG | Z80_P_FLAG)
+
+            | UNDOCUMENTED_FLAGS(x & Z80_S_FLAG)
+            | UNDOCUMENTED_FLAGS(address & YX_FLAGS)
+            | Z80_H_FLAG
+            | (F & Z80_C_FLAG);
+
+        break;
+    }
+
+    case SET_B_R: {
+
+        R(Z(opcode)) |= 1 << Y(opcode);
+        break;
+    }
+
+    case SET_B_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_CB_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        x |= 1 << Y(opcode);
+        WRITE_BYTE(address, x);
+        break;
+    }
+
+    case RES_B_R: {
+
+        R(Z(opcode)) &= ~(1 << Y(opcode));
+        break;
+    }
+
+    case RES_B_INDIRECT_HL: {
+
+        int address, x;
+
+        DECODED_CB_INDIRECT_HL(address);
+        READ_BYTE(address, x);
+        x &= ~(1 << Y(opcode));
+        WRITE_BYTE(address, x);
+        break;
+    }
+
+    case JP_NN: {
+
+        pc = d->operand;
+        elapsed_cycles += 6;
+        break;
+    }
+
+    case JP_CC_NN: {
+
+        pc = CC(Y(opcode)) ? d->operand : pc + 2;
+        elapsed_cycles += 6;
+        break;
+    }
+
+    case JR_E: {
+
+        pc = d->operand;
+        elapsed_cycles += 8;
+        break;
+    }
+
+    case JR_DD_E: {
+
+        if (DD(Q(opcode))) {
+
+            pc = d->operand;
+            elapsed_cycles += 8;
+
+        } else {
+
+            pc++;
+            elapsed_cycles += 3;
+        }
+        break;
+    }
+
+    case DJNZ_E: {
+
+        if (--B) {
+
+            pc = d->operand;
+            elapsed_cycles += 9;
+
+        } else {
+
+            pc++;
+            elapsed_cycles += 4;
+        }
+        break;
+    }
+
+    case CALL_NN: {
+
+        pc += 2;
+        elapsed_cycles += 6;
+        PUSH(pc);
+        pc = d->operand;
+        elapsed_cycles++;
+        break;
+    }
+
+    case RET: {
+
+        POP(pc);
+        break;
+    }
+
+    case RET_CC: {
+
+        if (CC(Y(opcode))) {
+
+            POP(pc);
+        }
+        elapsed_cycles++;
+        break;
+    }
+
+    default: /* NOP */
+        break;
+    }
+
+    state.pc = pc & 0xffff;
+    return elapsed_cycles;
+}
+
+/* Claim page for block b. A block covers at most two pages, the decoded bytes
+ * of an instruction are never more than four.
+ */
+
+static bool blockUsesPage(Z80_BLOCK* b, int page)
+{
+    if (page == b->page[0] || page == b->page[1])
+        return true;
+    if (b->page[1] != b->page[0])
+        return false;
+    bus_code_page(page);
+    b->page[1] = page;
+    b->gen[1] = cpu_code_gen[page];
+    return true;
+}
+
+static inline bool blockModified(const Z80_BLOCK* b)
+{
+    return cpu_code_gen[b->page[0]] != b->gen[0]
+        || cpu_code_gen[b->page[1]] != b->gen[1];
+}
+
+/* Execute from state.pc, recording each instruction into b as it runs. */
+
+template <class Policy>
+int Z80Core<Policy>::recordBlock(Z80_BLOCK* b, int max_cycles)
+{
+    int elapsed_cycles = 0;
+
+    b->pc = state.pc;
+    b->count = 0;
+    b->page[0] = b->page[1] = state.pc >> 8;
+    bus_code_page(b->page[0]);
+    b->gen[0] = b->gen[1] = cpu_code_gen[b->page[0]];
+#ifdef Z80_NATIVE
+    b->runs = 0;
+    b->native = NULL;
+#endif
+
+    while (b->count < Z80_BLOCK_LENGTH) {
+
+        Z80_DECODED* d = &b->ops[b->count];
+        if (!decode(state.pc, d)
+            || (b->count && isIO(d->instruction))
+            || !blockUsesPage(b, d->pc >> 8)
+            || !blockUsesPage(b, ((d->pc + 3) & 0xffff) >> 8))
+            break;
+        b->count++;
+
+        Z80_BLOCK_HOOK(elapsed_cycles);
+        m_cycle_limit = max_cycles - elapsed_cycles;
+        elapsed_cycles += executeDecoded(d);
+        if (endsBlock(d->instruction)
+            || elapsed_cycles >= max_cycles
+            || blockModified(b))
+            break;
+    }
+
+    if (b->count == 0) {
+        Z80_BLOCK_HOOK(0);
+        return step(max_cycles);
+    }
+    return elapsed_cycles;
+}
+
+#ifdef Z80_NATIVE
+
+/* Host code for hot blocks, see native.h.
+ *
+ * A block compiles to a function of max_cycles returning the cycles it ran,
+ * for the core that decoded it. The registers stay in Z80_STATE, which r12
+ * points to, and are worked on there. The flags come from the host's: LAHF
+ * puts S, Z, H, P and C where the Z80 keeps them, SETO gives V. bus_read_map
+ * is in r13, bus_write_map in r14, cerb_ram in r15, the cycles elapsed in ebx
+ * and trace_head in rbp, stored back around calls and on the way out. [rsp]
+ * holds max_cycles, [rsp + 4] cpu_code_epoch and [rsp + 8] cpu_cycles as
+ * they were at entry. [rsp + 12] keeps ecx across a call, [rsp + 16] is set
+ * when a write through bus_page_write() moved cpu_code_epoch and [rsp + 20]
+ * holds the low byte of a word being read.
+ *
+ * R is counted at compile time and added to state.r on the way out and before
+ * executeDecoded() is called, for anything not compiled. A taken branch back
+ * to the start of the block loops inside the code until the budget is used up.
+ */
+
+static_assert(Z80_S_FLAG == 0x80 && Z80_Z_FLAG == 0x40 && Z80_H_FLAG == 0x10
+        && Z80_PV_FLAG == 0x04 && Z80_C_FLAG == 0x01,
+    "the flags LAHF loads");
+
+/* What the code is compiled for: one core and its state. */
+struct z80_target {
+    Z80_STATE* state;
+    void* core;
+    int (*run)(void* core, const Z80_DECODED* d); /* executeDecoded() */
+    int* cycle_limit;
+    bool documented_flags_only;
+};
+
+#define ALWAYS -1
+
+typedef int (*z80_native)(int max_cycles);
+
+struct z80_exit {
+    uint8_t* jump;
+    int k; /* after instruction k */
+    int pc; /* stored on the way out, or -1 when state.pc is already */
+    int r; /* R still to add */
+    bool counted; /* the instructions are */
+};
+
+struct z80native {
+    native_asm a;
+    const Z80_BLOCK* b;
+    z80_target t;
+    uint8_t* loop;
+    int r; /* R not yet added to state.r */
+    int pc; /* of the instruction being compiled */
+    std::vector<z80_exit> exits;
+
+    void exit(int cc, int k, int to) { exits.push_back({ cc == ALWAYS ? a.jmp() : a.jcc(cc), k, to, r, false }); }
+
+    native_rm at(const void* p) { return nmem(R12, (int)((const uint8_t*)p - (const uint8_t*)t.state)); }
+    native_rm reg(int index) { return at(t.state->register_table[index]); }
+    native_rm byteReg(int which) { return at(&t.state->registers.byte[which]); }
+    native_rm wordReg(int which) { return at(&t.state->registers.word[which]); }
+
+    void count(int instructions)
+    {
+        a.movptr(RAX, &cpu_instructions);
+        a.alui(X86_ADD, 8, nmem(RAX), instructions);
+    }
+
+    /* state.r as executeFast() leaves it after n more instructions */
+    void addR(int n)
+    {
+        if ((n & 0x7f) == 0)
+            return;
+        a.load(4, RAX, at(&t.state->r));
+        a.lea(4, RCX, nmem(RAX, n & 0x7f));
+        a.alui(X86_AND, 4, nreg(RCX), 0x7f);
+        a.alui(X86_AND, 4, nreg(RAX), 0x80);
+        a.alu(X86_OR, 4, nreg(RAX), RCX);
+        a.mov(4, at(&t.state->r), RAX);
+    }
+
+    void flush()
+    {
+        a.movptr(R11, &trace_head);
+        a.mov(8, nmem(R11), RBP);
+    }
+
+    void call(const void* fn)
+    {
+        flush();
+        a.call(fn);
+        a.movptr(R11, &trace_head);
+        a.load(8, RBP, nmem(R11));
+    }
+
+    /* trace_z80() for instruction d */
+    void trace(const Z80_DECODED* d)
+    {
+        a.mov(4, nreg(RDX), RBP);
+        a.inc(8, nreg(RBP));
+        a.alui(X86_AND, 4, nreg(RDX), TRACE_RING_SIZE - 1);
+        a.lea(8, RDX, nmem(RDX, RDX, 2));
+        a.movptr(RAX, trace_ring);
+        a.lea(8, RDX, nmem(RAX, RDX, 8));
+
+        // cycle, pc and sp, the opcode bytes, AF BC DE HL, then IX IY
+        static_assert(offsetof(trace_record, pc) == 4 && offsetof(trace_record, sp) == 6
+                && offsetof(trace_record, op) == 8 && offsetof(trace_record, r) == 12
+                && sizeof(trace_record) == 24,
+            "the layout in trace.h");
+        static_assert(Z80_BC == 0 && Z80_DE == 1 && Z80_HL == 2 && Z80_AF == 3 && Z80_IX == 4 && Z80_IY == 5,
+            "the word registers in trace order but for AF");
+        a.load(4, RAX, nmem(RSP, 8));
+        a.alu(X86_ADD, 4, nreg(RAX), RBX);
+        a.movzx(2, RCX, wordReg(Z80_SP));
+        a.shift(SH_SHL, 4, nreg(RCX), 16);
+        a.alui(X86_OR, 4, nreg(RCX), d->pc);
+        a.shift(SH_SHL, 8, nreg(RCX), 32);
+        a.alu(X86_OR, 8, nreg(RAX), RCX);
+        a.mov(8, nmem(RDX), RAX);
+        if (d->pc <= 0xfffc) {
+            a.load(4, RAX, nmem(R15, d->pc));
+            a.mov(4, nmem(RDX, 8), RAX);
+        } else {
+            for (int i = 0; i < 4; i++) {
+                a.movzx(1, RAX, nmem(R15, (d->pc + i) & 0xffff));
+                a.mov(1, nmem(RDX, 8 + i), RAX);
+            }
+        }
+        a.load(8, RAX, wordReg(Z80_BC));
+        a.shift(SH_ROL, 8, nreg(RAX), 16);
+        a.mov(8, nmem(RDX, 12), RAX);
+        a.load(4, RAX, wordReg(Z80_IX));
+        a.mov(4, nmem(RDX, 20), RAX);
+    }
+
+    /* eax = the byte at addr, or at ecx if addr is -1. ecx is kept, the other
+     * caller saved registers are not. */
+    void read(int addr)
+    {
+        if (addr >= 0) {
+            a.load(8, RAX, nmem(R13, (addr >> 8) * 8));
+        } else {
+            a.mov(4, nreg(RAX), RCX);
+            a.shift(SH_SHR, 4, nreg(RAX), 8);
+            a.load(8, RAX, nmem(R13, RAX, 8));
+        }
+        a.test(8, nreg(RAX), RAX);
+        uint8_t* device = a.jcc(CC_E);
+        if (addr >= 0) {
+            a.movzx(1, RAX, nmem(RAX, addr & 0xff));
+        } else {
+            a.movzx(1, RDX, nreg(RCX));
+            a.movzx(1, RAX, nmem(RAX, RDX, 1));
+        }
+        uint8_t* done = a.jmp();
+        a.bind(device);
+        a.movi(4, at(&t.state->pc), pc);
+        if (addr >= 0) {
+            a.movi32(RDI, addr);
+        } else {
+            a.mov(4, nmem(RSP, 12), RCX);
+            a.mov(4, nreg(RDI), RCX);
+        }
+        call((const void*)bus_page_read);
+        a.movzx(1, RAX, nreg(RAX));
+        if (addr < 0)
+            a.load(4, RCX, nmem(RSP, 12));
+        a.bind(done);
+    }
+
+    /* The byte in dl to addr, or to ecx. ecx is kept, the other caller saved
+     * registers are not. */
+    void write(int addr)
+    {
+        if (addr >= 0) {
+            a.load(8, RAX, nmem(R14, (addr >> 8) * 8));
+        } else {
+            a.mov(4, nreg(RAX), RCX);
+            a.shift(SH_SHR, 4, nreg(RAX), 8);
+            a.load(8, RAX, nmem(R14, RAX, 8));
+        }
+        a.test(8, nreg(RAX), RAX);
+        uint8_t* trapped = a.jcc(CC_E);
+        if (addr >= 0) {
+            a.mov(1, nmem(RAX, addr & 0xff), RDX);
+        } else {
+            a.movzx(1, RSI, nreg(RCX));
+            a.mov(1, nmem(RAX, RSI, 1), RDX);
+        }
+        uint8_t* done = a.jmp();
+        a.bind(trapped);
+        a.movi(4, at(&t.state->pc), pc);
+        if (addr >= 0) {
+            a.movi32(RDI, addr);
+        } else {
+            a.mov(4, nmem(RSP, 12), RCX);
+            a.mov(4, nreg(RDI), RCX);
+        }
+        a.movzx(1, RSI, nreg(RDX));
+        call((const void*)bus_page_write);
+        a.movptr(RAX, &cpu_code_epoch);
+        a.load(4, RAX, nmem(RAX));
+        a.alu_load(X86_CMP, 4, RAX, nmem(RSP, 4));
+        a.setcc(CC_NE, nreg(RAX));
+        a.alu(X86_OR, 1, nmem(RSP, 16), RAX);
+        if (addr < 0)
+            a.load(4, RCX, nmem(RSP, 12));
+        a.bind(done);
+    }
+
+    void nextAddress(int addr)
+    {
+        if (addr < 0) {
+            a.lea(4, RCX, nmem(RCX, 1));
+            a.movzx(2, RCX, nreg(RCX));
+        }
+    }
+
+    /* eax = the word at addr, or at ecx, which is left on its second byte */
+    void readWord(int addr)
+    {
+        read(addr);
+        a.mov(4, nmem(RSP, 20), RAX);
+        nextAddress(addr);
+        read(addr < 0 ? -1 : (addr + 1) & 0xffff);
+        a.shift(SH_SHL, 4, nreg(RAX), 8);
+        a.alu_load(X86_OR, 4, RAX, nmem(RSP, 20));
+    }
+
+    /* The word at src, or value if src is NULL, to addr or ecx */
+    void writeWord(int addr, const native_rm* src, int value)
+    {
+        for (int i = 0; i < 2; i++) {
+            if (src) {
+                native_rm byte = *src;
+                byte.disp += i;
+                a.movzx(1, RDX, byte);
+            } else {
+                a.movi32(RDX, (value >> 8 * i) & 0xff);
+            }
+            if (i)
+                nextAddress(addr);
+            write(addr < 0 ? -1 : (addr + i) & 0xffff);
+        }
+    }
+
+    /* Out after instruction k, at to, if one of its writes changed code. */
+    void modified(int k, int to)
+    {
+        a.alui(X86_CMP, 1, nmem(RSP, 16), 0);
+        exit(CC_NE, k, to);
+    }
+
+    /* ecx = HL, or IX or IY plus the displacement */
+    void indirect(const Z80_DECODED* d, int displacement)
+    {
+        if (d->registers == t.state->register_table) {
+            a.movzx(2, RCX, wordReg(Z80_HL));
+        } else {
+            a.movzx(2, RCX, at(d->registers[6]));
+            a.lea(4, RCX, nmem(RCX, displacement));
+            a.movzx(2, RCX, nreg(RCX));
+        }
+    }
+
+    /* F from the host flags in ah, as far as mask, and dl as V */
+    void hostFlags(int mask, bool overflow)
+    {
+        a.mov(4, nreg(RSI), RAX);
+        a.shift(SH_SHR, 4, nreg(RSI), 8);
+        a.alui(X86_AND, 4, nreg(RSI), mask);
+        if (overflow)
+            a.lea(4, RSI, nmem(RSI, RDX, 4));
+    }
+
+    /* Y and X from the low byte of r into esi, unless only the documented
+     * flags are emulated. */
+    void undocumented(int r)
+    {
+        if (t.documented_flags_only)
+            return;
+        a.mov(4, nreg(RDI), r);
+        a.alui(X86_AND, 4, nreg(RDI), Z80_Y_FLAG | Z80_X_FLAG);
+        a.alu(X86_OR, 4, nreg(RSI), RDI);
+    }
+
+    /* A op= cl with F as the ALU macros set it, op one of the X86_ ones */
+    void arithmetic(int op, bool carry, bool compare)
+    {
+        native_rm acc = byteReg(Z80_A), flags = byteReg(Z80_F);
+        a.movzx(1, RAX, acc);
+        if (op == X86_AND || op == X86_OR || op == X86_XOR) {
+            a.alu(op, 1, nreg(RAX), RCX);
+            a.lahf();
+            a.mov(1, acc, RAX);
+            hostFlags(Z80_S_FLAG | Z80_Z_FLAG | Z80_PV_FLAG, false);
+            a.alui(X86_AND, 4, nreg(RAX), Z80_Y_FLAG | Z80_X_FLAG);
+            a.alu(X86_OR, 4, nreg(RSI), RAX);
+            if (op == X86_AND)
+                a.alui(X86_OR, 4, nreg(RSI), Z80_H_FLAG);
+            a.mov(1, flags, RSI);
+            return;
+        }
+        a.alu(X86_XOR, 4, nreg(RDX), RDX);
+        if (carry) {
+            a.movzx(1, RSI, flags);
+            a.shift(SH_SHR, 4, nreg(RSI), 1);
+            op = op == X86_ADD ? X86_ADC : X86_SBB;
+        }
+        a.alu(op, 1, nreg(RAX), RCX);
+        a.setcc(CC_O, nreg(RDX));
+        a.lahf();
+        if (!compare)
+            a.mov(1, acc, RAX);
+        hostFlags(Z80_S_FLAG | Z80_Z_FLAG | Z80_H_FLAG | Z80_C_FLAG, true);
+        if (op != X86_ADD && op != X86_ADC)
+            a.alui(X86_OR, 4, nreg(RSI), Z80_N_FLAG);
+        undocumented(compare ? RCX : RAX);
+        a.mov(1, flags, RSI);
+    }
+
+    /* INC or DEC of the byte at x, which is not in rax, rdx or rsi */
+    void incdec(native_rm x, bool dec)
+    {
+        a.alu(X86_XOR, 4, nreg(RDX), RDX);
+        if (dec)
+            a.dec(1, x);
+        else
+            a.inc(1, x);
+        a.setcc(CC_O, nreg(RDX));
+        a.lahf();
+        hostFlags(Z80_S_FLAG | Z80_Z_FLAG | Z80_H_FLAG, true);
+        a.movzx(1, RDX, byteReg(Z80_F));
+        a.alui(X86_AND, 4, nreg(RDX), Z80_C_FLAG);
+        a.alu(X86_OR, 4, nreg(RSI), RDX);
+        if (dec)
+            a.alui(X86_OR, 4, nreg(RSI), Z80_N_FLAG);
+        if (!t.documented_flags_only) {
+            a.movzx(1, RDX, x);
+            undocumented(RDX);
+        }
+        a.mov(1, byteReg(Z80_F), RSI);
+    }
+
+    /* The 0xcb rotate or shift y of al, with F as the macros set it */
+    void rotate(int y)
+    {
+        a.alu(X86_XOR, 4, nreg(RDX), RDX);
+        if (y == 2 || y == 3) { // RL RR
+            a.movzx(1, RSI, byteReg(Z80_F));
+            a.shift(SH_SHR, 4, nreg(RSI), 1);
+        }
+        static const int shifts[8] = { SH_ROL, SH_ROR, SH_RCL, SH_RCR, SH_SHL, SH_SAR, SH_SHL, SH_SHR };
+        a.shift(shifts[y], 1, nreg(RAX), 1);
+        a.setcc(CC_B, nreg(RDX));
+        if (y == 6) // SLL
+            a.alui(X86_OR, 1, nreg(RAX), 1);
+        a.test(1, nreg(RAX), RAX);
+        a.lahf();
+        hostFlags(Z80_S_FLAG | Z80_Z_FLAG | Z80_PV_FLAG, false);
+        a.alu(X86_OR, 4, nreg(RSI), RDX);
+        a.mov(4, nreg(RDI), RAX);
+        a.alui(X86_AND, 4, nreg(RDI), Z80_Y_FLAG | Z80_X_FLAG);
+        a.alu(X86_OR, 4, nreg(RSI), RDI);
+        a.mov(1, byteReg(Z80_F), RSI);
+    }
+
+    /* BIT y of al, with Y and X from the low byte of yx */
+    void bit(int y, int yx)
+    {
+        a.movzx(1, RSI, byteReg(Z80_F));
+        a.alui(X86_AND, 4, nreg(RSI), Z80_C_FLAG);
+        a.alui(X86_OR, 4, nreg(RSI), Z80_H_FLAG);
+        undocumented(yx);
+        a.testi(1, nreg(RAX), 1 << y);
+        uint8_t* set = a.jcc(CC_NE);
+        a.alui(X86_OR, 4, nreg(RSI), Z80_Z_FLAG | Z80_PV_FLAG);
+        if (y == 7 && !t.documented_flags_only) {
+            uint8_t* done = a.jmp();
+            a.bind(set);
+            a.alui(X86_OR, 4, nreg(RSI), Z80_S_FLAG);
+            a.bind(done);
+        } else {
+            a.bind(set);
+        }
+        a.mov(1, byteReg(Z80_F), RSI);
+    }
+
+    /* The host condition code under which condition cc holds, after F is
+     * tested. */
+    int condition(int cc)
+    {
+        static const int flags[4] = { Z80_Z_FLAG, Z80_C_FLAG, Z80_PV_FLAG, Z80_S_FLAG };
+        a.testi(1, byteReg(Z80_F), flags[cc >> 1]);
+        return cc & 1 ? CC_NE : CC_E;
+    }
+
+    /* Taken jump of instruction k to target, which loops while the budget
+     * lasts if that is the start of the block. */
+    void jump(int k, int target)
+    {
+        if (target != b->pc) {
+            exit(ALWAYS, k, target);
+            return;
+        }
+        count(k + 1);
+        addR(r);
+        a.alu_load(X86_CMP, 4, RBX, nmem(RSP));
+        a.jcc_to(CC_L, loop);
+        exits.push_back({ a.jmp(), k, target, 0, true });
+    }
+
+    int compile(const Z80_DECODED* d, int k);
+    bool fallback(const Z80_DECODED* d, int k);
+};
+
+/* Instruction k, without the trace. Returns the pc after it, or -1 when the
+ * block ends with it. */
+
+int z80native::compile(const Z80_DECODED* d, int k)
+{
+    void** registers = d->registers;
+    bool indexed = registers != t.state->register_table;
+    int opcode = d->opcode;
+    int next = d->operand_pc;
+    int cycles = d->prefix_cycles + 4;
+    int displacement = (int16_t)d->operand;
+    bool writes = false;
+
+    r += d->prefix_r + 1;
+
+    switch (d->instruction) {
+
+    case LD_R_R:
+        a.movzx(1, RAX, at(registers[Z(opcode)]));
+        a.mov(1, at(registers[Y(opcode)]), RAX);
+        break;
+
+    case LD_R_N:
+        a.movi(1, at(registers[Y(opcode)]), d->operand);
+        next++;
+        cycles += 3;
+        break;
+
+    case LD_R_INDIRECT_HL:
+        indirect(d, displacement);
+        read(-1);
+        a.mov(1, reg(Y(opcode)), RAX);
+        next += indexed;
+        cycles += indexed ? 11 : 3;
+        break;
+
+    case LD_INDIRECT_HL_R:
+        indirect(d, displacement);
+        a.movzx(1, RDX, reg(Z(opcode)));
+        write(-1);
+        next += indexed;
+        cycles += indexed ? 11 : 3;
+        writes = true;
+        break;
+
+    case LD_INDIRECT_HL_N:
+        indirect(d, (signed char)d->operand);
+        a.movi32(RDX, d->operand >> 8);
+        write(-1);
+        next += indexed ? 2 : 1;
+        cycles += indexed ? 11 : 6;
+        writes = true;
+        break;
+
+    case LD_A_INDIRECT_NN:
+        read(d->operand);
+        a.mov(1, byteReg(Z80_A), RAX);
+        next += 2;
+        cycles += 9;
+        break;
+
+    case LD_INDIRECT_NN_A:
+        a.movzx(1, RDX, byteReg(Z80_A));
+        write(d->operand);
+        next += 2;
+        cycles += 9;
+        writes = true;
+        break;
+
+    case LD_RR_NN:
+        a.movi(2, at(registers[P(opcode) + 8]), d->operand);
+        next += 2;
+        cycles += 6;
+        break;
+
+    case PUSH_SS: {
+        native_rm src = at(registers[P(opcode) + 12]);
+        a.alui(X86_SUB, 2, wordReg(Z80_SP), 2);
+        a.movzx(2, RCX, wordReg(Z80_SP));
+        writeWord(-1, &src, 0);
+        cycles += 7;
+        writes = true;
+        break;
+    }
+
+    case POP_SS:
+        a.movzx(2, RCX, wordReg(Z80_SP));
+        readWord(-1);
+        a.mov(2, at(registers[P(opcode) + 12]), RAX);
+        a.alui(X86_ADD, 2, wordReg(Z80_SP), 2);
+        cycles += 6;
+        break;
+
+    case EX_DE_HL:
+        static_assert(Z80_HL == Z80_DE + 1, "DE and HL are one dword");
+        a.shift(SH_ROL, 4, wordReg(Z80_DE), 16);
+        break;
+
+    case ADD_R:
+    case ADC_R:
+    case SUB_R:
+    case SBC_R:
+    case AND_R:
+    case XOR_R:
+    case OR_R:
+    case CP_R:
+        a.movzx(1, RCX, at(registers[Z(opcode)]));
+        break;
+
+    case ADD_N:
+    case ADC_N:
+    case SUB_N:
+    case SBC_N:
+    case AND_N:
+    case XOR_N:
+    case OR_N:
+    case CP_N:
+        a.movi32(RCX, d->operand & 0xff);
+        next++;
+        cycles += 3;
+        break;
+
+    case ADD_INDIRECT_HL:
+    case ADC_INDIRECT_HL:
+    case SUB_INDIRECT_HL:
+    case SBC_INDIRECT_HL:
+    case AND_INDIRECT_HL:
+    case XOR_INDIRECT_HL:
+    case OR_INDIRECT_HL:
+    case CP_INDIRECT_HL:
+        indirect(d, displacement);
+        read(-1);
+        a.mov(4, nreg(RCX), RAX);
+        next += indexed;
+        cycles += indexed ? 11 : 3;
+        break;
+
+    case INC_R:
+    case DEC_R:
+        incdec(at(registers[Y(opcode)]), d->instruction == DEC_R);
+        break;
+
+    case INC_INDIRECT_HL:
+    case DEC_INDIRECT_HL:
+        indirect(d, displacement);
+        read(-1);
+        a.mov(4, nreg(R8), RAX);
+        incdec(nreg(R8), d->instruction == DEC_INDIRECT_HL);
+        a.mov(4, nreg(RDX), R8);
+        write(-1);
+        next += indexed;
+        cycles += indexed ? 15 : 7;
+        writes = true;
+        break;
+
+    case INC_RR:
+        a.inc(2, at(registers[P(opcode) + 8]));
+        cycles += 2;
+        break;
+
+    case DEC_RR:
+        a.dec(2, at(registers[P(opcode) + 8]));
+        cycles += 2;
+        break;
+
+    case LD_HL_INDIRECT_NN:
+    case LD_RR_INDIRECT_NN:
+        readWord(d->operand);
+        a.mov(2, at(registers[d->instruction == LD_HL_INDIRECT_NN ? 6 : P(opcode) + 8]), RAX);
+        next += 2;
+        cycles += 12;
+        break;
+
+    case LD_INDIRECT_NN_HL:
+    case LD_INDIRECT_NN_RR: {
+        native_rm src = at(registers[d->instruction == LD_INDIRECT_NN_HL ? 6 : P(opcode) + 8]);
+        writeWord(d->operand, &src, 0);
+        next += 2;
+        cycles += 12;
+        writes = true;
+        break;
+    }
+
+    case LD_SP_HL:
+        a.movzx(2, RAX, at(registers[6]));
+        a.mov(2, wordReg(Z80_SP), RAX);
+        cycles += 2;
+        break;
+
+    case ADD_HL_RR: {
+        native_rm hl = at(registers[6]);
+        a.movzx(2, RAX, hl);
+        a.movzx(2, RCX, at(registers[P(opcode) + 8]));
+        a.lea(4, RDX, nmem(RAX, RCX, 1));
+        a.mov(2, hl, RDX);
+        a.alu(X86_XOR, 4, nreg(RAX), RCX);
+        a.alu(X86_XOR, 4, nreg(RAX), RDX);
+        a.movzx(1, RSI, byteReg(Z80_F));
+        a.alui(X86_AND, 4, nreg(RSI), Z80_S_FLAG | Z80_Z_FLAG | Z80_PV_FLAG);
+        a.mov(4, nreg(RCX), RDX);
+        a.shift(SH_SHR, 4, nreg(RCX), 16);
+        a.alu(X86_OR, 4, nreg(RSI), RCX);
+        if (!t.documented_flags_only) {
+            a.shift(SH_SHR, 4, nreg(RDX), 8);
+            undocumented(RDX);
+            a.shift(SH_SHR, 4, nreg(RAX), 8);
+            a.alui(X86_AND, 4, nreg(RAX), Z80_H_FLAG);
+            a.alu(X86_OR, 4, nreg(RSI), RAX);
+        }
+        a.mov(1, byteReg(Z80_F), RSI);
+        cycles += 7;
+        break;
+    }
+
+    case RLC_R:
+    case RL_R:
+    case RRC_R:
+    case RR_R:
+    case SLA_R:
+    case SLL_R:
+    case SRA_R:
+    case SRL_R:
+        a.movzx(1, RAX, at(registers[Z(opcode)]));
+        rotate(Y(opcode));
+        a.mov(1, at(registers[Z(opcode)]), RAX);
+        break;
+
+    case BIT_B_R:
+        a.movzx(1, RAX, at(registers[Z(opcode)]));
+        bit(Y(opcode), RAX);
+        break;
+
+    case SET_B_R:
+        a.alui(X86_OR, 1, at(registers[Z(opcode)]), 1 << Y(opcode));
+        break;
+
+    case RES_B_R:
+        a.alui(X86_AND, 1, at(registers[Z(opcode)]), ~(1 << Y(opcode)));
+        break;
+
+    case RLC_INDIRECT_HL:
+    case RL_INDIRECT_HL:
+    case RRC_INDIRECT_HL:
+    case RR_INDIRECT_HL:
+    case SLA_INDIRECT_HL:
+    case SLL_INDIRECT_HL:
+    case SRA_INDIRECT_HL:
+    case SRL_INDIRECT_HL:
+    case BIT_B_INDIRECT_HL:
+    case SET_B_INDIRECT_HL:
+    case RES_B_INDIRECT_HL:
+        indirect(d, displacement);
+        read(-1);
+        next += indexed ? 2 : 0;
+        cycles += indexed ? 8 : 4;
+        if (d->instruction == BIT_B_INDIRECT_HL) {
+            bit(Y(opcode), RCX);
+            break;
+        }
+        if (d->instruction == SET_B_INDIRECT_HL)
+            a.alui(X86_OR, 4, nreg(RAX), 1 << Y(opcode));
+        else if (d->instruction == RES_B_INDIRECT_HL)
+            a.alui(X86_AND, 4, nreg(RAX), ~(1 << Y(opcode)));
+        else
+            rotate(Y(opcode));
+        a.mov(4, nreg(RDX), RAX);
+        write(-1);
+        cycles += 3;
+        writes = true;
+        break;
+
+    case JP_NN:
+        a.alui(X86_ADD, 4, nreg(RBX), cycles + 6);
+        jump(k, d->operand);
+        return -1;
+
+    case JR_E:
+        a.alui(X86_ADD, 4, nreg(RBX), cycles + 8);
+        jump(k, d->operand);
+        return -1;
+
+    case JP_CC_NN:
+    case JR_DD_E:
+    case DJNZ_E: {
+        uint8_t* untaken;
+        int taken_cycles, untaken_cycles;
+        if (d->instruction == DJNZ_E) {
+            a.dec(1, byteReg(Z80_B));
+            untaken = a.jcc(CC_E);
+            taken_cycles = 9;
+            untaken_cycles = 4;
+        } else if (d->instruction == JR_DD_E) {
+            untaken = a.jcc(condition(Q(opcode)) ^ 1);
+            taken_cycles = 8;
+            untaken_cycles = 3;
+        } else {
+            untaken = a.jcc(condition(Y(opcode)) ^ 1);
+            taken_cycles = untaken_cycles = 6;
+        }
+        a.alui(X86_ADD, 4, nreg(RBX), cycles + taken_cycles);
+        jump(k, d->operand);
+        a.bind(untaken);
+        a.alui(X86_ADD, 4, nreg(RBX), cycles + untaken_cycles);
+        exit(ALWAYS, k, (next + (d->instruction == JP_CC_NN ? 2 : 1)) & 0xffff);
+        return -1;
+    }
+
+    case CALL_NN:
+        a.alui(X86_SUB, 2, wordReg(Z80_SP), 2);
+        a.movzx(2, RCX, wordReg(Z80_SP));
+        writeWord(-1, NULL, (next + 2) & 0xffff);
+        a.alui(X86_ADD, 4, nreg(RBX), cycles + 13);
+        modified(k, d->operand);
+        jump(k, d->operand);
+        return -1;
+
+    case RET_CC: {
+        uint8_t* taken = a.jcc(condition(Y(opcode)));
+        a.alui(X86_ADD, 4, nreg(RBX), cycles + 1);
+        exit(ALWAYS, k, next);
+        a.bind(taken);
+        cycles++;
+    }
+        // fall through
+    case RET:
+        a.movzx(2, RCX, wordReg(Z80_SP));
+        readWord(-1);
+        a.mov(4, at(&t.state->pc), RAX);
+        a.alui(X86_ADD, 2, wordReg(Z80_SP), 2);
+        a.alui(X86_ADD, 4, nreg(RBX), cycles + 6);
+        exit(ALWAYS, k, -1);
+        return -1;
+
+    default: /* NOP */
+        break;
+    }
+
+    switch (d->instruction) {
+    case ADD_R:
+    case ADD_N:
+    case ADD_INDIRECT_HL:
+        arithmetic(X86_ADD, false, false);
+        break;
+    case ADC_R:
+    case ADC_N:
+    case ADC_INDIRECT_HL:
+        arithmetic(X86_ADD, true, false);
+        break;
+    case SUB_R:
+    case SUB_N:
+    case SUB_INDIRECT_HL:
+        arithmetic(X86_SUB, false, false);
+        break;
+    case SBC_R:
+    case SBC_N:
+    case SBC_INDIRECT_HL:
+        arithmetic(X86_SUB, true, false);
+        break;
+    case AND_R:
+    case AND_N:
+    case AND_INDIRECT_HL:
+        arithmetic(X86_AND, false, false);
+        break;
+    case XOR_R:
+    case XOR_N:
+    case XOR_INDIRECT_HL:
+        arithmetic(X86_XOR, false, false);
+        break;
+    case OR_R:
+    case OR_N:
+    case OR_INDIRECT_HL:
+        arithmetic(X86_OR, false, false);
+        break;
+    case CP_R:
+    case CP_N:
+    case CP_INDIRECT_HL:
+        arithmetic(X86_SUB, false, true);
+        break;
+    }
+
+    next &= 0xffff;
+    a.alui(X86_ADD, 4, nreg(RBX), cycles);
+    if (writes)
+        modified(k, next);
+    return next;
+}
+
+/* Instruction k through executeDecoded(). False when the block ends with it. */
+
+bool z80native::fallback(const Z80_DECODED* d, int k)
+{
+    addR(r);
+    r = 0;
+    a.load(4, RAX, nmem(RSP));
+    a.alu(X86_SUB, 4, nreg(RAX), RBX);
+    a.movptr(RCX, t.cycle_limit);
+    a.mov(4, nmem(RCX), RAX);
+    a.movptr(RDI, t.core);
+    a.movptr(RSI, d);
+    call((const void*)t.run);
+    a.alu(X86_ADD, 4, nreg(RBX), RAX);
+    if (endsBlock(d->instruction) || k + 1 == b->count) {
+        exit(ALWAYS, k, -1);
+        return false;
+    }
+    a.alui(X86_CMP, 4, at(&t.state->pc), b->ops[k + 1].pc);
+    exit(CC_NE, k, -1);
+    a.movptr(RAX, &cpu_code_epoch);
+    a.load(4, RAX, nmem(RAX));
+    a.alu_load(X86_CMP, 4, RAX, nmem(RSP, 4));
+    exit(CC_NE, k, -1);
+    return true;
+}
+
+/* What runs natively: what executeFast() runs but ADC HL, SBC HL and NEG. */
+
+static bool compiled(const Z80_DECODED* d)
+{
+    switch (d->instruction) {
+    case ADC_HL_RR:
+    case SBC_HL_RR:
+    case NEG:
+        return false;
+    default:
+        return d->fast;
+    }
+}
+
+/* The trace trap is checked by trace_z80(), which the host code does not
+ * call. */
+
+static bool trapped(const Z80_BLOCK* b)
+{
+    if (trace_trap_pc < 0)
+        return false;
+    for (int k = 0; k < b->count; k++)
+        if (b->ops[k].pc == trace_trap_pc)
+            return true;
+    return false;
+}
+
+#define NATIVE_OP_SIZE 1536 /* bytes of host code per instruction, at most */
+
+static z80_native compileNative(const Z80_BLOCK* b, const z80_target& t)
+{
+    size_t max = NATIVE_OP_SIZE * (b->count + 1);
+    uint8_t* start = native_begin(max);
+    if (!start)
+        return NULL;
+
+    z80native n;
+    native_asm& a = n.a;
+    a.p = start;
+    n.b = b;
+    n.t = t;
+    n.r = 0;
+
+    static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+    for (int r : saved)
+        a.push(r);
+    a.alui(X86_SUB, 8, nreg(RSP), 24);
+    a.mov(4, nmem(RSP), RDI);
+    a.movptr(R12, t.state);
+    a.movptr(R13, bus_read_map);
+    a.movptr(R14, bus_write_map);
+    a.movptr(R15, cerb_ram);
+    a.movptr(RAX, &cpu_code_epoch);
+    a.load(4, RAX, nmem(RAX));
+    a.mov(4, nmem(RSP, 4), RAX);
+    a.movptr(RAX, &trace_head);
+    a.load(8, RBP, nmem(RAX));
+    a.movptr(RAX, &cpu_cycles);
+    a.load(4, RAX, nmem(RAX));
+    a.mov(4, nmem(RSP, 8), RAX);
+    a.movi(1, nmem(RSP, 16), 0);
+    a.alu(X86_XOR, 4, nreg(RBX), RBX);
+    a.movi(4, n.at(&t.state->status), 0);
+
+    n.loop = a.p;
+    for (int k = 0; k < b->count; k++) {
+        const Z80_DECODED* d = &b->ops[k];
+        n.pc = d->pc;
+        n.trace(d);
+        int next;
+        if (compiled(d)) {
+            next = n.compile(d, k);
+            if (next < 0)
+                break;
+        } else {
+            if (!n.fallback(d, k))
+                break;
+            next = -1;
+        }
+        if (k + 1 == b->count) {
+            n.exit(ALWAYS, k, next);
+        } else {
+            a.alu_load(X86_CMP, 4, RBX, nmem(RSP));
+            n.exit(CC_GE, k, next);
+        }
+    }
+
+    uint8_t* epilogue = a.p;
+    n.flush();
+    a.mov(4, nreg(RAX), RBX);
+    a.alui(X86_ADD, 8, nreg(RSP), 24);
+    for (int i = 5; i >= 0; i--)
+        a.pop(saved[i]);
+    a.ret();
+
+    for (const z80_exit& e : n.exits) {
+        a.bind(e.jump);
+        if (e.pc >= 0)
+            a.movi(4, n.at(&t.state->pc), e.pc);
+        if (!e.counted)
+            n.count(e.k + 1);
+        n.addR(e.r);
+        a.jmp_to(epilogue);
+    }
+
+    native_commit(a.p);
+    return reinterpret_cast<z80_native>(start);
+}
+
+template <class Policy>
+int Z80Core<Policy>::runDecoded(void* core, const Z80_DECODED* d)
+{
+    return static_cast<Z80Core*>(core)->executeDecoded(d);
+}
+
+template <class Policy>
+void Z80Core<Policy>::compileBlock(Z80_BLOCK* b)
+{
+    z80_target t = { &state, this, runDecoded, &m_cycle_limit, Policy::documented_flags_only };
+    b->native = compileNative(b, t);
+    b->native_gen = native_gen;
+}
+
+#endif /* Z80_NATIVE */
+
+#endif /* Z80_BLOCK_CACHE */
+
+template <class Policy>
+int Z80Core<Policy>::stepBlock(int max_cycles)
+{
+#ifdef Z80_BLOCK_CACHE
+
+    if (!m_blocks) {
+        m_blocks = static_cast<Z80_BLOCK*>(calloc(Z80_BLOCK_CACHE_SIZE, sizeof(Z80_BLOCK)));
+        if (!m_blocks) {
+            Z80_BLOCK_HOOK(0);
+            return step(max_cycles);
+        }
+    }
+
+    Z80_BLOCK* b = &m_blocks[state.pc & (Z80_BLOCK_CACHE_SIZE - 1)];
+    if (b->count == 0 || b->pc != state.pc || blockModified(b))
+        return recordBlock(b, max_cycles);
+
+#ifdef Z80_NATIVE
+    if (native_enabled && !trapped(b)) {
+        if (!b->native || b->native_gen != native_gen) {
+            b->native = NULL;
+            if (++b->runs >= Z80_NATIVE_HOT) {
+                b->runs = 0;
+                compileBlock(b);
+            }
+        }
+        if (b->native)
+            return b->native(max_cycles);
+    }
+#endif
+
+    int elapsed_cycles = 0;
+    uint32_t epoch = cpu_code_epoch;
+    const Z80_DECODED* d = b->ops;
+    const Z80_DECODED* end = d + b->count;
+    for (;;) {
+
+        Z80_BLOCK_HOOK(elapsed_cycles);
+        m_cycle_limit = max_cycles - elapsed_cycles;
+        elapsed_cycles += executeDecoded(d);
+        if (++d == end || elapsed_cycles >= max_cycles)
+            break;
+
+        /* Stop where the recorded path is left (a branch went the
+         * other way) or where the block overwrote its own code.
+         */
+
+        if (state.pc != d->pc || (cpu_code_epoch != epoch && blockModified(b)))
+            break;
+    }
+    return elapsed_cycles;
+
+#else
+
+    Z80_BLOCK_HOOK(0);
+    return step(max_cycles);
+
+#endif
+}
+
+/* Actual emulation function. opcode is the first opcode to emulate, this is
+ * needed by Z80Interrupt() for interrupt mode 0.
+ */
+
+template <class Policy>
+int Z80Core<Policy>::intemulate(int opcode, int elapsed_cycles)
+{
+    return execute(INSTRUCTION_TABLE[opcode], opcode, state.register_table,
+        state.pc, state.r & 0x7f, elapsed_cycles);
+}
+
+/* Emulate one instruction starting at its decoded form: instruction and opcode
+ * after any prefixes, the register table they select, pc on the first operand
+ * byte, and r and elapsed_cycles already counting the prefixes.
+ */
+
+template <class Policy>
+int Z80Core<Policy>::execute(int instruction, int opcode, void** registers, int pc, int r, int elapsed_cycles)
+{
+    bool repeatLoop;
+
+    do {
+
+        repeatLoop = false;
+
+        elapsed_cycles += 4;
+        r++;
+        switch (instruction) {
+
+            /* 8-bit load group. */
+
+        case LD_R_R: {
+
+            R(Y(opcode)) = R(Z(opcode));
+            break;
+        }
+
+        case LD_R_N: {
+
+            READ_N(R(Y(opcode)));
+            break;
+        }
+
+        case LD_R_INDIRECT_HL: {
+
+            if (registers == state.register_table) {
+
+                READ_BYTE(HL, R(Y(opcode)));
+
+            } else {
+
+                int d;
+
+                READ_D(d);
+                d += HL_IX_IY;
+                READ_BYTE(d, S(Y(opcode)));
+
+                elapsed_cycles += 5;
+            }
+            break;
+        }
+
+        case LD_INDIRECT_HL_R: {
+
+            if (registers == state.register_table) {
+
+                WRITE_BYTE(HL, R(Z(opcode)));
+
+            } else {
+
+                int d;
+
+                READ_D(d);
+                d += HL_IX_IY;
+                WRITE_BYTE(d, S(Z(opcode)));
+
+                elapsed_cycles += 5;
+            }
+            break;
+        }
+
+        case LD_INDIRECT_HL_N: {
+
+            int n;
+
+            if (registers == state.register_table) {
+
+                READ_N(n);
+                WRITE_BYTE(HL, n);
+
+            } else {
+
+                int d;
+
+                READ_D(d);
+                d += HL_IX_IY;
+                READ_N(n);
+                WRITE_BYTE(d, n);
+
+                elapsed_cycles += 2;
+            }
+
+            break;
+        }
+
+        case LD_A_INDIRECT_BC: {
+
+            READ_BYTE(BC, A);
+            break;
+        }
+
+        case LD_A_INDIRECT_DE: {
+
+            READ_BYTE(DE, A);
+            break;
+        }
+
+        case LD_A_INDIRECT_NN: {
+
+            int nn;
+
+            READ_NN(nn);
+            READ_BYTE(nn, A);
+            break;
+        }
+
+        case LD_INDIRECT_BC_A: {
+
+            WRITE_BYTE(BC, A);
+            break;
+        }
+
+        case LD_INDIRECT_DE_A: {
+
+            WRITE_BYTE(DE, A);
+            break;
+        }
+
+        case LD_INDIRECT_NN_A: {
+
+            int nn;
+
+            READ_NN(nn);
+            WRITE_BYTE(nn, A);
+            break;
+        }
+
+        case LD_A_I_LD_A_R: {
+
+            int a, f;
+
+            a = opcode == OPCODE_LD_A_I
+                ? state.i
+                : (state.r & 0x80) | (r & 0x7f);
+            f = SZYX_FLAGS_TABLE[a];
+
+            /* Note: On a real processor, if an interrupt
+             * occurs during the execution of either
+             * "LD A, I" or "LD A, R", the parity flag is
+             * reset. That can never happen here.
+             */
+
+            f |= state.iff2 << Z80_P_FLAG_SHIFT;
+            f |= F & Z80_C_FLAG;
+
+            AF = (a << 8) | f;
 
             elapsed_cycles++;
 
@@ -2653,14 +5247,13 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
             f = F & SZC_FLAGS;
             f |= --BC ? Z80_P_FLAG : 0;
 
-#ifndef Z80_DOCUMENTED_FLAGS_ONLY
-
-            n += A;
-            f |= n & Z80_X_FLAG;
-            f |= (n << (Z80_Y_FLAG_SHIFT - 1))
-                & Z80_Y_FLAG;
+            if (!Policy::documented_flags_only) {
 
-#endif
+                n += A;
+                f |= n & Z80_X_FLAG;
+                f |= (n << (Z80_Y_FLAG_SHIFT - 1))
+                    & Z80_Y_FLAG;
+            }
 
             F = f;
 
@@ -2675,17 +5268,11 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
         case LDIR_LDDR: {
 
-            int d, f, bc, de, hl, n;
-
-#ifdef Z80_HANDLE_SELF_MODIFYING_CODE
-
-            int p, q;
+            int d, f, bc, de, hl, n, p, q, count;
 
             p = (pc - 2) & 0xffff;
             q = (pc - 1) & 0xffff;
 
-#endif
-
             d = opcode == OPCODE_LDIR ? +1 : -1;
 
             f = F & SZC_FLAGS;
@@ -2695,6 +5282,32 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
             r -= 2;
             elapsed_cycles -= 8;
+
+            /* Copy all but the last iteration at once if no device
+             * is in the way, stopping short of the instruction's own
+             * opcode: the loop below writes it and fetches it again.
+             */
+
+            count = repeatCount(bc ? bc : 0x10000, elapsed_cycles, m_cycle_limit) - 1;
+            n = (d > 0 ? p - de : de - p) & 0xffff;
+            if (count > n)
+                count = n;
+            n = (d > 0 ? q - de : de - q) & 0xffff;
+            if (count > n)
+                count = n;
+            if (!Policy::handle_self_modifying_code
+                && count > 0
+                && !bus_range_mapped(d > 0 ? hl : hl - count + 1, count)
+                && !bus_range_mapped(d > 0 ? de : de - count + 1, count)) {
+
+                blockCopy(hl, de, count, d);
+                hl += d * count;
+                de += d * count;
+                bc -= count;
+                r += 2 * count;
+                elapsed_cycles += 21 * count;
+            }
+
             for (;;) {
 
                 r += 2;
@@ -2705,7 +5318,8 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
                 hl += d;
                 de += d;
 
-                if (--bc)
+                bc = (bc - 1) & 0xffff;
+                if (bc)
 
                     elapsed_cycles += 21;
 
@@ -2715,8 +5329,6 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
                     break;
                 }
 
-#ifdef Z80_HANDLE_SELF_MODIFYING_CODE
-
                 if (((de - d) & 0xffff) == p
                     || ((de - d) & 0xffff) == q) {
 
@@ -2725,7 +5337,8 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
                     break;
                 }
 
-#endif
+                if (elapsed_cycles < m_cycle_limit)
+                    continue;
 
                 f |= Z80_P_FLAG;
                 pc -= 2;
@@ -2736,14 +5349,13 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
             DE = de;
             BC = bc;
 
-#ifndef Z80_DOCUMENTED_FLAGS_ONLY
-
-            n += A;
-            f |= n & Z80_X_FLAG;
-            f |= (n << (Z80_Y_FLAG_SHIFT - 1))
-                & Z80_Y_FLAG;
+            if (!Policy::documented_flags_only) {
 
-#endif
+                n += A;
+                f |= n & Z80_X_FLAG;
+                f |= (n << (Z80_Y_FLAG_SHIFT - 1))
+                    & Z80_Y_FLAG;
+            }
 
             F = f;
 
@@ -2762,14 +5374,13 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
             f = (a ^ n ^ z) & Z80_H_FLAG;
 
-#ifndef Z80_DOCUMENTED_FLAGS_ONLY
+            if (!Policy::documented_flags_only) {
 
-            n = z - (f >> Z80_H_FLAG_SHIFT);
-            f |= (n << (Z80_Y_FLAG_SHIFT - 1))
-                & Z80_Y_FLAG;
-            f |= n & Z80_X_FLAG;
-
-#endif
+                n = z - (f >> Z80_H_FLAG_SHIFT);
+                f |= (n << (Z80_Y_FLAG_SHIFT - 1))
+                    & Z80_Y_FLAG;
+                f |= n & Z80_X_FLAG;
+            }
 
             f |= SZYX_FLAGS_TABLE[z & 0xff] & SZ_FLAGS;
             f |= --BC ? Z80_P_FLAG : 0;
@@ -2782,7 +5393,7 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
         case CPIR_CPDR: {
 
-            int d, a, bc, hl, n, z, f;
+            int d, a, bc, hl, n, z, f, count;
 
             d = opcode == OPCODE_CPIR ? +1 : -1;
 
@@ -2792,6 +5403,21 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
             r -= 2;
             elapsed_cycles -= 8;
+
+            /* Skip the bytes before a match at once if no device is
+             * in the way.
+             */
+
+            count = repeatCount(bc ? bc : 0x10000, elapsed_cycles, m_cycle_limit) - 1;
+            if (count > 0 && !bus_range_mapped(d > 0 ? hl : hl - count + 1, count)) {
+
+                count = blockScan(hl, count, d, a);
+                hl += d * count;
+                bc -= count;
+                r += 2 * count;
+                elapsed_cycles += 21 * count;
+            }
+
             for (;;) {
 
                 r += 2;
@@ -2800,7 +5426,8 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
                 z = a - n;
 
                 hl += d;
-                if (--bc && z)
+                bc = (bc - 1) & 0xffff;
+                if (bc && z)
 
                     elapsed_cycles += 21;
 
@@ -2810,6 +5437,9 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
                     break;
                 }
 
+                if (elapsed_cycles < m_cycle_limit)
+                    continue;
+
                 pc -= 2;
                 break;
             }
@@ -2819,14 +5449,13 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
             f = (a ^ n ^ z) & Z80_H_FLAG;
 
-#ifndef Z80_DOCUMENTED_FLAGS_ONLY
+            if (!Policy::documented_flags_only) {
 
-            n = z - (f >> Z80_H_FLAG_SHIFT);
-            f |= (n << (Z80_Y_FLAG_SHIFT - 1))
-                & Z80_Y_FLAG;
-            f |= n & Z80_X_FLAG;
-
-#endif
+                n = z - (f >> Z80_H_FLAG_SHIFT);
+                f |= (n << (Z80_Y_FLAG_SHIFT - 1))
+                    & Z80_Y_FLAG;
+                f |= n & Z80_X_FLAG;
+            }
 
             f |= SZYX_FLAGS_TABLE[z & 0xff] & SZ_FLAGS;
             f |= bc ? Z80_P_FLAG : 0;
@@ -3099,6 +5728,12 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
         case DAA: {
 
+#ifdef Z80_ALU_TABLES
+
+            AF = ALU_TABLES.daa[DAA_INDEX(F)][A];
+
+#else
+
             int a, c, d;
 
             /* The following algorithm is from
@@ -3125,6 +5760,10 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
                 | (F & Z80_N_FLAG)
                 | c;
 
+#endif
+
+            if (Policy::documented_flags_only)
+                F &= ~YX_FLAGS;
             break;
         }
 
@@ -3133,12 +5772,7 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
             A = ~A;
             F = (F & (SZPV_FLAGS | Z80_C_FLAG))
 
-#ifndef Z80_DOCUMENTED_FLAGS_ONLY
-
-                | (A & YX_FLAGS)
-
-#endif
-
+                | UNDOCUMENTED_FLAGS(A & YX_FLAGS)
                 | Z80_H_FLAG | Z80_N_FLAG;
 
             break;
@@ -3172,12 +5806,7 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
             F = (F & SZPV_FLAGS)
                 | (c << Z80_H_FLAG_SHIFT)
 
-#ifndef Z80_DOCUMENTED_FLAGS_ONLY
-
-                | (A & YX_FLAGS)
-
-#endif
-
+                | UNDOCUMENTED_FLAGS(A & YX_FLAGS)
                 | (c ^ Z80_C_FLAG);
 
             break;
@@ -3187,12 +5816,7 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
             F = (F & SZPV_FLAGS)
 
-#ifndef Z80_DOCUMENTED_FLAGS_ONLY
-
-                | (A & YX_FLAGS)
-
-#endif
-
+                | UNDOCUMENTED_FLAGS(A & YX_FLAGS)
                 | Z80_C_FLAG;
 
             break;
@@ -3205,11 +5829,9 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
         case HALT: {
 
-#ifdef Z80_CATCH_HALT
+            if (Policy::catch_halt)
 
-            state.status = Z80_STATUS_HALT;
-
-#endif
+                state.status = Z80_STATUS_HALT;
 
             break;
         }
@@ -3218,11 +5840,9 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
             state.iff1 = state.iff2 = 0;
 
-#ifdef Z80_CATCH_DI
+            if (Policy::catch_di)
 
-            state.status = Z80_STATUS_DI;
-
-#endif
+                state.status = Z80_STATUS_DI;
 
             break;
         }
@@ -3231,11 +5851,9 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
             state.iff1 = state.iff2 = 1;
 
-#ifdef Z80_CATCH_EI
+            if (Policy::catch_ei)
 
-            state.status = Z80_STATUS_EI;
-
-#endif
+                state.status = Z80_STATUS_EI;
 
             break;
         }
@@ -3274,12 +5892,11 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
             c = x ^ y ^ z;
             f = F & SZPV_FLAGS;
 
-#ifndef Z80_DOCUMENTED_FLAGS_ONLY
+            if (!Policy::documented_flags_only) {
 
-            f |= (z >> 8) & YX_FLAGS;
-            f |= (c >> 8) & Z80_H_FLAG;
-
-#endif
+                f |= (z >> 8) & YX_FLAGS;
+                f |= (c >> 8) & Z80_H_FLAG;
+            }
 
             f |= c >> (16 - Z80_C_FLAG_SHIFT);
 
@@ -3304,11 +5921,10 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
                 ? (z >> 8) & SYX_FLAGS
                 : Z80_Z_FLAG;
 
-#ifndef Z80_DOCUMENTED_FLAGS_ONLY
-
-            f |= (c >> 8) & Z80_H_FLAG;
+            if (!Policy::documented_flags_only) {
 
-#endif
+                f |= (c >> 8) & Z80_H_FLAG;
+            }
 
             f |= OVERFLOW_TABLE[c >> 15];
             f |= z >> (16 - Z80_C_FLAG_SHIFT);
@@ -3335,11 +5951,10 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
                 ? (z >> 8) & SYX_FLAGS
                 : Z80_Z_FLAG;
 
-#ifndef Z80_DOCUMENTED_FLAGS_ONLY
-
-            f |= (c >> 8) & Z80_H_FLAG;
+            if (!Policy::documented_flags_only) {
 
-#endif
+                f |= (c >> 8) & Z80_H_FLAG;
+            }
 
             c &= 0x018000;
             f |= OVERFLOW_TABLE[c >> 15];
@@ -3396,12 +6011,7 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
             a = A << 1;
             f = (F & SZPV_FLAGS)
 
-#ifndef Z80_DOCUMENTED_FLAGS_ONLY
-
-                | (a & YX_FLAGS)
-
-#endif
-
+                | UNDOCUMENTED_FLAGS(a & YX_FLAGS)
                 | (A >> 7);
             A = a | (F & Z80_C_FLAG);
             F = f;
@@ -3417,12 +6027,7 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
             A = (A >> 1) | (A << 7);
             F = (F & SZPV_FLAGS)
 
-#ifndef Z80_DOCUMENTED_FLAGS_ONLY
-
-                | (A & YX_FLAGS)
-
-#endif
-
+                | UNDOCUMENTED_FLAGS(A & YX_FLAGS)
                 | c;
 
             break;
@@ -3436,12 +6041,7 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
             A = (A >> 1) | ((F & Z80_C_FLAG) << 7);
             F = (F & SZPV_FLAGS)
 
-#ifndef Z80_DOCUMENTED_FLAGS_ONLY
-
-                | (A & YX_FLAGS)
-
-#endif
-
+                | UNDOCUMENTED_FLAGS(A & YX_FLAGS)
                 | c;
 
             break;
@@ -3799,13 +6399,8 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
             x = R(Z(opcode)) & (1 << Y(opcode));
             F = (x ? 0 : Z80_Z_FLAG | Z80_P_FLAG)
 
-#ifndef Z80_DOCUMENTED_FLAGS_ONLY
-
-                | (x & Z80_S_FLAG)
-                | (R(Z(opcode)) & YX_FLAGS)
-
-#endif
-
+                | UNDOCUMENTED_FLAGS(x & Z80_S_FLAG)
+                | UNDOCUMENTED_FLAGS(R(Z(opcode)) & YX_FLAGS)
                 | Z80_H_FLAG
                 | (F & Z80_C_FLAG);
 
@@ -3836,13 +6431,8 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
             x &= 1 << Y(opcode);
             F = (x ? 0 : Z80_Z_FLAG | Z80_P_FLAG)
 
-#ifndef Z80_DOCUMENTED_FLAGS_ONLY
-
-                | (x & Z80_S_FLAG)
-                | (d & YX_FLAGS)
-
-#endif
-
+                | UNDOCUMENTED_FLAGS(x & Z80_S_FLAG)
+                | UNDOCUMENTED_FLAGS(d & YX_FLAGS)
                 | Z80_H_FLAG
                 | (F & Z80_C_FLAG);
 
@@ -3954,11 +6544,9 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
             } else {
 
-#ifdef Z80_FALSE_CONDITION_FETCH
-
-                Z80_FETCH_WORD(pc, nn);
+                if (Policy::false_condition_fetch)
 
-#endif
+                    Z80_FETCH_WORD(pc, nn);
 
                 pc += 2;
             }
@@ -3993,11 +6581,9 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
             } else {
 
-#ifdef Z80_FALSE_CONDITION_FETCH
+                if (Policy::false_condition_fetch)
 
-                Z80_FETCH_BYTE(pc, e);
-
-#endif
+                    Z80_FETCH_BYTE(pc, e);
 
                 pc++;
 
@@ -4025,11 +6611,9 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
             } else {
 
-#ifdef Z80_FALSE_CONDITION_FETCH
-
-                Z80_FETCH_BYTE(pc, e);
+                if (Policy::false_condition_fetch)
 
-#endif
+                    Z80_FETCH_BYTE(pc, e);
 
                 pc++;
 
@@ -4067,11 +6651,9 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
             } else {
 
-#ifdef Z80_FALSE_CONDITION_FETCH
-
-                Z80_FETCH_WORD(pc, nn);
+                if (Policy::false_condition_fetch)
 
-#endif
+                    Z80_FETCH_WORD(pc, nn);
 
                 pc += 2;
 
@@ -4101,21 +6683,11 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
             state.iff1 = state.iff2;
             POP(pc);
 
-#if defined(Z80_CATCH_RETI) && defined(Z80_CATCH_RETN)
-
-            state.status = opcode == OPCODE_RETI
-                ? Z80_STATUS_RETI
-                : Z80_STATUS_RETN;
-
-#elif defined(Z80_CATCH_RETI)
-
-            state.status = Z80_STATUS_RETI;
+            if (opcode == OPCODE_RETI ? Policy::catch_reti : Policy::catch_retn)
 
-#elif defined(Z80_CATCH_RETN)
-
-            state.status = Z80_STATUS_RETN;
-
-#endif
+                state.status = opcode == OPCODE_RETI
+                    ? Z80_STATUS_RETI
+                    : Z80_STATUS_RETN;
 
             break;
         }
@@ -4195,17 +6767,11 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
         case INIR_INDR: {
 
-            int d, b, hl, x, f;
-
-#ifdef Z80_HANDLE_SELF_MODIFYING_CODE
-
-            int p, q;
+            int d, b, hl, x, f, p, q;
 
             p = (pc - 2) & 0xffff;
             q = (pc - 1) & 0xffff;
 
-#endif
-
             d = opcode == OPCODE_INIR ? +1 : -1;
 
             b = B;
@@ -4217,12 +6783,13 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
                 r += 2;
 
-                Z80_INPUT_BYTE(C, x);
+                Z80_REPEAT_IO(Z80_INPUT_BYTE(C, x));
                 Z80_WRITE_BYTE(hl, x);
 
                 hl += d;
 
-                if (--b)
+                b = (b - 1) & 0xff;
+                if (b)
 
                     elapsed_cycles += 21;
 
@@ -4233,8 +6800,6 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
                     break;
                 }
 
-#ifdef Z80_HANDLE_SELF_MODIFYING_CODE
-
                 if (((hl - d) & 0xffff) == p
                     || ((hl - d) & 0xffff) == q) {
 
@@ -4243,7 +6808,8 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
                     break;
                 }
 
-#endif
+                if (Z80_REPEAT_IO_AGAIN())
+                    continue;
 
                 f = SZYX_FLAGS_TABLE[b];
                 pc -= 2;
@@ -4325,10 +6891,11 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
                 r += 2;
 
                 Z80_READ_BYTE(hl, x);
-                Z80_OUTPUT_BYTE(C, x);
+                Z80_REPEAT_IO(Z80_OUTPUT_BYTE(C, x));
 
                 hl += d;
-                if (--b)
+                b = (b - 1) & 0xff;
+                if (b)
 
                     elapsed_cycles += 21;
 
@@ -4339,6 +6906,9 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
                     break;
                 }
 
+                if (Z80_REPEAT_IO_AGAIN())
+                    continue;
+
                 f = SZYX_FLAGS_TABLE[b];
                 pc -= 2;
                 break;
@@ -4422,12 +6992,11 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
         case ED_UNDEFINED: {
 
-#ifdef Z80_CATCH_ED_UNDEFINED
-
-            state.status = Z80_STATUS_FLAG_ED_UNDEFINED;
-            pc -= 2;
+            if (Policy::catch_ed_undefined) {
 
-#endif
+                state.status = Z80_STATUS_ED_UNDEFINED;
+                pc -= 2;
+            }
 
             break;
         }
@@ -4440,3 +7009,6 @@ int Z80::intemulate(int opcode, int elapsed_cycles)
 
     return elapsed_cycles;
 }
+
+template class Z80Core<Z80DefaultPolicy>;
+template class Z80Core<Z80FastPolicy>;
@@ -16,65 +16,123 @@
  * @brief This file contains fabgl::Z80 definition.
  */
 
+#include "native.h"
 #include <stdint.h>
 
 /* Define this macro if the host processor is big endian. */
 
 /* #define Z80_BIG_ENDIAN */
 
-/* Emulation can be speed up a little bit by emulating only the documented
- * flags.
+/* The emulation options are members of a policy type, the template argument
+ * of Z80Core. Each variant is compiled separately, so an option costs nothing
+ * at run time and several variants can live in one binary. Z80DefaultPolicy
+ * lists the options with their default values; a policy may derive from it
+ * and override some of them.
  */
 
-/* #define Z80_DOCUMENTED_FLAGS_ONLY */
+struct Z80DefaultPolicy {
 
-/* HALT, DI, EI, RETI, and RETN instructions can be catched. When such an
- * instruction is catched, the emulator is stopped and the PC register points
- * at the opcode to be executed next. The catched instruction can be determined
- * from the Z80_STATE's status value. Keep in mind that no interrupt can be
- * accepted at the instruction right after a DI or EI on an actual processor.
- */
+    /* Emulation can be speed up a little bit by emulating only the
+     * documented flags.
+     */
 
-#define Z80_CATCH_HALT
-/*
- #define Z80_CATCH_DI
- #define Z80_CATCH_EI
- #define Z80_CATCH_RETI
- #define Z80_CATCH_RETN
- */
+    static const bool documented_flags_only = false;
 
-/* Undefined 0xed prefixed opcodes may be catched, otherwise they are treated
- * like NOP instructions. When one is catched, Z80_STATUS_ED_UNDEFINED is set
- * in Z80_STATE's status member and the PC register points at the 0xed prefix
- * before the undefined opcode.
- */
+    /* HALT, DI, EI, RETI, and RETN instructions can be catched. When such
+     * an instruction is catched, the emulator is stopped and the PC register
+     * points at the opcode to be executed next. The catched instruction can
+     * be determined from the Z80_STATE's status value. Keep in mind that no
+     * interrupt can be accepted at the instruction right after a DI or EI on
+     * an actual processor.
+     */
+
+    static const bool catch_halt = true;
+    static const bool catch_di = false;
+    static const bool catch_ei = false;
+    static const bool catch_reti = false;
+    static const bool catch_retn = false;
+
+    /* Undefined 0xed prefixed opcodes may be catched, otherwise they are
+     * treated like NOP instructions. When one is catched,
+     * Z80_STATUS_ED_UNDEFINED is set in Z80_STATE's status member and the PC
+     * register points at the 0xed prefix before the undefined opcode.
+     */
+
+    static const bool catch_ed_undefined = false;
+
+    /* The emulator may always fetch the displacement or address of a
+     * conditionnal jump or call instruction, even if the condition is false
+     * and the fetch can be avoided. Set this if you need to account for
+     * memory wait states on code read.
+     */
 
-/* #define Z80_CATCH_ED_UNDEFINED */
+    static const bool false_condition_fetch = false;
 
-/* By defining this macro, the emulator will always fetch the displacement or
- * address of a conditionnal jump or call instruction, even if the condition
- * is false and the fetch can be avoided. Define this macro if you need to
- * account for memory wait states on code read.
+    /* LDIR, LDDR, INIR and INDR may overwrite their own opcode. The repeat
+     * always stops there and fetches the instruction again, as step() does.
+     * Set this to have LDIR and LDDR copy byte by byte instead of in bulk.
+     */
+
+    static const bool handle_self_modifying_code = false;
+
+    /* For interrupt mode 2, bit 0 of the 16-bit address to the interrupt
+     * vector can be masked to zero. Some documentation states that this bit
+     * is forced to zero. For instance, Zilog's application note about
+     * interrupts, states that "only 7 bits are required" and "the least
+     * significant bit is zero". Yet, this is quite unclear, even from
+     * Zilog's manuals. So this is left as an option.
+     */
+
+    static const bool mask_im2_vector_address = false;
+};
+
+/* Documented flags only and nothing catched, for batch runs that only need
+ * what documented code can observe.
  */
 
-/* #define Z80_FALSE_CONDITION_FETCH */
+struct Z80FastPolicy : Z80DefaultPolicy {
+
+    static const bool documented_flags_only = true;
+    static const bool catch_halt = false;
+};
 
-/* It may be possible to overwrite the opcode of the currently executing LDIR,
- * LDDR, INIR, or OTDR instruction. Define this macro if you need to handle
- * these pathological cases.
+/* stepBlock() can run basic blocks of pre-decoded instructions from a cache
+ * keyed by PC, so hot loops skip the opcode fetch and prefix decoding. Writes
+ * to a page holding cached code invalidate its blocks through cpu_page_trap and
+ * cpu_code_gen (cerberus.h). The cache takes Z80_BLOCK_CACHE_SIZE blocks of
+ * about 800 bytes each, so it is only enabled on SDL. Without it stepBlock()
+ * runs a single instruction.
+ *
+ * On Linux x86-64 (native.h) a block that has run Z80_NATIVE_HOT times is
+ * compiled once more, to host code working on the registers in Z80_STATE with
+ * the flags taken from the host's. It calls executeDecoded() for what it does
+ * not compile: the instructions executeFast() leaves to execute(), such as the
+ * block and I/O instructions, and ADC HL, SBC HL and NEG. The decoded block
+ * runs instead while the trace trap is in it or native_enabled is clear.
  */
 
-/* #define Z80_HANDLE_SELF_MODIFYING_CODE */
+#ifdef PLATFORM_SDL
+#define Z80_BLOCK_CACHE
+#endif
 
-/* For interrupt mode 2, bit 0 of the 16-bit address to the interrupt vector
- * can be masked to zero. Some documentation states that this bit is forced to
- * zero. For instance, Zilog's application note about interrupts, states that
- * "only 7 bits are required" and "the least significant bit is zero". Yet,
- * this is quite unclear, even from Zilog's manuals. So this is left as an
- * option.
+#if defined(Z80_BLOCK_CACHE) && defined(NATIVE_X86_64)
+#define Z80_NATIVE
+#endif
+
+#define Z80_BLOCK_CACHE_SIZE 2048 /* direct mapped, power of two */
+#define Z80_BLOCK_LENGTH 32 /* maximum instructions per block */
+#define Z80_NATIVE_HOT 32 /* runs of a block before it is compiled */
+
+/* With Z80_ALU_TABLES the flags of ADD, ADC, SUB, SBC, CP, INC, DEC, and DAA
+ * are looked up in tables built at compile time instead of computed. They take
+ * about 260 KB, so they are only enabled on SDL, and not there either when
+ * Z80_NO_ALU_TABLES is defined (-DZ80_NO_ALU_TABLES). Building them needs
+ * C++14.
  */
 
-/* #define Z80_MASK_IM2_VECTOR_ADDRESS */
+#if defined(PLATFORM_SDL) && !defined(Z80_NO_ALU_TABLES)
+#define Z80_ALU_TABLES
+#endif
 
 /* If Z80_STATE's status is non-zero, the emulation has been stopped for some
  * reason other than emulating the requested number of cycles.
@@ -194,10 +252,41 @@ struct Z80_STATE {
     void* fd_register_table[16];
 };
 
+/* One instruction as decoded by Z80::decode(). */
+
+struct Z80_DECODED {
+    void** registers; /* register table selected by 0xdd/0xfd prefixes */
+    unsigned short pc; /* address of the first prefix or opcode byte */
+    unsigned short operand_pc; /* pc once prefixes and opcode are read */
+    unsigned char instruction;
+    unsigned char opcode;
+    unsigned char prefix_cycles;
+    unsigned char prefix_r;
+    bool fast; /* run by executeFast() */
+    unsigned short operand; /* immediate, address or branch target if fast */
+};
+
+struct Z80_BLOCK {
+    unsigned short pc;
+    unsigned char count;
+    unsigned char page[2]; /* pages holding the decoded bytes */
+    unsigned int gen[2]; /* cpu_code_gen of those pages when decoded */
+#ifdef Z80_NATIVE
+    unsigned char runs; /* since decoded, up to Z80_NATIVE_HOT */
+    unsigned int native_gen; /* native_gen when compiled */
+    int (*native)(int max_cycles); /* host code, or NULL */
+#endif
+    Z80_DECODED ops[Z80_BLOCK_LENGTH];
+};
+
 /**
  * @brief Zilog Z80 CPU emulator
+ *
+ * Policy selects the emulation options, see Z80DefaultPolicy. The variants
+ * below are instantiated in Z80.cpp.
  */
-class Z80 {
+template <class Policy>
+class Z80Core {
 
 public:
     // callbacks
@@ -228,7 +317,18 @@ public:
      */
     int NMI();
 
-    int step();
+    /* Emulate one instruction and return the number of cycles elapsed. LDIR,
+     * LDDR, CPIR, CPDR, INIR, INDR, OTIR and OTDR repeat until done or until
+     * max_cycles have elapsed, then leave PC on themselves to continue later,
+     * as they do on hardware between two iterations. With max_cycles 0 they
+     * run a single iteration.
+     */
+    int step(int max_cycles = 0);
+
+    /* Run the cached block at PC, stopping early once max_cycles have
+     * elapsed. Return the number of cycles elapsed.
+     */
+    int stepBlock(int max_cycles);
 
     // CPU registers access
 
@@ -241,6 +341,25 @@ public:
     uint16_t getPC() { return state.pc; }
     void setPC(uint16_t value) { state.pc = value; }
 
+    /* The whole processor state, to rewind to or compare against. A state
+     * taken from another instance may be restored; the register decoding
+     * tables are left alone.
+     */
+    Z80_STATE getState() const { return state; }
+    void setState(const Z80_STATE& s)
+    {
+        state.status = s.status;
+        state.registers = s.registers;
+        for (int i = 0; i < 4; i++)
+            state.alternates[i] = s.alternates[i];
+        state.i = s.i;
+        state.r = s.r;
+        state.pc = s.pc;
+        state.iff1 = s.iff1;
+        state.iff2 = s.iff2;
+        state.im = s.im;
+    }
+
     int getStatus() { return state.status; }
     int getIM() { return state.im; }
     int getIFF1() { return state.iff1; }
@@ -248,10 +367,28 @@ public:
 
 private:
     int intemulate(int opcode, int elapsed_cycles);
+    int execute(int instruction, int opcode, void** registers, int pc, int r, int elapsed_cycles);
+#ifdef Z80_BLOCK_CACHE
+    bool decode(int pc, Z80_DECODED* d);
+    int executeDecoded(const Z80_DECODED* d);
+    int executeFast(const Z80_DECODED* d);
+    int recordBlock(Z80_BLOCK* b, int max_cycles);
+#ifdef Z80_NATIVE
+    void compileBlock(Z80_BLOCK* b);
+    static int runDecoded(void* core, const Z80_DECODED* d);
+#endif
+
+    Z80_BLOCK* m_blocks = nullptr;
+#endif
 
     Z80_STATE state;
 
+    int m_cycle_limit = 0; /* block instructions repeat while below this */
+
     // callbacks
 
     void* m_context;
 };
+
+typedef Z80Core<Z80DefaultPolicy> Z80;
+typedef Z80Core<Z80FastPolicy> Z80Fast;
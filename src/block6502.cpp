@@ -0,0 +1,1733 @@
+#include "block6502.h"
+#include "bus.h"
+#include "cerberus.h"
+#include "trace.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <vector>
+
+static int step(fake6502_context* c)
+{
+    cpu_instructions++;
+    trace_6502(c, cpu_cycles);
+    c->emu.clockticks = 0;
+    fake6502_step(c);
+    return c->emu.clockticks;
+}
+
+/* Instruction lengths, following the CMOS addressing modes of fake6502.c. */
+
+static const uint8_t lengths[256] = {
+    1, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+    3, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+    1, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+    1, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+};
+
+int block6502_length(uint8_t opcode)
+{
+    return lengths[opcode];
+}
+
+#ifdef BLOCK6502_CACHE
+
+struct block6502_op;
+
+/* Return the cycles taken, or BAIL before touching anything if the
+ * instruction would access a device page.
+ */
+typedef int (*block6502_handler)(fake6502_context* c, const block6502_op* o);
+
+struct block6502_op {
+    block6502_handler run;
+    uint16_t pc;
+    uint16_t next; /* pc of the following instruction */
+    uint16_t operand; /* immediate, address or branch target */
+    uint8_t opcode;
+    uint8_t cycles; /* fake6502_opcodes[opcode].clockticks */
+};
+
+typedef int (*block6502_native)(fake6502_context* c, int max_cycles);
+
+struct block6502 {
+    uint16_t pc;
+    uint8_t count;
+    uint8_t hits;
+    uint8_t page[2]; /* pages holding the translated bytes */
+    uint32_t gen[2]; /* cpu_code_gen of those pages when translated */
+#ifdef BLOCK6502_NATIVE
+    uint8_t runs; /* since translated, until compiled */
+    uint32_t native_gen; /* native_gen when compiled */
+    block6502_native native;
+#endif
+    block6502_op ops[BLOCK6502_LENGTH];
+};
+
+#define BAIL -1
+
+static block6502* blocks;
+
+/* Instructions after which a block ends: anything that may not continue with
+ * the next instruction in memory, and CLI and PLP, so a pending IRQ is taken
+ * right after them.
+ */
+
+static bool endsBlock(uint8_t opcode)
+{
+    switch (opcode) {
+    case 0x00: /* BRK */
+    case 0x20: /* JSR */
+    case 0x28: /* PLP */
+    case 0x40: /* RTI */
+    case 0x4c: /* JMP abs */
+    case 0x58: /* CLI */
+    case 0x60: /* RTS */
+    case 0x6c: /* JMP (abs) */
+    case 0x7c: /* JMP (abs,X) */
+    case 0x80: /* BRA */
+        return true;
+    default:
+        return false;
+    }
+}
+
+// addressing modes
+
+enum {
+    IMM,
+    ZP,
+    ZPX,
+    ZPY,
+    ABS,
+    ABSX,
+    ABSY,
+    ABSX_P, /* plus one cycle when indexing crosses a page */
+    ABSY_P,
+    INDY,
+    INDY_P,
+    INDX, /* the rest only for the host code */
+    ZPI,
+    ACC,
+    IMP,
+};
+
+static inline bool device(uint16_t addr)
+{
+    return __builtin_expect(bus_page_mapped[addr >> 8], 0);
+}
+
+/* Effective address of a memory operand, returns the page crossing penalty.
+ * Zero page is never a device page while blocks are translated.
+ */
+
+template <int M>
+static inline int address(fake6502_context* c, const block6502_op* o, uint16_t* ea)
+{
+    uint16_t base = o->operand;
+    switch (M) {
+    case ZP:
+    case ABS:
+        *ea = base;
+        return 0;
+    case ZPX:
+        *ea = (base + c->cpu.x) & 0xff;
+        return 0;
+    case ZPY:
+        *ea = (base + c->cpu.y) & 0xff;
+        return 0;
+    case ABSX:
+    case ABSX_P:
+        *ea = base + c->cpu.x;
+        break;
+    case ABSY:
+    case ABSY_P:
+        *ea = base + c->cpu.y;
+        break;
+    case INDY:
+    case INDY_P:
+        base = cpeek(base) | cpeek((base + 1) & 0xff) << 8;
+        *ea = base + c->cpu.y;
+        break;
+    }
+    if (M == ABSX_P || M == ABSY_P || M == INDY_P)
+        return (base & 0xff00) != (*ea & 0xff00);
+    return 0;
+}
+
+template <int M>
+static inline int load(fake6502_context* c, const block6502_op* o, uint8_t* value)
+{
+    if (M == IMM) {
+        *value = o->operand;
+        return 0;
+    }
+    uint16_t ea;
+    int penalty = address<M>(c, o, &ea);
+    if (M != ZP && M != ZPX && M != ZPY && device(ea))
+        return BAIL;
+    *value = cpeek(ea);
+    return penalty;
+}
+
+template <int M>
+static inline bool store(fake6502_context* c, const block6502_op* o, uint8_t value)
+{
+    uint16_t ea;
+    address<M>(c, o, &ea);
+    if (M != ZP && M != ZPX && M != ZPY && device(ea))
+        return false;
+    cpoke(ea, value);
+    return true;
+}
+
+/* Read-modify-write: returns the address, or -1 for a device page. */
+
+template <int M>
+static inline int modify(fake6502_context* c, const block6502_op* o)
+{
+    uint16_t ea;
+    address<M>(c, o, &ea);
+    if (M != ZP && M != ZPX && M != ZPY && device(ea))
+        return -1;
+    return ea;
+}
+
+// flags, as computed by fake6502.c
+
+static inline void setNZ(fake6502_context* c, uint8_t value)
+{
+    fake6502_zero_calc(c, value);
+    fake6502_sign_calc(c, value);
+}
+
+/* Binary ADC, SBC adds the ones complement. Decimal mode goes through
+ * fake6502_decimal_op().
+ */
+
+static inline void add(fake6502_context* c, uint16_t a, uint16_t b)
+{
+    uint16_t result = a + b + fake6502_carry_flag(c);
+
+    fake6502_overflow_calc(c, result, a, b);
+    fake6502_carry_calc(c, result);
+    setNZ(c, result);
+    c->cpu.a = result;
+}
+
+static inline void compare(fake6502_context* c, uint8_t r, uint8_t value)
+{
+    setNZ(c, r - value);
+    fake6502_carry_calc(c, 0x100 + r - value);
+}
+
+// handlers
+
+/* Any instruction, through fake6502_opcodes[] */
+
+static int run_any(fake6502_context* c, const block6502_op* o)
+{
+    const fake6502_opcode* op = &fake6502_opcodes[o->opcode];
+
+    c->cpu.pc = o->pc + 1;
+    c->emu.opcode = o->opcode;
+    c->emu.ea = 0; /* implied modes leave it alone */
+    c->emu.clockticks = 0;
+    op->addr_mode(c);
+    if (device(c->emu.ea)) {
+        c->cpu.pc = o->pc;
+        return BAIL;
+    }
+    op->opcode(c);
+    return c->emu.clockticks + o->cycles;
+}
+
+enum {
+    REG_A,
+    REG_X,
+    REG_Y,
+};
+
+static inline uint8_t* reg(fake6502_context* c, int r)
+{
+    return r == REG_A ? &c->cpu.a : r == REG_X ? &c->cpu.x : &c->cpu.y;
+}
+
+template <int R, int M>
+static int run_ld(fake6502_context* c, const block6502_op* o)
+{
+    uint8_t value;
+    int penalty = load<M>(c, o, &value);
+    if (penalty < 0)
+        return BAIL;
+    *reg(c, R) = value;
+    setNZ(c, value);
+    c->cpu.pc = o->next;
+    return o->cycles + penalty;
+}
+
+template <int R, int M>
+static int run_st(fake6502_context* c, const block6502_op* o)
+{
+    if (!store<M>(c, o, *reg(c, R)))
+        return BAIL;
+    c->cpu.pc = o->next;
+    return o->cycles;
+}
+
+template <int M>
+static int run_stz(fake6502_context* c, const block6502_op* o)
+{
+    if (!store<M>(c, o, 0))
+        return BAIL;
+    c->cpu.pc = o->next;
+    return o->cycles;
+}
+
+enum {
+    ALU_ORA,
+    ALU_AND,
+    ALU_EOR,
+    ALU_ADC,
+    ALU_SBC,
+};
+
+template <int OP, int M>
+static int run_alu(fake6502_context* c, const block6502_op* o)
+{
+    uint8_t value;
+    int penalty = load<M>(c, o, &value);
+    if (penalty < 0)
+        return BAIL;
+    switch (OP) {
+    case ALU_ORA:
+        c->cpu.a |= value;
+        setNZ(c, c->cpu.a);
+        break;
+    case ALU_AND:
+        c->cpu.a &= value;
+        setNZ(c, c->cpu.a);
+        break;
+    case ALU_EOR:
+        c->cpu.a ^= value;
+        setNZ(c, c->cpu.a);
+        break;
+    case ALU_ADC:
+        if (c->cpu.flags & FAKE6502_DECIMAL_FLAG)
+            fake6502_decimal_op(c, 0, value);
+        else
+            add(c, c->cpu.a, value);
+        break;
+    case ALU_SBC:
+        if (c->cpu.flags & FAKE6502_DECIMAL_FLAG)
+            fake6502_decimal_op(c, 1, value);
+        else
+            add(c, c->cpu.a, value ^ 0x00ff);
+        break;
+    }
+    c->cpu.pc = o->next;
+    return o->cycles + penalty;
+}
+
+template <int R, int M>
+static int run_cmp(fake6502_context* c, const block6502_op* o)
+{
+    uint8_t value;
+    int penalty = load<M>(c, o, &value);
+    if (penalty < 0)
+        return BAIL;
+    compare(c, *reg(c, R), value);
+    c->cpu.pc = o->next;
+    return o->cycles + penalty;
+}
+
+template <int DELTA, int M>
+static int run_incdec(fake6502_context* c, const block6502_op* o)
+{
+    int ea = modify<M>(c, o);
+    if (ea < 0)
+        return BAIL;
+    uint8_t value = cpeek(ea) + DELTA;
+    cpoke(ea, value);
+    setNZ(c, value);
+    c->cpu.pc = o->next;
+    return o->cycles;
+}
+
+template <int R, int DELTA>
+static int run_increg(fake6502_context* c, const block6502_op* o)
+{
+    uint8_t value = *reg(c, R) + DELTA;
+    *reg(c, R) = value;
+    setNZ(c, value);
+    c->cpu.pc = o->next;
+    return o->cycles;
+}
+
+template <int FROM, int TO>
+static int run_transfer(fake6502_context* c, const block6502_op* o)
+{
+    uint8_t value = *reg(c, FROM);
+    *reg(c, TO) = value;
+    setNZ(c, value);
+    c->cpu.pc = o->next;
+    return o->cycles;
+}
+
+template <int SET>
+static int run_carry(fake6502_context* c, const block6502_op* o)
+{
+    if (SET)
+        fake6502_carry_set(c);
+    else
+        fake6502_carry_clear(c);
+    c->cpu.pc = o->next;
+    return o->cycles;
+}
+
+/* Branch if the flag is SET, operand holds the target */
+
+template <int FLAG>
+static inline bool flag(const fake6502_context* c)
+{
+    if (FLAG == FAKE6502_ZERO_FLAG)
+        return fake6502_zero_flag(c);
+    if (FLAG == FAKE6502_SIGN_FLAG)
+        return fake6502_sign_flag(c);
+    if (FLAG == FAKE6502_CARRY_FLAG)
+        return fake6502_carry_flag(c);
+    return fake6502_overflow_flag(c);
+}
+
+template <int FLAG, int SET>
+static int run_branch(fake6502_context* c, const block6502_op* o)
+{
+    if (flag<FLAG>(c) == SET) {
+        c->cpu.pc = o->operand;
+        return o->cycles + ((o->next & 0xff00) != (o->operand & 0xff00) ? 2 : 1);
+    }
+    c->cpu.pc = o->next;
+    return o->cycles;
+}
+
+static int run_jmp(fake6502_context* c, const block6502_op* o)
+{
+    c->cpu.pc = o->operand;
+    return o->cycles;
+}
+
+static int run_jsr(fake6502_context* c, const block6502_op* o)
+{
+    uint16_t ret = o->next - 1;
+    cpoke(FAKE6502_STACK_BASE + c->cpu.s--, ret >> 8);
+    cpoke(FAKE6502_STACK_BASE + c->cpu.s--, ret & 0xff);
+    c->cpu.pc = o->operand;
+    return o->cycles;
+}
+
+static int run_rts(fake6502_context* c, const block6502_op* o)
+{
+    uint16_t ret = cpeek(FAKE6502_STACK_BASE + ++c->cpu.s);
+    ret |= cpeek(FAKE6502_STACK_BASE + ++c->cpu.s) << 8;
+    c->cpu.pc = ret + 1;
+    return o->cycles;
+}
+
+static int run_pha(fake6502_context* c, const block6502_op* o)
+{
+    cpoke(FAKE6502_STACK_BASE + c->cpu.s--, c->cpu.a);
+    c->cpu.pc = o->next;
+    return o->cycles;
+}
+
+static int run_pla(fake6502_context* c, const block6502_op* o)
+{
+    c->cpu.a = cpeek(FAKE6502_STACK_BASE + ++c->cpu.s);
+    setNZ(c, c->cpu.a);
+    c->cpu.pc = o->next;
+    return o->cycles;
+}
+
+/* Pick the handler for o. Branch operands become the target address. */
+
+static block6502_handler handler(block6502_op* o)
+{
+    switch (o->opcode) {
+    case 0xa9:
+        return run_ld<REG_A, IMM>;
+    case 0xa5:
+        return run_ld<REG_A, ZP>;
+    case 0xb5:
+        return run_ld<REG_A, ZPX>;
+    case 0xad:
+        return run_ld<REG_A, ABS>;
+    case 0xbd:
+        return run_ld<REG_A, ABSX_P>;
+    case 0xb9:
+        return run_ld<REG_A, ABSY_P>;
+    case 0xb1:
+        return run_ld<REG_A, INDY_P>;
+    case 0xa2:
+        return run_ld<REG_X, IMM>;
+    case 0xa6:
+        return run_ld<REG_X, ZP>;
+    case 0xb6:
+        return run_ld<REG_X, ZPY>;
+    case 0xae:
+        return run_ld<REG_X, ABS>;
+    case 0xbe:
+        return run_ld<REG_X, ABSY_P>;
+    case 0xa0:
+        return run_ld<REG_Y, IMM>;
+    case 0xa4:
+        return run_ld<REG_Y, ZP>;
+    case 0xb4:
+        return run_ld<REG_Y, ZPX>;
+    case 0xac:
+        return run_ld<REG_Y, ABS>;
+    case 0xbc:
+        return run_ld<REG_Y, ABSX_P>;
+
+    case 0x85:
+        return run_st<REG_A, ZP>;
+    case 0x95:
+        return run_st<REG_A, ZPX>;
+    case 0x8d:
+        return run_st<REG_A, ABS>;
+    case 0x9d:
+        return run_st<REG_A, ABSX>;
+    case 0x99:
+        return run_st<REG_A, ABSY>;
+    case 0x91:
+        return run_st<REG_A, INDY>;
+    case 0x86:
+        return run_st<REG_X, ZP>;
+    case 0x8e:
+        return run_st<REG_X, ABS>;
+    case 0x84:
+        return run_st<REG_Y, ZP>;
+    case 0x8c:
+        return run_st<REG_Y, ABS>;
+    case 0x64:
+        return run_stz<ZP>;
+    case 0x9c:
+        return run_stz<ABS>;
+
+    case 0x09:
+        return run_alu<ALU_ORA, IMM>;
+    case 0x05:
+        return run_alu<ALU_ORA, ZP>;
+    case 0x0d:
+        return run_alu<ALU_ORA, ABS>;
+    case 0x29:
+        return run_alu<ALU_AND, IMM>;
+    case 0x25:
+        return run_alu<ALU_AND, ZP>;
+    case 0x2d:
+        return run_alu<ALU_AND, ABS>;
+    case 0x49:
+        return run_alu<ALU_EOR, IMM>;
+    case 0x45:
+        return run_alu<ALU_EOR, ZP>;
+    case 0x4d:
+        return run_alu<ALU_EOR, ABS>;
+    case 0x69:
+        return run_alu<ALU_ADC, IMM>;
+    case 0x65:
+        return run_alu<ALU_ADC, ZP>;
+    case 0x6d:
+        return run_alu<ALU_ADC, ABS>;
+    case 0x7d:
+        return run_alu<ALU_ADC, ABSX_P>;
+    case 0x79:
+        return run_alu<ALU_ADC, ABSY_P>;
+    case 0x71:
+        return run_alu<ALU_ADC, INDY_P>;
+    case 0xe9:
+        return run_alu<ALU_SBC, IMM>;
+    case 0xe5:
+        return run_alu<ALU_SBC, ZP>;
+    case 0xed:
+        return run_alu<ALU_SBC, ABS>;
+    case 0xfd:
+        return run_alu<ALU_SBC, ABSX_P>;
+    case 0xf9:
+        return run_alu<ALU_SBC, ABSY_P>;
+    case 0xf1:
+        return run_alu<ALU_SBC, INDY_P>;
+
+    case 0xc9:
+        return run_cmp<REG_A, IMM>;
+    case 0xc5:
+        return run_cmp<REG_A, ZP>;
+    case 0xcd:
+        return run_cmp<REG_A, ABS>;
+    case 0xdd:
+        return run_cmp<REG_A, ABSX_P>;
+    case 0xd9:
+        return run_cmp<REG_A, ABSY_P>;
+    case 0xd1:
+        return run_cmp<REG_A, INDY_P>;
+    case 0xe0:
+        return run_cmp<REG_X, IMM>;
+    case 0xe4:
+        return run_cmp<REG_X, ZP>;
+    case 0xec:
+        return run_cmp<REG_X, ABS>;
+    case 0xc0:
+        return run_cmp<REG_Y, IMM>;
+    case 0xc4:
+        return run_cmp<REG_Y, ZP>;
+    case 0xcc:
+        return run_cmp<REG_Y, ABS>;
+
+    case 0xe6:
+        return run_incdec<1, ZP>;
+    case 0xf6:
+        return run_incdec<1, ZPX>;
+    case 0xee:
+        return run_incdec<1, ABS>;
+    case 0xc6:
+        return run_incdec<-1, ZP>;
+    case 0xd6:
+        return run_incdec<-1, ZPX>;
+    case 0xce:
+        return run_incdec<-1, ABS>;
+    case 0xe8:
+        return run_increg<REG_X, 1>;
+    case 0xc8:
+        return run_increg<REG_Y, 1>;
+    case 0xca:
+        return run_increg<REG_X, -1>;
+    case 0x88:
+        return run_increg<REG_Y, -1>;
+    case 0xaa:
+        return run_transfer<REG_A, REG_X>;
+    case 0x8a:
+        return run_transfer<REG_X, REG_A>;
+    case 0xa8:
+        return run_transfer<REG_A, REG_Y>;
+    case 0x98:
+        return run_transfer<REG_Y, REG_A>;
+    case 0x18:
+        return run_carry<0>;
+    case 0x38:
+        return run_carry<1>;
+
+    case 0x4c:
+        return run_jmp;
+    case 0x20:
+        return run_jsr;
+    case 0x60:
+        return run_rts;
+    case 0x48:
+        return run_pha;
+    case 0x68:
+        return run_pla;
+    }
+
+    block6502_handler branch;
+    switch (o->opcode) {
+    case 0x10:
+        branch = run_branch<FAKE6502_SIGN_FLAG, 0>;
+        break;
+    case 0x30:
+        branch = run_branch<FAKE6502_SIGN_FLAG, 1>;
+        break;
+    case 0x50:
+        branch = run_branch<FAKE6502_OVERFLOW_FLAG, 0>;
+        break;
+    case 0x70:
+        branch = run_branch<FAKE6502_OVERFLOW_FLAG, 1>;
+        break;
+    case 0x90:
+        branch = run_branch<FAKE6502_CARRY_FLAG, 0>;
+        break;
+    case 0xb0:
+        branch = run_branch<FAKE6502_CARRY_FLAG, 1>;
+        break;
+    case 0xd0:
+        branch = run_branch<FAKE6502_ZERO_FLAG, 0>;
+        break;
+    case 0xf0:
+        branch = run_branch<FAKE6502_ZERO_FLAG, 1>;
+        break;
+    default:
+        return run_any;
+    }
+    o->operand = o->next + (int8_t)o->operand;
+    return branch;
+}
+
+/* Claim page for block b, see Z80.cpp. */
+
+static bool blockUsesPage(block6502* b, int page)
+{
+    if (page == b->page[0] || page == b->page[1])
+        return true;
+    if (b->page[1] != b->page[0] || bus_page_mapped[page])
+        return false;
+    bus_code_page(page);
+    b->page[1] = page;
+    b->gen[1] = cpu_code_gen[page];
+    return true;
+}
+
+static inline bool blockModified(const block6502* b)
+{
+    return cpu_code_gen[b->page[0]] != b->gen[0]
+        || cpu_code_gen[b->page[1]] != b->gen[1];
+}
+
+static bool translate(block6502* b)
+{
+    uint16_t pc = b->pc;
+
+    b->count = 0;
+#ifdef BLOCK6502_NATIVE
+    b->runs = 0;
+    b->native = NULL;
+#endif
+    if (bus_page_mapped[0] || bus_page_mapped[1] || bus_page_mapped[pc >> 8])
+        return false;
+    b->page[0] = b->page[1] = pc >> 8;
+    bus_code_page(b->page[0]);
+    b->gen[0] = b->gen[1] = cpu_code_gen[b->page[0]];
+
+    while (b->count < BLOCK6502_LENGTH) {
+        uint8_t opcode = cpeek(pc);
+        int length = lengths[opcode];
+        if (!blockUsesPage(b, ((pc + length - 1) & 0xffff) >> 8))
+            break;
+
+        block6502_op* o = &b->ops[b->count++];
+        o->pc = pc;
+        o->next = pc + length;
+        o->opcode = opcode;
+        o->cycles = fake6502_opcodes[opcode].clockticks;
+        o->operand = length == 1 ? 0 : cpeek(pc + 1);
+        if (length == 3)
+            o->operand |= cpeek(pc + 2) << 8;
+        o->run = handler(o);
+
+        pc = o->next;
+        if (endsBlock(opcode))
+            break;
+    }
+    return b->count > 0;
+}
+
+#ifdef BLOCK6502_NATIVE
+
+/* Host code for hot blocks, see native.h.
+ *
+ * A block compiles to a function returning the cycles it ran, or BAIL when its
+ * first instruction would access a device page before anything ran. A, X and
+ * Y live in r14, r15 and ebp, the context is in r12, cerb_ram in r13 and the
+ * cycles elapsed in ebx. The flags stay in the lazy fields of the context,
+ * written as fake6502.c writes them and tested where a branch needs them.
+ * trace_head is kept in r10 and stored back around calls and on the way out.
+ * [rsp] holds max_cycles, [rsp + 4] cpu_code_epoch and [rsp + 8] cpu_cycles,
+ * both as they were at entry.
+ *
+ * Opcodes not in the table below call their threaded handler. A taken branch
+ * or JMP back to the start of the block loops inside the code until the
+ * budget is used up.
+ */
+
+enum {
+    N_LD,
+    N_ST,
+    N_STZ,
+    N_ALU,
+    N_CMP,
+    N_INC,
+    N_DEC,
+    N_INCREG,
+    N_DECREG,
+    N_TRANSFER, /* arg is FROM << 2 | TO */
+    N_TSX,
+    N_TXS,
+    N_FLAG,
+    N_BIT,
+    N_BIT_IMM,
+    N_SHIFT,
+    N_BRANCH,
+    N_JMP,
+    N_JSR,
+    N_RTS,
+    N_PUSH,
+    N_PULL,
+    N_LAX,
+};
+
+enum {
+    SHIFT_ASL,
+    SHIFT_LSR,
+    SHIFT_ROL,
+    SHIFT_ROR,
+};
+
+struct native_op {
+    uint8_t opcode;
+    uint8_t kind;
+    uint8_t mode;
+    uint8_t arg;
+};
+
+/* The modes and registers as fake6502_opcodes[] has them for the CMOS core. */
+
+static const native_op native_ops[] = {
+    { 0x01, N_ALU, INDX, ALU_ORA },
+    { 0x05, N_ALU, ZP, ALU_ORA },
+    { 0x06, N_SHIFT, ZP, SHIFT_ASL },
+    { 0x09, N_ALU, IMM, ALU_ORA },
+    { 0x0a, N_SHIFT, ACC, SHIFT_ASL },
+    { 0x0d, N_ALU, ABS, ALU_ORA },
+    { 0x0e, N_SHIFT, ABS, SHIFT_ASL },
+    { 0x10, N_BRANCH, IMP, 0 },
+    { 0x11, N_ALU, INDY_P, ALU_ORA },
+    { 0x12, N_ALU, ZPI, ALU_ORA },
+    { 0x15, N_ALU, ZPX, ALU_ORA },
+    { 0x16, N_SHIFT, ZPX, SHIFT_ASL },
+    { 0x18, N_FLAG, IMP, 0 },
+    { 0x19, N_ALU, ABSY_P, ALU_ORA },
+    { 0x1a, N_INCREG, ACC, REG_A },
+    { 0x1d, N_ALU, ABSX_P, ALU_ORA },
+    { 0x1e, N_SHIFT, ABSX, SHIFT_ASL },
+    { 0x20, N_JSR, ABS, 0 },
+    { 0x21, N_ALU, INDX, ALU_AND },
+    { 0x24, N_BIT, ZP, 0 },
+    { 0x25, N_ALU, ZP, ALU_AND },
+    { 0x26, N_SHIFT, ZP, SHIFT_ROL },
+    { 0x29, N_ALU, IMM, ALU_AND },
+    { 0x2a, N_SHIFT, ACC, SHIFT_ROL },
+    { 0x2c, N_BIT, ABS, 0 },
+    { 0x2d, N_ALU, ABS, ALU_AND },
+    { 0x2e, N_SHIFT, ABS, SHIFT_ROL },
+    { 0x30, N_BRANCH, IMP, 0 },
+    { 0x31, N_ALU, INDY_P, ALU_AND },
+    { 0x32, N_ALU, ZPI, ALU_ADC },
+    { 0x34, N_BIT, ZPX, 0 },
+    { 0x35, N_ALU, ZPX, ALU_AND },
+    { 0x36, N_SHIFT, ZPX, SHIFT_ROL },
+    { 0x38, N_FLAG, IMP, 0 },
+    { 0x39, N_ALU, ABSY_P, ALU_AND },
+    { 0x3a, N_DECREG, ACC, REG_A },
+    { 0x3c, N_BIT, ABSX_P, 0 },
+    { 0x3d, N_ALU, ABSX_P, ALU_AND },
+    { 0x3e, N_SHIFT, ABSX, SHIFT_ROL },
+    { 0x41, N_ALU, INDX, ALU_EOR },
+    { 0x45, N_ALU, ZP, ALU_EOR },
+    { 0x46, N_SHIFT, ZP, SHIFT_LSR },
+    { 0x48, N_PUSH, IMP, REG_A },
+    { 0x49, N_ALU, IMM, ALU_EOR },
+    { 0x4a, N_SHIFT, ACC, SHIFT_LSR },
+    { 0x4c, N_JMP, ABS, 0 },
+    { 0x4d, N_ALU, ABS, ALU_EOR },
+    { 0x4e, N_SHIFT, ABS, SHIFT_LSR },
+    { 0x50, N_BRANCH, IMP, 0 },
+    { 0x51, N_ALU, INDY_P, ALU_EOR },
+    { 0x52, N_ALU, ZPI, ALU_EOR },
+    { 0x55, N_ALU, ZPX, ALU_EOR },
+    { 0x56, N_SHIFT, ZPX, SHIFT_LSR },
+    { 0x59, N_ALU, ABSY_P, ALU_EOR },
+    { 0x5a, N_PUSH, IMP, REG_Y },
+    { 0x5d, N_ALU, ABSX_P, ALU_EOR },
+    { 0x5e, N_SHIFT, ABSX, SHIFT_LSR },
+    { 0x60, N_RTS, IMP, 0 },
+    { 0x61, N_ALU, INDX, ALU_ADC },
+    { 0x64, N_STZ, ZP, 0 },
+    { 0x65, N_ALU, ZP, ALU_ADC },
+    { 0x66, N_SHIFT, ZP, SHIFT_ROR },
+    { 0x68, N_PULL, IMP, REG_A },
+    { 0x69, N_ALU, IMM, ALU_ADC },
+    { 0x6a, N_SHIFT, ACC, SHIFT_ROR },
+    { 0x6d, N_ALU, ABS, ALU_ADC },
+    { 0x6e, N_SHIFT, ABS, SHIFT_ROR },
+    { 0x70, N_BRANCH, IMP, 0 },
+    { 0x71, N_ALU, INDY_P, ALU_ADC },
+    { 0x72, N_ALU, ZPI, ALU_ADC },
+    { 0x74, N_STZ, ZPX, 0 },
+    { 0x75, N_ALU, ZPX, ALU_ADC },
+    { 0x76, N_SHIFT, ZPX, SHIFT_ROR },
+    { 0x79, N_ALU, ABSY_P, ALU_ADC },
+    { 0x7a, N_PULL, IMP, REG_Y },
+    { 0x7d, N_ALU, ABSX_P, ALU_ADC },
+    { 0x7e, N_SHIFT, ABSX, SHIFT_ROR },
+    { 0x81, N_ST, INDX, REG_A },
+    { 0x84, N_ST, ZP, REG_Y },
+    { 0x85, N_ST, ZP, REG_A },
+    { 0x86, N_ST, ZP, REG_X },
+    { 0x88, N_DECREG, IMP, REG_Y },
+    { 0x89, N_BIT_IMM, IMM, 0 },
+    { 0x8a, N_TRANSFER, IMP, REG_X << 2 | REG_A },
+    { 0x8c, N_ST, ABS, REG_Y },
+    { 0x8d, N_ST, ABS, REG_A },
+    { 0x8e, N_ST, ABS, REG_X },
+    { 0x90, N_BRANCH, IMP, 0 },
+    { 0x91, N_ST, INDY, REG_A },
+    { 0x92, N_ST, ZPI, REG_A },
+    { 0x94, N_ST, ZPX, REG_Y },
+    { 0x95, N_ST, ZPX, REG_A },
+    { 0x96, N_ST, ZPY, REG_X },
+    { 0x98, N_TRANSFER, IMP, REG_Y << 2 | REG_A },
+    { 0x99, N_ST, ABSY, REG_A },
+    { 0x9a, N_TXS, IMP, 0 },
+    { 0x9c, N_STZ, ABS, 0 },
+    { 0x9d, N_ST, ABSX, REG_A },
+    { 0x9e, N_STZ, ABSX, 0 },
+    { 0xa0, N_LD, IMM, REG_Y },
+    { 0xa1, N_LD, INDX, REG_A },
+    { 0xa2, N_LD, IMM, REG_X },
+    { 0xa3, N_LAX, INDX, 0 },
+    { 0xa4, N_LD, ZP, REG_Y },
+    { 0xa5, N_LD, ZP, REG_A },
+    { 0xa6, N_LD, ZP, REG_X },
+    { 0xa7, N_LAX, ZP, 0 },
+    { 0xa8, N_TRANSFER, IMP, REG_A << 2 | REG_Y },
+    { 0xa9, N_LD, IMM, REG_A },
+    { 0xaa, N_TRANSFER, IMP, REG_A << 2 | REG_X },
+    { 0xac, N_LD, ABS, REG_Y },
+    { 0xad, N_LD, ABS, REG_A },
+    { 0xae, N_LD, ABS, REG_X },
+    { 0xaf, N_LAX, ABS, 0 },
+    { 0xb0, N_BRANCH, IMP, 0 },
+    { 0xb1, N_LD, INDY_P, REG_A },
+    { 0xb2, N_LD, ZPI, REG_A },
+    { 0xb3, N_LAX, INDY_P, 0 },
+    { 0xb4, N_LD, ZPX, REG_Y },
+    { 0xb5, N_LD, ZPX, REG_A },
+    { 0xb6, N_LD, ZPY, REG_X },
+    { 0xb7, N_LAX, ZPY, 0 },
+    { 0xb8, N_FLAG, IMP, 0 },
+    { 0xb9, N_LD, ABSY_P, REG_A },
+    { 0xba, N_TSX, IMP, 0 },
+    { 0xbb, N_LAX, ABSY_P, 0 },
+    { 0xbc, N_LD, ABSX_P, REG_Y },
+    { 0xbd, N_LD, ABSX_P, REG_A },
+    { 0xbe, N_LD, ABSY_P, REG_X },
+    { 0xbf, N_LAX, ABSY_P, 0 },
+    { 0xc0, N_CMP, IMM, REG_Y },
+    { 0xc1, N_CMP, INDX, REG_A },
+    { 0xc4, N_CMP, ZP, REG_Y },
+    { 0xc5, N_CMP, ZP, REG_A },
+    { 0xc6, N_DEC, ZP, 0 },
+    { 0xc8, N_INCREG, IMP, REG_Y },
+    { 0xc9, N_CMP, IMM, REG_A },
+    { 0xca, N_DECREG, IMP, REG_X },
+    { 0xcc, N_CMP, ABS, REG_Y },
+    { 0xcd, N_CMP, ABS, REG_A },
+    { 0xce, N_DEC, ABS, 0 },
+    { 0xd0, N_BRANCH, IMP, 0 },
+    { 0xd1, N_CMP, INDY_P, REG_A },
+    { 0xd2, N_CMP, ZPI, REG_A },
+    { 0xd5, N_CMP, ZPX, REG_A },
+    { 0xd6, N_DEC, ZPX, 0 },
+    { 0xd8, N_FLAG, IMP, 0 },
+    { 0xd9, N_CMP, ABSY_P, REG_A },
+    { 0xda, N_PUSH, IMP, REG_X },
+    { 0xdd, N_CMP, ABSX_P, REG_A },
+    { 0xde, N_DEC, ABSX, 0 },
+    { 0xe0, N_CMP, IMM, REG_X },
+    { 0xe1, N_ALU, INDX, ALU_SBC },
+    { 0xe4, N_CMP, ZP, REG_X },
+    { 0xe5, N_ALU, ZP, ALU_SBC },
+    { 0xe6, N_INC, ZP, 0 },
+    { 0xe8, N_INCREG, IMP, REG_X },
+    { 0xe9, N_ALU, IMM, ALU_SBC },
+    { 0xeb, N_ALU, IMM, ALU_SBC },
+    { 0xec, N_CMP, ABS, REG_X },
+    { 0xed, N_ALU, ABS, ALU_SBC },
+    { 0xee, N_INC, ABS, 0 },
+    { 0xf0, N_BRANCH, IMP, 0 },
+    { 0xf1, N_ALU, INDY_P, ALU_SBC },
+    { 0xf2, N_ALU, ZPI, ALU_SBC },
+    { 0xf5, N_ALU, ZPX, ALU_SBC },
+    { 0xf6, N_INC, ZPX, 0 },
+    { 0xf8, N_FLAG, IMP, 0 },
+    { 0xf9, N_ALU, ABSY_P, ALU_SBC },
+    { 0xfa, N_PULL, IMP, REG_X },
+    { 0xfd, N_ALU, ABSX_P, ALU_SBC },
+    { 0xfe, N_INC, ABSX, 0 },
+};
+
+static const native_op* nativeOp(uint8_t opcode)
+{
+    for (const native_op& n : native_ops)
+        if (n.opcode == opcode)
+            return &n;
+    return NULL;
+}
+
+static void decimal(fake6502_context* c, int sbc, int value)
+{
+    fake6502_decimal_op(c, sbc, value);
+}
+
+#define CPU(field) nmem(R12, offsetof(fake6502_context, cpu.field))
+
+static_assert(offsetof(fake6502_context, cpu.sign_result) == offsetof(fake6502_context, cpu.zero_result) + 1,
+    "the trace stores zero_result and sign_result as one word");
+
+static const int guest[3] = { R14, R15, RBP };
+
+enum {
+    EXIT_NEXT, /* after instruction k, at its next */
+    EXIT_PC, /* after instruction k, cpu.pc is stored */
+    EXIT_BAIL, /* before instruction k */
+    EXIT_DONE, /* cpu.pc is stored and the instructions counted */
+};
+
+#define ALWAYS -1
+
+struct native_exit {
+    uint8_t* jump;
+    int type;
+    int k;
+};
+
+struct native6502 {
+    native_asm a;
+    const block6502* b;
+    uint8_t* loop;
+    std::vector<native_exit> exits;
+
+    void exit(int cc, int type, int k) { exits.push_back({ cc == ALWAYS ? a.jmp() : a.jcc(cc), type, k }); }
+
+    void count(int instructions)
+    {
+        a.movptr(RAX, &cpu_instructions);
+        a.alui(X86_ADD, 8, nmem(RAX), instructions);
+    }
+
+    void flush()
+    {
+        a.movptr(R11, &trace_head);
+        a.mov(8, nmem(R11), R10);
+    }
+
+    void call(const void* fn)
+    {
+        flush();
+        a.call(fn);
+        a.movptr(R11, &trace_head);
+        a.load(8, R10, nmem(R11));
+    }
+
+    void spill()
+    {
+        a.mov(1, CPU(a), R14);
+        a.mov(1, CPU(x), R15);
+        a.mov(1, CPU(y), RBP);
+    }
+
+    void reload()
+    {
+        a.movzx(1, R14, CPU(a));
+        a.movzx(1, R15, CPU(x));
+        a.movzx(1, RBP, CPU(y));
+    }
+
+    void setNZ(int r)
+    {
+        a.mov(1, CPU(zero_result), r);
+        a.mov(1, CPU(sign_result), r);
+    }
+
+    /* r = 1 if the carry is set, else 0 */
+    void carry(int r)
+    {
+        a.movzx(2, r, CPU(carry_result));
+        a.alui(X86_CMP, 4, nreg(r), 0xff);
+        a.setcc(CC_A, nreg(r));
+        a.movzx(1, r, nreg(r));
+    }
+
+    /* trace_6502() for instruction o */
+    void trace(const block6502_op* o)
+    {
+        a.mov(4, nreg(RDX), R10);
+        a.inc(8, nreg(R10));
+        a.alui(X86_AND, 4, nreg(RDX), TRACE_RING_SIZE - 1);
+        a.lea(8, RDX, nmem(RDX, RDX, 2));
+        a.movptr(RAX, trace_ring);
+        a.lea(8, RDX, nmem(RAX, RDX, 8));
+
+        // the record goes out in four stores: cycle, pc and sp, the opcode
+        // bytes, A X Y and r[3], then r[4] and r[5]
+        static_assert(offsetof(trace_record, pc) == 4 && offsetof(trace_record, sp) == 6
+                && offsetof(trace_record, op) == 8 && offsetof(trace_record, r) == 12,
+            "the layout in trace.h");
+        a.load(4, RAX, nmem(RSP, 8));
+        a.alu(X86_ADD, 4, nreg(RAX), RBX);
+        a.movzx(1, RCX, CPU(s));
+        a.shift(SH_SHL, 4, nreg(RCX), 16);
+        a.alui(X86_OR, 4, nreg(RCX), o->pc);
+        a.shift(SH_SHL, 8, nreg(RCX), 32);
+        a.alu(X86_OR, 8, nreg(RAX), RCX);
+        a.mov(8, nmem(RDX), RAX);
+        if (o->pc <= 0xfffc) {
+            a.load(4, RAX, nmem(R13, o->pc));
+            a.mov(4, nmem(RDX, 8), RAX);
+        } else {
+            for (int i = 0; i < 4; i++) {
+                a.movzx(1, RAX, nmem(R13, (o->pc + i) & 0xffff));
+                a.mov(1, nmem(RDX, 8 + i), RAX);
+            }
+        }
+        a.movzx(1, RAX, CPU(flags));
+        a.movzx(1, RCX, CPU(overflow_result));
+        a.shift(SH_SHL, 4, nreg(RCX), 8);
+        a.alu(X86_OR, 4, nreg(RAX), RCX);
+        for (int r = REG_Y; r >= REG_A; r--) {
+            a.shift(SH_SHL, 8, nreg(RAX), 16);
+            a.alu(X86_OR, 8, nreg(RAX), guest[r]);
+        }
+        a.mov(8, nmem(RDX, 12), RAX);
+        a.movzx(2, RAX, CPU(zero_result));
+        a.movzx(2, RCX, CPU(carry_result));
+        a.shift(SH_SHL, 4, nreg(RCX), 16);
+        a.alu(X86_OR, 4, nreg(RAX), RCX);
+        a.mov(4, nmem(RDX, 20), RAX);
+    }
+
+    /* Effective address of instruction k: returned when it is known now, else
+     * -1 with the address in ecx. Bails out on a device page and then adds
+     * the page crossing penalty to ebx.
+     */
+    int address(const block6502_op* o, int mode, int k)
+    {
+        int base = o->operand;
+        switch (mode) {
+        case ZP:
+            return base;
+        case ABS:
+            a.movptr(RAX, &bus_page_mapped[base >> 8]);
+            a.alui(X86_CMP, 1, nmem(RAX), 0);
+            exit(CC_NE, EXIT_BAIL, k);
+            return base;
+        case ZPX:
+        case ZPY:
+            a.lea(4, RCX, nmem(guest[mode == ZPX ? REG_X : REG_Y], base));
+            a.movzx(1, RCX, nreg(RCX));
+            return -1;
+        case ABSX:
+        case ABSX_P:
+        case ABSY:
+        case ABSY_P: {
+            int index = guest[mode == ABSX || mode == ABSX_P ? REG_X : REG_Y];
+            a.lea(4, RCX, nmem(index, base));
+            a.movzx(2, RCX, nreg(RCX));
+            if (mode == ABSX_P || mode == ABSY_P) {
+                a.lea(4, RDX, nmem(index, base & 0xff));
+                a.shift(SH_SHR, 4, nreg(RDX), 8);
+            }
+            break;
+        }
+        case INDX:
+            a.lea(4, RAX, nmem(R15, base));
+            a.movzx(1, RAX, nreg(RAX));
+            a.movzx(1, RCX, nmem(R13, RAX, 1));
+            a.alui(X86_ADD, 4, nreg(RAX), 1);
+            a.movzx(1, RAX, nreg(RAX));
+            a.movzx(1, RAX, nmem(R13, RAX, 1));
+            a.shift(SH_SHL, 4, nreg(RAX), 8);
+            a.alu(X86_OR, 4, nreg(RCX), RAX);
+            break;
+        case INDY:
+        case INDY_P:
+        case ZPI:
+            a.movzx(1, RCX, nmem(R13, base));
+            a.movzx(1, RAX, nmem(R13, (base + 1) & 0xff));
+            a.shift(SH_SHL, 4, nreg(RAX), 8);
+            a.alu(X86_OR, 4, nreg(RCX), RAX);
+            if (mode == INDY_P) {
+                a.movzx(1, RDX, nreg(RCX));
+                a.alu(X86_ADD, 4, nreg(RDX), RBP);
+                a.shift(SH_SHR, 4, nreg(RDX), 8);
+            }
+            if (mode != ZPI) {
+                a.alu(X86_ADD, 4, nreg(RCX), RBP);
+                a.movzx(2, RCX, nreg(RCX));
+            }
+            break;
+        }
+        a.mov(4, nreg(RAX), RCX);
+        a.shift(SH_SHR, 4, nreg(RAX), 8);
+        a.movptr(RSI, bus_page_mapped);
+        a.alui(X86_CMP, 1, nmem(RSI, RAX, 1), 0);
+        exit(CC_NE, EXIT_BAIL, k);
+        if (mode == ABSX_P || mode == ABSY_P || mode == INDY_P)
+            a.alu(X86_ADD, 4, nreg(RBX), RDX);
+        return -1;
+    }
+
+    native_rm at(int ea) { return ea >= 0 ? nmem(R13, ea) : nmem(R13, RCX, 1); }
+
+    /* eax = the operand of instruction k */
+    void load(const block6502_op* o, int mode, int k)
+    {
+        if (mode == IMM)
+            a.movi32(RAX, o->operand & 0xff);
+        else if (mode == ACC)
+            a.mov(4, nreg(RAX), R14);
+        else
+            a.movzx(1, RAX, at(address(o, mode, k)));
+    }
+
+    /* After a write to ea, or to ecx: the page trap, and the way out if the
+     * write changed translated code. ecx, eax and the other caller saved
+     * registers are gone afterwards.
+     */
+    void written(int ea, int k)
+    {
+        if (ea >= 0) {
+            a.movptr(RAX, &cpu_page_trap[ea >> 8]);
+            a.alui(X86_CMP, 1, nmem(RAX), 0);
+        } else {
+            a.mov(4, nreg(RAX), RCX);
+            a.shift(SH_SHR, 4, nreg(RAX), 8);
+            a.movptr(RSI, cpu_page_trap);
+            a.alui(X86_CMP, 1, nmem(RSI, RAX, 1), 0);
+        }
+        uint8_t* untrapped = a.jcc(CC_E);
+        if (ea >= 0)
+            a.movi32(RDI, ea);
+        else
+            a.mov(4, nreg(RDI), RCX);
+        a.movi32(RSI, 1);
+        call((const void*)cpu_page_written);
+        a.movptr(RAX, &cpu_code_epoch);
+        a.load(4, RAX, nmem(RAX));
+        a.alu_load(X86_CMP, 4, RAX, nmem(RSP, 4));
+        exit(CC_NE, EXIT_NEXT, k);
+        a.bind(untrapped);
+    }
+
+    /* the stack page at S, plus delta */
+    native_rm stack(int delta)
+    {
+        a.movzx(1, RCX, CPU(s));
+        if (delta) {
+            a.alui(X86_ADD, 4, nreg(RCX), delta);
+            a.movzx(1, RCX, nreg(RCX));
+        }
+        return nmem(R13, RCX, 1, FAKE6502_STACK_BASE);
+    }
+
+    void push(int r, int k)
+    {
+        a.mov(1, stack(0), r);
+        a.dec(1, CPU(s));
+        a.alui(X86_ADD, 4, nreg(RCX), FAKE6502_STACK_BASE);
+        written(-1, k);
+    }
+
+    /* Taken jump of instruction k to its operand, which loops while the
+     * budget lasts if that is the start of the block. */
+    void jump(const block6502_op* o, int k, int cycles)
+    {
+        a.alui(X86_ADD, 4, nreg(RBX), cycles);
+        if (o->operand != b->pc) {
+            a.movi(2, CPU(pc), o->operand);
+            exit(ALWAYS, EXIT_PC, k);
+            return;
+        }
+        count(k + 1);
+        a.alu_load(X86_CMP, 4, RBX, nmem(RSP));
+        a.jcc_to(CC_L, loop);
+        a.movi(2, CPU(pc), o->operand);
+        exit(ALWAYS, EXIT_DONE, k);
+    }
+
+    bool compile(const block6502_op* o, const native_op* n, int k);
+    bool fallback(const block6502_op* o, int k);
+};
+
+/* Instruction k, without the trace. False when the block ends with it. */
+
+bool native6502::compile(const block6502_op* o, const native_op* n, int k)
+{
+    int mode = n->mode, r = n->arg;
+    int ea;
+
+    switch (n->kind) {
+    case N_LD:
+    case N_LAX:
+        load(o, mode, k);
+        a.mov(4, nreg(guest[n->kind == N_LAX ? REG_A : r]), RAX);
+        if (n->kind == N_LAX)
+            a.mov(4, nreg(R15), RAX);
+        setNZ(RAX);
+        break;
+    case N_ST:
+        ea = address(o, mode, k);
+        a.mov(1, at(ea), guest[r]);
+        a.alui(X86_ADD, 4, nreg(RBX), o->cycles);
+        written(ea, k);
+        return true;
+    case N_STZ:
+        ea = address(o, mode, k);
+        a.movi(1, at(ea), 0);
+        a.alui(X86_ADD, 4, nreg(RBX), o->cycles);
+        written(ea, k);
+        return true;
+    case N_ALU:
+        load(o, mode, k);
+        if (r == ALU_ADC || r == ALU_SBC) {
+            a.testi(1, CPU(flags), FAKE6502_DECIMAL_FLAG);
+            uint8_t* binary = a.jcc(CC_E);
+            a.mov(1, CPU(a), R14);
+            a.mov(8, nreg(RDI), R12);
+            a.movi32(RSI, r == ALU_SBC);
+            a.mov(4, nreg(RDX), RAX);
+            call((const void*)decimal);
+            a.movzx(1, R14, CPU(a));
+            uint8_t* done = a.jmp();
+            a.bind(binary);
+            if (r == ALU_SBC)
+                a.alui(X86_XOR, 4, nreg(RAX), 0xff);
+            carry(RCX);
+            a.lea(4, RDX, nmem(R14, RAX, 1));
+            a.alu(X86_ADD, 4, nreg(RDX), RCX);
+            // overflow_result = (result ^ a) & (result ^ value)
+            a.mov(4, nreg(RCX), RDX);
+            a.alu(X86_XOR, 4, nreg(RCX), R14);
+            a.alu(X86_XOR, 4, nreg(RAX), RDX);
+            a.alu(X86_AND, 4, nreg(RCX), RAX);
+            a.mov(1, CPU(overflow_result), RCX);
+            a.mov(2, CPU(carry_result), RDX);
+            setNZ(RDX);
+            a.movzx(1, R14, nreg(RDX));
+            a.bind(done);
+        } else {
+            a.alu(r == ALU_ORA ? X86_OR : r == ALU_AND ? X86_AND : X86_XOR, 4, nreg(R14), RAX);
+            setNZ(R14);
+        }
+        break;
+    case N_CMP:
+        load(o, mode, k);
+        a.mov(4, nreg(RCX), guest[r]);
+        a.alu(X86_SUB, 4, nreg(RCX), RAX);
+        setNZ(RCX);
+        a.alui(X86_ADD, 4, nreg(RCX), 0x100);
+        a.mov(2, CPU(carry_result), RCX);
+        break;
+    case N_INC:
+    case N_DEC:
+        ea = address(o, mode, k);
+        a.movzx(1, RAX, at(ea));
+        a.alui(X86_ADD, 4, nreg(RAX), n->kind == N_INC ? 1 : -1);
+        a.mov(1, at(ea), RAX);
+        setNZ(RAX);
+        a.alui(X86_ADD, 4, nreg(RBX), o->cycles);
+        written(ea, k);
+        return true;
+    case N_INCREG:
+    case N_DECREG:
+        a.lea(4, RAX, nmem(guest[r], n->kind == N_INCREG ? 1 : -1));
+        a.movzx(1, guest[r], nreg(RAX));
+        setNZ(RAX);
+        break;
+    case N_TRANSFER:
+        a.mov(4, nreg(guest[r & 3]), guest[r >> 2]);
+        setNZ(guest[r & 3]);
+        break;
+    case N_TSX:
+        a.movzx(1, R15, CPU(s));
+        setNZ(R15);
+        break;
+    case N_TXS:
+        a.mov(1, CPU(s), R15);
+        break;
+    case N_FLAG:
+        switch (o->opcode) {
+        case 0x18: /* CLC */
+            a.movi(2, CPU(carry_result), 0);
+            break;
+        case 0x38: /* SEC */
+            a.movi(2, CPU(carry_result), 0x100);
+            break;
+        case 0xb8: /* CLV */
+            a.movi(1, CPU(overflow_result), 0);
+            break;
+        case 0xd8: /* CLD */
+            a.alui(X86_AND, 1, CPU(flags), ~FAKE6502_DECIMAL_FLAG);
+            break;
+        case 0xf8: /* SED */
+            a.alui(X86_OR, 1, CPU(flags), FAKE6502_DECIMAL_FLAG);
+            break;
+        }
+        break;
+    case N_BIT:
+        load(o, mode, k);
+        a.mov(4, nreg(RCX), RAX);
+        a.alu(X86_AND, 4, nreg(RCX), R14);
+        a.mov(1, CPU(zero_result), RCX);
+        a.mov(1, CPU(sign_result), RAX);
+        a.alu(X86_ADD, 4, nreg(RAX), RAX);
+        a.mov(1, CPU(overflow_result), RAX);
+        break;
+    case N_BIT_IMM:
+        a.mov(4, nreg(RAX), R14);
+        a.alui(X86_AND, 4, nreg(RAX), o->operand & 0xff);
+        a.mov(1, CPU(zero_result), RAX);
+        break;
+    case N_SHIFT:
+        ea = mode == ACC ? -1 : address(o, mode, k);
+        if (mode == ACC)
+            a.mov(4, nreg(RAX), R14);
+        else
+            a.movzx(1, RAX, at(ea));
+        switch (r) {
+        case SHIFT_ASL:
+            a.alu(X86_ADD, 4, nreg(RAX), RAX);
+            a.mov(2, CPU(carry_result), RAX);
+            break;
+        case SHIFT_LSR:
+            a.mov(4, nreg(RDX), RAX);
+            a.alui(X86_AND, 4, nreg(RDX), 1);
+            a.shift(SH_SHL, 4, nreg(RDX), 8);
+            a.mov(2, CPU(carry_result), RDX);
+            a.shift(SH_SHR, 4, nreg(RAX), 1);
+            break;
+        case SHIFT_ROL:
+            carry(RDX);
+            a.alu(X86_ADD, 4, nreg(RAX), RAX);
+            a.alu(X86_OR, 4, nreg(RAX), RDX);
+            a.mov(2, CPU(carry_result), RAX);
+            break;
+        case SHIFT_ROR:
+            carry(RDX);
+            a.shift(SH_SHL, 4, nreg(RDX), 7);
+            a.mov(4, nreg(RSI), RAX);
+            a.alui(X86_AND, 4, nreg(RSI), 1);
+            a.shift(SH_SHL, 4, nreg(RSI), 8);
+            a.mov(2, CPU(carry_result), RSI);
+            a.shift(SH_SHR, 4, nreg(RAX), 1);
+            a.alu(X86_OR, 4, nreg(RAX), RDX);
+            break;
+        }
+        setNZ(RAX);
+        if (mode == ACC) {
+            a.movzx(1, R14, nreg(RAX));
+            break;
+        }
+        a.mov(1, at(ea), RAX);
+        a.alui(X86_ADD, 4, nreg(RBX), o->cycles);
+        written(ea, k);
+        return true;
+    case N_BRANCH: {
+        int taken;
+        switch (o->opcode & 0xc0) {
+        case 0x00: /* BPL BMI */
+            a.testi(1, CPU(sign_result), 0x80);
+            taken = CC_NE;
+            break;
+        case 0x40: /* BVC BVS */
+            a.testi(1, CPU(overflow_result), 0x80);
+            taken = CC_NE;
+            break;
+        case 0x80: /* BCC BCS */
+            a.alui(X86_CMP, 2, CPU(carry_result), 0xff);
+            taken = CC_A;
+            break;
+        default: /* BNE BEQ */
+            a.alui(X86_CMP, 1, CPU(zero_result), 0);
+            taken = CC_E;
+            break;
+        }
+        if (!(o->opcode & 0x20))
+            taken ^= 1;
+        uint8_t* untaken = a.jcc(taken ^ 1);
+        jump(o, k, o->cycles + ((o->next & 0xff00) != (o->operand & 0xff00) ? 2 : 1));
+        a.bind(untaken);
+        break;
+    }
+    case N_JMP:
+        jump(o, k, o->cycles);
+        return false;
+    case N_JSR: {
+        uint16_t ret = o->next - 1;
+        a.movi(1, stack(0), ret >> 8);
+        a.movi(1, stack(-1), ret & 0xff);
+        a.alui(X86_ADD, 4, nreg(RCX), -1);
+        a.mov(1, CPU(s), RCX);
+        a.movptr(RAX, &cpu_page_trap[FAKE6502_STACK_BASE >> 8]);
+        a.alui(X86_CMP, 1, nmem(RAX), 0);
+        uint8_t* untrapped = a.jcc(CC_E);
+        for (int i = 2; i > 0; i--) {
+            stack(i);
+            a.lea(4, RDI, nmem(RCX, FAKE6502_STACK_BASE));
+            a.movi32(RSI, 1);
+            call((const void*)cpu_page_written);
+        }
+        a.bind(untrapped);
+        a.movi(2, CPU(pc), o->operand);
+        a.alui(X86_ADD, 4, nreg(RBX), o->cycles);
+        exit(ALWAYS, EXIT_PC, k);
+        return false;
+    }
+    case N_RTS:
+        a.movzx(1, RAX, stack(1));
+        a.alui(X86_ADD, 4, nreg(RCX), 1);
+        a.movzx(1, RCX, nreg(RCX));
+        a.mov(1, CPU(s), RCX);
+        a.movzx(1, RDX, nmem(R13, RCX, 1, FAKE6502_STACK_BASE));
+        a.shift(SH_SHL, 4, nreg(RDX), 8);
+        a.alu(X86_OR, 4, nreg(RAX), RDX);
+        a.alui(X86_ADD, 4, nreg(RAX), 1);
+        a.mov(2, CPU(pc), RAX);
+        a.alui(X86_ADD, 4, nreg(RBX), o->cycles);
+        exit(ALWAYS, EXIT_PC, k);
+        return false;
+    case N_PUSH:
+        a.alui(X86_ADD, 4, nreg(RBX), o->cycles);
+        push(guest[r], k);
+        return true;
+    case N_PULL:
+        a.movzx(1, guest[r], stack(1));
+        a.mov(1, CPU(s), RCX);
+        setNZ(guest[r]);
+        break;
+    }
+    a.alui(X86_ADD, 4, nreg(RBX), o->cycles);
+    return true;
+}
+
+/* Instruction k through its threaded handler. */
+
+bool native6502::fallback(const block6502_op* o, int k)
+{
+    spill();
+    a.mov(8, nreg(RDI), R12);
+    a.movptr(RSI, o);
+    call((const void*)o->run);
+    reload();
+    a.alui(X86_CMP, 4, nreg(RAX), BAIL);
+    exit(CC_E, EXIT_BAIL, k);
+    a.alu(X86_ADD, 4, nreg(RBX), RAX);
+    if (endsBlock(o->opcode)) {
+        exit(ALWAYS, EXIT_PC, k);
+        return false;
+    }
+    a.alui(X86_CMP, 2, CPU(pc), o->next);
+    exit(CC_NE, EXIT_PC, k);
+    a.movptr(RAX, &cpu_code_epoch);
+    a.load(4, RAX, nmem(RAX));
+    a.alu_load(X86_CMP, 4, RAX, nmem(RSP, 4));
+    exit(CC_NE, EXIT_PC, k);
+    return true;
+}
+
+#define NATIVE_OP_SIZE 1024 /* bytes of host code per instruction, at most */
+
+/* The trace trap is checked by trace_6502(), which the host code does not
+ * call. */
+
+static bool trapped(const block6502* b)
+{
+    if (trace_trap_pc < 0)
+        return false;
+    for (int k = 0; k < b->count; k++)
+        if (b->ops[k].pc == trace_trap_pc)
+            return true;
+    return false;
+}
+
+static block6502_native compile(const block6502* b)
+{
+    size_t max = NATIVE_OP_SIZE * (b->count + 1);
+    uint8_t* start = native_begin(max);
+    if (!start)
+        return NULL;
+
+    native6502 n;
+    native_asm& a = n.a;
+    a.p = start;
+    n.b = b;
+
+    static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+    for (int r : saved)
+        a.push(r);
+    a.alui(X86_SUB, 8, nreg(RSP), 24);
+    a.mov(8, nreg(R12), RDI);
+    a.mov(4, nmem(RSP), RSI);
+    a.movptr(R13, cerb_ram);
+    a.movptr(RAX, &cpu_code_epoch);
+    a.load(4, RAX, nmem(RAX));
+    a.mov(4, nmem(RSP, 4), RAX);
+    a.movptr(RAX, &trace_head);
+    a.load(8, R10, nmem(RAX));
+    a.movptr(RAX, &cpu_cycles);
+    a.load(4, RAX, nmem(RAX));
+    a.mov(4, nmem(RSP, 8), RAX);
+    a.alu(X86_XOR, 4, nreg(RBX), RBX);
+    n.reload();
+
+    n.loop = a.p;
+    for (int k = 0; k < b->count; k++) {
+        const block6502_op* o = &b->ops[k];
+        const native_op* op = nativeOp(o->opcode);
+        n.trace(o);
+        if (!(op ? n.compile(o, op, k) : n.fallback(o, k)))
+            break;
+        if (k + 1 == b->count) {
+            n.exit(ALWAYS, EXIT_NEXT, k);
+        } else {
+            a.alu_load(X86_CMP, 4, RBX, nmem(RSP));
+            n.exit(CC_GE, EXIT_NEXT, k);
+        }
+    }
+
+    uint8_t* epilogue = a.p;
+    n.flush();
+    n.spill();
+    a.mov(4, nreg(RAX), RBX);
+    a.alui(X86_ADD, 8, nreg(RSP), 24);
+    for (int i = 5; i >= 0; i--)
+        a.pop(saved[i]);
+    a.ret();
+
+    for (const native_exit& e : n.exits) {
+        const block6502_op* o = &b->ops[e.k];
+        if (e.type == EXIT_DONE) {
+            a.bind_to(e.jump, epilogue);
+            continue;
+        }
+        a.bind(e.jump);
+        switch (e.type) {
+        case EXIT_NEXT:
+            a.movi(2, CPU(pc), o->next);
+            n.count(e.k + 1);
+            break;
+        case EXIT_PC:
+            n.count(e.k + 1);
+            break;
+        case EXIT_BAIL:
+            a.movi(2, CPU(pc), o->pc);
+            if (e.k == 0) {
+                // nothing ran, the caller steps the instruction
+                a.test(4, nreg(RBX), RBX);
+                uint8_t* ran = a.jcc(CC_NE);
+                n.count(1);
+                a.movi32(RBX, BAIL);
+                a.jmp_to(epilogue);
+                a.bind(ran);
+            }
+            a.dec(8, nreg(R10));
+            if (e.k)
+                n.count(e.k);
+            break;
+        }
+        a.jmp_to(epilogue);
+    }
+
+    native_commit(a.p);
+    return reinterpret_cast<block6502_native>(start);
+}
+
+#endif /* BLOCK6502_NATIVE */
+
+#endif /* BLOCK6502_CACHE */
+
+int block6502_step(fake6502_context* c, int max_cycles)
+{
+#ifdef BLOCK6502_CACHE
+
+    if (!blocks) {
+        blocks = static_cast<block6502*>(calloc(BLOCK6502_CACHE_SIZE, sizeof(block6502)));
+        if (!blocks)
+            return step(c);
+    }
+
+    block6502* b = &blocks[c->cpu.pc & (BLOCK6502_CACHE_SIZE - 1)];
+    if (b->pc != c->cpu.pc || (b->count && blockModified(b))) {
+        b->pc = c->cpu.pc;
+        b->count = 0;
+        b->hits = 0;
+    }
+    if (b->count == 0) {
+        if (++b->hits < BLOCK6502_HOT)
+            return step(c);
+        b->hits = 0;
+        if (!translate(b))
+            return step(c);
+    }
+
+#ifdef BLOCK6502_NATIVE
+    if (native_enabled && !trapped(b)) {
+        if (!b->native || b->native_gen != native_gen) {
+            b->native = NULL;
+            if (++b->runs >= BLOCK6502_NATIVE_HOT) {
+                b->runs = 0;
+                b->native = compile(b);
+                b->native_gen = native_gen;
+            }
+        }
+        if (b->native) {
+            c->cpu.flags |= FAKE6502_CONSTANT_FLAG;
+            int cycles = b->native(c, max_cycles);
+            if (cycles == BAIL) {
+                c->emu.clockticks = 0;
+                fake6502_step(c);
+                return c->emu.clockticks;
+            }
+            return cycles;
+        }
+    }
+#endif
+
+    int elapsed_cycles = 0;
+    uint32_t epoch = cpu_code_epoch;
+    const block6502_op* o = b->ops;
+    const block6502_op* end = o + b->count;
+    c->cpu.flags |= FAKE6502_CONSTANT_FLAG;
+    for (;;) {
+        cpu_instructions++;
+        trace_6502(c, cpu_cycles + elapsed_cycles);
+        int cycles = o->run(c, o);
+        if (cycles == BAIL) {
+
+            /* A device access runs on its own, first in a block. */
+
+            if (elapsed_cycles == 0) {
+                c->emu.clockticks = 0;
+                fake6502_step(c);
+                return c->emu.clockticks;
+            }
+            cpu_instructions--;
+            trace_head--;
+            break;
+        }
+        elapsed_cycles += cycles;
+        if (++o == end || elapsed_cycles >= max_cycles)
+            break;
+
+        /* Stop where the recorded path is left (a branch was taken) or
+         * where the block overwrote its own code.
+         */
+
+        if (c->cpu.pc != o->pc || (cpu_code_epoch != epoch && blockModified(b)))
+            break;
+    }
+    return elapsed_cycles;
+
+#else
+
+    return step(c);
+
+#endif
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+/* Translated basic blocks for the 6502 core.
+ *
+ * fake6502_step() fetches the opcode and makes two indirect calls through
+ * fake6502_opcodes[] for every instruction. block6502_step() counts how often
+ * each PC starts a step and, once an address is hot, translates the straight
+ * line code there into a block: one handler call per instruction, specialized
+ * for the common opcode and addressing mode pairs, with the operand, the next
+ * PC and branch targets decoded in advance. The flags are computed exactly as
+ * in fake6502.c. Everything else runs through the fake6502_opcodes[] entry.
+ *
+ * A block runs on through untaken branches and ends after a jump, call,
+ * return, BRK, CLI or PLP, when the cycle budget is used up, or where the
+ * taken path leaves the recorded one. Writes to a page holding translated code
+ * invalidate its blocks through cpu_page_trap and cpu_code_gen (cerberus.h).
+ *
+ * Device pages (bus.h) are only accessed by an instruction that runs first in
+ * its block, so the device sees cpu_cycles current. Blocks are not translated
+ * while page 0 or 1 is mapped.
+ *
+ * On Linux x86-64 (native.h) a block that has run BLOCK6502_NATIVE_HOT times
+ * is compiled once more, to host code with A, X and Y in host registers and
+ * the flags left lazy as fake6502.h keeps them. It reads and writes cerb_ram
+ * directly, checks bus_page_mapped before an access outside pages 0 and 1 and
+ * cpu_page_trap after a write, and loops on a branch back to its start. What
+ * it does not compile calls the threaded handler. The threaded code runs the
+ * block instead while the trace trap is in it or native_enabled is clear.
+ *
+ * The cache takes BLOCK6502_CACHE_SIZE blocks of about 550 bytes each, so it
+ * is only enabled on SDL. Without it block6502_step() is fake6502_step().
+ */
+
+#include "fake6502.h"
+#include "native.h"
+
+#ifdef PLATFORM_SDL
+#define BLOCK6502_CACHE
+#endif
+
+#if defined(BLOCK6502_CACHE) && defined(NATIVE_X86_64) && defined(LAZYFLAGS)
+#define BLOCK6502_NATIVE
+#endif
+
+#define BLOCK6502_CACHE_SIZE 1024 /* direct mapped, power of two */
+#define BLOCK6502_LENGTH 32 /* maximum instructions per block */
+#define BLOCK6502_HOT 8 /* steps at an address before it is translated */
+#define BLOCK6502_NATIVE_HOT 32 /* runs of a block before it is compiled */
+
+/* Run the block at the PC, or a single instruction while the address is
+ * still cold, and return the number of cycles elapsed. Stops early once
+ * max_cycles have elapsed. Feeds the instruction trace.
+ */
+int block6502_step(fake6502_context* c, int max_cycles);
+/* Bytes in the instruction with this opcode, operands included. */
+int block6502_length(uint8_t opcode);
@@ -0,0 +1,620 @@
+#include "breakpoints.h"
+#include "Z80.h"
+#include "block6502.h"
+#include "cerberus.h"
+#include "fake6502.h"
+#include "trace.h"
+#include "watch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern Z80 z80;
+extern fake6502_context m6502;
+
+#define BP_MAX_CONDS 4
+#define BP_HITS -1 /* condition on the hit count rather than a register */
+
+enum {
+    EQ,
+    NE,
+    LT,
+    LE,
+    GT,
+    GE,
+};
+
+struct condition {
+    char reg[5]; /* looked up when tested, the CPU may have changed */
+    int op;
+    unsigned int value;
+};
+
+static struct breakpoint {
+    bool used;
+    int owner;
+    int type;
+    uint16_t addr;
+    int len;
+    condition conds[BP_MAX_CONDS];
+    int cond_count;
+    unsigned int hits;
+    int accessed; /* byte accessed by the current instruction, -1: none */
+    int access_type;
+} bps[BP_MAX];
+
+volatile bool bp_armed;
+volatile bool bp_stopped;
+uint16_t bp_pages[256];
+struct bp_stop_info bp_stop;
+
+#ifdef PLATFORM_SDL
+std::mutex bp_machine_mutex;
+#endif
+
+static uint8_t break_bits[65536 / 8]; /* addresses with a BP_EXEC breakpoint */
+static int watch_count;
+static bool stepping; /* stop after the next instruction */
+static bool resuming; /* run the next instruction even if it has a breakpoint */
+static bool accessed; /* a watchpoint has a byte in accessed */
+static bool poking; /* bp_poke() is writing */
+static int fetch_pc = -1; /* PC of the instruction being stepped, -1: none */
+static int fetch_length; /* its bytes, prefixes and operands included */
+static uint64_t fetched; /* bit n: the byte at fetch_pc + n was fetched */
+
+// registers
+
+static const char* const z80_names[] = { "af", "bc", "de", "hl", "sp", "pc", "ix", "iy", "af'", "bc'", "de'", "hl'", "ir" };
+static const char* const m6502_names[] = { "a", "x", "y", "p", "s", "pc" };
+
+/* 8-bit Z80 registers for conditions, after the word registers */
+static const char* const z80_bytes[] = { "a", "f", "b", "c", "d", "e", "h", "l", "i", "r" };
+#define Z80_BYTES 100
+
+static const int z80_words[] = { Z80_AF, Z80_BC, Z80_DE, Z80_HL, Z80_SP };
+static const int z80_index[] = { Z80_IX, Z80_IY };
+
+int bp_reg_count()
+{
+    return mode ? 13 : 6;
+}
+
+const char* bp_reg_name(int n)
+{
+    return mode ? z80_names[n] : m6502_names[n];
+}
+
+int bp_reg_size(int n)
+{
+    return mode || n == BP_REG_PC ? 2 : 1;
+}
+
+unsigned int bp_reg_read(int n)
+{
+    if (mode) {
+        Z80_STATE s = z80.getState();
+        if (n >= Z80_BYTES) {
+            // a f b c d e h l are the halves of af bc de hl, then i r
+            n -= Z80_BYTES;
+            if (n < 8)
+                return (s.registers.word[z80_words[n >> 1]] >> (n & 1 ? 0 : 8)) & 0xff;
+            return (n == 8 ? s.i : s.r) & 0xff;
+        }
+        if (n < 5)
+            return s.registers.word[z80_words[n]];
+        if (n == 5)
+            return s.pc & 0xffff;
+        if (n < 8)
+            return s.registers.word[z80_index[n - 6]];
+        if (n < 12)
+            return s.alternates[z80_words[n - 8]];
+        return (s.i & 0xff) << 8 | (s.r & 0xff);
+    }
+    switch (n) {
+    case 0:
+        return m6502.cpu.a;
+    case 1:
+        return m6502.cpu.x;
+    case 2:
+        return m6502.cpu.y;
+    case 3:
+        return fake6502_get_flags(&m6502);
+    case 4:
+        return m6502.cpu.s;
+    default:
+        return m6502.cpu.pc;
+    }
+}
+
+void bp_reg_write(int n, unsigned int value)
+{
+    if (mode) {
+        Z80_STATE s = z80.getState();
+        if (n < 5)
+            s.registers.word[z80_words[n]] = value;
+        else if (n == 5)
+            s.pc = value & 0xffff;
+        else if (n < 8)
+            s.registers.word[z80_index[n - 6]] = value;
+        else if (n < 12)
+            s.alternates[z80_words[n - 8]] = value;
+        else {
+            s.i = (value >> 8) & 0xff;
+            s.r = value & 0xff;
+        }
+        z80.setState(s);
+        return;
+    }
+    switch (n) {
+    case 0:
+        m6502.cpu.a = value;
+        break;
+    case 1:
+        m6502.cpu.x = value;
+        break;
+    case 2:
+        m6502.cpu.y = value;
+        break;
+    case 3:
+        fake6502_set_flags(&m6502, value);
+        break;
+    case 4:
+        m6502.cpu.s = value;
+        break;
+    default:
+        m6502.cpu.pc = value;
+        break;
+    }
+}
+
+static uint16_t current_pc()
+{
+    return mode ? z80.getPC() : m6502.cpu.pc;
+}
+
+// conditions
+
+/* register by name for a condition on the Z80 or the 6502, -2 if there is
+ * none */
+static int reg_lookup(bool z80_mode, const char* name)
+{
+    if (strcmp(name, "hits") == 0)
+        return BP_HITS;
+    if (!z80_mode) {
+        for (int n = 0; n < 6; n++)
+            if (strcmp(name, m6502_names[n]) == 0)
+                return n;
+        return -2;
+    }
+    for (int n = 0; n < 13; n++)
+        if (strcmp(name, z80_names[n]) == 0)
+            return n;
+    for (int n = 0; n < (int)(sizeof z80_bytes / sizeof z80_bytes[0]); n++)
+        if (strcmp(name, z80_bytes[n]) == 0)
+            return Z80_BYTES + n;
+    return -2;
+}
+
+/* "REG OP VALUE" up to the next comma, advances p */
+static bool parse_condition(const char*& p, condition* c)
+{
+    size_t len = 0;
+    while (p[len] && strchr("abcdefhilnprstxy'", p[len]))
+        len++;
+    if (len >= sizeof c->reg)
+        return false;
+    memcpy(c->reg, p, len);
+    c->reg[len] = '\0';
+    p += len;
+    if (reg_lookup(true, c->reg) == -2 && reg_lookup(false, c->reg) == -2)
+        return false;
+
+    static const struct {
+        const char* text;
+        int op;
+    } ops[] = { { "==", EQ }, { "!=", NE }, { "<=", LE }, { ">=", GE }, { "<", LT }, { ">", GT }, { "=", EQ } };
+    size_t i;
+    for (i = 0; i < sizeof ops / sizeof ops[0]; i++)
+        if (strncmp(p, ops[i].text, strlen(ops[i].text)) == 0)
+            break;
+    if (i == sizeof ops / sizeof ops[0])
+        return false;
+    c->op = ops[i].op;
+    p += strlen(ops[i].text);
+
+    char* end;
+    c->value = strtoul(p, &end, 16);
+    if (end == p)
+        return false;
+    p = end;
+    return *p == ',' || *p == '\0';
+}
+
+static bool holds(const breakpoint* b)
+{
+    for (int i = 0; i < b->cond_count; i++) {
+        const condition* c = &b->conds[i];
+        int reg = reg_lookup(mode, c->reg);
+        if (reg == -2) // not a register of this CPU
+            return false;
+        unsigned int v = reg == BP_HITS ? b->hits : bp_reg_read(reg);
+        bool ok;
+        switch (c->op) {
+        case EQ:
+            ok = v == c->value;
+            break;
+        case NE:
+            ok = v != c->value;
+            break;
+        case LT:
+            ok = v < c->value;
+            break;
+        case LE:
+            ok = v <= c->value;
+            break;
+        case GT:
+            ok = v > c->value;
+            break;
+        default:
+            ok = v >= c->value;
+            break;
+        }
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+// watchpoints
+
+static void watch_write(void* ctx, int addr, int len)
+{
+    if (poking)
+        return;
+    for (int id = 0; id < BP_MAX; id++) {
+        breakpoint* b = &bps[id];
+        if (b->used && (b->type & BP_WRITE) && b->accessed < 0
+            && addr < b->addr + b->len && b->addr < addr + len) {
+            b->accessed = addr > b->addr ? addr : b->addr;
+            b->access_type = BP_WRITE;
+            accessed = true;
+        }
+    }
+}
+
+/* bytes in the Z80 instruction at pc */
+static int z80_length(uint16_t pc)
+{
+    int n = 0;
+    bool indexed = false;
+    uint8_t op;
+    // any number of DD and FD prefixes, the last one counts
+    while (((op = cpeek(pc + n)) == 0xdd || op == 0xfd) && n < 0xffff) {
+        indexed = true;
+        n++;
+    }
+    if (op == 0xed)
+        return n + ((cpeek(pc + n + 1) & 0xc7) == 0x43 ? 4 : 2); // ld (nn),rr and ld rr,(nn)
+    if (op == 0xcb)
+        return n + (indexed ? 3 : 2);
+
+    int length = 1;
+    if ((op & 0xc7) == 0x06 || (op & 0xc7) == 0xc6 || ((op & 0xc7) == 0x00 && op >= 0x10) || op == 0xd3 || op == 0xdb)
+        length = 2; // ld r,n, alu n, djnz and jr, out (n),a and in a,(n)
+    else if ((op & 0xcf) == 0x01 || (op & 0xe7) == 0x22 || (op & 0xc7) == 0xc2 || (op & 0xc7) == 0xc4 || op == 0xc3 || op == 0xcd)
+        length = 3; // ld rr,nn, the loads and stores to (nn), jp and call
+    // (hl) becomes (ix+d)
+    if (indexed
+        && (op == 0x34 || op == 0x35 || op == 0x36
+            || (op >= 0x40 && op < 0x80 && op != 0x76 && ((op & 7) == 6 || (op & 0x38) == 0x30))
+            || (op >= 0x80 && op < 0xc0 && (op & 7) == 6)))
+        length++;
+    return n + length;
+}
+
+static void watch_read(void* ctx, int addr)
+{
+    // the fetch reads each byte of the instruction once, not always in order:
+    // DD CB d op reads op before d. Bytes past 64 prefixes are always fetches.
+    if (fetch_pc >= 0) {
+        int offset = (addr - fetch_pc) & 0xffff;
+        if (offset < fetch_length) {
+            uint64_t bit = offset < 64 ? (uint64_t)1 << offset : 0;
+            if (!(fetched & bit)) {
+                fetched |= bit;
+                return;
+            }
+        }
+    }
+    fetch_pc = -1;
+    for (int id = 0; id < BP_MAX; id++) {
+        breakpoint* b = &bps[id];
+        if (b->used && (b->type & BP_READ) && b->accessed < 0
+            && addr >= b->addr && addr < b->addr + b->len) {
+            b->accessed = addr;
+            b->access_type = BP_READ;
+            accessed = true;
+        }
+    }
+}
+
+void bp_rearm()
+{
+    bool write[256] = {}, read[256] = {};
+    for (int id = 0; id < BP_MAX; id++) {
+        const breakpoint* b = &bps[id];
+        if (!b->used || b->type == BP_EXEC)
+            continue;
+        for (int page = b->addr >> 8; page <= (b->addr + b->len - 1) >> 8; page++) {
+            write[page] |= (b->type & BP_WRITE) != 0;
+            read[page] |= (b->type & BP_READ) != 0;
+        }
+    }
+    for (int page = 0; page < 256; page++) {
+        bool has_write = cpu_page_trap[page] & CPU_TRAP_WATCH, has_read = cpu_read_trap[page];
+        if (write[page] && !has_write)
+            watch_register(page, watch_write, NULL);
+        else if (!write[page] && has_write)
+            watch_unregister(page);
+        if (read[page] && !has_read)
+            watch_register_read(page, watch_read, NULL);
+        else if (!read[page] && has_read)
+            watch_unregister_read(page);
+    }
+}
+
+void bp_poke(uint16_t addr, uint8_t value)
+{
+    poking = true;
+    cpoke(addr, value);
+    poking = false;
+}
+
+// the table
+
+static void update_armed()
+{
+    int count = 0;
+    watch_count = 0;
+    for (int id = 0; id < BP_MAX; id++)
+        if (bps[id].used) {
+            count++;
+            watch_count += bps[id].type != BP_EXEC;
+        }
+    bp_armed = count || stepping;
+}
+
+int bp_add(int owner, int type, uint16_t addr, int len, const char* cond)
+{
+    if (len < 1 || addr + len > 0x10000)
+        return -1;
+    int id;
+    for (id = 0; id < BP_MAX && bps[id].used; id++)
+        ;
+    if (id == BP_MAX)
+        return -1;
+
+    breakpoint* b = &bps[id];
+    b->cond_count = 0;
+    for (const char* p = cond; p;) {
+        if (b->cond_count == BP_MAX_CONDS || !parse_condition(p, &b->conds[b->cond_count]))
+            return -1;
+        b->cond_count++;
+        if (*p != ',')
+            break;
+        p++;
+    }
+    b->owner = owner;
+    b->type = type;
+    b->addr = addr;
+    b->len = type == BP_EXEC ? 1 : len;
+    b->hits = 0;
+    b->accessed = -1;
+    b->used = true;
+
+    if (type == BP_EXEC) {
+        break_bits[addr >> 3] |= 1 << (addr & 7);
+        bp_pages[addr >> 8]++;
+    } else {
+        bp_rearm();
+    }
+    update_armed();
+    return id;
+}
+
+static void remove_id(int id)
+{
+    breakpoint* b = &bps[id];
+    b->used = false;
+    if (b->type == BP_EXEC) {
+        bp_pages[b->addr >> 8]--;
+        bool other = false;
+        for (int i = 0; i < BP_MAX; i++)
+            other |= bps[i].used && bps[i].type == BP_EXEC && bps[i].addr == b->addr;
+        if (!other)
+            break_bits[b->addr >> 3] &= ~(1 << (b->addr & 7));
+    }
+}
+
+bool bp_remove(int owner, int type, uint16_t addr, int len)
+{
+    for (int id = 0; id < BP_MAX; id++) {
+        const breakpoint* b = &bps[id];
+        if (b->used && b->owner == owner && b->type == type && b->addr == addr && (type == BP_EXEC || b->len == len)) {
+            remove_id(id);
+            bp_rearm();
+            update_armed();
+            return true;
+        }
+    }
+    return false;
+}
+
+void bp_clear(int owner)
+{
+    for (int id = 0; id < BP_MAX; id++)
+        if (bps[id].used && bps[id].owner == owner)
+            remove_id(id);
+    bp_rearm();
+    update_armed();
+}
+
+bool bp_parse(int owner, int type, const char* spec)
+{
+    char* end;
+    unsigned long addr = strtoul(spec, &end, 16), last = addr;
+    if (end == spec || addr > 0xffff)
+        return false;
+    if (*end == '-') {
+        const char* p = end + 1;
+        last = strtoul(p, &end, 16);
+        if (end == p || last < addr || last > 0xffff)
+            return false;
+    }
+    if (*end != '\0' && *end != ',')
+        return false;
+    return bp_add(owner, type, addr, last - addr + 1, *end ? end + 1 : NULL) >= 0;
+}
+
+// running
+
+static void stop(int reason, int addr, int id)
+{
+    bp_stop.reason = reason;
+    bp_stop.addr = addr;
+    bp_stop.id = id;
+    bp_stop.owner = id >= 0 ? bps[id].owner : -1;
+    bp_stopped = true;
+    stepping = false;
+    update_armed();
+}
+
+/* a breakpoint at the PC whose conditions hold, -1 if none */
+static int exec_hit(uint16_t pc)
+{
+    int hit = -1;
+    for (int id = 0; id < BP_MAX; id++) {
+        breakpoint* b = &bps[id];
+        if (b->used && b->type == BP_EXEC && b->addr == pc) {
+            b->hits++;
+            if (hit < 0 && holds(b))
+                hit = id;
+        }
+    }
+    return hit;
+}
+
+/* a watchpoint accessed since the last call whose conditions hold */
+static bool watch_hit()
+{
+    bool hit = false;
+    accessed = false;
+    for (int id = 0; id < BP_MAX; id++) {
+        breakpoint* b = &bps[id];
+        if (b->used && b->accessed >= 0) {
+            b->hits++;
+            if (!hit && holds(b)) {
+                stop(b->type == BP_ACCESS ? BP_ACCESS : b->access_type, b->accessed, id);
+                hit = true;
+            }
+            b->accessed = -1;
+        }
+    }
+    return hit;
+}
+
+int bp_step(int max_cycles)
+{
+    uint16_t pc = current_pc();
+    int page = pc >> 8;
+
+    if (!stepping && !watch_count && !bp_pages[page] && !bp_pages[(page + 1) & 0xff]) {
+        resuming = false;
+        return mode ? z80.stepBlock(max_cycles) : block6502_step(&m6502, max_cycles);
+    }
+
+    // accesses by CAT or an interrupt since the last instruction
+    if (accessed && watch_hit())
+        return 0;
+    if (!resuming && (break_bits[pc >> 3] & (1 << (pc & 7)))) {
+        int id = exec_hit(pc);
+        if (id >= 0) {
+            stop(BP_EXEC, pc, id);
+            return 0;
+        }
+    }
+    resuming = false;
+
+    int cycles;
+    fetch_pc = pc;
+    fetch_length = mode ? z80_length(pc) : block6502_length(cpeek(pc));
+    fetched = 0;
+    cpu_instructions++;
+    if (mode) {
+        trace_z80(z80, cpu_cycles);
+        cycles = z80.step();
+    } else {
+        trace_6502(&m6502, cpu_cycles);
+        m6502.emu.clockticks = 0;
+        fake6502_step(&m6502);
+        cycles = m6502.emu.clockticks;
+    }
+    fetch_pc = -1;
+
+    if (accessed && watch_hit())
+        return cycles;
+    if (stepping)
+        stop(BP_STOP_STEP, -1, -1);
+    return cycles;
+}
+
+void bp_resume(bool step)
+{
+    stepping = step;
+    resuming = true;
+    for (int id = 0; id < BP_MAX; id++)
+        bps[id].accessed = -1;
+    accessed = false;
+    update_armed();
+    bp_stopped = false;
+}
+
+void bp_reset()
+{
+    bp_resume(false);
+    resuming = false;
+}
+
+void bp_interrupt()
+{
+    if (!bp_stopped)
+        stop(BP_STOP_INTERRUPT, -1, -1);
+}
+
+// overlay
+
+void bp_format_state(char* out, size_t size)
+{
+    static const char* const kinds[] = { "BREAK", "WATCH W", "WATCH R", "WATCH RW", "STEP", "STOPPED" };
+    size_t n = 0;
+#define APPEND(...) n += snprintf(out + n, n < size ? size - n : 0, __VA_ARGS__)
+
+    uint16_t pc = current_pc();
+    APPEND("%s", kinds[bp_stop.reason]);
+    if (bp_stop.addr >= 0)
+        APPEND(" %04X", bp_stop.addr);
+    if (bp_stop.id >= 0)
+        APPEND(" #%d", bp_stop.id);
+    APPEND("  %04X:", pc);
+    for (int i = 0; i < 4; i++)
+        APPEND(" %02X", cpeek(pc + i));
+    APPEND("\n");
+
+    // four registers to a line, names padded to three characters
+    for (int r = 0; r < bp_reg_count(); r++) {
+        const char* name = bp_reg_name(r);
+        APPEND(bp_reg_size(r) == 2 ? "%-3s%04X" : "%-2s%02X", name, bp_reg_read(r));
+        APPEND(r % 4 == 3 || r == bp_reg_count() - 1 ? "\n" : " ");
+    }
+#undef APPEND
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+/* Breakpoints and watchpoints for both cores.
+ *
+ * A breakpoint stops the CPU before the instruction at its address runs, a
+ * watchpoint after the instruction that read or wrote its range. Either can
+ * have conditions, all of which must hold: a register compared with a value,
+ * or hits, the number of times the address was reached or the range accessed,
+ * this time included. bp_parse() reads them as in
+ *
+ *   0209            break at $0209
+ *   0209,a==3f      ... when A is $3F
+ *   8000-80ff,hits>=10,hl!=8000
+ *
+ * with all numbers in hex. The registers are those of bp_reg_name(), plus
+ * the 8-bit halves a f b c d e h l i r on the Z80.
+ *
+ * cpu_clockcycles() tests bp_armed once per block and otherwise runs as
+ * before. While armed it runs through bp_step(), which still runs whole
+ * blocks unless the block could reach a breakpoint: bp_pages counts the
+ * breakpoints in each page, and a block starting in page P stays within P and
+ * P + 1 (Z80_BLOCK_LENGTH and BLOCK6502_LENGTH instructions of at most four
+ * bytes). While single-stepping or with watchpoints set every instruction is
+ * stepped, so the stop is exact.
+ *
+ * Watchpoints are watch.h handlers: writes are seen from any path, CAT's BIOS
+ * calls included, reads only from the cores (watch_register_read()). The bytes
+ * an instruction fetches are not counted as reads. A page can have one handler
+ * of each kind at a time.
+ *
+ * While bp_stopped, cpu_clockcycles() returns at once and no NMI is
+ * delivered, so the machine is frozen; CAT keeps reading the keyboard.
+ * Breakpoints belong to an owner, the command line or the GDB stub
+ * (gdbstub.h), so one can clear its own without touching the other's.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef PLATFORM_SDL
+#include <mutex>
+#endif
+
+/* breakpoint types, the watchpoint ones are bits */
+#define BP_EXEC 0
+#define BP_WRITE 1
+#define BP_READ 2
+#define BP_ACCESS (BP_READ | BP_WRITE)
+
+/* why the CPU stopped, besides the breakpoint types */
+#define BP_STOP_STEP 4 /* after bp_resume(true) */
+#define BP_STOP_INTERRUPT 5 /* bp_interrupt() */
+
+/* owners */
+#define BP_USER 0
+#define BP_GDB 1
+
+#define BP_MAX 32
+
+struct bp_stop_info {
+    int reason; /* BP_EXEC, BP_WRITE, BP_READ, BP_ACCESS or BP_STOP_* */
+    int addr; /* breakpoint address or the byte accessed, -1 if neither */
+    int id; /* the breakpoint that stopped the CPU, -1 if none */
+    int owner; /* its owner */
+};
+
+extern volatile bool bp_armed; /* any breakpoint set or a step pending, run through bp_step() */
+extern volatile bool bp_stopped; /* the CPU is stopped */
+extern uint16_t bp_pages[256]; /* breakpoints set in each page */
+extern struct bp_stop_info bp_stop;
+
+/* Add a breakpoint of type for addr..addr + len - 1 with conditions cond (see
+ * above, NULL for none). Returns the id, or -1 when the table is full or cond
+ * does not parse. */
+int bp_add(int owner, int type, uint16_t addr, int len, const char* cond);
+/* Remove owner's breakpoint of type at exactly addr, len. */
+bool bp_remove(int owner, int type, uint16_t addr, int len);
+void bp_clear(int owner);
+/* Add a breakpoint from "ADDR[-END][,COND]...", false if it does not parse. */
+bool bp_parse(int owner, int type, const char* spec);
+/* Register the watchpoints' handlers again, after watch_reset(). */
+void bp_rearm();
+/* cpoke() for a debugger, does not trigger watchpoints. */
+void bp_poke(uint16_t addr, uint8_t value);
+
+/* Run the current CPU like z80.stepBlock() or block6502_step(), checking
+ * breakpoints, watchpoints and single-step, and return the cycles elapsed.
+ * Sets bp_stopped, possibly after running an instruction.
+ */
+int bp_step(int max_cycles);
+/* Continue, or run one instruction and stop again. */
+void bp_resume(bool step);
+/* Stop the CPU before its next instruction. */
+void bp_interrupt();
+/* Forget the stop and any step pending, a reset CPU runs. */
+void bp_reset();
+
+/* The current CPU's registers in GDB's order: af bc de hl sp pc ix iy af' bc'
+ * de' hl' ir on the Z80, a x y p s pc on the 6502. */
+int bp_reg_count();
+const char* bp_reg_name(int n);
+int bp_reg_size(int n); /* in bytes */
+unsigned int bp_reg_read(int n);
+void bp_reg_write(int n, unsigned int value);
+#define BP_REG_PC 5
+
+/* Describe the stop and the registers in lines of at most 40 characters,
+ * separated by '\n', for an overlay. */
+void bp_format_state(char* out, size_t size);
+
+#ifdef PLATFORM_SDL
+/* Held by the emulation thread while it runs a frame, and by anything else
+ * touching the machine while it could be running. */
+extern std::mutex bp_machine_mutex;
+#endif
@@ -0,0 +1,92 @@
+#include "bus.h"
+#include <string.h>
+
+struct bus_handler bus_ports[256];
+struct bus_handler bus_pages[256];
+uint8_t bus_page_mapped[256];
+uint8_t* bus_read_map[256];
+uint8_t* bus_write_map[256];
+int bus_wait_cycles = 0;
+uint8_t bus_irq = 0;
+uint64_t bus_next_event = UINT64_MAX;
+
+void bus_reset(void)
+{
+    memset(bus_ports, 0, sizeof bus_ports);
+    memset(bus_pages, 0, sizeof bus_pages);
+    memset(bus_page_mapped, 0, sizeof bus_page_mapped);
+    bus_wait_cycles = 0;
+    bus_irq = 0;
+    bus_next_event = UINT64_MAX;
+    for (int page = 0; page < 256; page++)
+        bus_update_page(page);
+}
+
+void bus_update_page(int page)
+{
+    uint8_t* ram = &cerb_ram[page << 8];
+    bus_read_map[page] = bus_page_mapped[page] || cpu_read_trap[page] ? NULL : ram;
+    bus_write_map[page] = bus_page_mapped[page] || cpu_page_trap[page] ? NULL : ram;
+}
+
+void bus_register_port(int port, bus_read_handler read, bus_write_handler write, void* ctx)
+{
+    struct bus_handler* p = &bus_ports[port & 0xff];
+    p->read = read;
+    p->write = write;
+    p->ctx = ctx;
+}
+
+void bus_register_page(int page, bus_read_handler read, bus_write_handler write, void* ctx)
+{
+    struct bus_handler* p = &bus_pages[page & 0xff];
+    p->read = read;
+    p->write = write;
+    p->ctx = ctx;
+    bus_page_mapped[page & 0xff] = 1;
+    bus_update_page(page & 0xff);
+}
+
+void bus_unregister_page(int page)
+{
+    memset(&bus_pages[page & 0xff], 0, sizeof(struct bus_handler));
+    bus_page_mapped[page & 0xff] = 0;
+    bus_update_page(page & 0xff);
+}
+
+static int port_window_read(void* ctx, int addr)
+{
+    return bus_in(addr & 0xff);
+}
+
+static void port_window_write(void* ctx, int addr, int value)
+{
+    bus_out(addr & 0xff, value);
+}
+
+void bus_map_port_window(int page)
+{
+    bus_register_page(page, port_window_read, port_window_write, NULL);
+}
+
+uint8_t bus_page_read(uint16_t addr)
+{
+    struct bus_handler* p = &bus_pages[addr >> 8];
+    if (p->read)
+        return p->read(p->ctx, addr);
+    if (cpu_read_trap[addr >> 8])
+        cpu_page_read(addr);
+    return cpeek(addr);
+}
+
+void bus_page_write(uint16_t addr, uint8_t value)
+{
+    struct bus_handler* p = &bus_pages[addr >> 8];
+    if (p->write) {
+        p->write(p->ctx, addr, value);
+    } else {
+        cpoke(addr, value);
+        // the write cleared the page's one-shot traps, back to the fast path
+        bus_update_page(addr >> 8);
+    }
+}
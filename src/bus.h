@@ -0,0 +1,148 @@
+#pragma once
+
+/* Device bus.
+ *
+ * Emulated devices hang off two dispatch tables:
+ *
+ *   bus_ports[256]  Z80 IN/OUT, indexed by the low byte of the port address.
+ *   bus_pages[256]  memory mapped I/O for both cores, indexed by addr >> 8.
+ *
+ * The cores read and write memory through bus_peek()/bus_poke(), which look
+ * the page up in bus_read_map[]/bus_write_map[]. A plain RAM page maps to its
+ * bytes in cerb_ram and the access is a pointer load, a predicted branch and
+ * the RAM access. A NULL entry sends the access to bus_page_read() or
+ * bus_page_write(). Reads take that path on device pages and pages with a read
+ * trap set in cpu_read_trap, writes on device pages and pages with a write
+ * trap set in cpu_page_trap, which the write runs through cpoke() (see
+ * watch.h). bus_update_page() works the entries out again whenever one of
+ * those changes.
+ * CAT firmware code keeps using cpeek()/cpoke() and always sees RAM.
+ *
+ * The 6502 has no I/O space, so in 6502 mode page BUS_IO_PAGE is a window onto
+ * the port table: $FE00+n reads and writes port n. This page sits between the
+ * end of video RAM ($FCAF) and the vectors and is left as RAM in Z80 mode.
+ *
+ * Port map:
+ *
+ *   $00-$0F  debug ports (io.h)
+ *   $20-$2D  timer and cycle counter (timer.h)
+ *   $30      random number source (rng.h)
+ *   $40-$51  math coprocessor (mathcop.h)
+ *
+ * A device that takes time to respond adds the cycles to bus_wait_cycles. They
+ * are charged to the instruction that made the access.
+ *
+ * Devices that act on their own schedule lower bus_next_event to the cycle
+ * they next need attention; cpu_clockcycles compares it against cpu_cycles
+ * once per instruction. The IRQ line is level triggered and shared: each device
+ * holding it sets its bit in bus_irq until the guest acknowledges it.
+ *
+ * This is also where an emulated expansion slot (the XBUSREQ/XIRQ lines in
+ * cat_loop) would be attached.
+ */
+
+#include "cerberus.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUS_IO_PAGE 0xfe
+
+/* bus_irq bits */
+#define BUS_IRQ_TIMER 0x01
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* addr is the full 16-bit port or memory address */
+typedef int (*bus_read_handler)(void* ctx, int addr);
+typedef void (*bus_write_handler)(void* ctx, int addr, int value);
+
+struct bus_handler {
+    bus_read_handler read; /* NULL: ports read 0, pages read RAM */
+    bus_write_handler write; /* NULL: ports ignore, pages write RAM */
+    void* ctx;
+};
+
+extern struct bus_handler bus_ports[256];
+extern struct bus_handler bus_pages[256];
+extern uint8_t bus_page_mapped[256];
+extern uint8_t* bus_read_map[256]; /* page's RAM, NULL: bus_page_read() */
+extern uint8_t* bus_write_map[256]; /* page's RAM, NULL: bus_page_write() */
+extern int bus_wait_cycles;
+extern uint8_t bus_irq;
+extern uint64_t bus_next_event;
+
+void bus_reset(void);
+void bus_register_port(int port, bus_read_handler read, bus_write_handler write, void* ctx);
+void bus_register_page(int page, bus_read_handler read, bus_write_handler write, void* ctx);
+void bus_unregister_page(int page);
+/* map page onto the port table, see BUS_IO_PAGE */
+void bus_map_port_window(int page);
+/* recompute the bus_read_map and bus_write_map entries for page */
+void bus_update_page(int page);
+
+/* page now holds cached decoded code, see CPU_TRAP_CODE */
+static inline void bus_code_page(int page)
+{
+    cpu_page_trap[page] |= CPU_TRAP_CODE;
+    bus_write_map[page] = NULL;
+}
+
+static inline int bus_in(int port)
+{
+    struct bus_handler* p = &bus_ports[port & 0xff];
+    return p->read ? p->read(p->ctx, port) : 0;
+}
+
+static inline void bus_out(int port, int value)
+{
+    struct bus_handler* p = &bus_ports[port & 0xff];
+    if (p->write)
+        p->write(p->ctx, port, value);
+}
+
+uint8_t bus_page_read(uint16_t addr);
+void bus_page_write(uint16_t addr, uint8_t value);
+
+/* non-zero if a device is mapped anywhere in addr..addr + len - 1, wrapping */
+static inline int bus_range_mapped(uint16_t addr, int len)
+{
+    int pages = ((addr & 0xff) + len + 0xff) >> 8;
+    for (int page = addr >> 8; pages > 0; pages--, page = (page + 1) & 0xff)
+        if (bus_page_mapped[page])
+            return 1;
+    return 0;
+}
+
+static inline uint8_t bus_peek(uint16_t addr)
+{
+    uint8_t* ram = bus_read_map[addr >> 8];
+    if (__builtin_expect(ram != NULL, 1))
+        return ram[addr & 0xff];
+    return bus_page_read(addr);
+}
+
+static inline void bus_poke(uint16_t addr, uint8_t value)
+{
+    uint8_t* ram = bus_write_map[addr >> 8];
+    if (__builtin_expect(ram != NULL, 1))
+        ram[addr & 0xff] = value;
+    else
+        bus_page_write(addr, value);
+}
+
+static inline unsigned int bus_peekW(unsigned int addr)
+{
+    return bus_peek(addr) | (bus_peek(addr + 1) << 8);
+}
+
+static inline void bus_pokeW(unsigned int addr, unsigned int data)
+{
+    bus_poke(addr, data & 0xff);
+    bus_poke(addr + 1, (data >> 8) & 0xff);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,142 @@
+#include "capture.h"
+#include "cerberus.h"
+#include "screen.h"
+
+#ifdef PLATFORM_SDL
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+
+/* What a frame is made of: the glyphs, then the tile map right after them. */
+#define CAPTURE_GLYPH_BYTES (256 * 8)
+#define CAPTURE_TILE_BYTES (SCREEN_COLS * SCREEN_ROWS)
+#define CAPTURE_BYTES (CAPTURE_GLYPH_BYTES + CAPTURE_TILE_BYTES)
+static_assert(SCREEN_GLYPHS + CAPTURE_GLYPH_BYTES == SCREEN_TILES, "glyphs and tiles must be adjacent");
+
+#define CAPTURE_SLOTS 64 /* frames, must be a power of two */
+
+struct capture_slot {
+    uint32_t frame;
+    uint8_t ram[CAPTURE_BYTES];
+};
+
+/* Single producer (the emulation thread), single consumer (the encoder) ring,
+ * as the io.cpp streams. head and tail count slots and wrap. */
+static capture_slot slots[CAPTURE_SLOTS];
+static std::atomic<uint32_t> head { 0 };
+static std::atomic<uint32_t> tail { 0 };
+static std::atomic<uint32_t> dropped { 0 };
+static uint32_t frame;
+static bool drop_when_full;
+
+static FILE* capture_file;
+static uint8_t prev[CAPTURE_BYTES]; /* the last frame written */
+static std::thread encoder;
+static std::atomic<bool> encoder_running { false };
+
+static void encode(const capture_slot* s)
+{
+    static uint8_t out[sizeof(capture_frame_header) + 256 * 9 + CAPTURE_TILE_BYTES * 3];
+    capture_frame_header h;
+    h.frame = s->frame;
+    h.glyphs = 0;
+    h.tiles = 0;
+    uint8_t* p = out + sizeof h;
+    for (int glyph = 0; glyph < 256; glyph++) {
+        const uint8_t* g = &s->ram[glyph * 8];
+        if (memcmp(g, &prev[glyph * 8], 8) != 0) {
+            *p++ = glyph;
+            memcpy(p, g, 8);
+            p += 8;
+            h.glyphs++;
+        }
+    }
+    const uint8_t* tiles = &s->ram[CAPTURE_GLYPH_BYTES];
+    const uint8_t* prev_tiles = &prev[CAPTURE_GLYPH_BYTES];
+    for (int i = 0; i < CAPTURE_TILE_BYTES; i++)
+        if (tiles[i] != prev_tiles[i]) {
+            *p++ = i & 0xff;
+            *p++ = i >> 8;
+            *p++ = tiles[i];
+            h.tiles++;
+        }
+    memcpy(out, &h, sizeof h);
+    fwrite(out, 1, p - out, capture_file);
+    memcpy(prev, s->ram, CAPTURE_BYTES);
+}
+
+static void drain()
+{
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    uint32_t h = head.load(std::memory_order_acquire);
+    for (; t != h; t++) {
+        encode(&slots[t & (CAPTURE_SLOTS - 1)]);
+        tail.store(t + 1, std::memory_order_release);
+    }
+}
+
+bool capture_start(const char* path, bool realtime)
+{
+    capture_file = fopen(path, "wb");
+    if (!capture_file)
+        return false;
+    capture_file_header h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, CAPTURE_MAGIC, sizeof h.magic);
+    h.version = CAPTURE_VERSION;
+    h.cols = SCREEN_COLS;
+    h.rows = SCREEN_ROWS;
+    h.fps = CAPTURE_FPS;
+    fwrite(&h, sizeof h, 1, capture_file);
+    // the first frame is stored against a blank screen
+    memset(prev, 0, sizeof prev);
+    frame = 0;
+    head = tail = dropped = 0;
+    drop_when_full = realtime;
+
+    encoder_running = true;
+    encoder = std::thread([] {
+        using namespace std::chrono_literals;
+        while (encoder_running) {
+            drain();
+            std::this_thread::sleep_for(10ms);
+        }
+    });
+    return true;
+}
+
+void capture_frame()
+{
+    if (!encoder_running)
+        return;
+    using namespace std::chrono_literals;
+    uint32_t h = head.load(std::memory_order_relaxed);
+    while (!drop_when_full && h - tail.load(std::memory_order_acquire) == CAPTURE_SLOTS)
+        std::this_thread::sleep_for(1ms);
+    if (h - tail.load(std::memory_order_acquire) == CAPTURE_SLOTS) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        capture_slot* s = &slots[h & (CAPTURE_SLOTS - 1)];
+        s->frame = frame;
+        memcpy(s->ram, &cerb_ram[SCREEN_GLYPHS], CAPTURE_BYTES);
+        head.store(h + 1, std::memory_order_release);
+    }
+    frame++;
+}
+
+void capture_stop()
+{
+    if (!encoder_running)
+        return;
+    encoder_running = false;
+    encoder.join();
+    drain();
+    fclose(capture_file);
+    capture_file = NULL;
+    if (uint32_t n = dropped.exchange(0))
+        fprintf(stderr, "[capture: %u frames dropped]\n", n);
+}
+
+#endif /* PLATFORM_SDL */
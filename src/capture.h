@@ -0,0 +1,48 @@
+#pragma once
+
+/* Lossless video capture.
+ *
+ * capture_frame() copies the glyphs and the tile map (screen.h) into a ring of
+ * snapshots once per emulated frame, which is one memcpy of about 3 KiB. A
+ * background thread takes them from the ring and writes each frame as the
+ * tiles and glyphs that changed since the frame before. In real time, when the
+ * ring is full the frame is dropped and counted, the emulation never waits for
+ * the disk. Otherwise (the headless frontend, which runs as fast as it can)
+ * capture_frame() waits for the encoder and no frame is lost.
+ * tools/capexport turns a capture into raw RGB24 or Y4M frames for an encoder.
+ *
+ * File layout: capture_file_header, then for every frame a capture_frame_header
+ * followed by its glyphs, each a glyph number and 8 bytes, and its tiles, each
+ * a little endian 16-bit index into the tile map and the tile number. Frames
+ * count from 0 at capture_start(); a dropped frame is missing from the file and
+ * shows the frame before it. Little endian.
+ */
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "OHDVIDEO"
+#define CAPTURE_VERSION 1
+#define CAPTURE_FPS 50
+
+struct capture_file_header {
+    char magic[8];
+    uint8_t version;
+    uint8_t cols; /* SCREEN_COLS */
+    uint8_t rows; /* SCREEN_ROWS */
+    uint8_t fps;
+};
+
+struct capture_frame_header {
+    uint32_t frame;
+    uint16_t glyphs; /* changed glyphs, 9 bytes each */
+    uint16_t tiles; /* changed tiles, 3 bytes each */
+};
+
+#ifdef PLATFORM_SDL
+/* Start writing to path. False if it could not be opened. */
+bool capture_start(const char* path, bool realtime);
+/* Called by the frontend's emulation thread after every frame. */
+void capture_frame();
+/* Write out what is queued and close the file. */
+void capture_stop();
+#endif
@@ -1,4 +1,6 @@
 #include "cerberus.h"
+#include "metrics.h"
+#include "trace.h"
 #include <chrono>
 #include <cstdarg>
 #include <cstring>
@@ -18,6 +20,7 @@ bool SD_exists(std::string& filename);
 FILE* SD_open(std::string& filename, const char* mode);
 
 void runCode();
+void catReset();
 
 /** Next is the string in CAT's internal memory containing the edit line, **/
 /** intialized in startup.                              **/
@@ -32,7 +35,7 @@ volatile bool cpurunning = false; /** true = CPU is running, CAT should not use
 volatile bool interruptFlag = false; /** true = Triggered by interrupt **/
 volatile bool fast = true; /** true = 8 MHz CPU clock, false = 4 MHz CPU clock **/
 volatile bool expflag = false;
-void (*resetFunc)(void) = 0; /** Software reset fuction at address 0 **/
+void (*resetFunc)(void) = catReset; /** Software reset function **/
 
 /** Compilation defaults **/
 #define config_dev_mode 0 // Turn off various BIOS outputs to speed up development, specifically uploading code
@@ -60,7 +63,7 @@ void (*resetFunc)(void) = 0; /** Software reset fuction at address 0 **/
 #define STATUS_POWER 10
 #define STATUS_EOF 11
 
-const uint8_t chardefs[] = {
+extern const uint8_t chardefs[] = { // also the SDL debugger overlay's font
     0x5a, 0x99, 0xe7, 0x5e, 0x5e, 0x24, 0x18, 0x66, 0xf0, 0xf0, 0xf0, 0xf0,
     0x00, 0x00, 0x00, 0x00, 0x0f, 0x0f, 0x0f, 0x0f, 0x00, 0x00, 0x00, 0x00,
     0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
@@ -331,14 +334,17 @@ boolean cpokeStr(unsigned int address, std::string text)
 
 boolean cpeekStr(unsigned int address, volatile char* dest, int max)
 {
-    unsigned int i;
+    /** Copies a zero terminated string from memory. A longer string than max - 1 **/
+    /** characters is cut short, still terminated, and false is returned **/
+    int i;
     byte c;
-    for (i = 0; i < max; i++) {
+    for (i = 0; i < max - 1; i++) {
         c = cpeek(address + i);
         dest[i] = c;
         if (c == 0)
             return true;
     }
+    dest[i] = 0;
     return false;
 }
 #define tone(a, b, c)
@@ -566,22 +572,21 @@ std::string getNextWord(bool fromTheBeginning)
 {
     /** A very simple parser that returns the next word in the edit line **/
     static byte initialPosition; /** Start parsing from this point in the edit line **/
-    byte i, j, k; /** General-purpose indices **/
+    byte i, j; /** General-purpose indices **/
     if (fromTheBeginning)
         initialPosition = 1; /** Starting from the beginning of the edit line **/
     i = initialPosition; /** Otherwise, continuing on from where we left off in previous call **/
-    while ((editLine[i] == 32) || (editLine[i] == 44))
+    while (i < sizeof editLine && ((editLine[i] == 32) || (editLine[i] == 44)))
         i++; /** Ignore leading spaces or commas **/
-    j = i + 1; /** Now start indexing the next word proper **/
-    /** Find the end of the word, marked either by a space, a comma or the cursor **/
-    while ((editLine[j] != 32) && (editLine[j] != 44) && (editLine[j] != 0))
+    j = i; /** Now start indexing the next word proper **/
+    /** Find the end of the word, marked either by a space, a comma, the cursor or the end of the edit line **/
+    while (j < sizeof editLine && (editLine[j] != 32) && (editLine[j] != 44) && (editLine[j] != 0))
         j++;
-    char nextWord[j - i + 1]; /** Create a buffer (the +1 is to make space for null-termination) **/
-    for (k = i; k < j; k++)
-        nextWord[k - i] = editLine[k]; /** Transfer the word to the buffer **/
-    nextWord[j - i] = 0; /** Null-termination **/
+    std::string nextWord;
+    for (byte k = i; k < j; k++)
+        nextWord += editLine[k]; /** Transfer the word **/
     initialPosition = j; /** Next time round, start from here, unless... **/
-    return (nextWord); /** Return the contents of the buffer **/
+    return nextWord;
 }
 
 void binMove(std::string startAddr, std::string endAddr, std::string destAddr)
@@ -600,7 +605,7 @@ void binMove(std::string startAddr, std::string endAddr, std::string destAddr)
                 cprintStatus(STATUS_MISSING_OPERAND); /** Missing the file's name **/
             else {
                 destination = strtol(destAddr.c_str(), NULL, 16); /** Convert hexadecimal address string to unsigned int **/
-                if (finish < start)
+                if ((finish < start) || (finish > 0xFFFF))
                     cprintStatus(STATUS_ADDRESS_ERROR); /** Invalid address range **/
                 else if ((destination <= finish) && (destination >= start))
                     cprintStatus(STATUS_ADDRESS_ERROR); /** Destination cannot be within original range **/
@@ -707,6 +712,16 @@ void SD_close(FILE* f)
     fclose(f);
 }
 
+/** True if filename has no directory part, so it stays on the uSD card. The CAT **/
+/** commands and the BIOS calls check names with this; the autoload file given on **/
+/** the command line may be anywhere. **/
+bool SD_validName(std::string& filename)
+{
+    if ((filename == ".") || (filename == ".."))
+        return false;
+    return filename.find_first_of("/\\") == std::string::npos;
+}
+
 bool SD_exists(std::string& filename)
 {
     FILE* f = SD_open(filename, "r");
@@ -732,7 +747,7 @@ int delFile(std::string filename)
 
 void catDelFile(std::string filename)
 {
-    cprintStatus(delFile(filename));
+    cprintStatus(SD_validName(filename) ? delFile(filename) : STATUS_NO_FILE);
 }
 
 int get_file_size(const char* filename)
@@ -805,7 +820,7 @@ int save(std::string filename, unsigned int startAddress, unsigned int endAddres
     unsigned int i; /** Memory address counter **/
     byte data; /** Data from memory **/
     FILE* dataFile; /** File to be created and written to **/
-    if (endAddress < startAddress) {
+    if ((endAddress < startAddress) || (endAddress > 0xFFFF)) {
         status = STATUS_ADDRESS_ERROR; /** Invalid address range **/
     } else {
         if (filename == "") {
@@ -844,7 +859,10 @@ void catSave(std::string filename, std::string startAddress, std::string endAddr
             status = STATUS_MISSING_OPERAND;
         } else {
             endAddr = strtol(endAddress.c_str(), NULL, 16);
-            status = save(filename, startAddr, endAddr);
+            if (!SD_validName(filename))
+                status = STATUS_CANNOT_OPEN;
+            else
+                status = save(filename, startAddr, endAddr);
         }
     }
     cprintStatus(status);
@@ -856,6 +874,7 @@ int load(std::string filename, unsigned int startAddr)
     FILE* dataFile; /** File for reading from on SD Card, if present **/
     uint16_t addr = startAddr; /** Address where to load the file into memory **/
     int status = STATUS_DEFAULT;
+    bytesRead = 0;
     if (filename == "") {
         status = STATUS_MISSING_OPERAND;
     } else {
@@ -869,15 +888,12 @@ int load(std::string filename, unsigned int startAddr)
         if (!dataFile) {
             status = STATUS_CANNOT_OPEN; /** Cannot open the file **/
         } else {
-            bytesRead = 0;
             int dataByte;
             while ((dataByte = fgetc(dataFile)) != EOF) {
                 bytesRead++;
                 cpoke(addr++, dataByte);
-                if (addr == 0) { /** Break if address wraps around to the start of memory **/
-                    fclose(dataFile);
+                if (addr == 0) /** Break if address wraps around to the start of memory **/
                     break;
-                }
             }
             fclose(dataFile);
             status = STATUS_READY;
@@ -896,12 +912,17 @@ void catLoad(std::string filename, std::string startAddress, bool silent)
     } else {
         startAddr = strtol(startAddress.c_str(), NULL, 16); /** Convert address string to hexadecimal number **/
     }
-    status = load(filename, startAddr);
+    if (!SD_validName(filename))
+        status = STATUS_CANNOT_OPEN;
+    else
+        status = load(filename, startAddr);
     if (!silent) {
         cprintStatus(status);
     }
 }
 
+static bool biosTraceDumped; /** An unknown BIOS call has been logged since runCode() **/
+
 void runCode()
 {
     byte runL = config_code_start & 0xFF;
@@ -914,6 +935,7 @@ void runCode()
     cpoke(config_outbox_flag, 0x00); /** Reset outbox mail flag	**/
     cpoke(config_outbox_data, 0x00); /** Reset outbox mail data	**/
     cpoke(config_inbox_flag, 0x00); /** Reset inbox mail flag	**/
+    biosTraceDumped = false;
     if (!mode) { /** We are in 6502 mode **/
         /** Non-maskable interrupt vector points to 0xFCB0, just after video area **/
         cpoke(0xFFFA, 0xB0);
@@ -1120,6 +1142,13 @@ void stopCode()
     clearEditLine(); /** Clear and display the edit line **/
 }
 
+void catReset()
+{
+    /** Stops the CPU and starts CAT over, which is all the hardware reset does to RAM and devices **/
+    cpurunning = false;
+    cat_setup();
+}
+
 // CPU Interrupt Routine (50hz)
 //
 void cpuInterrupt(void)
@@ -1136,14 +1165,26 @@ void cpuInterrupt(void)
     interruptFlag = true;
 }
 
+// Fetch the file name of a BIOS call into editLine
+//
+int cpeekFilename(unsigned int address)
+{
+    if (!cpeekStr(address, editLine, 38))
+        return STATUS_CANNOT_OPEN; // Longer than any name CAT can handle
+    std::string filename((char*)editLine);
+    return SD_validName(filename) ? STATUS_READY : STATUS_CANNOT_OPEN;
+}
+
 // Handle LOAD command from BASIC
 //
 int cmdLoad(unsigned int address)
 {
     int result;
     unsigned int startAddr = cpeekW(address);
-    cpeekStr(address + 4, editLine, 38);
-    result = load((char*)editLine, startAddr);
+    bytesRead = 0;
+    result = cpeekFilename(address + 4);
+    if (result == STATUS_READY)
+        result = load((char*)editLine, startAddr);
     cpokeW(address + 2, bytesRead);
 
     return result;
@@ -1155,7 +1196,11 @@ int cmdSave(unsigned int address)
 {
     unsigned int startAddr = cpeekW(address);
     unsigned int length = cpeekW(address + 2);
-    cpeekStr(address + 4, editLine, 38);
+    int result = cpeekFilename(address + 4);
+    if (result != STATUS_READY)
+        return result;
+    if (length == 0)
+        return STATUS_ADDRESS_ERROR; // The range would end before it starts
     return save((char*)editLine, startAddr, startAddr + length - 1);
 }
 
@@ -1164,6 +1209,8 @@ DIR* cd;
 //
 int cmdCatOpen(unsigned int address)
 {
+    if (cd) // A listing the program did not read to the end
+        closedir(cd);
     cd = opendir(SDCARD_MOUNT_PATH);
     return STATUS_READY;
 }
@@ -1179,6 +1226,7 @@ int cmdCatEntry(unsigned int address)
         entry = readdir(cd); // Open the next file
         if (!entry) { // If we've read past the last file in the directory
             closedir(cd);
+            cd = NULL;
             return STATUS_EOF; // And return end of file
         }
     } while (entry->d_type & DT_DIR);
@@ -1194,7 +1242,9 @@ int cmdCatEntry(unsigned int address)
 //
 int cmdDelFile(unsigned int address)
 {
-    cpeekStr(address, editLine, 38);
+    int result = cpeekFilename(address);
+    if (result != STATUS_READY)
+        return STATUS_NO_FILE;
     return delFile((char*)editLine);
 }
 
@@ -1213,6 +1263,7 @@ void messageHandler(void)
                                          //
         if (flag > 0 && flag < 0x80) {
             //debug_log("CAT bios call 0x%x\r\n", flag);
+            uint64_t started = metrics_enabled ? metrics_ns() : 0;
 
             address = cpeekW(config_inbox_data);
             switch (flag) {
@@ -1256,12 +1307,18 @@ void messageHandler(void)
                 break;
             case 0x7F:
                 resetFunc();
-                break;
+                return; // Nothing left to resume
             default:
-                debug_log("Unknown BIOS call 0x%x\r\n", flag);
+                if (!biosTraceDumped) { // Once per run, a program may keep calling
+                    debug_log("Unknown BIOS call 0x%x\r\n", flag);
+                    trace_dump(TRACE_REASON_BIOS);
+                    biosTraceDumped = true;
+                }
                 break;
             }
             cpoke(config_inbox_flag, retVal); // Flag we're done - values >= 0x80 are error codes
+            if (metrics_enabled)
+                metrics_bios(flag, metrics_ns() - started);
         }
         // digitalWrite(CPUGO, HIGH);   			// Restart the CPU
         cpurunning = true;
@@ -1279,6 +1336,7 @@ void cat_loop()
     if (ascii != 0) {
         if (cpurunning) {
             if (ascii == PS2_F12) { /** This happens if F1 has been pressed... and so on... **/
+                trace_dump(TRACE_REASON_STOP);
                 stopCode();
             }
             // else {
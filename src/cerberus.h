@@ -16,6 +16,7 @@ void debug_log(const char* format, ...) __attribute__((format(printf, 1, 2)));
 // main.cpp
 extern int readKey();
 extern void platform_delay(int ms);
+extern uint64_t platform_micros(); /** host wall clock in microseconds **/
 
 // CAT firmware state
 extern void cpuInterrupt(void);
@@ -27,7 +28,34 @@ extern volatile bool cpurunning; /** true = CPU is running, CAT should not use t
 
 // ram access
 extern uint8_t cerb_ram[65536];
-static inline void cpoke(uint16_t addr, uint8_t val) { cerb_ram[addr] = val; }
+extern uint8_t cpu_page_trap[256]; /** writes to the page go through cpu_page_written(), CPU_TRAP_* bits **/
+extern uint32_t cpu_code_gen[256]; /** bumped when a CPU_TRAP_CODE page is written **/
+extern uint32_t cpu_code_epoch; /** bumped with any cpu_code_gen **/
+#define CPU_TRAP_CODE 0x01 /* page holds cached decoded code */
+#define CPU_TRAP_CLEAN 0x02 /* page not written since the last watch_harvest() */
+#define CPU_TRAP_WATCH 0x04 /* page has a watch_register() handler */
+// write tracking for cerb_ram[addr, addr + len), which must stay within one page (watch.cpp)
+extern void cpu_page_written(unsigned int addr, int len);
+extern uint8_t cpu_read_trap[256]; /** core reads from the page go through cpu_page_read() **/
+extern void cpu_page_read(unsigned int addr);
+static inline void cpoke(uint16_t addr, uint8_t val)
+{
+    cerb_ram[addr] = val;
+    if (cpu_page_trap[addr >> 8])
+        cpu_page_written(addr, 1);
+}
+// tell the write tracking that cerb_ram[addr, addr + len) was written
+// directly, without cpoke(). The range must not wrap.
+static inline void cpoke_written(unsigned int addr, int len)
+{
+    unsigned int end = addr + len;
+    for (unsigned int page = addr >> 8; page <= (end - 1) >> 8; page++)
+        if (cpu_page_trap[page]) {
+            unsigned int from = page << 8 > addr ? page << 8 : addr;
+            unsigned int to = (page + 1) << 8 < end ? (page + 1) << 8 : end;
+            cpu_page_written(from, to - from);
+        }
+}
 static inline uint8_t cpeek(uint16_t address) { return cerb_ram[address]; }
 static inline unsigned int cpeekW(unsigned int address)
 {
@@ -45,3 +73,6 @@ extern void init_cpus();
 extern void cpu_z80_nmi();
 extern void cpu_6502_nmi();
 extern void cpu_clockcycles(int num_clocks);
+extern bool cpu_z80fast; /** run the Z80 as Z80Fast, documented flags only **/
+extern uint64_t cpu_cycles; /** emulated cycles executed since power on **/
+extern uint64_t cpu_instructions; /** instructions executed since power on **/
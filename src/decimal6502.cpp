@@ -0,0 +1,78 @@
+#include "fake6502.h"
+
+#ifdef DECIMALTABLES
+
+/* Each quarter of the table is a separate constant expression, which keeps
+ * it within the compiler's constexpr evaluation limit.
+ */
+
+static constexpr fake6502_decimal_table_t make_table(int sbc, int carry)
+{
+    fake6502_decimal_table_t t {};
+    for (int a = 0; a < 256; a++)
+        for (int b = 0; b < 256; b++)
+            t.r[a][b] = fake6502_decimal(sbc, a, b, carry);
+    return t;
+}
+
+constexpr fake6502_decimal_table_t fake6502_decimal_table[4] = {
+    make_table(0, 0),
+    make_table(0, 1),
+    make_table(1, 0),
+    make_table(1, 1),
+};
+
+static constexpr bool bcd(int x)
+{
+    return (x & 0x0f) < 10 && x < 0xa0;
+}
+
+static constexpr int bin(int x)
+{
+    return (x >> 4) * 10 + (x & 0x0f);
+}
+
+/* Exhaustive check over all values of A and the operand:
+ *  - Z and N always follow the result, SBC's C and V always match binary SBC.
+ *  - For valid BCD operands the result and carry are the decimal sum or
+ *    difference, and agree with the NMOS formula in fake6502.c's add8().
+ */
+
+static constexpr bool table_valid(int sbc, int carry)
+{
+    for (int a = 0; a < 256; a++)
+        for (int b = 0; b < 256; b++) {
+            int e = fake6502_decimal_table[sbc * 2 + carry].r[a][b];
+            int r = e & 0xff, flags = e >> 8;
+            if (!(flags & FAKE6502_ZERO_FLAG) != !!r || (flags & FAKE6502_SIGN_FLAG) != (r & 0x80))
+                return false;
+            if (sbc) {
+                int binary = a - b + carry - 1;
+                if (!(flags & FAKE6502_CARRY_FLAG) != (binary < 0)
+                    || !(flags & FAKE6502_OVERFLOW_FLAG) != !((a ^ b) & (a ^ binary) & 0x80))
+                    return false;
+            }
+            if (!bcd(a) || !bcd(b))
+                continue;
+
+            int d = sbc ? bin(a) - bin(b) + carry - 1 : bin(a) + bin(b) + carry;
+            bool c = sbc ? d >= 0 : d >= 100;
+            d = (d + 100) % 100;
+            if (r != (d / 10 << 4 | d % 10) || !(flags & FAKE6502_CARRY_FLAG) != !c)
+                return false;
+
+            uint16_t v = sbc ? (b ^ 0x00ff) - 0x0066 : b;
+            uint16_t n = a + v + carry;
+            n += ((((n + 0x66) ^ a ^ v) >> 3) & 0x22) * 3;
+            if ((n & 0xff) != r || !(n & 0xff00) != !c)
+                return false;
+        }
+    return true;
+}
+
+static_assert(table_valid(0, 0), "decimal ADC table does not match the checks");
+static_assert(table_valid(0, 1), "decimal ADC table does not match the checks");
+static_assert(table_valid(1, 0), "decimal SBC table does not match the checks");
+static_assert(table_valid(1, 1), "decimal SBC table does not match the checks");
+
+#endif
@@ -1,20 +1,61 @@
 #include "Z80.h"
+#include "block6502.h"
+#include "breakpoints.h"
+#include "bus.h"
 #include "cerberus.h"
 #include "fake6502.h"
+#include "io.h"
+#include "mathcop.h"
+#include "rng.h"
+#include "timer.h"
+#include "trace.h"
+#include "watch.h"
+#include <type_traits>
 
 Z80 z80;
+Z80Fast z80fast;
+bool cpu_z80fast = false;
 fake6502_context m6502;
+uint64_t cpu_cycles = 0;
+uint64_t cpu_instructions = 0;
+uint32_t cpu_code_gen[256];
+uint32_t cpu_code_epoch;
 
 void cpu_reset()
 {
     z80.reset();
+    z80fast.reset();
     fake6502_reset(&m6502);
+    trace_reset();
+    timer_reset();
+    bp_reset();
+    // drop all cached decoded code, RAM may have been loaded without cpoke
+    for (int page = 0; page < 256; page++) {
+        cpu_page_trap[page] &= ~CPU_TRAP_CODE;
+        cpu_code_gen[page]++;
+        bus_update_page(page);
+    }
+    cpu_code_epoch++;
+    // the 6502 reaches the ports through memory, the Z80 keeps that page as RAM
+    if (mode)
+        bus_unregister_page(BUS_IO_PAGE);
+    else
+        bus_map_port_window(BUS_IO_PAGE);
 }
 
 void init_cpus()
 {
-    // set z80 context to self, to use in m_readIO debug routine
+    // set z80 context to self
     z80.setCallbacks(&z80);
+    z80fast.setCallbacks(&z80fast);
+    // devices on the bus
+    watch_reset();
+    bp_rearm();
+    bus_reset();
+    io_init(&z80, &m6502);
+    rng_init();
+    math_init();
+    timer_init();
     cpu_reset();
 }
 
@@ -28,17 +69,92 @@ void cpu_6502_nmi()
     fake6502_nmi(&m6502);
 }
 
+// device events and the IRQ line, runs once cpu_cycles reaches bus_next_event.
+// Returns the cycles taken to accept an interrupt.
+template <class Core>
+static int service_bus(Core& core)
+{
+    bus_next_event = timer_tick(cpu_cycles);
+    if (!bus_irq)
+        return 0;
+    // level triggered: check again after every instruction until the device
+    // releases the line
+    bus_next_event = cpu_cycles;
+    if (mode)
+        return core.IRQ(0xff);
+    if (m6502.cpu.flags & FAKE6502_INTERRUPT_FLAG)
+        return 0;
+    fake6502_irq(&m6502);
+    return 7;
+}
+
+// Runs the Z80 as core, z80 or z80fast, and returns the clocks still to run.
+// Breakpoints are only checked on z80 (bp_step), so z80fast stops and leaves
+// the rest to it as soon as one is armed. The debug ports read the registers
+// of core while it runs, z80 always runs last.
+template <class Core>
+static int run_z80(Core& core, int num_clocks)
+{
+    io_set_z80(&core);
+    while (num_clocks > 0) {
+        if (cpu_cycles >= bus_next_event) {
+            int cycles = service_bus(core);
+            num_clocks -= cycles;
+            cpu_cycles += cycles;
+        }
+        // end the block in time for the next device event
+        int budget = num_clocks;
+        if (bus_next_event - cpu_cycles < (uint64_t)budget)
+            budget = bus_next_event - cpu_cycles;
+        int cycles;
+        if (__builtin_expect(bp_armed, 0)) {
+            if (!std::is_same<Core, Z80>::value)
+                break;
+            cycles = bp_step(budget);
+        } else
+            cycles = core.stepBlock(budget);
+        if (bus_wait_cycles) {
+            cycles += bus_wait_cycles;
+            bus_wait_cycles = 0;
+        }
+        num_clocks -= cycles;
+        cpu_cycles += cycles;
+        if (__builtin_expect(bp_stopped, 0))
+            return 0;
+    }
+    return num_clocks;
+}
+
 void cpu_clockcycles(int num_clocks)
 {
-    if (cpurunning) {
+    if (cpurunning && !bp_stopped) {
         if (mode) {
-            while (num_clocks > 0) {
-                num_clocks -= z80.step();
+            // z80 holds the registers between calls, z80fast borrows them
+            if (cpu_z80fast) {
+                z80fast.setState(z80.getState());
+                num_clocks = run_z80(z80fast, num_clocks);
+                z80.setState(z80fast.getState());
             }
+            run_z80(z80, num_clocks);
         } else {
-            m6502.emu.clockticks = 0;
-            while (m6502.emu.clockticks < num_clocks) {
-                fake6502_step(&m6502);
+            while (num_clocks > 0) {
+                if (cpu_cycles >= bus_next_event) {
+                    int cycles = service_bus(z80);
+                    num_clocks -= cycles;
+                    cpu_cycles += cycles;
+                }
+                int budget = num_clocks;
+                if (bus_next_event - cpu_cycles < (uint64_t)budget)
+                    budget = bus_next_event - cpu_cycles;
+                int cycles = __builtin_expect(bp_armed, 0) ? bp_step(budget) : block6502_step(&m6502, budget);
+                if (bus_wait_cycles) {
+                    cycles += bus_wait_cycles;
+                    bus_wait_cycles = 0;
+                }
+                num_clocks -= cycles;
+                cpu_cycles += cycles;
+                if (__builtin_expect(bp_stopped, 0))
+                    break;
             }
         }
     }
@@ -64,7 +64,31 @@ instructions)
 
 - DECIMALMODE
 
-when this is defined, BCD mode is implemented (in adc and rra).
+when this is defined, BCD mode is implemented (in adc and rra). With CMOS6502
+ADC and SBC follow the 65C02 in decimal mode: Z and N reflect the decimal
+result and operands that are not valid BCD give the 65C02's results (see
+fake6502_decimal() in fake6502.h). The extra cycle the 65C02 takes is not
+modelled.
+
+
+- DECIMALTABLES
+
+when this is defined with CMOS6502, decimal mode ADC and SBC look their result
+and flags up in a table built at compile time by decimal6502.cpp, which also
+checks it against decimal arithmetic for every operand and carry. The table
+takes 512K, so fake6502.h only defines this on SDL.
+
+
+- LAZYFLAGS
+
+when this is defined, instructions store the value the zero, sign, carry and
+overflow flags are derived from instead of computing the flags. They are
+only worked out when read: by the branches, ADC, SBC and the rotates, PHP,
+BRK and interrupts, or by the host through fake6502_get_flags(). The result
+is the same as without it, tests/lazyflags runs the core both ways and
+compares them after every instruction. The host must then use
+fake6502_get_flags() and fake6502_set_flags() to access the whole status
+register.
 
 
 - FAKE6502_OPS_STATIC
@@ -150,14 +174,15 @@ ie. at the next call to fake6502_step().
 #include <stdio.h>
 
 // Cerberus thing
+#include "bus.h"
 #include "cerberus.h"
 static inline uint8_t fake6502_mem_read(fake6502_context* c, uint16_t address)
 {
-    return cpeek(address);
+    return bus_peek(address);
 }
 static inline void fake6502_mem_write(fake6502_context* c, uint16_t address, uint8_t val)
 {
-    cpoke(address, val);
+    bus_poke(address, val);
 }
 
 // -------------------------------------------------------------------
@@ -433,12 +458,9 @@ uint8_t add8(fake6502_context* c, uint16_t a, uint16_t b, bool carry)
 
 uint8_t rotate_right(fake6502_context* c, uint16_t value)
 {
-    uint16_t result = (value >> 1) | ((c->cpu.flags & FAKE6502_CARRY_FLAG) << 7);
+    uint16_t result = (value >> 1) | (fake6502_carry_flag(c) << 7);
 
-    if (value & 1)
-        fake6502_carry_set(c);
-    else
-        fake6502_carry_clear(c);
+    fake6502_carry_calc(c, (value & 1) << 8);
     fake6502_zero_calc(c, result);
     fake6502_sign_calc(c, result);
 
@@ -447,7 +469,7 @@ uint8_t rotate_right(fake6502_context* c, uint16_t value)
 
 uint8_t rotate_left(fake6502_context* c, uint16_t value)
 {
-    uint16_t result = (value << 1) | (c->cpu.flags & FAKE6502_CARRY_FLAG);
+    uint16_t result = (value << 1) | fake6502_carry_flag(c);
 
     fake6502_carry_calc(c, result);
     fake6502_zero_calc(c, result);
@@ -459,10 +481,7 @@ uint8_t rotate_left(fake6502_context* c, uint16_t value)
 uint8_t logical_shift_right(fake6502_context* c, uint8_t value)
 {
     uint16_t result = value >> 1;
-    if (value & 1)
-        fake6502_carry_set(c);
-    else
-        fake6502_carry_clear(c);
+    fake6502_carry_calc(c, (value & 1) << 8);
     fake6502_zero_calc(c, result);
     fake6502_sign_calc(c, result);
 
@@ -519,10 +538,7 @@ void compare(fake6502_context* c, uint16_t r)
     uint16_t value = fake6502_get_value(c);
     uint16_t result = r - value;
 
-    if (r >= (uint8_t)(value & 0x00FF))
-        fake6502_carry_set(c);
-    else
-        fake6502_carry_clear(c);
+    fake6502_carry_calc(c, 0x100 + r - (uint8_t)(value & 0x00FF));
     if (r == (uint8_t)(value & 0x00FF))
         fake6502_zero_set(c);
     else
@@ -537,7 +553,13 @@ void compare(fake6502_context* c, uint16_t r)
 FAKE6502_FN_OPCODE(adc)
 {
     uint16_t value = fake6502_get_value(c);
-    fake6502_accum_save(c, add8(c, c->cpu.a, value, c->cpu.flags & FAKE6502_CARRY_FLAG));
+#ifdef CMOS6502
+    if (c->cpu.flags & FAKE6502_DECIMAL_FLAG) {
+        fake6502_decimal_op(c, 0, value);
+        return;
+    }
+#endif
+    fake6502_accum_save(c, add8(c, c->cpu.a, value, fake6502_carry_flag(c)));
 }
 
 FAKE6502_FN_OPCODE(and)
@@ -566,19 +588,19 @@ FAKE6502_FN_OPCODE(bra)
 
 FAKE6502_FN_OPCODE(bcc)
 {
-    if ((c->cpu.flags & FAKE6502_CARRY_FLAG) == 0)
+    if (!fake6502_carry_flag(c))
         bra(c);
 }
 
 FAKE6502_FN_OPCODE(bcs)
 {
-    if ((c->cpu.flags & FAKE6502_CARRY_FLAG) == FAKE6502_CARRY_FLAG)
+    if (fake6502_carry_flag(c))
         bra(c);
 }
 
 FAKE6502_FN_OPCODE(beq)
 {
-    if ((c->cpu.flags & FAKE6502_ZERO_FLAG) == FAKE6502_ZERO_FLAG)
+    if (fake6502_zero_flag(c))
         bra(c);
 }
 
@@ -588,7 +610,8 @@ FAKE6502_FN_OPCODE(bit)
     uint8_t result = (uint16_t)c->cpu.a & value;
 
     fake6502_zero_calc(c, result);
-    c->cpu.flags = (c->cpu.flags & 0x3F) | (uint8_t)(value & 0xC0);
+    fake6502_sign_calc(c, value);
+    fake6502_overflow_copy(c, value);
 }
 
 void bit_imm(fake6502_context* c)
@@ -601,19 +624,19 @@ void bit_imm(fake6502_context* c)
 
 FAKE6502_FN_OPCODE(bmi)
 {
-    if ((c->cpu.flags & FAKE6502_SIGN_FLAG) == FAKE6502_SIGN_FLAG)
+    if (fake6502_sign_flag(c))
         bra(c);
 }
 
 FAKE6502_FN_OPCODE(bne)
 {
-    if ((c->cpu.flags & FAKE6502_ZERO_FLAG) == 0)
+    if (!fake6502_zero_flag(c))
         bra(c);
 }
 
 FAKE6502_FN_OPCODE(bpl)
 {
-    if ((c->cpu.flags & FAKE6502_SIGN_FLAG) == 0)
+    if (!fake6502_sign_flag(c))
         bra(c);
 }
 
@@ -625,7 +648,7 @@ FAKE6502_FN_OPCODE(brk)
     fake6502_push_16(c, c->cpu.pc);
 
     // push CPU flags to stack
-    fake6502_push_8(c, c->cpu.flags | FAKE6502_BREAK_FLAG);
+    fake6502_push_8(c, fake6502_get_flags(c) | FAKE6502_BREAK_FLAG);
 
     // set interrupt flag
     fake6502_interrupt_set(c);
@@ -635,13 +658,13 @@ FAKE6502_FN_OPCODE(brk)
 
 FAKE6502_FN_OPCODE(bvc)
 {
-    if ((c->cpu.flags & FAKE6502_OVERFLOW_FLAG) == 0)
+    if (!fake6502_overflow_flag(c))
         bra(c);
 }
 
 FAKE6502_FN_OPCODE(bvs)
 {
-    if ((c->cpu.flags & FAKE6502_OVERFLOW_FLAG) == FAKE6502_OVERFLOW_FLAG)
+    if (fake6502_overflow_flag(c))
         bra(c);
 }
 
@@ -767,7 +790,7 @@ FAKE6502_FN_OPCODE(nop)
         c->cpu.y,
         c->cpu.s,
         c->cpu.pc,
-        c->cpu.flags);
+        fake6502_get_flags(c));
 #endif
 }
 
@@ -799,7 +822,7 @@ FAKE6502_FN_OPCODE(phy)
 
 FAKE6502_FN_OPCODE(php)
 {
-    fake6502_push_8(c, c->cpu.flags | FAKE6502_BREAK_FLAG);
+    fake6502_push_8(c, fake6502_get_flags(c) | FAKE6502_BREAK_FLAG);
 }
 
 FAKE6502_FN_OPCODE(pla)
@@ -828,7 +851,7 @@ FAKE6502_FN_OPCODE(ply)
 
 FAKE6502_FN_OPCODE(plp)
 {
-    c->cpu.flags = fake6502_pull_8(c) | FAKE6502_CONSTANT_FLAG | FAKE6502_BREAK_FLAG;
+    fake6502_set_flags(c, fake6502_pull_8(c) | FAKE6502_CONSTANT_FLAG | FAKE6502_BREAK_FLAG);
 }
 
 FAKE6502_FN_OPCODE(rol)
@@ -849,7 +872,7 @@ FAKE6502_FN_OPCODE(ror)
 
 FAKE6502_FN_OPCODE(rti)
 {
-    c->cpu.flags = fake6502_pull_8(c) | FAKE6502_CONSTANT_FLAG | FAKE6502_BREAK_FLAG;
+    fake6502_set_flags(c, fake6502_pull_8(c) | FAKE6502_CONSTANT_FLAG | FAKE6502_BREAK_FLAG);
     c->cpu.pc = fake6502_pull_16(c);
 }
 
@@ -860,6 +883,12 @@ FAKE6502_FN_OPCODE(rts)
 
 FAKE6502_FN_OPCODE(sbc)
 {
+#ifdef CMOS6502
+    if (c->cpu.flags & FAKE6502_DECIMAL_FLAG) {
+        fake6502_decimal_op(c, 1, fake6502_get_value(c));
+        return;
+    }
+#endif
     uint16_t value = fake6502_get_value(c) ^ 0x00ff; // ones complement
 
 #ifdef DECIMALMODE
@@ -868,7 +897,7 @@ FAKE6502_FN_OPCODE(sbc)
         value -= 0x0066; // use nines complement for BCD
 #endif
 
-    fake6502_accum_save(c, add8(c, c->cpu.a, value, c->cpu.flags & FAKE6502_CARRY_FLAG));
+    fake6502_accum_save(c, add8(c, c->cpu.a, value, fake6502_carry_flag(c)));
 }
 
 FAKE6502_FN_OPCODE(sec)
@@ -1023,7 +1052,7 @@ FAKE6502_FN_OPCODE(rra)
     uint16_t result = rotate_right(c, value);
     fake6502_put_value(c, value);
     fake6502_put_value(c, result);
-    fake6502_accum_save(c, add8(c, c->cpu.a, result, c->cpu.flags & FAKE6502_CARRY_FLAG));
+    fake6502_accum_save(c, add8(c, c->cpu.a, result, fake6502_carry_flag(c)));
 }
 
 // -------------------------------------------------------------------
@@ -1609,7 +1638,7 @@ void fake6502_reset(fake6502_context* c)
     fake6502_mem_read(c, 0x01fe);
     c->cpu.pc = fake6502_mem_read16(c, 0xfffc);
     c->cpu.s = 0xfd;
-    c->cpu.flags |= FAKE6502_CONSTANT_FLAG | FAKE6502_INTERRUPT_FLAG;
+    fake6502_set_flags(c, FAKE6502_CONSTANT_FLAG | FAKE6502_INTERRUPT_FLAG);
 
     c->emu.instructions = 0;
     c->emu.clockticks = 0;
@@ -1618,7 +1647,7 @@ void fake6502_reset(fake6502_context* c)
 void fake6502_nmi(fake6502_context* c)
 {
     fake6502_push_16(c, c->cpu.pc);
-    fake6502_push_8(c, c->cpu.flags & ~FAKE6502_BREAK_FLAG);
+    fake6502_push_8(c, fake6502_get_flags(c) & ~FAKE6502_BREAK_FLAG);
     c->cpu.flags |= FAKE6502_INTERRUPT_FLAG;
     c->cpu.pc = fake6502_mem_read16(c, 0xfffa);
 }
@@ -1627,7 +1656,7 @@ void fake6502_irq(fake6502_context* c)
 {
     if ((c->cpu.flags & FAKE6502_INTERRUPT_FLAG) == 0) {
         fake6502_push_16(c, c->cpu.pc);
-        fake6502_push_8(c, c->cpu.flags & ~FAKE6502_BREAK_FLAG);
+        fake6502_push_8(c, fake6502_get_flags(c) & ~FAKE6502_BREAK_FLAG);
         c->cpu.flags |= FAKE6502_INTERRUPT_FLAG;
         c->cpu.pc = fake6502_mem_read16(c, 0xfffe);
     }
@@ -6,6 +6,12 @@
 
 #define CMOS6502
 #define DECIMALMODE
+#ifndef FAKE6502_EAGERFLAGS // tests/lazyflags builds the core both ways
+#define LAZYFLAGS
+#endif
+#ifdef PLATFORM_SDL
+#define DECIMALTABLES
+#endif
 
 // -------------------------------------------------------------------
 
@@ -62,22 +68,66 @@ extern "C" {
 
 // flag modifier macros
 
-#define fake6502_carry_set(c) (c)->cpu.flags |= FAKE6502_CARRY_FLAG
-#define fake6502_carry_clear(c) (c)->cpu.flags &= (~FAKE6502_CARRY_FLAG)
-#define fake6502_zero_set(c) (c)->cpu.flags |= FAKE6502_ZERO_FLAG
-#define fake6502_zero_clear(c) (c)->cpu.flags &= (~FAKE6502_ZERO_FLAG)
 #define fake6502_interrupt_set(c) (c)->cpu.flags |= FAKE6502_INTERRUPT_FLAG
 #define fake6502_interrupt_clear(c) (c)->cpu.flags &= (~FAKE6502_INTERRUPT_FLAG)
 #define fake6502_decimal_set(c) (c)->cpu.flags |= FAKE6502_DECIMAL_FLAG
 #define fake6502_decimal_clear(c) (c)->cpu.flags &= (~FAKE6502_DECIMAL_FLAG)
-#define fake6502_overflow_set(c) (c)->cpu.flags |= FAKE6502_OVERFLOW_FLAG
-#define fake6502_overflow_clear(c) (c)->cpu.flags &= (~FAKE6502_OVERFLOW_FLAG)
+
+#ifdef LAZYFLAGS
+
+// zero, sign, carry and overflow live in cpu.zero_result, cpu.sign_result,
+// cpu.carry_result and cpu.overflow_result, the Z, N, C and V bits of
+// cpu.flags are stale. Use fake6502_get_flags() to read the whole register.
+
+#define fake6502_zero_set(c) (c)->cpu.zero_result = 0
+#define fake6502_zero_clear(c) (c)->cpu.zero_result = 1
+#define fake6502_sign_set(c) (c)->cpu.sign_result = 0x80
+#define fake6502_sign_clear(c) (c)->cpu.sign_result = 0
+#define fake6502_carry_set(c) (c)->cpu.carry_result = 0x100
+#define fake6502_carry_clear(c) (c)->cpu.carry_result = 0
+#define fake6502_overflow_set(c) (c)->cpu.overflow_result = 0x80
+#define fake6502_overflow_clear(c) (c)->cpu.overflow_result = 0
+
+#define fake6502_zero_flag(c) ((c)->cpu.zero_result == 0)
+#define fake6502_sign_flag(c) (((c)->cpu.sign_result & 0x80) != 0)
+#define fake6502_carry_flag(c) ((c)->cpu.carry_result > 0xFF)
+#define fake6502_overflow_flag(c) (((c)->cpu.overflow_result & 0x80) != 0)
+
+#else
+
+#define fake6502_zero_set(c) (c)->cpu.flags |= FAKE6502_ZERO_FLAG
+#define fake6502_zero_clear(c) (c)->cpu.flags &= (~FAKE6502_ZERO_FLAG)
 #define fake6502_sign_set(c) (c)->cpu.flags |= FAKE6502_SIGN_FLAG
 #define fake6502_sign_clear(c) (c)->cpu.flags &= (~FAKE6502_SIGN_FLAG)
+#define fake6502_carry_set(c) (c)->cpu.flags |= FAKE6502_CARRY_FLAG
+#define fake6502_carry_clear(c) (c)->cpu.flags &= (~FAKE6502_CARRY_FLAG)
+#define fake6502_overflow_set(c) (c)->cpu.flags |= FAKE6502_OVERFLOW_FLAG
+#define fake6502_overflow_clear(c) (c)->cpu.flags &= (~FAKE6502_OVERFLOW_FLAG)
+
+#define fake6502_zero_flag(c) (((c)->cpu.flags & FAKE6502_ZERO_FLAG) != 0)
+#define fake6502_sign_flag(c) (((c)->cpu.flags & FAKE6502_SIGN_FLAG) != 0)
+#define fake6502_carry_flag(c) ((c)->cpu.flags & FAKE6502_CARRY_FLAG)
+#define fake6502_overflow_flag(c) (((c)->cpu.flags & FAKE6502_OVERFLOW_FLAG) != 0)
+
+#endif
 
 #define fake6502_accum_save(c, n) (c)->cpu.a = (uint8_t)((n)&0x00FF)
 
-// flag calculation macros
+// flag calculation macros: C is set from the high byte of n, for overflow
+// n = result, m = accumulator, o = memory
+
+#ifdef LAZYFLAGS
+
+#define fake6502_zero_calc(c, n) (c)->cpu.zero_result = (uint8_t)(n)
+#define fake6502_sign_calc(c, n) (c)->cpu.sign_result = (uint8_t)(n)
+#define fake6502_carry_calc(c, n) (c)->cpu.carry_result = (uint16_t)(n)
+#define fake6502_overflow_calc(c, n, m, o) \
+    (c)->cpu.overflow_result = (uint8_t)(((n) ^ (uint16_t)(m)) & ((n) ^ (o)))
+
+// V from bit 6 of n, as BIT does
+#define fake6502_overflow_copy(c, n) (c)->cpu.overflow_result = (uint8_t)((n) << 1)
+
+#else
 
 #define fake6502_zero_calc(c, n)    \
     {                               \
@@ -103,8 +153,6 @@ extern "C" {
             fake6502_carry_clear(c); \
     }
 
-// n = result, m = accumulator, o = memory
-
 #define fake6502_overflow_calc(c, n, m, o)                \
     {                                                     \
         if (((n) ^ (uint16_t)(m)) & ((n) ^ (o)) & 0x0080) \
@@ -113,6 +161,11 @@ extern "C" {
             fake6502_overflow_clear(c);                   \
     }
 
+#define fake6502_overflow_copy(c, n) \
+    (c)->cpu.flags = ((c)->cpu.flags & ~FAKE6502_OVERFLOW_FLAG) | ((n)&FAKE6502_OVERFLOW_FLAG)
+
+#endif
+
 // -------------------------------------------------------------------
 // typedef's
 // -------------------------------------------------------------------
@@ -124,6 +177,12 @@ typedef struct fake6502_cpu_state {
     uint8_t flags;
     uint8_t s;
     uint16_t pc;
+#ifdef LAZYFLAGS
+    uint8_t zero_result; // Z is set when this is 0
+    uint8_t sign_result; // N is bit 7 of this
+    uint8_t overflow_result; // V is bit 7 of this
+    uint16_t carry_result; // C is set when this is above 0xFF
+#endif
 } fake6502_cpu_state;
 
 typedef struct fake6502_emu_state {
@@ -145,6 +204,109 @@ typedef struct fake6502_opcode {
     int clockticks;
 } fake6502_opcode;
 
+// the processor status register, with LAZYFLAGS the Z, N, C and V bits are
+// computed here
+
+static inline uint8_t fake6502_get_flags(const fake6502_context* c)
+{
+#ifdef LAZYFLAGS
+    return (c->cpu.flags & ~(FAKE6502_ZERO_FLAG | FAKE6502_SIGN_FLAG | FAKE6502_CARRY_FLAG | FAKE6502_OVERFLOW_FLAG))
+        | (c->cpu.zero_result ? 0 : FAKE6502_ZERO_FLAG)
+        | (c->cpu.sign_result & FAKE6502_SIGN_FLAG)
+        | (c->cpu.carry_result > 0xFF ? FAKE6502_CARRY_FLAG : 0)
+        | ((c->cpu.overflow_result >> 1) & FAKE6502_OVERFLOW_FLAG);
+#else
+    return c->cpu.flags;
+#endif
+}
+
+static inline void fake6502_set_flags(fake6502_context* c, uint8_t flags)
+{
+    c->cpu.flags = flags;
+#ifdef LAZYFLAGS
+    c->cpu.zero_result = !(flags & FAKE6502_ZERO_FLAG);
+    c->cpu.sign_result = flags;
+    c->cpu.overflow_result = flags << 1;
+    c->cpu.carry_result = (flags & FAKE6502_CARRY_FLAG) << 8;
+#endif
+}
+
+#ifdef CMOS6502
+
+#if __cplusplus >= 201402L
+#define FAKE6502_CONSTEXPR constexpr
+#else
+#define FAKE6502_CONSTEXPR
+#endif
+
+// 65C02 decimal mode ADC (sbc 0) or SBC (sbc 1) of a and b with the carry in:
+// the result in the low byte and the C, Z, V and N flags in the high byte.
+// This follows appendix A of Bruce Clark's "Decimal Mode" tutorial, which
+// also covers operands that are not valid BCD. Z and N come from the result;
+// V is the binary one for SBC and comes from the sum before the high digit is
+// adjusted for ADC.
+
+static inline FAKE6502_CONSTEXPR uint16_t fake6502_decimal(int sbc, uint8_t a, uint8_t b, int carry)
+{
+    int al = 0, r = 0, flags = 0;
+    if (sbc) {
+        r = a - b + carry - 1;
+        if (r >= 0)
+            flags |= FAKE6502_CARRY_FLAG;
+        if ((a ^ b) & (a ^ r) & 0x80)
+            flags |= FAKE6502_OVERFLOW_FLAG;
+        al = (a & 0x0f) - (b & 0x0f) + carry - 1;
+        if (r < 0)
+            r -= 0x60;
+        if (al < 0)
+            r -= 0x06;
+    } else {
+        al = (a & 0x0f) + (b & 0x0f) + carry;
+        if (al >= 0x0a)
+            al = ((al + 0x06) & 0x0f) + 0x10;
+        r = (int8_t)(a & 0xf0) + (int8_t)(b & 0xf0) + al;
+        if (r < -128 || r > 127)
+            flags |= FAKE6502_OVERFLOW_FLAG;
+        r = (a & 0xf0) + (b & 0xf0) + al;
+        if (r >= 0xa0)
+            r += 0x60;
+        if (r >= 0x100)
+            flags |= FAKE6502_CARRY_FLAG;
+    }
+    r &= 0xff;
+    if (!r)
+        flags |= FAKE6502_ZERO_FLAG;
+    flags |= r & FAKE6502_SIGN_FLAG;
+    return r | flags << 8;
+}
+
+#ifdef DECIMALTABLES
+// fake6502_decimal() for every input, built at compile time in decimal6502.cpp
+typedef struct fake6502_decimal_table_t {
+    uint16_t r[256][256]; // [a][b]
+} fake6502_decimal_table_t;
+extern const fake6502_decimal_table_t fake6502_decimal_table[4]; // [sbc * 2 + carry]
+#endif
+
+// ADC or SBC of value with the decimal flag set
+
+static inline void fake6502_decimal_op(fake6502_context* c, int sbc, uint8_t value)
+{
+    int carry = fake6502_carry_flag(c);
+#ifdef DECIMALTABLES
+    uint16_t r = fake6502_decimal_table[sbc * 2 + carry].r[c->cpu.a][value];
+#else
+    uint16_t r = fake6502_decimal(sbc, c->cpu.a, value, carry);
+#endif
+    fake6502_carry_calc(c, r & (FAKE6502_CARRY_FLAG << 8));
+    fake6502_overflow_copy(c, r >> 8);
+    c->cpu.a = r;
+    fake6502_zero_calc(c, c->cpu.a);
+    fake6502_sign_calc(c, c->cpu.a);
+}
+
+#endif
+
 // -------------------------------------------------------------------
 // global's
 // -------------------------------------------------------------------
@@ -0,0 +1,520 @@
+#include "gdbstub.h"
+
+#ifdef PLATFORM_SDL
+
+#include "breakpoints.h"
+#include "cerberus.h"
+#include <arpa/inet.h>
+#include <atomic>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+#define GDB_SIGINT 2
+#define GDB_SIGTRAP 5
+
+#define GDB_PACKET_SIZE 4096
+#define GDB_POLL_MS 10 /* how often a running target is checked for a stop */
+
+static std::thread server_thread;
+static std::atomic<bool> server_running { false };
+static int listen_fd = -1;
+static bool interrupted; /* stopped by a Ctrl-C rather than on attach */
+
+static const char z80_target_xml[] = "<?xml version=\"1.0\"?>"
+                                     "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+                                     "<target version=\"1.0\">"
+                                     "<architecture>z80</architecture>"
+                                     "<feature name=\"org.gnu.gdb.z80.cpu\">"
+                                     "<reg name=\"af\" bitsize=\"16\" type=\"int\"/>"
+                                     "<reg name=\"bc\" bitsize=\"16\" type=\"int\"/>"
+                                     "<reg name=\"de\" bitsize=\"16\" type=\"data_ptr\"/>"
+                                     "<reg name=\"hl\" bitsize=\"16\" type=\"data_ptr\"/>"
+                                     "<reg name=\"sp\" bitsize=\"16\" type=\"data_ptr\"/>"
+                                     "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+                                     "<reg name=\"ix\" bitsize=\"16\" type=\"data_ptr\"/>"
+                                     "<reg name=\"iy\" bitsize=\"16\" type=\"data_ptr\"/>"
+                                     "<reg name=\"af'\" bitsize=\"16\" type=\"int\"/>"
+                                     "<reg name=\"bc'\" bitsize=\"16\" type=\"int\"/>"
+                                     "<reg name=\"de'\" bitsize=\"16\" type=\"int\"/>"
+                                     "<reg name=\"hl'\" bitsize=\"16\" type=\"int\"/>"
+                                     "<reg name=\"ir\" bitsize=\"16\" type=\"int\"/>"
+                                     "</feature></target>";
+
+static const char m6502_target_xml[] = "<?xml version=\"1.0\"?>"
+                                       "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+                                       "<target version=\"1.0\">"
+                                       "<feature name=\"org.gnu.gdb.m6502.cpu\">"
+                                       "<reg name=\"a\" bitsize=\"8\" type=\"int\"/>"
+                                       "<reg name=\"x\" bitsize=\"8\" type=\"int\"/>"
+                                       "<reg name=\"y\" bitsize=\"8\" type=\"int\"/>"
+                                       "<reg name=\"p\" bitsize=\"8\" type=\"int\"/>"
+                                       "<reg name=\"s\" bitsize=\"8\" type=\"int\"/>"
+                                       "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+                                       "</feature></target>";
+
+// hex encoding, registers little endian
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static void put_hex(std::string& out, unsigned int value, int bytes)
+{
+    for (int i = 0; i < bytes; i++, value >>= 8) {
+        out += hex_digits[(value >> 4) & 0x0f];
+        out += hex_digits[value & 0x0f];
+    }
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* bytes little endian hex digits from p, -1 if malformed */
+static long get_hex_le(const char*& p, int bytes)
+{
+    long value = 0;
+    for (int i = 0; i < bytes; i++) {
+        int hi = hex_value(p[0]), lo = hi < 0 ? -1 : hex_value(p[1]);
+        if (lo < 0)
+            return -1;
+        value |= (long)(hi << 4 | lo) << (8 * i);
+        p += 2;
+    }
+    return value;
+}
+
+/* a big endian hex number as in addresses and lengths */
+static unsigned long get_number(const char*& p)
+{
+    unsigned long value = 0;
+    int digit;
+    while ((digit = hex_value(*p)) >= 0) {
+        value = value << 4 | digit;
+        p++;
+    }
+    return value;
+}
+
+// connection
+
+struct connection {
+    int fd;
+    bool ack; /* '+' and '-' in use, until QStartNoAckMode */
+    std::string last; /* last packet sent, for a '-' */
+    char buf[GDB_PACKET_SIZE];
+    int len, pos;
+};
+
+/* next byte, -1 after timeout_ms (-1: wait), -2 once the client is gone */
+static int read_byte(connection* c, int timeout_ms)
+{
+    if (c->pos == c->len) {
+        struct pollfd p = { c->fd, POLLIN, 0 };
+        int ready = poll(&p, 1, timeout_ms);
+        if (ready == 0)
+            return -1;
+        if (ready < 0)
+            return -2;
+        int n = read(c->fd, c->buf, sizeof c->buf);
+        if (n <= 0)
+            return -2;
+        c->len = n;
+        c->pos = 0;
+    }
+    return (uint8_t)c->buf[c->pos++];
+}
+
+static bool send_raw(connection* c, const std::string& data)
+{
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = write(c->fd, data.data() + done, data.size() - done);
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+static bool send_packet(connection* c, const std::string& payload)
+{
+    uint8_t sum = 0;
+    for (char ch : payload)
+        sum += ch;
+    std::string packet = "$" + payload + "#";
+    put_hex(packet, sum, 1);
+    c->last = packet;
+    return send_raw(c, packet);
+}
+
+/* Read a packet into payload. Returns 1 for a packet, 0 for a Ctrl-C, -1 on
+ * timeout, -2 when the client is gone. */
+static int read_packet(connection* c, std::string& payload, int timeout_ms)
+{
+    for (;;) {
+        int ch = read_byte(c, timeout_ms);
+        if (ch < 0)
+            return ch;
+        if (ch == 0x03)
+            return 0;
+        if (ch == '-' && c->ack)
+            send_raw(c, c->last);
+        if (ch != '$')
+            continue;
+
+        payload.clear();
+        uint8_t sum = 0;
+        while ((ch = read_byte(c, -1)) != '#') {
+            if (ch < 0)
+                return -2;
+            payload += ch;
+            sum += ch;
+        }
+        int hi = read_byte(c, -1), lo = read_byte(c, -1);
+        if (lo < 0)
+            return -2;
+        if (hex_value(hi) << 4 != (sum & 0xf0) || hex_value(lo) != (sum & 0x0f)) {
+            if (c->ack)
+                send_raw(c, "-");
+            continue;
+        }
+        if (c->ack)
+            send_raw(c, "+");
+        return 1;
+    }
+}
+
+static std::string stop_reply()
+{
+    std::string reply = "T";
+    put_hex(reply, bp_stop.reason == BP_STOP_INTERRUPT && interrupted ? GDB_SIGINT : GDB_SIGTRAP, 1);
+    // only report the watchpoints GDB knows about
+    static const char* const kinds[] = { NULL, "watch", "rwatch", "awatch" };
+    if (bp_stop.reason >= BP_WRITE && bp_stop.reason <= BP_ACCESS && bp_stop.owner == BP_GDB) {
+        char field[16];
+        snprintf(field, sizeof field, "%s:%x;", kinds[bp_stop.reason], bp_stop.addr);
+        reply += field;
+    }
+    return reply;
+}
+
+/* Resume after c or s, with an optional new PC. */
+static void resume(const char* args, bool step)
+{
+    const char* p = args;
+    if (*p)
+        bp_reg_write(BP_REG_PC, get_number(p));
+    interrupted = false;
+    bp_resume(step);
+}
+
+static std::string read_memory(const char* args)
+{
+    const char* p = args;
+    unsigned long addr = get_number(p);
+    if (*p++ != ',')
+        return "E01";
+    unsigned long len = get_number(p);
+    if (len > GDB_PACKET_SIZE / 2 - 8)
+        len = GDB_PACKET_SIZE / 2 - 8;
+    std::string reply;
+    for (unsigned long i = 0; i < len; i++)
+        put_hex(reply, cpeek(addr + i), 1);
+    return reply;
+}
+
+static std::string write_memory(const char* args)
+{
+    const char* p = args;
+    unsigned long addr = get_number(p);
+    if (*p++ != ',')
+        return "E01";
+    unsigned long len = get_number(p);
+    if (*p++ != ':' || strlen(p) != 2 * len)
+        return "E01";
+    for (unsigned long i = 0; i < len; i++)
+        bp_poke(addr + i, get_hex_le(p, 1));
+    return "OK";
+}
+
+static std::string read_registers()
+{
+    std::string reply;
+    for (int n = 0; n < bp_reg_count(); n++)
+        put_hex(reply, bp_reg_read(n), bp_reg_size(n));
+    return reply;
+}
+
+static std::string write_registers(const char* args)
+{
+    const char* p = args;
+    for (int n = 0; n < bp_reg_count(); n++) {
+        long value = get_hex_le(p, bp_reg_size(n));
+        if (value < 0)
+            return "E01";
+        bp_reg_write(n, value);
+    }
+    return "OK";
+}
+
+static std::string read_register(const char* args)
+{
+    const char* p = args;
+    unsigned long n = get_number(p);
+    if (n >= (unsigned long)bp_reg_count())
+        return "E01";
+    std::string reply;
+    put_hex(reply, bp_reg_read(n), bp_reg_size(n));
+    return reply;
+}
+
+static std::string write_register(const char* args)
+{
+    const char* p = args;
+    unsigned long n = get_number(p);
+    if (*p++ != '=' || n >= (unsigned long)bp_reg_count())
+        return "E01";
+    long value = get_hex_le(p, bp_reg_size(n));
+    if (value < 0)
+        return "E01";
+    bp_reg_write(n, value);
+    return "OK";
+}
+
+static std::string breakpoint(const char* args, bool on)
+{
+    const char* p = args;
+    unsigned long type = get_number(p);
+    if (*p++ != ',')
+        return "E01";
+    unsigned long addr = get_number(p);
+    if (*p++ != ',')
+        return "E01";
+    unsigned long len = get_number(p);
+    if (addr > 0xffff || len > 0x10000)
+        return "E01";
+    // software and hardware breakpoints are the same here, then write, read
+    // and access watchpoints
+    static const int types[] = { BP_EXEC, BP_EXEC, BP_WRITE, BP_READ, BP_ACCESS };
+    if (type >= sizeof types / sizeof types[0])
+        return "";
+    if (on)
+        return bp_add(BP_GDB, types[type], addr, len, NULL) >= 0 ? "OK" : "E01";
+    return bp_remove(BP_GDB, types[type], addr, len) ? "OK" : "E01";
+}
+
+static std::string query(const std::string& packet)
+{
+    if (packet.compare(0, 10, "qSupported") == 0)
+        return "PacketSize=" + std::to_string(GDB_PACKET_SIZE) + ";qXfer:features:read+;QStartNoAckMode+";
+    if (packet == "qAttached")
+        return "1";
+    if (packet == "qC")
+        return "QC1";
+    if (packet == "qfThreadInfo")
+        return "m1";
+    if (packet == "qsThreadInfo")
+        return "l";
+    static const char xfer[] = "qXfer:features:read:target.xml:";
+    if (packet.compare(0, sizeof xfer - 1, xfer) == 0) {
+        const char* p = packet.c_str() + sizeof xfer - 1;
+        unsigned long offset = get_number(p);
+        if (*p++ != ',')
+            return "E01";
+        unsigned long len = get_number(p);
+        std::string xml = mode ? z80_target_xml : m6502_target_xml;
+        if (offset >= xml.size())
+            return "l";
+        std::string chunk = xml.substr(offset, len);
+        return (offset + chunk.size() < xml.size() ? "m" : "l") + chunk;
+    }
+    return "";
+}
+
+enum {
+    REPLY, /* send the reply */
+    REPLIED, /* handle() already replied */
+    RESUMED, /* the target runs, reply when it stops */
+    CLOSE, /* send the reply, then end the connection */
+};
+
+static int handle(connection* c, const std::string& packet, std::string& reply)
+{
+    const char* args = packet.c_str() + 1;
+    reply.clear();
+    switch (packet[0]) {
+    case '?':
+        reply = stop_reply();
+        break;
+    case 'g':
+        reply = read_registers();
+        break;
+    case 'G':
+        reply = write_registers(args);
+        break;
+    case 'p':
+        reply = read_register(args);
+        break;
+    case 'P':
+        reply = write_register(args);
+        break;
+    case 'm':
+        reply = read_memory(args);
+        break;
+    case 'M':
+        reply = write_memory(args);
+        break;
+    case 'c':
+        resume(args, false);
+        return RESUMED;
+    case 's':
+        resume(args, true);
+        return RESUMED;
+    case 'Z':
+        reply = breakpoint(args, true);
+        break;
+    case 'z':
+        reply = breakpoint(args, false);
+        break;
+    case 'H':
+    case 'T':
+        reply = "OK";
+        break;
+    case 'q':
+        reply = query(packet);
+        break;
+    case 'Q':
+        if (packet == "QStartNoAckMode") {
+            send_packet(c, "OK");
+            c->ack = false;
+            return REPLIED;
+        }
+        break;
+    case 'D':
+        reply = "OK";
+        return CLOSE;
+    case 'k':
+        return CLOSE;
+    case 'v':
+        if (packet.compare(0, 5, "vKill") == 0) {
+            reply = "OK";
+            return CLOSE;
+        }
+        break;
+    }
+    return REPLY;
+}
+
+static void serve(int fd)
+{
+    connection c;
+    c.fd = fd;
+    c.ack = true;
+    c.len = c.pos = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(bp_machine_mutex);
+        bp_clear(BP_GDB);
+        interrupted = false;
+        bp_interrupt();
+    }
+    debug_log("gdb: client attached\r\n");
+
+    bool running = false;
+    std::string packet, reply;
+    while (server_running) {
+        int got = read_packet(&c, packet, running ? GDB_POLL_MS : 100);
+        if (got == -2)
+            break;
+        std::lock_guard<std::mutex> lock(bp_machine_mutex);
+        if (got == 0 && !bp_stopped) {
+            interrupted = true;
+            bp_interrupt();
+        }
+        if (running && bp_stopped) {
+            running = false;
+            if (!send_packet(&c, stop_reply()))
+                break;
+        }
+        if (got != 1)
+            continue;
+        if (running) // only Ctrl-C is expected while the target runs
+            continue;
+        int what = handle(&c, packet, reply);
+        if (what == RESUMED) {
+            running = true;
+            continue;
+        }
+        if (what == REPLIED)
+            continue;
+        if ((what == REPLY || !reply.empty()) && !send_packet(&c, reply))
+            break;
+        if (what == CLOSE)
+            break;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(bp_machine_mutex);
+        bp_clear(BP_GDB);
+        if (bp_stopped)
+            bp_resume(false);
+    }
+    close(fd);
+    debug_log("gdb: client detached\r\n");
+}
+
+bool gdb_start(int port)
+{
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        return false;
+    int on = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // local clients only
+    addr.sin_port = htons(port);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof addr) < 0 || listen(listen_fd, 1) < 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    server_running = true;
+    server_thread = std::thread([] {
+        while (server_running) {
+            struct pollfd p = { listen_fd, POLLIN, 0 };
+            if (poll(&p, 1, 100) <= 0)
+                continue;
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0)
+                serve(fd);
+        }
+    });
+    return true;
+}
+
+void gdb_stop()
+{
+    if (server_running) {
+        server_running = false;
+        server_thread.join();
+        close(listen_fd);
+        listen_fd = -1;
+    }
+}
+
+#endif /* PLATFORM_SDL */
@@ -0,0 +1,20 @@
+#pragma once
+
+/* GDB remote serial protocol stub.
+ *
+ * gdb_start() listens on a local TCP port (main-sdl -gdb PORT). A client such
+ * as `gdb -ex "target remote :PORT"` attaches to whichever CPU is selected and
+ * stops it. Supported: reading and writing registers and memory, continue,
+ * single-step, software breakpoints (Z0, Z1 is treated the same), write, read
+ * and access watchpoints (Z2 to Z4), and Ctrl-C. The target description is
+ * sent through qXfer:features:read, with the registers of bp_reg_name().
+ *
+ * Breakpoints, stepping and stopping are those of breakpoints.h, with the
+ * stub as owner BP_GDB: attaching and detaching clear only the stub's own.
+ * Memory is accessed as the CAT does, through cpeek() and bp_poke().
+ */
+
+#ifdef PLATFORM_SDL
+bool gdb_start(int port);
+void gdb_stop();
+#endif
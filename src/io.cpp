@@ -0,0 +1,223 @@
+#include "io.h"
+#include "bus.h"
+#include "cerberus.h"
+#include "trace.h"
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef PLATFORM_SDL
+#include <chrono>
+#include <thread>
+#define IO_CONSOLE_SIZE 65536
+#define IO_TRACE_SIZE 65536
+#else /* PLATFORM_FABGL */
+#define IO_CONSOLE_SIZE 1024
+#define IO_TRACE_SIZE 2048
+#endif
+
+/* Single producer (the CPU thread), single consumer (io_flush) byte ring. head
+ * and tail count bytes and wrap, size is a power of two.
+ */
+template <uint32_t size>
+struct io_stream {
+    static_assert((size & (size - 1)) == 0, "io_stream size must be a power of two");
+    uint8_t buf[size];
+    std::atomic<uint32_t> head { 0 };
+    std::atomic<uint32_t> tail { 0 };
+    std::atomic<uint32_t> dropped { 0 };
+
+    // all or nothing, so trace records are never split
+    bool put(const void* data, uint32_t len)
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (size - (h - tail.load(std::memory_order_acquire)) < len) {
+            dropped.fetch_add(len, std::memory_order_relaxed);
+            return false;
+        }
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        for (uint32_t i = 0; i < len; i++)
+            buf[(h + i) & (size - 1)] = p[i];
+        head.store(h + len, std::memory_order_release);
+        return true;
+    }
+
+    // write everything buffered to f, returns the number of bytes written
+    uint32_t drain(FILE* f)
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        uint32_t h = head.load(std::memory_order_acquire);
+        uint32_t n = h - t;
+        if (n == 0)
+            return 0;
+        uint32_t start = t & (size - 1);
+        uint32_t first = n < size - start ? n : size - start;
+        fwrite(buf + start, 1, first, f);
+        if (first < n)
+            fwrite(buf, 1, n - first, f);
+        tail.store(h, std::memory_order_release);
+        return n;
+    }
+};
+
+static io_stream<IO_CONSOLE_SIZE> console;
+static io_stream<IO_TRACE_SIZE> porttrace;
+static FILE* porttrace_file = NULL;
+static int regdump_port = IO_PORT_REGDUMP;
+static void* io_z80;
+static io_reg_reader io_z80_read;
+static fake6502_context* io_6502;
+
+// the registers of the core that is running, z80 or z80fast
+static uint16_t z80_reg(int reg)
+{
+    return io_z80_read(io_z80, reg);
+}
+
+static void console_write(void* ctx, int port, int value)
+{
+    uint8_t c = value;
+    console.put(&c, 1);
+}
+
+static void trace_write(void* ctx, int port, int value)
+{
+    // the newest trace ring record is the instruction doing the OUT, it has the
+    // cycle stamp, pc and opcode bytes. The registers are sampled again, mid
+    // instruction.
+    trace_record t = trace_ring[(trace_head - 1) & (TRACE_RING_SIZE - 1)];
+    if (mode) {
+        t.sp = z80_reg(Z80_SP);
+        t.r[0] = z80_reg(Z80_AF);
+        t.r[1] = z80_reg(Z80_BC);
+        t.r[2] = z80_reg(Z80_DE);
+        t.r[3] = z80_reg(Z80_HL);
+        t.r[4] = z80_reg(Z80_IX);
+        t.r[5] = z80_reg(Z80_IY);
+    } else {
+        trace_6502_regs(&t, io_6502);
+    }
+    porttrace.put(&t, sizeof t);
+}
+
+static void regdump_write(void* ctx, int port, int value)
+{
+    char line[128];
+    int len;
+    if (mode)
+        len = snprintf(line, sizeof line, "OUT($%02x) debug trigger: BC=%04x DE=%04x HL=%04x AF=%04x IX=%04x IY=%04x SP=%04x\n",
+            port & 0xff,
+            z80_reg(Z80_BC),
+            z80_reg(Z80_DE),
+            z80_reg(Z80_HL),
+            z80_reg(Z80_AF),
+            z80_reg(Z80_IX),
+            z80_reg(Z80_IY),
+            z80_reg(Z80_SP));
+    else
+        len = snprintf(line, sizeof line, "STA($%02x%02x) debug trigger: A=%02x X=%02x Y=%02x P=%02x S=%02x\n",
+            BUS_IO_PAGE,
+            port & 0xff,
+            io_6502->cpu.a,
+            io_6502->cpu.x,
+            io_6502->cpu.y,
+            fake6502_get_flags(io_6502),
+            io_6502->cpu.s);
+    console.put(line, len);
+}
+
+void io_init(Z80* z80, fake6502_context* m6502)
+{
+    io_set_z80(z80);
+    io_6502 = m6502;
+    bus_register_port(IO_PORT_CONSOLE, NULL, console_write, NULL);
+    bus_register_port(IO_PORT_TRACE, NULL, trace_write, NULL);
+    bus_register_port(regdump_port, NULL, regdump_write, NULL);
+}
+
+void io_set_z80(void* core, io_reg_reader read)
+{
+    io_z80 = core;
+    io_z80_read = read;
+}
+
+void io_set_regdump_port(int port)
+{
+    if (bus_ports[regdump_port].write == regdump_write)
+        bus_register_port(regdump_port, NULL, NULL, NULL);
+    regdump_port = port & 0xff;
+    bus_register_port(regdump_port, NULL, regdump_write, NULL);
+}
+
+static bool porttrace_open()
+{
+    char path[256];
+    snprintf(path, sizeof path, "%s/%s", SDCARD_MOUNT_PATH, IO_PORTTRACE_FILENAME);
+    porttrace_file = fopen(path, "wb");
+    if (!porttrace_file) {
+        debug_log("Could not write %s\r\n", path);
+        return false;
+    }
+    trace_file_header h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, TRACE_MAGIC, sizeof h.magic);
+    h.version = TRACE_VERSION;
+    h.cpu = mode ? TRACE_CPU_Z80 : TRACE_CPU_6502;
+    h.reason = TRACE_REASON_PORT;
+    h.record_size = sizeof(trace_record);
+    h.count = TRACE_COUNT_STREAM;
+    h.cycles = cpu_cycles;
+    fwrite(&h, sizeof h, 1, porttrace_file);
+    debug_log("Writing port trace to %s\r\n", path);
+    return true;
+}
+
+void io_flush()
+{
+    if (console.drain(stdout))
+        fflush(stdout);
+    if (uint32_t n = console.dropped.exchange(0))
+        fprintf(stderr, "[console port: %u bytes dropped]\n", n);
+
+    if (porttrace.head.load(std::memory_order_acquire) != porttrace.tail.load(std::memory_order_relaxed)) {
+        if (porttrace_file || porttrace_open()) {
+            porttrace.drain(porttrace_file);
+            fflush(porttrace_file);
+        } else {
+            // no file, discard
+            porttrace.tail.store(porttrace.head.load(std::memory_order_acquire), std::memory_order_release);
+        }
+    }
+    if (uint32_t n = porttrace.dropped.exchange(0))
+        fprintf(stderr, "[trace port: %u records dropped]\n", n / (uint32_t)sizeof(trace_record));
+}
+
+#ifdef PLATFORM_SDL
+static std::thread flush_thread;
+static std::atomic<bool> flush_thread_running { false };
+
+void io_start_flush_thread()
+{
+    flush_thread_running = true;
+    flush_thread = std::thread([] {
+        using namespace std::chrono_literals;
+        while (flush_thread_running) {
+            io_flush();
+            std::this_thread::sleep_for(10ms);
+        }
+    });
+}
+
+void io_stop_flush_thread()
+{
+    if (flush_thread_running) {
+        flush_thread_running = false;
+        flush_thread.join();
+    }
+    io_flush();
+    if (porttrace_file) {
+        fclose(porttrace_file);
+        porttrace_file = NULL;
+    }
+}
+#endif
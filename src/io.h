@@ -0,0 +1,48 @@
+#pragma once
+
+/* Debug ports on the device bus (bus.h). In 6502 mode they are reached through
+ * the I/O page, e.g. STA $FE01 for the console.
+ *
+ *   IO_PORT_CONSOLE  OUT writes the byte to the host console (stdout).
+ *   IO_PORT_TRACE    OUT appends a register snapshot of the current
+ *                    instruction, in the trace_record format from trace.h, to
+ *                    SDCARD_MOUNT_PATH/porttrace.bin.
+ *   regdump port     OUT prints all registers to the host console. Defaults to
+ *                    IO_PORT_REGDUMP, change it with io_set_regdump_port().
+ *
+ * Console and trace output go through lock-free single producer, single
+ * consumer buffers so a write costs a few stores. io_flush() drains them. On SDL
+ * a background thread calls it, elsewhere the frame loop does. When a buffer is
+ * full new output is dropped and counted, never waited for.
+ */
+
+#include "Z80.h"
+#include "fake6502.h"
+#include <stdint.h>
+
+#define IO_PORT_REGDUMP 0x00
+#define IO_PORT_CONSOLE 0x01
+#define IO_PORT_TRACE 0x02
+
+#define IO_PORTTRACE_FILENAME "porttrace.bin"
+
+void io_init(Z80* z80, fake6502_context* m6502);
+
+/* The Z80 core whose registers the ports report. cpu_clockcycles() sets the
+ * one it is about to run, io_init() starts with z80.
+ */
+typedef uint16_t (*io_reg_reader)(void* core, int reg);
+void io_set_z80(void* core, io_reg_reader read);
+
+template <class Core>
+void io_set_z80(Core* core)
+{
+    io_set_z80(core, [](void* c, int reg) -> uint16_t { return static_cast<Core*>(c)->readRegWord(reg); });
+}
+
+void io_set_regdump_port(int port);
+void io_flush();
+#ifdef PLATFORM_SDL
+void io_start_flush_thread();
+void io_stop_flush_thread();
+#endif
@@ -1,4 +1,5 @@
 #include "cerberus.h"
+#include "io.h"
 #include "fabgl.h"
 #include "fabglconf.h"
 #include "fabutils.h"
@@ -160,6 +161,7 @@ void _loop(void*)
         cpuInterrupt();
         cat_loop();
         cpu_clockcycles(fast ? 160000 : 80000); // 8 mhz cycles in 0.02 seconds
+        io_flush();
 
         // 50Hz timer (every 0.02 seconds)
         int64_t now;
@@ -208,3 +210,8 @@ void platform_delay(int ms)
 {
     delay(ms);
 }
+
+uint64_t platform_micros()
+{
+    return esp_timer_get_time();
+}
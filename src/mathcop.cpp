@@ -0,0 +1,358 @@
+#include "mathcop.h"
+#include "bus.h"
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+static struct {
+    uint8_t a[8];
+    uint8_t b[8];
+    uint8_t cmd;
+    uint8_t status;
+} math;
+static int math_cycles = MATH_DEFAULT_CYCLES;
+
+static uint64_t get(const uint8_t* r, int n)
+{
+    uint64_t v = 0;
+    for (int i = n - 1; i >= 0; i--)
+        v = v << 8 | r[i];
+    return v;
+}
+
+static void put(uint8_t* r, uint64_t v, int n)
+{
+    for (int i = 0; i < n; i++, v >>= 8)
+        r[i] = v & 0xff;
+}
+
+static float get_f(const uint8_t* r)
+{
+    uint32_t u = get(r, 4);
+    float f;
+    memcpy(&f, &u, sizeof f);
+    return f;
+}
+
+static void put_f(uint8_t* r, float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof u);
+    put(r, u, 4);
+}
+
+static double get_d(const uint8_t* r)
+{
+    uint64_t u = get(r, 8);
+    double d;
+    memcpy(&d, &u, sizeof d);
+    return d;
+}
+
+static void put_d(uint8_t* r, double d)
+{
+    uint64_t u;
+    memcpy(&u, &d, sizeof u);
+    put(r, u, 8);
+}
+
+/* Microsoft binary format: value = 0.1mmm... * 2^(exp - 128), exp 0 is zero.
+ * The top mantissa bit holds the sign in place of the implied 1.
+ */
+static double mbf_decode(uint8_t exp, uint64_t mant, int bits)
+{
+    if (exp == 0)
+        return 0.0;
+    uint64_t top = 1ull << (bits - 1);
+    double v = ldexp((double)(mant | top), exp - 128 - bits);
+    return (mant & top) ? -v : v;
+}
+
+static uint64_t mbf_encode(double v, int bits, uint8_t* exp)
+{
+    uint64_t top = 1ull << (bits - 1);
+    if (isnan(v)) {
+        math.status |= MATH_INVALID;
+        *exp = 0;
+        return 0;
+    }
+    uint64_t sign = signbit(v) ? top : 0;
+    if (v == 0.0) {
+        *exp = 0;
+        return 0;
+    }
+    if (isinf(v)) {
+        math.status |= MATH_OVERFLOW;
+        *exp = 0xff;
+        return (top - 1) | sign;
+    }
+    int e;
+    double f = frexp(fabs(v), &e);
+    uint64_t m = (uint64_t)llround(ldexp(f, bits));
+    if (m >> bits) { // rounded up to the next power of two
+        m >>= 1;
+        e++;
+    }
+    e += 128;
+    if (e <= 0) {
+        *exp = 0;
+        return 0;
+    }
+    if (e > 0xff) {
+        math.status |= MATH_OVERFLOW;
+        *exp = 0xff;
+        return (top - 1) | sign;
+    }
+    *exp = e;
+    return (m & (top - 1)) | sign;
+}
+
+static void check_float(double r, double x, double y)
+{
+    if (isnan(r) && !isnan(x) && !isnan(y))
+        math.status |= MATH_INVALID;
+    if (isinf(r) && !isinf(x) && !isinf(y))
+        math.status |= MATH_OVERFLOW;
+}
+
+static void run_float(int op)
+{
+    float x = get_f(math.a), y = get_f(math.b), r;
+    switch (op) {
+    case MATH_FADD:
+        r = x + y;
+        break;
+    case MATH_FSUB:
+        r = x - y;
+        break;
+    case MATH_FMUL:
+        r = x * y;
+        break;
+    case MATH_FDIV:
+        if (y == 0.0f)
+            math.status |= MATH_DIV_ZERO;
+        r = x / y;
+        break;
+    default: /* MATH_FSQRT */
+        y = 0.0f;
+        r = sqrtf(x);
+        break;
+    }
+    if (!(op == MATH_FDIV && y == 0.0f))
+        check_float(r, x, y);
+    put_f(math.a, r);
+}
+
+static void run_double(int op)
+{
+    double x = get_d(math.a), y = get_d(math.b), r;
+    switch (op) {
+    case MATH_DADD:
+        r = x + y;
+        break;
+    case MATH_DSUB:
+        r = x - y;
+        break;
+    case MATH_DMUL:
+        r = x * y;
+        break;
+    case MATH_DDIV:
+        if (y == 0.0)
+            math.status |= MATH_DIV_ZERO;
+        r = x / y;
+        break;
+    default: /* MATH_DSQRT */
+        y = 0.0;
+        r = sqrt(x);
+        break;
+    }
+    if (!(op == MATH_DDIV && y == 0.0))
+        check_float(r, x, y);
+    put_d(math.a, r);
+}
+
+/* n byte division, quotient in A[0..n-1], remainder after it */
+static void run_div(int n, bool is_signed)
+{
+    uint64_t mask = n == 8 ? ~0ull : (1ull << (n * 8)) - 1;
+    uint64_t x = get(math.a, n), y = get(math.b, n);
+    uint64_t q, r;
+    if (y == 0) {
+        math.status |= MATH_DIV_ZERO;
+        q = mask;
+        r = x;
+    } else if (is_signed) {
+        int shift = 64 - n * 8;
+        int64_t sx = (int64_t)(x << shift) >> shift;
+        int64_t sy = (int64_t)(y << shift) >> shift;
+        int64_t min = INT64_MIN >> (64 - n * 8);
+        if (sx == min && sy == -1) {
+            math.status |= MATH_OVERFLOW;
+            q = x;
+            r = 0;
+        } else {
+            q = (uint64_t)(sx / sy) & mask;
+            r = (uint64_t)(sx % sy) & mask;
+        }
+    } else {
+        q = x / y;
+        r = x % y;
+    }
+    put(math.a, q, n);
+    put(math.a + n, r, n);
+}
+
+static void run_mul(int n, bool is_signed)
+{
+    uint64_t x = get(math.a, n), y = get(math.b, n);
+    uint64_t p;
+    if (is_signed) {
+        int shift = 64 - n * 8;
+        p = (uint64_t)(((int64_t)(x << shift) >> shift) * ((int64_t)(y << shift) >> shift));
+    } else {
+        p = x * y;
+    }
+    put(math.a, p, n * 2);
+}
+
+static void run(int op)
+{
+    uint8_t exp;
+    uint64_t m;
+    double d;
+
+    math.cmd = op;
+    math.status = 0;
+    bus_wait_cycles += math_cycles;
+
+    switch (op) {
+    case MATH_MUL16:
+    case MATH_MULS16:
+        run_mul(2, op == MATH_MULS16);
+        break;
+    case MATH_MUL32:
+    case MATH_MULS32:
+        run_mul(4, op == MATH_MULS32);
+        break;
+    case MATH_DIV16:
+    case MATH_DIVS16:
+        run_div(2, op == MATH_DIVS16);
+        break;
+    case MATH_DIV32:
+    case MATH_DIVS32:
+        run_div(4, op == MATH_DIVS32);
+        break;
+    case MATH_FADD:
+    case MATH_FSUB:
+    case MATH_FMUL:
+    case MATH_FDIV:
+    case MATH_FSQRT:
+        run_float(op);
+        break;
+    case MATH_DADD:
+    case MATH_DSUB:
+    case MATH_DMUL:
+    case MATH_DDIV:
+    case MATH_DSQRT:
+        run_double(op);
+        break;
+    case MATH_MBF4_TO_D:
+        put_d(math.a, mbf_decode(math.a[3], get(math.a, 3), 24));
+        break;
+    case MATH_D_TO_MBF4:
+        m = mbf_encode(get_d(math.a), 24, &exp);
+        memset(math.a, 0, sizeof math.a);
+        put(math.a, m, 3);
+        math.a[3] = exp;
+        break;
+    case MATH_MBF5_TO_D:
+        m = (uint64_t)math.a[1] << 24 | math.a[2] << 16 | math.a[3] << 8 | math.a[4];
+        put_d(math.a, mbf_decode(math.a[0], m, 32));
+        break;
+    case MATH_D_TO_MBF5:
+        m = mbf_encode(get_d(math.a), 32, &exp);
+        memset(math.a, 0, sizeof math.a);
+        math.a[0] = exp;
+        math.a[1] = m >> 24;
+        math.a[2] = m >> 16;
+        math.a[3] = m >> 8;
+        math.a[4] = m;
+        break;
+    case MATH_MBF8_TO_D:
+        put_d(math.a, mbf_decode(math.a[7], get(math.a, 7), 56));
+        break;
+    case MATH_D_TO_MBF8:
+        m = mbf_encode(get_d(math.a), 56, &exp);
+        put(math.a, m, 7);
+        math.a[7] = exp;
+        break;
+    case MATH_F_TO_D:
+        put_d(math.a, get_f(math.a));
+        break;
+    case MATH_D_TO_F:
+        d = get_d(math.a);
+        if (isfinite(d) && isinf((float)d))
+            math.status |= MATH_OVERFLOW;
+        memset(math.a, 0, sizeof math.a);
+        put_f(math.a, (float)d);
+        break;
+    case MATH_I32_TO_D:
+        put_d(math.a, (int32_t)get(math.a, 4));
+        break;
+    case MATH_D_TO_I32: {
+        d = trunc(get_d(math.a));
+        int32_t i;
+        if (isnan(d)) {
+            math.status |= MATH_INVALID;
+            i = 0;
+        } else if (d > 2147483647.0) {
+            math.status |= MATH_OVERFLOW;
+            i = 2147483647;
+        } else if (d < -2147483648.0) {
+            math.status |= MATH_OVERFLOW;
+            i = -2147483647 - 1;
+        } else {
+            i = (int32_t)d;
+        }
+        memset(math.a, 0, sizeof math.a);
+        put(math.a, (uint32_t)i, 4);
+        break;
+    }
+    default:
+        math.status |= MATH_INVALID;
+        break;
+    }
+}
+
+static int math_read(void* ctx, int port)
+{
+    int reg = (port & 0xff) - MATH_PORT_A;
+    if (reg < 8)
+        return math.a[reg];
+    if (reg < 16)
+        return math.b[reg - 8];
+    return (port & 0xff) == MATH_PORT_CMD ? math.cmd : math.status;
+}
+
+static void math_write(void* ctx, int port, int value)
+{
+    int reg = (port & 0xff) - MATH_PORT_A;
+    if (reg < 8)
+        math.a[reg] = value;
+    else if (reg < 16)
+        math.b[reg - 8] = value;
+    else if ((port & 0xff) == MATH_PORT_CMD)
+        run(value);
+}
+
+void math_set_cycle_cost(int cycles)
+{
+    math_cycles = cycles;
+}
+
+void math_init()
+{
+    memset(&math, 0, sizeof math);
+    for (int port = MATH_PORT_A; port <= MATH_PORT_STATUS; port++)
+        bus_register_port(port, math_read, port == MATH_PORT_STATUS ? NULL : math_write, NULL);
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+/* Math coprocessor.
+ *
+ * Two 8-byte little endian operand registers, a command port and a status
+ * port. Write the operands, write a command, read the result back from A. The
+ * result replaces A, so operations can be chained.
+ *
+ *   $40-$47  A   operand, result
+ *   $48-$4F  B   operand
+ *   $50      CMD write to run an operation, read returns the last command
+ *   $51      STATUS (read only), cleared by every command
+ *
+ * Integer operations, bytes of A and B used as shown:
+ *
+ *   $01 MUL16    A[0-3]  = A[0-1] * B[0-1]           unsigned
+ *   $02 MULS16   A[0-3]  = A[0-1] * B[0-1]           signed
+ *   $03 DIV16    A[0-1]  = A[0-1] / B[0-1], A[2-3] = remainder, unsigned
+ *   $04 DIVS16   as DIV16, signed, truncates toward zero
+ *   $05 MUL32    A[0-7]  = A[0-3] * B[0-3]           unsigned
+ *   $06 MULS32   A[0-7]  = A[0-3] * B[0-3]           signed
+ *   $07 DIV32    A[0-3]  = A[0-3] / B[0-3], A[4-7] = remainder, unsigned
+ *   $08 DIVS32   as DIV32, signed
+ *
+ * Division by zero sets MATH_DIV_ZERO and leaves a quotient of all ones and the
+ * dividend as remainder. The signed minimum divided by -1 sets MATH_OVERFLOW.
+ *
+ * IEEE 754 operations, single precision on A[0-3]/B[0-3], double on A/B:
+ *
+ *   $10 FADD  $11 FSUB  $12 FMUL  $13 FDIV  $14 FSQRT (of A)
+ *   $20 DADD  $21 DSUB  $22 DMUL  $23 DDIV  $24 DSQRT (of A)
+ *
+ * Conversions, all through double in A:
+ *
+ *   $30 MBF4 to double     $31 double to MBF4    4-byte Microsoft single, as
+ *                                                stored by Z80 BASICs
+ *   $32 MBF5 to double     $33 double to MBF5    5-byte 6502 MS BASIC, exponent
+ *                                                first, mantissa big endian
+ *   $34 MBF8 to double     $35 double to MBF8    8-byte Microsoft double
+ *   $36 single to double   $37 double to single
+ *   $38 int32 to double    $39 double to int32   truncates toward zero
+ *
+ * Every command stalls the CPU for a configurable number of cycles, see
+ * math_set_cycle_cost().
+ */
+
+#define MATH_PORT_A 0x40
+#define MATH_PORT_B 0x48
+#define MATH_PORT_CMD 0x50
+#define MATH_PORT_STATUS 0x51
+
+#define MATH_DEFAULT_CYCLES 20
+
+enum {
+    MATH_DIV_ZERO = 0x01,
+    MATH_OVERFLOW = 0x02, /* result out of range, saturated */
+    MATH_INVALID = 0x04, /* NaN result or unknown command */
+};
+
+enum {
+    MATH_MUL16 = 0x01,
+    MATH_MULS16 = 0x02,
+    MATH_DIV16 = 0x03,
+    MATH_DIVS16 = 0x04,
+    MATH_MUL32 = 0x05,
+    MATH_MULS32 = 0x06,
+    MATH_DIV32 = 0x07,
+    MATH_DIVS32 = 0x08,
+    MATH_FADD = 0x10,
+    MATH_FSUB = 0x11,
+    MATH_FMUL = 0x12,
+    MATH_FDIV = 0x13,
+    MATH_FSQRT = 0x14,
+    MATH_DADD = 0x20,
+    MATH_DSUB = 0x21,
+    MATH_DMUL = 0x22,
+    MATH_DDIV = 0x23,
+    MATH_DSQRT = 0x24,
+    MATH_MBF4_TO_D = 0x30,
+    MATH_D_TO_MBF4 = 0x31,
+    MATH_MBF5_TO_D = 0x32,
+    MATH_D_TO_MBF5 = 0x33,
+    MATH_MBF8_TO_D = 0x34,
+    MATH_D_TO_MBF8 = 0x35,
+    MATH_F_TO_D = 0x36,
+    MATH_D_TO_F = 0x37,
+    MATH_I32_TO_D = 0x38,
+    MATH_D_TO_I32 = 0x39,
+};
+
+void math_init();
+void math_set_cycle_cost(int cycles);
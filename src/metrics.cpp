@@ -0,0 +1,253 @@
+#include "metrics.h"
+#include "cerberus.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+
+bool metrics_enabled;
+
+static std::mutex metrics_mutex;
+static std::condition_variable window_done; /* a window moved to last */
+static uint64_t period_ns;
+static uint64_t window_start;
+static metrics_window current, last;
+static uint32_t last_seq; /* windows completed */
+static uint32_t frame_ns[METRICS_MAX_FRAMES]; /* of the current window */
+
+uint64_t metrics_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void metrics_start(int period_ms)
+{
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    if (metrics_enabled)
+        return;
+    period_ns = (uint64_t)period_ms * 1000000;
+    window_start = metrics_ns();
+    memset(&current, 0, sizeof current);
+    metrics_enabled = true;
+}
+
+static inline uint32_t clamp32(uint64_t v)
+{
+    return v > UINT32_MAX ? UINT32_MAX : v;
+}
+
+/* Close the window, with metrics_mutex held. */
+static void finish_window(uint64_t now)
+{
+    current.ns = now - window_start;
+    uint32_t n = current.frames < METRICS_MAX_FRAMES ? current.frames : METRICS_MAX_FRAMES;
+    if (n) {
+        std::sort(frame_ns, frame_ns + n);
+        current.frame_p50_ns = frame_ns[n * 50 / 100];
+        current.frame_p95_ns = frame_ns[n * 95 / 100];
+        current.frame_p99_ns = frame_ns[n * 99 / 100];
+    }
+    last = current;
+    last_seq++;
+    memset(&current, 0, sizeof current);
+    window_start = now;
+    window_done.notify_all();
+}
+
+void metrics_frame(uint64_t work_ns, uint64_t idle_ns, uint64_t cycles, uint64_t instructions)
+{
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    if (current.frames < METRICS_MAX_FRAMES)
+        frame_ns[current.frames] = clamp32(work_ns);
+    current.frames++;
+    current.cycles += cycles;
+    current.instructions += instructions;
+    current.work_ns += work_ns;
+    current.idle_ns += idle_ns;
+    current.frame_max_ns = std::max(current.frame_max_ns, clamp32(work_ns));
+    uint64_t now = metrics_ns();
+    if (now - window_start >= period_ns)
+        finish_window(now);
+}
+
+void metrics_render(uint64_t ns)
+{
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    current.renders++;
+    current.render_ns += ns;
+    current.render_max_ns = std::max(current.render_max_ns, ns);
+}
+
+void metrics_bios(int call, uint64_t ns)
+{
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    current.bios_calls++;
+    current.bios_ns += ns;
+    current.bios_max_ns = std::max(current.bios_max_ns, ns);
+    current.bios_by_call[call & 127]++;
+}
+
+void metrics_key(uint64_t ns)
+{
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    current.keys++;
+    current.key_ns += ns;
+    current.key_max_ns = std::max(current.key_max_ns, ns);
+}
+
+bool metrics_last(metrics_window* out)
+{
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    if (!last_seq)
+        return false;
+    *out = last;
+    return true;
+}
+
+static double average(uint64_t total, uint32_t n)
+{
+    return n ? (double)total / n : 0;
+}
+
+void metrics_format_hud(const metrics_window* w, char* out, int size)
+{
+    double seconds = w->ns / 1e9;
+    snprintf(out, size,
+        "%6.2f MHz %6.1f ns/inst idle %3.0f%%\n"
+        "frame ms %5.2f %5.2f %5.2f max %5.2f\n"
+        "render %5.2f ms max %5.2f  key %5.1f ms\n"
+        "bios %4u calls %7.0f us max %7.0f\n",
+        seconds ? w->cycles / seconds / 1e6 : 0, w->instructions ? (double)w->work_ns / w->instructions : 0,
+        w->ns ? 100.0 * w->idle_ns / w->ns : 0,
+        w->frame_p50_ns / 1e6, w->frame_p95_ns / 1e6, w->frame_p99_ns / 1e6, w->frame_max_ns / 1e6,
+        average(w->render_ns, w->renders) / 1e6, w->render_max_ns / 1e6, average(w->key_ns, w->keys) / 1e6,
+        w->bios_calls, average(w->bios_ns, w->bios_calls) / 1e3, w->bios_max_ns / 1e3);
+}
+
+#ifdef PLATFORM_SDL
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+static std::thread exporter;
+static bool exporter_running;
+static FILE* export_file;
+static const char* export_socket; /* path after "unix:" */
+static int export_fd = -1;
+
+static int format_json(const metrics_window* w, char* out, int size)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    double seconds = w->ns / 1e9;
+    int n = snprintf(out, size,
+        "{\"time\": %lld.%03ld, \"pid\": %d, \"cpu\": \"%s\", \"seconds\": %.3f, \"frames\": %u, "
+        "\"cycles\": %llu, \"instructions\": %llu, \"mhz\": %.3f, \"ns_per_instruction\": %.2f, "
+        "\"frame_us\": {\"p50\": %.1f, \"p95\": %.1f, \"p99\": %.1f, \"max\": %.1f}, \"idle\": %.3f, "
+        "\"render_us\": {\"count\": %u, \"avg\": %.1f, \"max\": %.1f}, "
+        "\"key_us\": {\"count\": %u, \"avg\": %.1f, \"max\": %.1f}, "
+        "\"bios\": {\"count\": %u, \"avg_us\": %.1f, \"max_us\": %.1f, \"calls\": {",
+        (long long)ts.tv_sec, ts.tv_nsec / 1000000, (int)getpid(), mode ? "z80" : "6502", seconds, w->frames,
+        (unsigned long long)w->cycles, (unsigned long long)w->instructions,
+        seconds ? w->cycles / seconds / 1e6 : 0, w->instructions ? (double)w->work_ns / w->instructions : 0,
+        w->frame_p50_ns / 1e3, w->frame_p95_ns / 1e3, w->frame_p99_ns / 1e3, w->frame_max_ns / 1e3,
+        w->ns ? (double)w->idle_ns / w->ns : 0,
+        w->renders, average(w->render_ns, w->renders) / 1e3, w->render_max_ns / 1e3,
+        w->keys, average(w->key_ns, w->keys) / 1e3, w->key_max_ns / 1e3,
+        w->bios_calls, average(w->bios_ns, w->bios_calls) / 1e3, w->bios_max_ns / 1e3);
+    const char* sep = "";
+    for (int call = 0; call < 128 && n < size; call++)
+        if (w->bios_by_call[call]) {
+            n += snprintf(out + n, size - n, "%s\"0x%02x\": %u", sep, call, w->bios_by_call[call]);
+            sep = ", ";
+        }
+    if (n < size)
+        n += snprintf(out + n, size - n, "}}}\n");
+    return n < size ? n : size - 1;
+}
+
+static bool connect_socket()
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, export_socket, sizeof addr.sun_path - 1);
+    export_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (export_fd >= 0 && connect(export_fd, (struct sockaddr*)&addr, sizeof addr) == 0)
+        return true;
+    if (export_fd >= 0)
+        close(export_fd);
+    export_fd = -1;
+    return false;
+}
+
+static void write_line(const char* line, int len)
+{
+    if (export_file) {
+        fwrite(line, 1, len, export_file);
+        fflush(export_file);
+        return;
+    }
+    // a collector that went away is tried again at the next window
+    if (export_fd < 0 && !connect_socket())
+        return;
+    if (send(export_fd, line, len, MSG_NOSIGNAL) != len) {
+        close(export_fd);
+        export_fd = -1;
+    }
+}
+
+bool metrics_export_start(const char* target)
+{
+    if (strncmp(target, "unix:", 5) == 0) {
+        export_socket = target + 5;
+        if (!connect_socket())
+            return false;
+    } else {
+        export_file = fopen(target, "a");
+        if (!export_file)
+            return false;
+    }
+    metrics_start(METRICS_PERIOD_MS);
+    exporter_running = true;
+    exporter = std::thread([] {
+        std::unique_lock<std::mutex> lock(metrics_mutex);
+        uint32_t seq = last_seq;
+        for (;;) {
+            window_done.wait(lock, [&] { return !exporter_running || last_seq != seq; });
+            if (!exporter_running)
+                break;
+            seq = last_seq;
+            metrics_window w = last;
+            // write without holding up the emulation
+            lock.unlock();
+            char line[2048];
+            write_line(line, format_json(&w, line, sizeof line));
+            lock.lock();
+        }
+    });
+    return true;
+}
+
+void metrics_export_stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(metrics_mutex);
+        if (!exporter_running)
+            return;
+        exporter_running = false;
+        window_done.notify_all();
+    }
+    exporter.join();
+    if (export_file)
+        fclose(export_file);
+    export_file = NULL;
+    if (export_fd >= 0)
+        close(export_fd);
+    export_fd = -1;
+}
+#endif /* PLATFORM_SDL */
@@ -0,0 +1,62 @@
+#pragma once
+
+/* Performance metrics.
+ *
+ * The frontend reports the host time spent on every emulated frame and the
+ * sleep after it, every rendered frame and the time from a key press to the key
+ * entering the guest's mailbox; CAT reports each BIOS call and the host time it
+ * took. Everything is summed over a window of metrics_start()'s period, and at
+ * the end of each window the totals become the ones metrics_last() returns.
+ *
+ * Until metrics_start() the hooks are skipped: callers test metrics_enabled
+ * first, so the emulation pays one branch per frame, BIOS call or key.
+ *
+ * On SDL metrics_export_start() appends every window as one line of JSON to a
+ * file, or sends it to a Unix socket ("unix:PATH", reconnecting when the
+ * collector goes away), from a thread of its own.
+ */
+
+#include <stdint.h>
+
+#define METRICS_PERIOD_MS 1000
+#define METRICS_MAX_FRAMES 4096 /* frames kept for the percentiles of a window */
+
+struct metrics_window {
+    uint64_t ns; /* host time covered */
+    uint32_t frames;
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t work_ns; /* emulating, over all frames */
+    uint64_t idle_ns; /* sleeping between frames */
+    uint32_t frame_p50_ns, frame_p95_ns, frame_p99_ns, frame_max_ns; /* emulating one frame */
+    uint32_t renders;
+    uint64_t render_ns, render_max_ns;
+    uint32_t bios_calls;
+    uint64_t bios_ns, bios_max_ns;
+    uint32_t bios_by_call[128]; /* calls of each inbox flag */
+    uint32_t keys;
+    uint64_t key_ns, key_max_ns;
+};
+
+extern bool metrics_enabled;
+
+/* Start collecting, windows of period_ms. Calling it again changes nothing. */
+void metrics_start(int period_ms);
+/* Host steady clock in nanoseconds. */
+uint64_t metrics_ns();
+
+void metrics_frame(uint64_t work_ns, uint64_t idle_ns, uint64_t cycles, uint64_t instructions);
+void metrics_render(uint64_t ns);
+void metrics_bios(int call, uint64_t ns);
+void metrics_key(uint64_t ns);
+
+/* The last complete window, false if there is none yet. */
+bool metrics_last(metrics_window* out);
+/* The window as 40 column lines of text for an overlay. */
+void metrics_format_hud(const metrics_window* w, char* out, int size);
+
+#ifdef PLATFORM_SDL
+/* Export to a file path or "unix:PATH". False if it could not be opened. */
+bool metrics_export_start(const char* target);
+void metrics_export_stop();
+#endif
@@ -0,0 +1,39 @@
+#include "native.h"
+
+bool native_enabled = true;
+
+#ifdef NATIVE_X86_64
+#include <sys/mman.h>
+
+uint32_t native_gen;
+
+static uint8_t* arena;
+static size_t arena_used;
+static bool arena_failed;
+
+uint8_t* native_begin(size_t max)
+{
+    if (!arena && !arena_failed) {
+        void* p = mmap(NULL, NATIVE_ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            arena_failed = true;
+        else
+            arena = static_cast<uint8_t*>(p);
+    }
+    if (!arena || max > NATIVE_ARENA_SIZE)
+        return NULL;
+    if (arena_used + max > NATIVE_ARENA_SIZE) {
+        arena_used = 0;
+        native_gen++;
+    }
+    return arena + arena_used;
+}
+
+void native_commit(uint8_t* end)
+{
+    // keep the next block's code 16-byte aligned
+    arena_used = (end - arena + 15) & ~(size_t)15;
+}
+
+#endif /* NATIVE_X86_64 */
@@ -0,0 +1,331 @@
+#pragma once
+
+/* Native x86-64 code for the block translators.
+ *
+ * On Linux x86-64 hosts the translators (block6502.cpp, and the Z80 block cache
+ * in Z80.cpp) compile their hottest blocks once more, to host machine code, and
+ * keep the threaded or decoded code as the fallback for everything the
+ * compiled code does not handle. This file has what both share:
+ * an arena of executable memory and an encoder for the handful of x86-64
+ * instructions the compilers emit.
+ *
+ * The arena is one mapping of NATIVE_ARENA_SIZE bytes. Code is appended to it
+ * and never freed one block at a time: when it is full it starts again from the
+ * beginning and native_gen is bumped, so every block compiled under an older
+ * generation is dropped and compiled again once it is hot. If the host refuses
+ * an executable mapping, native_begin() returns NULL and the threaded code
+ * runs.
+ *
+ * native_enabled turns the compilers off at run time (-nojit). Elsewhere
+ * NATIVE_X86_64 is not defined and only that flag exists.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(PLATFORM_SDL) && defined(__x86_64__) && defined(__linux__)
+#define NATIVE_X86_64
+#endif
+
+extern bool native_enabled; /* compile hot blocks to host code, -nojit clears it */
+
+#ifdef NATIVE_X86_64
+
+#define NATIVE_ARENA_SIZE (16 << 20)
+
+extern uint32_t native_gen; /* bumped when the arena starts again */
+
+/* Room for up to max bytes of code, or NULL without an arena. Code written
+ * there is kept by native_commit(end), or dropped if that is not called. A
+ * full arena starts again first, which bumps native_gen.
+ */
+uint8_t* native_begin(size_t max);
+void native_commit(uint8_t* end);
+
+// registers
+
+enum {
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15,
+    NOREG = -1,
+};
+
+// condition codes
+
+enum {
+    CC_O,
+    CC_NO,
+    CC_B,
+    CC_AE,
+    CC_E,
+    CC_NE,
+    CC_BE,
+    CC_A,
+    CC_S,
+    CC_NS,
+    CC_P,
+    CC_NP,
+    CC_L,
+    CC_GE,
+    CC_LE,
+    CC_G,
+};
+
+// the group 1 arithmetic operations, as the /digit of 0x81
+
+enum {
+    X86_ADD,
+    X86_OR,
+    X86_ADC,
+    X86_SBB,
+    X86_AND,
+    X86_SUB,
+    X86_XOR,
+    X86_CMP,
+};
+
+// shifts and rotates, as the /digit of 0xc1
+
+enum {
+    SH_ROL,
+    SH_ROR,
+    SH_RCL,
+    SH_RCR,
+    SH_SHL,
+    SH_SHR,
+    SH_SAR = 7,
+};
+
+/* An operand: a register, or memory at [base + index * scale + disp]. */
+struct native_rm {
+    int reg;
+    int base;
+    int index;
+    int scale;
+    int32_t disp;
+};
+
+static inline native_rm nreg(int r)
+{
+    return { r, NOREG, NOREG, 1, 0 };
+}
+
+static inline native_rm nmem(int base, int32_t disp = 0)
+{
+    return { NOREG, base, NOREG, 1, disp };
+}
+
+static inline native_rm nmem(int base, int index, int scale, int32_t disp = 0)
+{
+    return { NOREG, base, index, scale, disp };
+}
+
+/* Appends instructions at p. Sizes are in bytes, 1, 2, 4 or 8. A 4-byte
+ * operation on a register clears its upper half as on the hardware.
+ */
+struct native_asm {
+    uint8_t* p;
+
+    void byte(int b) { *p++ = b; }
+    void word(int w)
+    {
+        byte(w);
+        byte(w >> 8);
+    }
+    void dword(uint32_t d)
+    {
+        for (int i = 0; i < 4; i++)
+            byte(d >> 8 * i);
+    }
+    void qword(uint64_t q)
+    {
+        for (int i = 0; i < 8; i++)
+            byte(q >> 8 * i);
+    }
+
+    /* opcode (one byte, or 0x0fxx for two) with reg in the ModRM reg field,
+     * a register or a /digit, and rm as the other operand */
+    void op(int size, int opcode, int r, bool r_is_reg, native_rm rm, bool rm_byte = false)
+    {
+        if (size == 2)
+            byte(0x66);
+        int rex = (size == 8 ? 8 : 0) | (r & 8 ? 4 : 0);
+        if (rm.reg != NOREG)
+            rex |= rm.reg & 8 ? 1 : 0;
+        else
+            rex |= (rm.index != NOREG && (rm.index & 8) ? 2 : 0) | (rm.base & 8 ? 1 : 0);
+        // spl, bpl, sil and dil need a REX prefix to be told from ah..bh
+        bool byte_reg = (size == 1 && r_is_reg && r >= 4 && r < 8)
+            || ((size == 1 || rm_byte) && rm.reg >= 4 && rm.reg < 8);
+        if (rex || byte_reg)
+            byte(0x40 | rex);
+        if (opcode > 0xff)
+            byte(opcode >> 8);
+        byte(opcode);
+        modrm(r & 7, rm);
+    }
+
+    void modrm(int r, native_rm rm)
+    {
+        if (rm.reg != NOREG) {
+            byte(0xc0 | r << 3 | (rm.reg & 7));
+            return;
+        }
+        int mod = rm.disp == 0 && (rm.base & 7) != RBP ? 0 : rm.disp == (int8_t)rm.disp ? 1 : 2;
+        if (rm.index == NOREG && (rm.base & 7) != RSP) {
+            byte(mod << 6 | r << 3 | (rm.base & 7));
+        } else {
+            int scale = rm.scale == 8 ? 3 : rm.scale == 4 ? 2 : rm.scale == 2 ? 1 : 0;
+            byte(mod << 6 | r << 3 | 4);
+            byte(scale << 6 | (rm.index == NOREG ? 4 : rm.index & 7) << 3 | (rm.base & 7));
+        }
+        if (mod == 1)
+            byte(rm.disp);
+        else if (mod == 2)
+            dword(rm.disp);
+    }
+
+    void imm(int size, int32_t value)
+    {
+        if (size == 1)
+            byte(value);
+        else if (size == 2)
+            word(value);
+        else
+            dword(value);
+    }
+
+    // moves
+
+    void mov(int size, native_rm dst, int src) { op(size, size == 1 ? 0x88 : 0x89, src, true, dst); }
+    void load(int size, int dst, native_rm src) { op(size, size == 1 ? 0x8a : 0x8b, dst, true, src); }
+    void movi(int size, native_rm dst, int32_t value)
+    {
+        op(size, size == 1 ? 0xc6 : 0xc7, 0, false, dst);
+        imm(size == 8 ? 4 : size, value);
+    }
+    void movi32(int dst, uint32_t value)
+    {
+        if (dst & 8)
+            byte(0x41);
+        byte(0xb8 + (dst & 7));
+        dword(value);
+    }
+    void movi64(int dst, uint64_t value)
+    {
+        byte(0x48 | (dst & 8 ? 1 : 0));
+        byte(0xb8 + (dst & 7));
+        qword(value);
+    }
+    void movptr(int dst, const volatile void* ptr) { movi64(dst, (uint64_t)(uintptr_t)ptr); }
+    /* zero extend a byte or word into a 32-bit register */
+    void movzx(int size, int dst, native_rm src) { op(4, size == 1 ? 0x0fb6 : 0x0fb7, dst, true, src, size == 1); }
+    void movsx(int size, int dst, native_rm src) { op(4, size == 1 ? 0x0fbe : 0x0fbf, dst, true, src, size == 1); }
+    void lea(int size, int dst, native_rm src) { op(size, 0x8d, dst, true, src); }
+
+    // arithmetic
+
+    void alu(int operation, int size, native_rm dst, int src)
+    {
+        op(size, operation << 3 | (size == 1 ? 0 : 1), src, true, dst);
+    }
+    void alu_load(int operation, int size, int dst, native_rm src)
+    {
+        op(size, operation << 3 | (size == 1 ? 2 : 3), dst, true, src);
+    }
+    void alui(int operation, int size, native_rm dst, int32_t value)
+    {
+        if (size == 1) {
+            op(1, 0x80, operation, false, dst);
+            byte(value);
+        } else if (value == (int8_t)value) {
+            op(size, 0x83, operation, false, dst);
+            byte(value);
+        } else {
+            op(size, 0x81, operation, false, dst);
+            imm(size == 8 ? 4 : size, value);
+        }
+    }
+    void test(int size, native_rm dst, int src) { op(size, size == 1 ? 0x84 : 0x85, src, true, dst); }
+    void testi(int size, native_rm dst, int32_t value)
+    {
+        op(size, size == 1 ? 0xf6 : 0xf7, 0, false, dst);
+        imm(size == 8 ? 4 : size, value);
+    }
+    void shift(int operation, int size, native_rm dst, int count)
+    {
+        if (count == 1) {
+            op(size, size == 1 ? 0xd0 : 0xd1, operation, false, dst);
+        } else {
+            op(size, size == 1 ? 0xc0 : 0xc1, operation, false, dst);
+            byte(count);
+        }
+    }
+    void inc(int size, native_rm dst) { op(size, size == 1 ? 0xfe : 0xff, 0, false, dst); }
+    void dec(int size, native_rm dst) { op(size, size == 1 ? 0xfe : 0xff, 1, false, dst); }
+    void neg(int size, native_rm dst) { op(size, size == 1 ? 0xf6 : 0xf7, 3, false, dst); }
+    void setcc(int cc, native_rm dst) { op(1, 0x0f90 + cc, 0, false, dst); }
+    /* ah = SF ZF 0 AF 0 PF 1 CF */
+    void lahf() { byte(0x9f); }
+    void bswap16(int r) { shift(SH_ROL, 2, nreg(r), 8); }
+
+    // control flow, jumps return where their target goes for bind()
+
+    uint8_t* jcc(int cc)
+    {
+        byte(0x0f);
+        byte(0x80 + cc);
+        dword(0);
+        return p - 4;
+    }
+    uint8_t* jmp()
+    {
+        byte(0xe9);
+        dword(0);
+        return p - 4;
+    }
+    void jcc_to(int cc, const uint8_t* target) { bind_to(jcc(cc), target); }
+    void jmp_to(const uint8_t* target) { bind_to(jmp(), target); }
+    void bind(uint8_t* jump) { bind_to(jump, p); }
+    static void bind_to(uint8_t* jump, const uint8_t* target)
+    {
+        int32_t rel = target - (jump + 4);
+        for (int i = 0; i < 4; i++)
+            jump[i] = rel >> 8 * i;
+    }
+    /* calls fn through rax, the stack must be 16-byte aligned */
+    void call(const void* fn)
+    {
+        movptr(RAX, fn);
+        op(4, 0xff, 2, false, nreg(RAX));
+    }
+    void push(int r)
+    {
+        if (r & 8)
+            byte(0x41);
+        byte(0x50 + (r & 7));
+    }
+    void pop(int r)
+    {
+        if (r & 8)
+            byte(0x41);
+        byte(0x58 + (r & 7));
+    }
+    void ret() { byte(0xc3); }
+};
+
+#endif /* NATIVE_X86_64 */
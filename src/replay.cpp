@@ -0,0 +1,147 @@
+#include "replay.h"
+#include "cerberus.h"
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+
+int replay_mode = REPLAY_OFF;
+uint32_t replay_frame;
+
+static FILE* replay_file;
+static replay_event next; /* the next event to replay */
+static bool diverged; /* a mismatch was reported */
+
+static void report_divergence(const char* what)
+{
+    if (diverged)
+        return;
+    diverged = true;
+    fprintf(stderr, "replay: %s at frame %u, cycle %llu, recorded cycle %llu, the run diverged\n",
+        what, replay_frame, (unsigned long long)cpu_cycles, (unsigned long long)next.cycle);
+}
+
+static bool read_event()
+{
+    if (fread(&next, sizeof next, 1, replay_file) == 1)
+        return true;
+    // a recording cut short, play it as if it ended here
+    memset(&next, 0, sizeof next);
+    next.frame = UINT32_MAX;
+    next.end = 1;
+    return false;
+}
+
+static void finish_replay()
+{
+    fprintf(stderr, "replay: finished at frame %u, cycle %llu%s\n", replay_frame,
+        (unsigned long long)cpu_cycles, diverged ? " (diverged)" : "");
+    fclose(replay_file);
+    replay_file = NULL;
+    replay_mode = REPLAY_OFF;
+}
+
+bool replay_record(const char* path)
+{
+    replay_file = fopen(path, "wb");
+    if (!replay_file)
+        return false;
+    replay_file_header h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, REPLAY_MAGIC, sizeof h.magic);
+    h.version = REPLAY_VERSION;
+    h.cpu = mode ? TRACE_CPU_Z80 : TRACE_CPU_6502;
+    h.fast = fast;
+    h.z80fast = cpu_z80fast;
+    h.event_size = sizeof(replay_event);
+    fwrite(&h, sizeof h, 1, replay_file);
+    replay_frame = 0;
+    replay_mode = REPLAY_RECORD;
+    return true;
+}
+
+bool replay_play(const char* path)
+{
+    replay_file = fopen(path, "rb");
+    if (!replay_file)
+        return false;
+    replay_file_header h;
+    if (fread(&h, sizeof h, 1, replay_file) != 1 || memcmp(h.magic, REPLAY_MAGIC, sizeof h.magic) != 0
+        || h.version != REPLAY_VERSION || h.event_size != sizeof(replay_event)) {
+        fclose(replay_file);
+        replay_file = NULL;
+        return false;
+    }
+    // the recording's CPU and clock, whatever the command line said
+    mode = h.cpu == TRACE_CPU_Z80;
+    fast = h.fast;
+    cpu_z80fast = h.z80fast;
+    read_event();
+    replay_frame = 0;
+    diverged = false;
+    replay_mode = REPLAY_PLAY;
+    return true;
+}
+
+void replay_close()
+{
+    if (replay_mode == REPLAY_RECORD) {
+        replay_event e;
+        memset(&e, 0, sizeof e);
+        e.cycle = cpu_cycles;
+        e.frame = replay_frame;
+        e.end = 1;
+        fwrite(&e, sizeof e, 1, replay_file);
+        fclose(replay_file);
+        replay_file = NULL;
+    } else if (replay_mode == REPLAY_PLAY) {
+        fclose(replay_file);
+        replay_file = NULL;
+    }
+    replay_mode = REPLAY_OFF;
+}
+
+void replay_next_frame()
+{
+    replay_frame++;
+    if (replay_mode == REPLAY_PLAY && next.end && replay_frame > next.frame) {
+        if (next.frame != UINT32_MAX && cpu_cycles != next.cycle)
+            report_divergence("end");
+        finish_replay();
+    } else if (replay_mode == REPLAY_PLAY && !next.end && replay_frame > next.frame) {
+        // the key was due in a frame that did not read the keyboard
+        report_divergence("key not read");
+        read_event();
+    }
+}
+
+int replay_key(int key)
+{
+    switch (replay_mode) {
+    case REPLAY_RECORD:
+        if (key) {
+            replay_event e;
+            memset(&e, 0, sizeof e);
+            e.cycle = cpu_cycles;
+            e.frame = replay_frame;
+            e.key = key;
+            fwrite(&e, sizeof e, 1, replay_file);
+            fflush(replay_file);
+        }
+        return key;
+    case REPLAY_PLAY:
+        if (next.end || next.frame != replay_frame)
+            return 0;
+        if (next.cycle != cpu_cycles)
+            report_divergence("key");
+        key = next.key;
+        read_event();
+        return key;
+    default:
+        return key;
+    }
+}
+
+uint64_t replay_micros()
+{
+    return cpu_cycles / (fast ? 8 : 4);
+}
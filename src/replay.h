@@ -0,0 +1,69 @@
+#pragma once
+
+/* Input recording and deterministic replay.
+ *
+ * The emulation is deterministic apart from two inputs: the keys, which the
+ * frontend queues whenever they are pressed, and the wall clock behind the
+ * timer's MICROS register (timer.h). While recording, every key CAT reads
+ * through readKey() is logged with the frame it was read in and cpu_cycles at
+ * that moment. A replay hands each key to readKey() in the same frame and
+ * ignores the keyboard. In both modes MICROS counts emulated time instead, so a
+ * replay of the same program with the same SD card contents and options runs
+ * bit-exact, which makes benchmark runs repeatable and guest regressions
+ * bisectable.
+ *
+ * A replay checks the cycle count of every key and of the end of the
+ * recording, and reports the first mismatch (the run diverged) on stderr.
+ * Stopping at a breakpoint (breakpoints.h) shortens a frame, so recordings
+ * should be made without stops.
+ *
+ * File layout: replay_file_header, then replay_event records ending with one
+ * with end set. Little endian.
+ */
+
+#include <stdint.h>
+
+#define REPLAY_MAGIC "OHDINPUT"
+#define REPLAY_VERSION 2
+
+enum {
+    REPLAY_OFF,
+    REPLAY_RECORD,
+    REPLAY_PLAY,
+};
+
+struct replay_file_header {
+    char magic[8];
+    uint8_t version;
+    uint8_t cpu; /* TRACE_CPU_* when the recording started */
+    uint8_t fast;
+    uint8_t event_size;
+    uint8_t z80fast; /* cpu_z80fast, it leaves the X and Y flags clear */
+    uint8_t pad[3];
+};
+
+struct replay_event {
+    uint64_t cycle; /* cpu_cycles when the key was read */
+    uint32_t frame; /* replay_frame then */
+    uint8_t key;
+    uint8_t end; /* last record, the recording stopped here */
+    uint8_t pad[2];
+};
+
+extern int replay_mode;
+extern uint32_t replay_frame; /* frames since the recording or replay started */
+
+/* Start recording to, or replaying from, path. Call before the first frame. */
+bool replay_record(const char* path);
+bool replay_play(const char* path);
+/* Finish a recording with its end record, or abandon a replay. */
+void replay_close();
+
+/* Called by the frontend at the start of every frame. */
+void replay_next_frame();
+/* Called by readKey() with the key taken from the keyboard (0 if none) and
+ * returns the key to hand to CAT: logged while recording, the recorded one
+ * while replaying. */
+int replay_key(int key);
+/* Emulated time in microseconds, for MICROS while recording or replaying. */
+uint64_t replay_micros();
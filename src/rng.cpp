@@ -0,0 +1,28 @@
+#include "rng.h"
+#include "bus.h"
+#include <stddef.h>
+
+static uint32_t rng_state;
+
+static int rng_read(void* ctx, int port)
+{
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rng_state = x;
+    return x & 0xff;
+}
+
+static void rng_write(void* ctx, int port, int value)
+{
+    rng_state = (rng_state << 8 | (rng_state >> 24)) ^ value;
+    if (rng_state == 0) // xorshift must never reach 0
+        rng_state = 0x2545f491;
+}
+
+void rng_init()
+{
+    rng_state = 0x2545f491;
+    bus_register_port(RNG_PORT, rng_read, rng_write, NULL);
+}
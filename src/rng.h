@@ -0,0 +1,14 @@
+#pragma once
+
+/* Random number source.
+ *
+ *   IN  RNG_PORT  next random byte
+ *   OUT RNG_PORT  mix the byte into the generator state
+ *
+ * The generator is xorshift32 seeded at power on, so runs are repeatable
+ * unless the guest seeds it.
+ */
+
+#define RNG_PORT 0x30
+
+void rng_init();
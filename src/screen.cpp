@@ -0,0 +1,197 @@
+#include "screen.h"
+#include "cerberus.h"
+#include <stdio.h>
+#include <string.h>
+
+const uint8_t screen_palette[8][3] = {
+    { 0, 255, 0 },
+    { 255, 0, 0 },
+    { 0, 0, 255 },
+    { 255, 255, 0 },
+    { 0, 255, 255 },
+    { 255, 0, 255 },
+    { 0, 0, 0 },
+    { 255, 255, 255 }
+};
+
+void screen_text(char out[SCREEN_TEXT_SIZE])
+{
+    const uint8_t* tiles = &cerb_ram[SCREEN_TILES];
+    for (int row = 0; row < SCREEN_ROWS; row++) {
+        for (int col = 0; col < SCREEN_COLS; col++) {
+            uint8_t c = *tiles++;
+            *out++ = c >= 32 && c < 127 ? c : ' ';
+        }
+        *out++ = '\n';
+    }
+    *out = '\0';
+}
+
+static inline uint64_t mix(uint64_t h, uint64_t w)
+{
+    h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+    return h ^ h >> 32;
+}
+
+uint64_t screen_hash()
+{
+    const uint8_t* tiles = &cerb_ram[SCREEN_TILES];
+    uint32_t used[8] = {};
+    uint64_t h = 0;
+    for (int i = 0; i < SCREEN_COLS * SCREEN_ROWS; i += 8) {
+        uint64_t w;
+        memcpy(&w, tiles + i, 8);
+        h = mix(h, w);
+        for (int j = i; j < i + 8; j++)
+            used[tiles[j] >> 5] |= 1u << (tiles[j] & 31);
+    }
+    // the glyphs on screen, in tile order
+    for (int tile = 0; tile < 256; tile++)
+        if (used[tile >> 5] & 1u << (tile & 31)) {
+            uint64_t w;
+            memcpy(&w, &cerb_ram[SCREEN_GLYPHS + tile * 8], 8);
+            h = mix(h, w ^ tile);
+        }
+    // finish as splitmix64
+    h = (h ^ h >> 30) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ h >> 27) * 0x94d049bb133111ebull;
+    return h ^ h >> 31;
+}
+
+void screen_render_line(int line, uint8_t rgb[SCREEN_WIDTH * 3])
+{
+    const uint8_t* bgcolor = screen_palette[6];
+    for (int col = 0; col < SCREEN_COLS; col++) {
+        uint8_t tile_num = cerb_ram[SCREEN_TILES + (line / 8) * SCREEN_COLS + col];
+        uint8_t tile_dat = cerb_ram[SCREEN_GLYPHS + tile_num * 8 + (line & 7)];
+        const uint8_t* fgcolor = screen_palette[7];
+        if (tile_num >= 8 && tile_num < 32)
+            fgcolor = screen_palette[(tile_num - 8) % 6];
+        for (int p = 0; p < 8; p++)
+            memcpy(&rgb[(col * 8 + p) * 3], tile_dat & (0x80 >> p) ? fgcolor : bgcolor, 3);
+    }
+}
+
+void screen_render(uint8_t rgb[SCREEN_WIDTH * SCREEN_HEIGHT * 3])
+{
+    for (int line = 0; line < SCREEN_HEIGHT; line++)
+        screen_render_line(line, &rgb[line * SCREEN_WIDTH * 3]);
+}
+
+/* PNG writer: one IDAT of uncompressed deflate blocks, written a scanline at a
+ * time so the frame is never held in memory. */
+
+#define PNG_ROW (1 + SCREEN_WIDTH * 3) /* filter type 0, then the pixels */
+#define PNG_DATA (PNG_ROW * SCREEN_HEIGHT)
+#define PNG_BLOCK 65535 /* largest stored block */
+#define PNG_BLOCKS ((PNG_DATA + PNG_BLOCK - 1) / PNG_BLOCK)
+
+struct png_writer {
+    FILE* f;
+    uint32_t crc; /* of the current chunk */
+    uint32_t adler_a, adler_b;
+    uint32_t left; /* image bytes still to write */
+    uint32_t block_left;
+};
+
+static uint32_t crc_table[256];
+
+static void put_be32(uint8_t* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void chunk_data(png_writer* w, const uint8_t* data, uint32_t len)
+{
+    if (!crc_table[1])
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320 ^ c >> 1 : c >> 1;
+            crc_table[n] = c;
+        }
+    for (uint32_t i = 0; i < len; i++)
+        w->crc = crc_table[(w->crc ^ data[i]) & 0xff] ^ w->crc >> 8;
+    fwrite(data, 1, len, w->f);
+}
+
+static void chunk_start(png_writer* w, const char* type, uint32_t len)
+{
+    uint8_t b[4];
+    put_be32(b, len);
+    fwrite(b, 1, 4, w->f);
+    w->crc = 0xffffffff;
+    chunk_data(w, (const uint8_t*)type, 4);
+}
+
+static void chunk_end(png_writer* w)
+{
+    uint8_t b[4];
+    put_be32(b, ~w->crc);
+    fwrite(b, 1, 4, w->f);
+}
+
+static void image_data(png_writer* w, const uint8_t* data, uint32_t len)
+{
+    while (len) {
+        if (!w->block_left) {
+            uint32_t n = w->left < PNG_BLOCK ? w->left : PNG_BLOCK;
+            uint8_t h[5] = { (uint8_t)(n == w->left), (uint8_t)n, (uint8_t)(n >> 8), (uint8_t)~n, (uint8_t)(~n >> 8) };
+            chunk_data(w, h, 5);
+            w->block_left = n;
+        }
+        uint32_t n = len < w->block_left ? len : w->block_left;
+        for (uint32_t i = 0; i < n; i++) {
+            w->adler_a = (w->adler_a + data[i]) % 65521;
+            w->adler_b = (w->adler_b + w->adler_a) % 65521;
+        }
+        chunk_data(w, data, n);
+        w->block_left -= n;
+        w->left -= n;
+        data += n;
+        len -= n;
+    }
+}
+
+bool screen_write_png(const char* path)
+{
+    png_writer w;
+    memset(&w, 0, sizeof w);
+    w.f = fopen(path, "wb");
+    if (!w.f)
+        return false;
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, w.f);
+
+    uint8_t ihdr[13] = { 0 };
+    put_be32(ihdr, SCREEN_WIDTH);
+    put_be32(ihdr + 4, SCREEN_HEIGHT);
+    ihdr[8] = 8; // bits per channel
+    ihdr[9] = 2; // RGB
+    chunk_start(&w, "IHDR", sizeof ihdr);
+    chunk_data(&w, ihdr, sizeof ihdr);
+    chunk_end(&w);
+
+    // zlib header, stored blocks, Adler-32
+    chunk_start(&w, "IDAT", 2 + PNG_BLOCKS * 5 + PNG_DATA + 4);
+    chunk_data(&w, (const uint8_t*)"\x78\x01", 2);
+    w.adler_a = 1;
+    w.left = PNG_DATA;
+    uint8_t row[PNG_ROW];
+    row[0] = 0;
+    for (int line = 0; line < SCREEN_HEIGHT; line++) {
+        screen_render_line(line, row + 1);
+        image_data(&w, row, sizeof row);
+    }
+    uint8_t adler[4];
+    put_be32(adler, w.adler_b << 16 | w.adler_a);
+    chunk_data(&w, adler, 4);
+    chunk_end(&w);
+
+    chunk_start(&w, "IEND", 0);
+    chunk_end(&w);
+    bool ok = !ferror(w.f);
+    return fclose(w.f) == 0 && ok;
+}
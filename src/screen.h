@@ -0,0 +1,37 @@
+#pragma once
+
+/* The video output, without a display.
+ *
+ * The screen is a 40x30 map of tile numbers at SCREEN_TILES, each tile an
+ * 8x8 glyph at SCREEN_GLYPHS + tile * 8, one byte per line with the leftmost
+ * pixel in bit 7. Tiles 8 to 31 are drawn in colour, all others in white, on
+ * black. CAT's font puts the printable ASCII characters at their own codes, so
+ * text printed with cprintString() reads back as ASCII.
+ *
+ * screen_hash() covers everything that decides the pixels (the tile map and
+ * the glyphs it uses) and reads about 2 KiB, so it can run every frame: a test
+ * waits for the screen to change, or to equal a known frame, without rendering.
+ */
+
+#include <stdint.h>
+
+#define SCREEN_TILES 0xf800
+#define SCREEN_GLYPHS 0xf000
+#define SCREEN_COLS 40
+#define SCREEN_ROWS 30
+#define SCREEN_WIDTH (SCREEN_COLS * 8)
+#define SCREEN_HEIGHT (SCREEN_ROWS * 8)
+/* screen_text() output: SCREEN_ROWS lines of SCREEN_COLS characters and '\n' */
+#define SCREEN_TEXT_SIZE (SCREEN_ROWS * (SCREEN_COLS + 1) + 1)
+
+extern const uint8_t screen_palette[8][3]; /* RGB; 6 is the background, 7 white */
+
+/* The tile map as text, tiles outside printable ASCII as spaces. */
+void screen_text(char out[SCREEN_TEXT_SIZE]);
+/* 64-bit hash of the rendered frame. */
+uint64_t screen_hash();
+/* Render one scanline, or the whole frame, as RGB24. */
+void screen_render_line(int line, uint8_t rgb[SCREEN_WIDTH * 3]);
+void screen_render(uint8_t rgb[SCREEN_WIDTH * SCREEN_HEIGHT * 3]);
+/* Render the frame into a PNG file. False if it could not be written. */
+bool screen_write_png(const char* path);
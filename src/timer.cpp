@@ -0,0 +1,105 @@
+#include "timer.h"
+#include "bus.h"
+#include "cerberus.h"
+#include "replay.h"
+#include <stddef.h>
+#include <string.h>
+
+static struct {
+    uint8_t cycles[4]; /* latched */
+    uint8_t micros[4]; /* latched */
+    uint8_t period[4];
+    uint8_t ctrl;
+    uint8_t status;
+    uint64_t deadline;
+} timer;
+
+static void latch(uint8_t* r, uint32_t v)
+{
+    for (int i = 0; i < 4; i++, v >>= 8)
+        r[i] = v & 0xff;
+}
+
+static uint64_t period()
+{
+    uint32_t p = timer.period[0] | timer.period[1] << 8 | timer.period[2] << 16 | (uint32_t)timer.period[3] << 24;
+    return p ? p : 1ull << 32;
+}
+
+static void update_irq()
+{
+    if ((timer.status & TIMER_EXPIRED) && (timer.ctrl & TIMER_IRQ)) {
+        bus_irq |= BUS_IRQ_TIMER;
+        bus_next_event = cpu_cycles; // take it after the current instruction
+    } else {
+        bus_irq &= ~BUS_IRQ_TIMER;
+    }
+}
+
+uint64_t timer_tick(uint64_t now)
+{
+    if (!(timer.ctrl & TIMER_RUN))
+        return UINT64_MAX;
+    if (now >= timer.deadline) {
+        timer.status |= TIMER_EXPIRED;
+        if (timer.ctrl & TIMER_PERIODIC) {
+            uint64_t p = period();
+            timer.deadline += (now - timer.deadline) / p * p + p;
+        } else {
+            timer.ctrl &= ~TIMER_RUN;
+        }
+        update_irq();
+        if (!(timer.ctrl & TIMER_RUN))
+            return UINT64_MAX;
+    }
+    return timer.deadline;
+}
+
+static int timer_read(void* ctx, int port)
+{
+    int reg = port & 0xff;
+    if (reg == TIMER_PORT_CYCLES)
+        latch(timer.cycles, cpu_cycles);
+    else if (reg == TIMER_PORT_MICROS)
+        latch(timer.micros, replay_mode == REPLAY_OFF ? platform_micros() : replay_micros());
+
+    if (reg < TIMER_PORT_MICROS)
+        return timer.cycles[reg - TIMER_PORT_CYCLES];
+    if (reg < TIMER_PORT_PERIOD)
+        return timer.micros[reg - TIMER_PORT_MICROS];
+    if (reg < TIMER_PORT_CTRL)
+        return timer.period[reg - TIMER_PORT_PERIOD];
+    return reg == TIMER_PORT_CTRL ? timer.ctrl : timer.status;
+}
+
+static void timer_write(void* ctx, int port, int value)
+{
+    int reg = port & 0xff;
+    if (reg >= TIMER_PORT_PERIOD && reg < TIMER_PORT_CTRL) {
+        timer.period[reg - TIMER_PORT_PERIOD] = value;
+    } else if (reg == TIMER_PORT_CTRL) {
+        timer.ctrl = value & (TIMER_RUN | TIMER_PERIODIC | TIMER_IRQ);
+        if (timer.ctrl & TIMER_RUN) {
+            timer.deadline = cpu_cycles + period();
+            if (timer.deadline < bus_next_event)
+                bus_next_event = timer.deadline;
+        }
+        update_irq();
+    } else if (reg == TIMER_PORT_STATUS) {
+        timer.status &= ~value;
+        update_irq();
+    }
+}
+
+void timer_reset()
+{
+    memset(&timer, 0, sizeof timer);
+    bus_irq &= ~BUS_IRQ_TIMER;
+}
+
+void timer_init()
+{
+    timer_reset();
+    for (int port = TIMER_PORT_CYCLES; port <= TIMER_PORT_STATUS; port++)
+        bus_register_port(port, timer_read, timer_write, NULL);
+}
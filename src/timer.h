@@ -0,0 +1,43 @@
+#pragma once
+
+/* Timer and cycle counter.
+ *
+ *   $20-$23  CYCLES  free-running count of emulated CPU cycles, low 32 bits.
+ *                    Reading $20 latches all four bytes, read it first.
+ *   $24-$27  MICROS  host wall clock in microseconds, emulated time while
+ *                    recording or replaying (replay.h). Reading $24 latches.
+ *   $28-$2B  PERIOD  timer period in CPU cycles, 0 means 2^32
+ *   $2C      CTRL    bit 0 run, bit 1 periodic (else one-shot), bit 2 IRQ
+ *                    enable. Writing CTRL with the run bit set restarts the
+ *                    timer from PERIOD.
+ *   $2D      STATUS  bit 0 expired. Write 1 to acknowledge.
+ *
+ * While STATUS bit 0 and the IRQ enable bit are set the timer holds the CPU IRQ
+ * line (Z80 maskable interrupt with $FF on the bus, 6502 IRQ). The interrupt
+ * handler must acknowledge it before re-enabling interrupts. A one-shot timer
+ * clears the run bit when it expires.
+ */
+
+#include <stdint.h>
+
+#define TIMER_PORT_CYCLES 0x20
+#define TIMER_PORT_MICROS 0x24
+#define TIMER_PORT_PERIOD 0x28
+#define TIMER_PORT_CTRL 0x2c
+#define TIMER_PORT_STATUS 0x2d
+
+enum {
+    TIMER_RUN = 0x01,
+    TIMER_PERIODIC = 0x02,
+    TIMER_IRQ = 0x04,
+};
+
+enum {
+    TIMER_EXPIRED = 0x01,
+};
+
+void timer_init();
+void timer_reset();
+/* Called by cpu_clockcycles once cpu_cycles reaches bus_next_event. Returns
+ * the cycle of the next expiry. */
+uint64_t timer_tick(uint64_t now);
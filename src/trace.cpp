@@ -0,0 +1,60 @@
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+
+trace_record trace_ring[TRACE_RING_SIZE];
+uint64_t trace_head = 0;
+int trace_trap_pc = -1;
+static int trap_pc = -1; /* as set, trace_trap_pc is cleared when it fires */
+
+static_assert(sizeof(trace_record) == 24, "trace_record layout is part of the file format");
+static_assert((TRACE_RING_SIZE & (TRACE_RING_SIZE - 1)) == 0, "TRACE_RING_SIZE must be a power of two");
+
+void trace_reset()
+{
+    trace_head = 0;
+    trace_trap_pc = trap_pc;
+}
+
+void trace_set_trap(int pc)
+{
+    trap_pc = trace_trap_pc = pc;
+}
+
+void trace_trapped()
+{
+    // a trap in a loop would otherwise rewrite the file on every pass, and
+    // leave the last hit instead of the first
+    trace_trap_pc = -1;
+    trace_dump(TRACE_REASON_TRAP);
+}
+
+bool trace_dump(int reason)
+{
+    char path[256];
+    snprintf(path, sizeof path, "%s/%s", SDCARD_MOUNT_PATH, TRACE_FILENAME);
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        debug_log("Could not write %s\r\n", path);
+        return false;
+    }
+
+    trace_file_header h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, TRACE_MAGIC, sizeof h.magic);
+    h.version = TRACE_VERSION;
+    h.cpu = mode ? TRACE_CPU_Z80 : TRACE_CPU_6502;
+    h.reason = reason;
+    h.record_size = sizeof(trace_record);
+    h.count = trace_head < TRACE_RING_SIZE ? trace_head : TRACE_RING_SIZE;
+    h.cycles = cpu_cycles;
+    fwrite(&h, sizeof h, 1, f);
+
+    // oldest record first
+    for (uint64_t i = trace_head - h.count; i != trace_head; i++) {
+        fwrite(&trace_ring[i & (TRACE_RING_SIZE - 1)], sizeof(trace_record), 1, f);
+    }
+    fclose(f);
+    debug_log("Wrote %u trace records to %s\r\n", h.count, path);
+    return true;
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+/* Instruction trace ring buffer.
+ *
+ * Every instruction executed by either core is appended to a fixed size ring
+ * of compact binary records (PC, the first opcode bytes, the main registers
+ * and a cycle stamp). Recording is a handful of stores per instruction, so it
+ * is always on. The ring is written to SDCARD_MOUNT_PATH/trace.bin when the
+ * program is stopped with F12, on an unknown BIOS call, or when the PC hits the
+ * user trap address. tools/tracedump decodes and disassembles the file.
+ */
+
+#include "Z80.h"
+#include "cerberus.h"
+#include "fake6502.h"
+#include <stdint.h>
+
+/* Number of records kept. Must be a power of two. */
+#ifndef TRACE_RING_SIZE
+#ifdef PLATFORM_SDL
+#define TRACE_RING_SIZE 4096
+#else /* PLATFORM_FABGL */
+#define TRACE_RING_SIZE 256
+#endif
+#endif
+
+#define TRACE_FILENAME "trace.bin"
+#define TRACE_MAGIC "OHDTRACE"
+#define TRACE_VERSION 2
+
+enum {
+    TRACE_CPU_6502 = 0,
+    TRACE_CPU_Z80 = 1,
+};
+
+enum {
+    TRACE_REASON_STOP = 0, /* F12 pressed */
+    TRACE_REASON_BIOS = 1, /* unknown BIOS call */
+    TRACE_REASON_TRAP = 2, /* PC reached the trap address */
+    TRACE_REASON_PORT = 3, /* snapshots written to the trace port, see io.h */
+};
+
+/* trace_file_header.count of a file that is still being appended to: read
+ * records until end of file. */
+#define TRACE_COUNT_STREAM 0xffffffffu
+
+/* One executed instruction, 24 bytes, little endian. Registers are sampled
+ * before the instruction executes. For the Z80 r[] is AF BC DE HL IX IY, for
+ * the 6502 it is A X Y and the flags as trace_6502_regs() stores them. sp is
+ * the 8-bit S register on the 6502.
+ */
+struct trace_record {
+    uint32_t cycle; /* low 32 bits of cpu_cycles when the instruction started */
+    uint16_t pc;
+    uint16_t sp;
+    uint8_t op[4]; /* memory at pc..pc+3 */
+    uint16_t r[6];
+};
+
+/* File layout: trace_file_header followed by count records, oldest first. */
+struct trace_file_header {
+    char magic[8];
+    uint8_t version;
+    uint8_t cpu;
+    uint8_t reason;
+    uint8_t record_size;
+    uint32_t count;
+    uint64_t cycles; /* cpu_cycles at the time of the dump */
+};
+
+extern trace_record trace_ring[TRACE_RING_SIZE];
+extern uint64_t trace_head; /* total records written, does not wrap */
+extern int trace_trap_pc; /* -1 = no trap, or it fired in this run */
+
+/* Called at every CPU reset. Clears the ring and arms the trap again. */
+void trace_reset();
+void trace_set_trap(int pc);
+bool trace_dump(int reason);
+/* The PC reached the trap: dump once and disarm until the next reset. */
+void trace_trapped();
+
+static inline void trace_fill_op(trace_record* t, uint16_t pc)
+{
+    t->pc = pc;
+    t->op[0] = cpeek(pc);
+    t->op[1] = cpeek(pc + 1);
+    t->op[2] = cpeek(pc + 2);
+    t->op[3] = cpeek(pc + 3);
+}
+
+template <class Policy>
+static inline void trace_z80(Z80Core<Policy>& z80, uint64_t cycles)
+{
+    trace_record* t = &trace_ring[trace_head++ & (TRACE_RING_SIZE - 1)];
+    t->cycle = (uint32_t)cycles;
+    trace_fill_op(t, z80.getPC());
+    t->sp = z80.readRegWord(Z80_SP);
+    t->r[0] = z80.readRegWord(Z80_AF);
+    t->r[1] = z80.readRegWord(Z80_BC);
+    t->r[2] = z80.readRegWord(Z80_DE);
+    t->r[3] = z80.readRegWord(Z80_HL);
+    t->r[4] = z80.readRegWord(Z80_IX);
+    t->r[5] = z80.readRegWord(Z80_IY);
+    if (t->pc == trace_trap_pc)
+        trace_trapped();
+}
+
+/* With LAZYFLAGS the flags go in as the core keeps them, so recording does not
+ * work them out: r[3] is cpu.flags with overflow_result above it, r[4]
+ * zero_result and sign_result, r[5] carry_result. trace_6502_flags() puts the
+ * status register together when the file is read.
+ */
+static inline void trace_6502_regs(trace_record* t, const fake6502_context* c)
+{
+    t->sp = c->cpu.s;
+    t->r[0] = c->cpu.a;
+    t->r[1] = c->cpu.x;
+    t->r[2] = c->cpu.y;
+#ifdef LAZYFLAGS
+    t->r[3] = c->cpu.flags | c->cpu.overflow_result << 8;
+    t->r[4] = c->cpu.zero_result | c->cpu.sign_result << 8;
+    t->r[5] = c->cpu.carry_result;
+#else
+    t->r[3] = c->cpu.flags;
+    t->r[4] = 0;
+    t->r[5] = 0;
+#endif
+}
+
+static inline uint8_t trace_6502_flags(const trace_record* t)
+{
+#ifdef LAZYFLAGS
+    fake6502_context c;
+    c.cpu.flags = t->r[3];
+    c.cpu.overflow_result = t->r[3] >> 8;
+    c.cpu.zero_result = t->r[4];
+    c.cpu.sign_result = t->r[4] >> 8;
+    c.cpu.carry_result = t->r[5];
+    return fake6502_get_flags(&c);
+#else
+    return t->r[3];
+#endif
+}
+
+static inline void trace_6502(fake6502_context* c, uint64_t cycles)
+{
+    trace_record* t = &trace_ring[trace_head++ & (TRACE_RING_SIZE - 1)];
+    t->cycle = (uint32_t)cycles;
+    trace_fill_op(t, c->cpu.pc);
+    trace_6502_regs(t, c);
+    if (t->pc == trace_trap_pc)
+        trace_trapped();
+}
@@ -0,0 +1,93 @@
+#include "watch.h"
+#include "bus.h"
+#include "cerberus.h"
+#include <stddef.h>
+
+uint8_t cpu_page_trap[256];
+uint8_t cpu_read_trap[256];
+
+static struct {
+    watch_handler handler;
+    void* ctx;
+} watches[256];
+
+static struct {
+    watch_read_handler handler;
+    void* ctx;
+} read_watches[256];
+
+void cpu_page_written(unsigned int addr, int len)
+{
+    int page = addr >> 8;
+    uint8_t trap = cpu_page_trap[page];
+    if (trap & CPU_TRAP_CODE) {
+        cpu_code_gen[page]++;
+        cpu_code_epoch++;
+    }
+    cpu_page_trap[page] = trap & CPU_TRAP_WATCH;
+    if (trap & CPU_TRAP_WATCH)
+        watches[page].handler(watches[page].ctx, addr, len);
+}
+
+void cpu_page_read(unsigned int addr)
+{
+    int page = addr >> 8;
+    read_watches[page].handler(read_watches[page].ctx, addr);
+}
+
+void watch_reset()
+{
+    for (int page = 0; page < 256; page++) {
+        watches[page].handler = NULL;
+        read_watches[page].handler = NULL;
+        cpu_page_trap[page] &= CPU_TRAP_CODE;
+        cpu_read_trap[page] = 0;
+        bus_update_page(page);
+    }
+}
+
+void watch_register(int page, watch_handler handler, void* ctx)
+{
+    page &= 0xff;
+    watches[page].handler = handler;
+    watches[page].ctx = ctx;
+    cpu_page_trap[page] |= CPU_TRAP_WATCH;
+    bus_write_map[page] = NULL;
+}
+
+void watch_unregister(int page)
+{
+    page &= 0xff;
+    watches[page].handler = NULL;
+    cpu_page_trap[page] &= ~CPU_TRAP_WATCH;
+    bus_update_page(page);
+}
+
+void watch_register_read(int page, watch_read_handler handler, void* ctx)
+{
+    page &= 0xff;
+    read_watches[page].handler = handler;
+    read_watches[page].ctx = ctx;
+    cpu_read_trap[page] = 1;
+    bus_update_page(page);
+}
+
+void watch_unregister_read(int page)
+{
+    page &= 0xff;
+    read_watches[page].handler = NULL;
+    cpu_read_trap[page] = 0;
+    bus_update_page(page);
+}
+
+void watch_harvest(uint32_t dirty[8])
+{
+    for (int i = 0; i < 8; i++)
+        dirty[i] = 0;
+    for (int page = 0; page < 256; page++)
+        if (!(cpu_page_trap[page] & CPU_TRAP_CLEAN)) {
+            dirty[page >> 5] |= 1u << (page & 31);
+            cpu_page_trap[page] |= CPU_TRAP_CLEAN;
+            bus_write_map[page] = NULL;
+        }
+}
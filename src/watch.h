@@ -0,0 +1,45 @@
+#pragma once
+
+/* Write tracking on guest RAM.
+ *
+ * A write to a page with any bit set in cpu_page_trap (cerberus.h) runs
+ * cpu_page_written() after the RAM is updated. That covers cpoke(),
+ * cpoke_written() and the cores' bus_poke(), whose write map entry is NULL
+ * while the page is trapped (bus.h). A write to any other page costs the one
+ * branch in cpoke() and nothing in bus_poke().
+ *
+ *   CPU_TRAP_CODE   the page holds cached decoded code. The write bumps
+ *                   cpu_code_gen and clears the bit.
+ *   CPU_TRAP_CLEAN  the page has not been written since the last
+ *                   watch_harvest(). The write clears the bit.
+ *   CPU_TRAP_WATCH  the page has a handler, called on every write.
+ *
+ * Dirty tracking is always on, and costs one slow write per page that is
+ * written between two harvests: after that the page runs at full speed again.
+ */
+
+#include <stdint.h>
+
+/* addr..addr + len - 1 was written, all within one page. A handler that writes
+ * to its own page must do so through cerb_ram, not cpoke(). */
+typedef void (*watch_handler)(void* ctx, int addr, int len);
+
+/* drop all handlers and count every page as dirty */
+void watch_reset();
+void watch_register(int page, watch_handler handler, void* ctx);
+void watch_unregister(int page);
+
+/* addr was read by a core. Reads run through bus_page_read() while the page
+ * has a handler (cpu_read_trap), opcode fetches included. Translated 6502
+ * blocks and the Z80's bulk block instructions read RAM directly and are not
+ * seen, nor are CAT's cpeek() and reads of device pages. */
+typedef void (*watch_read_handler)(void* ctx, int addr);
+
+void watch_register_read(int page, watch_read_handler handler, void* ctx);
+void watch_unregister_read(int page);
+
+/* Fill dirty with the pages written since the last harvest, page n in bit
+ * n & 31 of dirty[n >> 5], and mark them all clean in the same pass. Meant to
+ * be called once per frame.
+ */
+void watch_harvest(uint32_t dirty[8]);
@@ -0,0 +1,265 @@
+/* Unit test of the breakpoints (breakpoints.h): bp_parse(), the conditions and
+ * hit counts, which reads the watchpoints count, and that the debug ports
+ * (io.h) report the registers of the running core while -z80fast hands over to
+ * the exact core for a breakpoint.
+ *
+ *   tests/bptest [-v]
+ *
+ * Each case loads a few instructions at CODE_START on a machine with nothing
+ * on the bus and runs it through cpu_clockcycles() until it stops or the cycles
+ * run out. Prints every check with -v, only the failed ones otherwise, and
+ * exits with 1 if one failed.
+ */
+
+#include "../src/Z80.h"
+#include "../src/breakpoints.h"
+#include "../src/bus.h"
+#include "../src/cerberus.h"
+#include "../src/fake6502.h"
+#include "../src/io.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+extern Z80 z80;
+extern fake6502_context m6502;
+
+int readKey() { return 0; }
+void platform_delay(int ms) { }
+uint64_t platform_micros() { return 0; }
+void debug_log(const char* format, ...) { }
+
+#define CODE_START 0x0205
+#define RUN_CYCLES 10000
+
+static bool verbose;
+static int checks, failed;
+
+static void check(bool ok, const char* what)
+{
+    checks++;
+    if (!ok)
+        failed++;
+    if (!ok || verbose)
+        printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+}
+
+/* a fresh machine in Z80 or 6502 mode with code at CODE_START */
+static void load(bool z80_mode, const uint8_t* code, int length)
+{
+    mode = z80_mode;
+    cpurunning = true;
+    bp_clear(BP_USER);
+    init_cpus();
+    bus_reset();
+    memset(cerb_ram, 0, sizeof cerb_ram);
+    memcpy(&cerb_ram[CODE_START], code, length);
+    cerb_ram[0xfffc] = CODE_START & 0xff;
+    cerb_ram[0xfffd] = CODE_START >> 8;
+    cpu_reset();
+    bus_unregister_page(BUS_IO_PAGE);
+    bp_reg_write(BP_REG_PC, CODE_START);
+    bp_reg_write(0, 0); // af or a
+}
+
+static unsigned int z80_a()
+{
+    return bp_reg_read(0) >> 8;
+}
+
+static void test_parse()
+{
+    static const struct {
+        const char* spec;
+        bool ok;
+    } specs[] = {
+        { "0209", true },
+        { "ffff", true },
+        { "0209,a==3f", true },
+        { "0209,a=3f", true },
+        { "8000-80ff,hits>=10,hl!=8000", true },
+        { "0209,x<10,y>1,s<=ff,p>=0", true },
+        { "0209,af'==1234", true },
+        { "", false },
+        { "x", false },
+        { "10000", false },
+        { "8000-7fff", false },
+        { "8000-10000", false },
+        { "0209;", false },
+        { "0209,", false },
+        { "0209,zz==1", false },
+        { "0209,a~1", false },
+        { "0209,a==", false },
+        { "0209,a==1x", false },
+        { "0209,a==1,b==2,c==3,d==4,e==5", false },
+    };
+    for (size_t i = 0; i < sizeof specs / sizeof specs[0]; i++) {
+        char what[80];
+        snprintf(what, sizeof what, "bp_parse(\"%s\") %s", specs[i].spec, specs[i].ok ? "parses" : "fails");
+        check(bp_parse(BP_USER, BP_EXEC, specs[i].spec) == specs[i].ok, what);
+        bp_clear(BP_USER);
+    }
+    check(bp_parse(BP_USER, BP_WRITE, "ff00-ffff,hits>=1"), "a watchpoint range up to ffff parses");
+    bp_clear(BP_USER);
+}
+
+/* ld b,5; loop: inc a; djnz loop; jr $ */
+static const uint8_t z80_loop[] = { 0x06, 0x05, 0x3c, 0x10, 0xfd, 0x18, 0xfe };
+#define LOOP 0x0207
+
+static void test_conditions()
+{
+    load(true, z80_loop, sizeof z80_loop);
+    bp_parse(BP_USER, BP_EXEC, "0207,a==3");
+    cpu_clockcycles(RUN_CYCLES);
+    check(bp_stopped && bp_stop.reason == BP_EXEC && bp_stop.addr == LOOP, "z80 break at 0207,a==3 stops");
+    check(z80_a() == 3, "... with A 3, before the inc");
+
+    load(true, z80_loop, sizeof z80_loop);
+    bp_parse(BP_USER, BP_EXEC, "0207,hits>=2");
+    cpu_clockcycles(RUN_CYCLES);
+    check(bp_stopped && z80_a() == 1, "z80 break at 0207,hits>=2 stops the second time");
+    bp_resume(false);
+    cpu_clockcycles(RUN_CYCLES);
+    check(bp_stopped && z80_a() == 2, "... and again the third time");
+
+    load(true, z80_loop, sizeof z80_loop);
+    bp_parse(BP_USER, BP_EXEC, "0207,a==ff");
+    cpu_clockcycles(RUN_CYCLES);
+    check(!bp_stopped && z80_a() == 5, "z80 break at 0207,a==ff never stops");
+
+    load(true, z80_loop, sizeof z80_loop);
+    bp_parse(BP_USER, BP_EXEC, "0207,x==0");
+    cpu_clockcycles(RUN_CYCLES);
+    check(!bp_stopped, "a condition on a 6502 register never holds on the Z80");
+
+    load(true, z80_loop, sizeof z80_loop);
+    bp_parse(BP_USER, BP_EXEC, "0207,a>=2,b<=3");
+    cpu_clockcycles(RUN_CYCLES);
+    check(bp_stopped && z80_a() == 2, "all conditions must hold");
+}
+
+static void test_watch()
+{
+    // ld a,(0208); jr $, the byte after the instruction is read as data
+    static const uint8_t z80_load[] = { 0x3a, 0x08, 0x02, 0x18, 0xfe };
+    load(true, z80_load, sizeof z80_load);
+    bp_parse(BP_USER, BP_READ, "0208");
+    cpu_clockcycles(RUN_CYCLES);
+    check(bp_stopped && bp_stop.reason == BP_READ && bp_stop.addr == 0x0208,
+        "z80 rwatch on the byte after ld a,(nn) sees the read");
+
+    load(true, z80_load, sizeof z80_load);
+    bp_parse(BP_USER, BP_READ, "0205-0207");
+    cpu_clockcycles(RUN_CYCLES);
+    check(!bp_stopped, "z80 rwatch on ld a,(nn) itself does not see its fetch");
+
+    // bit 0,(ix+2); jr $, fetches op before d
+    static const uint8_t z80_indexed[] = { 0xdd, 0xcb, 0x02, 0x46, 0x18, 0xfe };
+    load(true, z80_indexed, sizeof z80_indexed);
+    bp_reg_write(6, 0x8000);
+    bp_parse(BP_USER, BP_READ, "0205-0208");
+    cpu_clockcycles(RUN_CYCLES);
+    check(!bp_stopped, "z80 rwatch on bit 0,(ix+d) itself does not see its fetch");
+
+    load(true, z80_indexed, sizeof z80_indexed);
+    bp_reg_write(6, 0x8000);
+    bp_parse(BP_USER, BP_READ, "8002,hits==1");
+    cpu_clockcycles(RUN_CYCLES);
+    check(bp_stopped && bp_stop.addr == 0x8002, "z80 rwatch on (ix+d) sees the read");
+
+    // lda $0208; jmp $0208
+    static const uint8_t m6502_load[] = { 0xad, 0x08, 0x02, 0x4c, 0x08, 0x02 };
+    load(false, m6502_load, sizeof m6502_load);
+    bp_parse(BP_USER, BP_READ, "0208");
+    cpu_clockcycles(RUN_CYCLES);
+    check(bp_stopped && bp_stop.reason == BP_READ && bp_stop.addr == 0x0208,
+        "6502 rwatch on the byte after lda abs sees the read");
+
+    // inx; jmp $0205
+    static const uint8_t m6502_inx[] = { 0xe8, 0x4c, 0x05, 0x02 };
+    load(false, m6502_inx, sizeof m6502_inx);
+    bp_parse(BP_USER, BP_READ, "0205-0208");
+    cpu_clockcycles(RUN_CYCLES);
+    check(!bp_stopped, "6502 rwatch on the code does not see its fetches");
+
+    load(false, m6502_inx, sizeof m6502_inx);
+    bp_parse(BP_USER, BP_WRITE, "0205-0208");
+    cpoke(0x0206, 0x4c);
+    check(bp_stopped == false, "a write outside the CPU is only seen at the next instruction");
+    cpu_clockcycles(RUN_CYCLES);
+    check(bp_stopped && bp_stop.reason == BP_WRITE && bp_stop.addr == 0x0206, "... which then stops");
+}
+
+/* What the debug ports wrote to the console since the last call. */
+static void console_output(char* out, int size)
+{
+    fflush(stdout);
+    FILE* f = tmpfile();
+    int saved = dup(1);
+    dup2(fileno(f), 1);
+    io_flush();
+    fflush(stdout);
+    dup2(saved, 1);
+    close(saved);
+    rewind(f);
+    size_t n = fread(out, 1, size - 1, f);
+    out[n] = 0;
+    fclose(f);
+}
+
+static void test_ports()
+{
+    // ld bc,1234; ld de,5678; out (0),a; jr $
+    static const uint8_t z80_regdump[] = { 0x01, 0x34, 0x12, 0x11, 0x78, 0x56, 0xd3, 0x00, 0x18, 0xfe };
+    char out[1024];
+    console_output(out, sizeof out);
+
+    load(true, z80_regdump, sizeof z80_regdump);
+    io_set_regdump_port(IO_PORT_REGDUMP);
+    cpu_clockcycles(RUN_CYCLES);
+    console_output(out, sizeof out);
+    check(strstr(out, "BC=1234 DE=5678") != NULL, "z80 regdump port reports the registers");
+
+    // a watchpoint that never fires hands -z80fast over to the exact core,
+    // other values so what is left of the last run does not pass
+    load(true, z80_regdump, sizeof z80_regdump);
+    cpoke(CODE_START + 1, 0xcd);
+    cpoke(CODE_START + 2, 0xab);
+    io_set_regdump_port(IO_PORT_REGDUMP);
+    bp_parse(BP_USER, BP_WRITE, "9000");
+    cpu_z80fast = true;
+    cpu_clockcycles(RUN_CYCLES);
+    cpu_z80fast = false;
+    console_output(out, sizeof out);
+    check(!bp_stopped && strstr(out, "BC=abcd DE=5678") != NULL,
+        "... also with -z80fast and a watchpoint set");
+}
+
+int main(int argc, char** argv)
+{
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-v") == 0)
+            verbose = true;
+        else {
+            fprintf(stderr, "usage: %s [-v]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    cat_setup();
+    // the debug NOPs print to stderr
+    if (!verbose) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 2);
+        close(null);
+    }
+
+    test_parse();
+    test_conditions();
+    test_watch();
+    test_ports();
+    printf("bptest: %d of %d checks passed\n", checks - failed, checks);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,483 @@
+/* CPU conformance tests and throughput benchmark.
+ *
+ *   tests/cputest [-v] [-roms DIR] [-json FILE] [-baseline FILE]
+ *                 [-tolerance PERCENT] [TEST...]
+ *
+ * Runs each test through cpu_clockcycles(), the path the emulator uses, and
+ * reports pass or fail with the emulated MHz and the host nanoseconds per
+ * guest instruction (counted in cpu_instructions). With no TEST arguments all
+ * of them run.
+ *
+ *   zexdoc, zexall    Frank Cringle's Z80 instruction exercisers, CP/M .com
+ *                     files. A small CP/M shim provides BDOS functions 2 and
+ *                     9 through port CPM_PORT_BDOS and warm boot through
+ *                     CPM_PORT_BOOT.
+ *   6502_functional   Klaus Dormann's functional test and 65C02 extended
+ *   65c02_extended    opcodes test, 64K images started at $0400. They end in
+ *                     a jump to itself, the success address tells pass from
+ *                     fail.
+ *   6502_decimal      Decimal mode ADC and SBC, driven from the host: every
+ *                     pair of valid BCD operands with either carry, checked
+ *                     against decimal arithmetic, then known 65C02 results
+ *                     for V of ADC and for digits above 9.
+ *
+ * The ROM images are not part of the repository. `make test-roms` downloads
+ * them into tests/roms. A test whose image is missing is skipped, which the
+ * report says at the end; it does not fail the run.
+ *
+ * -json writes one line per test in a JSON array. -baseline reads such a file
+ * and fails a test whose MHz dropped by more than -tolerance percent (10).
+ * Exits with 1 if a test failed and 2 if one regressed.
+ */
+
+#include "../src/Z80.h"
+#include "../src/bus.h"
+#include "../src/cerberus.h"
+#include "../src/fake6502.h"
+#include "../src/trace.h"
+#include <chrono>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+
+extern Z80 z80;
+extern fake6502_context m6502;
+
+int readKey() { return 0; }
+void platform_delay(int ms) { }
+uint64_t platform_micros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+void debug_log(const char* format, ...) { }
+
+#define CPM_PORT_BDOS 0xf0
+#define CPM_PORT_BOOT 0xf1
+#define CPM_BDOS 0xff00 /* also the top of the TPA */
+
+#define SLICE 100000 /* cycles between checks for the end of a test */
+
+enum {
+    STATUS_PASS,
+    STATUS_FAIL,
+    STATUS_SKIP,
+};
+
+static const char* const status_names[] = { "pass", "fail", "skip" };
+
+struct cpu_test;
+
+struct result {
+    int status;
+    uint64_t cycles;
+    uint64_t instructions;
+    double seconds;
+    std::string detail;
+};
+
+struct cpu_test {
+    const char* name;
+    const char* rom; /* NULL: built in */
+    bool z80;
+    void (*run)(const cpu_test* t, const uint8_t* image, long size, result* r);
+    uint16_t start;
+    uint16_t success; /* trap address of a passed 6502 test */
+    uint64_t max_cycles;
+};
+
+static bool verbose;
+
+/* cpu_clockcycles() until done() or max_cycles, counting instructions */
+
+template <class F>
+static void run_cpu(result* r, uint64_t max_cycles, F done)
+{
+    uint64_t start = cpu_cycles;
+    cpurunning = true;
+    auto t0 = std::chrono::steady_clock::now();
+    while (cpu_cycles - start < max_cycles && !done()) {
+        uint64_t instructions = cpu_instructions;
+        cpu_clockcycles(SLICE);
+        r->instructions += cpu_instructions - instructions;
+    }
+    r->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    cpurunning = false;
+    r->cycles = cpu_cycles - start;
+    if (r->cycles >= max_cycles) {
+        r->status = STATUS_FAIL;
+        r->detail = "cycle limit reached";
+    }
+}
+
+// CP/M
+
+static std::string cpm_output;
+static bool cpm_done;
+
+static void cpm_putc(int c)
+{
+    cpm_output += (char)c;
+    if (verbose)
+        putchar(c);
+}
+
+static void cpm_bdos(void* ctx, int port, int value)
+{
+    switch (z80.readRegByte(Z80_C)) {
+    case 2:
+        cpm_putc(z80.readRegByte(Z80_E));
+        break;
+    case 9:
+        for (uint16_t addr = z80.readRegWord(Z80_DE); cpeek(addr) != '$'; addr++)
+            cpm_putc(cpeek(addr));
+        break;
+    }
+}
+
+static void cpm_boot(void* ctx, int port, int value)
+{
+    cpm_done = true;
+}
+
+static void run_cpm(const cpu_test* t, const uint8_t* image, long size, result* r)
+{
+    static const uint8_t page0[] = {
+        0xd3, CPM_PORT_BOOT, /* 0000 out (CPM_PORT_BOOT),a */
+        0x18, 0xfe, /*          0002 jr $ */
+        0x00, /*                0004 */
+        0xc3, CPM_BDOS & 0xff, CPM_BDOS >> 8, /* 0005 jp CPM_BDOS */
+    };
+    static const uint8_t bdos[] = {
+        0xd3, CPM_PORT_BDOS, /* out (CPM_PORT_BDOS),a */
+        0xc9, /*                ret */
+    };
+
+    memcpy(cerb_ram, page0, sizeof page0);
+    memcpy(&cerb_ram[CPM_BDOS], bdos, sizeof bdos);
+    memcpy(&cerb_ram[0x100], image, size);
+    bus_register_port(CPM_PORT_BDOS, NULL, cpm_bdos, NULL);
+    bus_register_port(CPM_PORT_BOOT, NULL, cpm_boot, NULL);
+    z80.setPC(0x100);
+    cpm_output.clear();
+    cpm_done = false;
+
+    run_cpu(r, t->max_cycles, [] { return cpm_done; });
+    if (r->status == STATUS_FAIL)
+        return;
+    size_t error = cpm_output.find("ERROR");
+    if (error != std::string::npos) {
+        size_t line = cpm_output.rfind('\n', error);
+        r->status = STATUS_FAIL;
+        size_t from = line == std::string::npos ? 0 : line + 1;
+        r->detail = cpm_output.substr(from, cpm_output.find_first_of("\r\n", error) - from);
+    } else if (cpm_output.find("Tests complete") == std::string::npos) {
+        r->status = STATUS_FAIL;
+        r->detail = "no \"Tests complete\"";
+    }
+}
+
+// 6502 trap style
+
+/* JMP to itself or a branch to itself at pc */
+static bool trapped(uint16_t pc)
+{
+    uint8_t op = cpeek(pc);
+    if (op == 0x4c)
+        return cpeekW(pc + 1) == pc;
+    bool branch = (op & 0x1f) == 0x10 || op == 0x80;
+    return branch && cpeek(pc + 1) == 0xfe;
+}
+
+static void run_trap(const cpu_test* t, const uint8_t* image, long size, result* r)
+{
+    memcpy(cerb_ram, image, size);
+    // the tests own all 64K, no I/O page
+    bus_unregister_page(BUS_IO_PAGE);
+    m6502.cpu.pc = t->start;
+
+    // a trap macro the program falls through may sit where a slice ends,
+    // so it only counts once the PC stays there
+    run_cpu(r, t->max_cycles, [] {
+        uint16_t pc = m6502.cpu.pc;
+        if (!trapped(pc))
+            return false;
+        cpu_clockcycles(8);
+        return m6502.cpu.pc == pc;
+    });
+    if (r->status == STATUS_FAIL)
+        return;
+    if (m6502.cpu.pc != t->success) {
+        char detail[40];
+        snprintf(detail, sizeof detail, "trapped at $%04x", m6502.cpu.pc);
+        r->status = STATUS_FAIL;
+        r->detail = detail;
+    }
+}
+
+// 6502 decimal mode
+
+#define FLAGS_NZC (FAKE6502_SIGN_FLAG | FAKE6502_ZERO_FLAG | FAKE6502_CARRY_FLAG)
+#define FLAGS_NVZC (FLAGS_NZC | FAKE6502_OVERFLOW_FLAG)
+
+/* A and P after ADC (sbc 0) or SBC (sbc 1) of two valid BCD numbers on the
+ * 65C02, by decimal arithmetic on the numbers the bytes stand for. N and Z
+ * follow A. V of SBC is the binary one; V of ADC has no decimal meaning and is
+ * left to decimal_vectors.
+ */
+static int bcd_65c02(int sbc, int a, int b, int c, int* rp)
+{
+    int x = (a >> 4) * 10 + (a & 0x0f), y = (b >> 4) * 10 + (b & 0x0f);
+    int r = sbc ? x - y - !c : x + y + c;
+    int p = 0;
+    if (sbc ? r >= 0 : r >= 100)
+        p |= FAKE6502_CARRY_FLAG;
+    if (sbc) {
+        int s = (int8_t)a - (int8_t)b - !c;
+        if (s < -128 || s > 127)
+            p |= FAKE6502_OVERFLOW_FLAG;
+    }
+    r = (r + 100) % 100;
+    int ra = (r / 10) << 4 | r % 10;
+    *rp = p | (ra ? 0 : FAKE6502_ZERO_FLAG) | (ra & FAKE6502_SIGN_FLAG);
+    return ra;
+}
+
+/* Results the digit arithmetic cannot give: V of ADC, worked by hand from
+ * sequence 2 in appendix A of Bruce Clark's decimal mode tutorial, and
+ * operands with digits above 9 from its sequences 1 and 4.
+ */
+static const struct {
+    uint8_t sbc, a, b, c;
+    uint8_t ra, rp;
+} decimal_vectors[] = {
+    // ADC: V of the sum with the low digit adjusted, as signed bytes
+    { 0, 0x79, 0x00, 1, 0x80, FAKE6502_SIGN_FLAG | FAKE6502_OVERFLOW_FLAG },
+    { 0, 0x24, 0x56, 0, 0x80, FAKE6502_SIGN_FLAG | FAKE6502_OVERFLOW_FLAG },
+    { 0, 0x93, 0x82, 0, 0x75, FAKE6502_OVERFLOW_FLAG | FAKE6502_CARRY_FLAG },
+    { 0, 0x89, 0x76, 0, 0x65, FAKE6502_CARRY_FLAG },
+    { 0, 0x99, 0x01, 0, 0x00, FAKE6502_ZERO_FLAG | FAKE6502_CARRY_FLAG },
+    { 0, 0x58, 0x46, 1, 0x05, FAKE6502_OVERFLOW_FLAG | FAKE6502_CARRY_FLAG },
+    { 0, 0x00, 0x00, 0, 0x00, FAKE6502_ZERO_FLAG },
+    // digits above 9: the low digit carries once it reaches 10, the high
+    // digit adds 6 once the sum reaches $A0
+    { 0, 0x0f, 0x01, 0, 0x16, 0 },
+    { 0, 0x1a, 0x00, 0, 0x20, 0 },
+    { 0, 0xa0, 0x00, 0, 0x00, FAKE6502_ZERO_FLAG | FAKE6502_CARRY_FLAG },
+    { 0, 0xff, 0xff, 1, 0x55, FAKE6502_CARRY_FLAG },
+    // SBC: the binary difference, less 6 for a borrow out of the low digit
+    // and $60 for one out of the byte
+    { 1, 0x0f, 0x00, 1, 0x0f, FAKE6502_CARRY_FLAG },
+    { 1, 0x10, 0x0f, 1, 0xfb, FAKE6502_SIGN_FLAG | FAKE6502_CARRY_FLAG },
+    { 1, 0x00, 0xff, 1, 0x9b, FAKE6502_SIGN_FLAG },
+    { 1, 0xaa, 0x00, 0, 0xa9, FAKE6502_SIGN_FLAG | FAKE6502_CARRY_FLAG },
+};
+
+/* Runs sed; adc $10 or sed; sbc $10 with the operand in $10 and checks A and
+ * the flags in mask. The code stays put, so once it is hot the translated
+ * blocks run it as well.
+ */
+static bool check_decimal(int sbc, int a, int b, int c, int ra, int rp, int mask, result* r)
+{
+    cpoke(0x10, b);
+    m6502.cpu.pc = sbc ? 0x310 : 0x300;
+    m6502.cpu.a = a;
+    fake6502_set_flags(&m6502, FAKE6502_CONSTANT_FLAG | c);
+    uint64_t instructions = cpu_instructions;
+    uint64_t start = cpu_cycles;
+    cpurunning = true;
+    cpu_clockcycles(5);
+    cpurunning = false;
+    r->instructions += cpu_instructions - instructions;
+    r->cycles += cpu_cycles - start;
+
+    int p = fake6502_get_flags(&m6502) & mask;
+    if (m6502.cpu.a == ra && p == rp)
+        return true;
+    char detail[80];
+    snprintf(detail, sizeof detail, "%s $%02x,#$%02x C=%d: A=%02x P=%02x, expected A=%02x P=%02x",
+        sbc ? "sbc" : "adc", a, b, c, m6502.cpu.a, p, ra, rp);
+    r->status = STATUS_FAIL;
+    r->detail = detail;
+    return false;
+}
+
+static void run_decimal(const cpu_test* t, const uint8_t* image, long size, result* r)
+{
+    static const uint8_t code[] = { 0xf8, 0x65, 0x10, 0x4c, 0x00, 0x03 };
+    memcpy(&cerb_ram[0x300], code, sizeof code);
+    memcpy(&cerb_ram[0x310], code, sizeof code);
+    cerb_ram[0x311] = 0xe5;
+    cerb_ram[0x315] = 0x03;
+    cerb_ram[0x314] = 0x10;
+
+    auto t0 = std::chrono::steady_clock::now();
+    bool ok = true;
+    for (int sbc = 0; sbc < 2 && ok; sbc++)
+        for (int c = 0; c < 2 && ok; c++)
+            for (int x = 0; x < 100 && ok; x++)
+                for (int y = 0; y < 100 && ok; y++) {
+                    int a = (x / 10) << 4 | x % 10, b = (y / 10) << 4 | y % 10, rp;
+                    int ra = bcd_65c02(sbc, a, b, c, &rp);
+                    ok = check_decimal(sbc, a, b, c, ra, rp, sbc ? FLAGS_NVZC : FLAGS_NZC, r);
+                }
+    for (size_t i = 0; i < sizeof decimal_vectors / sizeof decimal_vectors[0] && ok; i++) {
+        const auto& v = decimal_vectors[i];
+        ok = check_decimal(v.sbc, v.a, v.b, v.c, v.ra, v.rp, FLAGS_NVZC, r);
+    }
+    r->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+static const cpu_test tests[] = {
+    { "zexdoc", "zexdoc.com", true, run_cpm, 0, 0, 100000000000ull },
+    { "zexall", "zexall.com", true, run_cpm, 0, 0, 100000000000ull },
+    { "6502_functional", "6502_functional_test.bin", false, run_trap, 0x0400, 0x3469, 2000000000ull },
+    { "65c02_extended", "65C02_extended_opcodes_test.bin", false, run_trap, 0x0400, 0x24f1, 2000000000ull },
+    { "6502_decimal", NULL, false, run_decimal, 0, 0, 0 },
+};
+
+#define TEST_COUNT (int)(sizeof tests / sizeof tests[0])
+
+static uint8_t* load_rom(const char* dir, const char* name, long* size)
+{
+    std::string path = std::string(dir) + "/" + name;
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f)
+        return NULL;
+    uint8_t* image = (uint8_t*)malloc(0x10000);
+    *size = fread(image, 1, 0x10000, f);
+    fclose(f);
+    return image;
+}
+
+static void run_test(const cpu_test* t, const char* roms, result* r)
+{
+    long size = 0;
+    uint8_t* image = NULL;
+    if (t->rom && !(image = load_rom(roms, t->rom, &size))) {
+        r->status = STATUS_SKIP;
+        r->detail = std::string(t->rom) + " missing, see make test-roms";
+        return;
+    }
+
+    mode = t->z80;
+    init_cpus();
+    memset(cerb_ram, 0, sizeof cerb_ram);
+    cpu_reset();
+
+    // the debug NOPs and ports write to stderr, keep the report readable
+    int saved_stderr = dup(2);
+    if (!verbose) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 2);
+        close(null);
+    }
+    t->run(t, image, size, r);
+    dup2(saved_stderr, 2);
+    close(saved_stderr);
+    free(image);
+}
+
+/* MHz of test name in a file written by -json, 0 if not found */
+static double baseline_mhz(const char* path, const char* name)
+{
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return 0;
+    char line[512], key[80];
+    double mhz = 0;
+    snprintf(key, sizeof key, "\"name\": \"%s\"", name);
+    while (fgets(line, sizeof line, f))
+        if (strstr(line, key)) {
+            const char* m = strstr(line, "\"mhz\": ");
+            if (m)
+                mhz = atof(m + 7);
+        }
+    fclose(f);
+    return mhz;
+}
+
+int main(int argc, char** argv)
+{
+    const char* roms = "tests/roms";
+    const char* json = NULL;
+    const char* baseline = NULL;
+    double tolerance = 10;
+    bool selected[TEST_COUNT] = {};
+    bool any_selected = false;
+
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-v") == 0) {
+            verbose = true;
+        } else if (strcmp(argv[arg], "-roms") == 0 && arg + 1 < argc) {
+            roms = argv[++arg];
+        } else if (strcmp(argv[arg], "-json") == 0 && arg + 1 < argc) {
+            json = argv[++arg];
+        } else if (strcmp(argv[arg], "-baseline") == 0 && arg + 1 < argc) {
+            baseline = argv[++arg];
+        } else if (strcmp(argv[arg], "-tolerance") == 0 && arg + 1 < argc) {
+            tolerance = atof(argv[++arg]);
+        } else {
+            int i = 0;
+            while (i < TEST_COUNT && strcmp(argv[arg], tests[i].name) != 0)
+                i++;
+            if (i == TEST_COUNT) {
+                fprintf(stderr, "unknown test %s\n", argv[arg]);
+                return 1;
+            }
+            selected[i] = any_selected = true;
+        }
+    }
+
+    cat_setup();
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    FILE* out = json ? fopen(json, "w") : NULL;
+    if (json && !out) {
+        perror(json);
+        return 1;
+    }
+    if (out)
+        fprintf(out, "[\n");
+
+    int failed = 0, regressed = 0, skipped = 0, written = 0;
+    printf("%-16s %-5s %14s %16s %10s %8s\n", "test", "", "cycles", "instructions", "MHz", "ns/inst");
+    for (int i = 0; i < TEST_COUNT; i++) {
+        if (any_selected && !selected[i])
+            continue;
+        const cpu_test* t = &tests[i];
+        result r = {};
+        run_test(t, roms, &r);
+
+        double mhz = r.seconds > 0 ? r.cycles / r.seconds / 1e6 : 0;
+        double ns = r.instructions ? r.seconds * 1e9 / r.instructions : 0;
+        printf("%-16s %-5s %14llu %16llu %10.1f %8.2f  %s\n", t->name, status_names[r.status],
+            (unsigned long long)r.cycles, (unsigned long long)r.instructions, mhz, ns, r.detail.c_str());
+        if (r.status == STATUS_FAIL)
+            failed++;
+        if (r.status == STATUS_SKIP)
+            skipped++;
+
+        double base = baseline && r.status == STATUS_PASS ? baseline_mhz(baseline, t->name) : 0;
+        if (base > 0 && mhz < base * (1 - tolerance / 100)) {
+            printf("%-16s regressed: %.1f MHz, baseline %.1f MHz\n", t->name, mhz, base);
+            regressed++;
+        }
+
+        if (out) {
+            fprintf(out, "%s  {\"name\": \"%s\", \"cpu\": \"%s\", \"status\": \"%s\", \"cycles\": %llu, "
+                         "\"instructions\": %llu, \"seconds\": %.6f, \"mhz\": %.3f, \"ns_per_instruction\": %.4f}",
+                written++ ? ",\n" : "", t->name, t->z80 ? "z80" : "6502", status_names[r.status],
+                (unsigned long long)r.cycles, (unsigned long long)r.instructions, r.seconds, mhz, ns);
+        }
+    }
+    if (out) {
+        fprintf(out, "\n]\n");
+        fclose(out);
+    }
+    if (skipped)
+        printf("%d tests skipped, their images are not in %s; make test-roms downloads them (needs network)\n", skipped, roms);
+    return failed ? 1 : regressed ? 2 : 0;
+}
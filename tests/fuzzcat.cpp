@@ -0,0 +1,365 @@
+/* Fuzz target for the CAT BIOS mailbox and command line parser.
+ *
+ * Each input is a guest's view of the machine when it hands control to CAT:
+ *
+ *   byte 0         bit 7: run the edit line through enter() first
+ *                  bit 6: Z80 mode, else 6502
+ *                  bits 0-1: number of BIOS calls, 0 to 3
+ *   bytes 1-3      inbox flag of each BIOS call
+ *   bytes 4-41     the edit line, not necessarily zero terminated
+ *   rest           RAM from config_outbox_flag ($0200) on, the inbox data
+ *                  pointer at $0203 included
+ *
+ * Missing bytes read as zero. The calls go through messageHandler() as if the
+ * CPU had raised them, against a scratch directory standing in for the uSD
+ * card. It holds a small and a larger-than-RAM file and a subdirectory. A
+ * file next to the card directory must come through every input untouched,
+ * or the target aborts.
+ *
+ * Built with libFuzzer (make fuzz, needs clang) the engine provides main().
+ * Otherwise, as tests/fuzzcat for make test, main() replays the files given
+ * on the command line, or with none runs built-in inputs for each command
+ * followed by random mutations of them:
+ *
+ *   tests/fuzzcat [-runs N] [-seed S] [-corpus DIR] [FILE...]
+ *
+ * -corpus writes the built-in inputs to DIR as a starting corpus instead.
+ *
+ * Build either with -fsanitize=address,undefined to catch memory errors; a
+ * hang shows up as the run not finishing.
+ */
+
+#include "../src/cerberus.h"
+#include "../src/ps2.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+extern volatile char editLine[38];
+extern volatile uint8_t pos;
+extern DIR* cd;
+void enter();
+void messageHandler();
+
+int readKey() { return PS2_ESC; } /* dir() waits for a key after each screen */
+void platform_delay(int ms) { }
+uint64_t platform_micros() { return 0; }
+void debug_log(const char* format, ...) { }
+
+#define HEADER 42
+#define RAM_START 0x0200
+#define INBOX_FLAG 0x0202
+
+#define OUTSIDE_SIZE 16
+
+static std::string root; /* scratch directory, holds the card directory "sd" */
+
+static void write_file(const std::string& path, int size)
+{
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) {
+        perror(path.c_str());
+        abort();
+    }
+    for (int i = 0; i < size; i++)
+        fputc(i * 7, f);
+    fclose(f);
+}
+
+static void remove_tree(const std::string& path)
+{
+    DIR* d = opendir(path.c_str());
+    if (!d) {
+        remove(path.c_str());
+        return;
+    }
+    while (struct dirent* e = readdir(d))
+        if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0)
+            remove_tree(path + "/" + e->d_name);
+    closedir(d);
+    rmdir(path.c_str());
+}
+
+/* the card as every input finds it */
+static void reset_card()
+{
+    remove_tree(root + "/sd");
+    mkdir((root + "/sd").c_str(), 0700);
+    mkdir((root + "/sd/sub").c_str(), 0700);
+    write_file(root + "/sd/a.bin", 16);
+    write_file(root + "/sd/big.bin", 70000);
+}
+
+/* nothing outside the card directory may change */
+static void check_outside()
+{
+    struct stat st;
+    if (stat((root + "/outside.bin").c_str(), &st) != 0 || st.st_size != OUTSIDE_SIZE) {
+        fprintf(stderr, "fuzzcat: a file outside the card directory was changed\n");
+        abort();
+    }
+    DIR* d = opendir(root.c_str());
+    int entries = 0;
+    while (readdir(d))
+        entries++;
+    closedir(d);
+    if (entries != 4) { /* ".", "..", outside.bin and sd */
+        fprintf(stderr, "fuzzcat: a file was created outside the card directory\n");
+        abort();
+    }
+}
+
+static void cleanup()
+{
+    if (!root.empty())
+        remove_tree(root);
+}
+
+extern "C" int LLVMFuzzerInitialize(int* argc, char*** argv)
+{
+    char dir[] = "/tmp/fuzzcat.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        abort();
+    }
+    root = dir;
+    atexit(cleanup);
+    write_file(root + "/outside.bin", OUTSIDE_SIZE);
+    reset_card();
+    // SDCARD_MOUNT_PATH is the working directory
+    if (chdir((root + "/sd").c_str()) != 0) {
+        perror("chdir");
+        abort();
+    }
+    cat_setup();
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    uint8_t header[HEADER] = {};
+    memcpy(header, data, size < HEADER ? size : HEADER);
+
+    if (cd) {
+        closedir(cd);
+        cd = NULL;
+    }
+    if (chdir(root.c_str()) != 0)
+        abort();
+    reset_card();
+    if (chdir((root + "/sd").c_str()) != 0)
+        abort();
+
+    memset(cerb_ram, 0, sizeof cerb_ram);
+    if (size > HEADER) {
+        size_t n = size - HEADER;
+        if (n > sizeof cerb_ram - RAM_START)
+            n = sizeof cerb_ram - RAM_START;
+        memcpy(&cerb_ram[RAM_START], data + HEADER, n);
+    }
+    cpu_reset();
+    mode = header[0] & 0x40;
+    cpurunning = false;
+
+    for (int i = 0; i < 38; i++)
+        editLine[i] = header[4 + i];
+    pos = 37;
+    if (header[0] & 0x80)
+        enter();
+
+    for (int call = 0; call < (header[0] & 3); call++) {
+        cpoke(INBOX_FLAG, header[1 + call]);
+        cpurunning = true;
+        messageHandler();
+    }
+    cpurunning = false;
+
+    check_outside();
+    return 0;
+}
+
+#ifndef FUZZCAT_LIBFUZZER
+
+/* One input per command and BIOS call, hostile where the argument allows. */
+
+struct seed_input {
+    uint8_t flags;
+    uint8_t calls[3];
+    const char* line;
+    std::vector<uint8_t> ram; /* from $0200 */
+};
+
+/* inbox data pointing at $0210, followed by RAM from $0205 on */
+static std::vector<uint8_t> mailbox(std::vector<uint8_t> at_0210)
+{
+    std::vector<uint8_t> ram = { 0, 0, 0, 0x10, 0x02 };
+    ram.resize(0x10);
+    ram.insert(ram.end(), at_0210.begin(), at_0210.end());
+    return ram;
+}
+
+static std::vector<uint8_t> name(std::vector<uint8_t> head, const char* s)
+{
+    head.insert(head.end(), s, s + strlen(s) + 1);
+    return head;
+}
+
+static const std::vector<seed_input> seeds = {
+    { 0x80, {}, "load a.bin 300", {} },
+    { 0x80, {}, "load big.bin fff0", {} },
+    { 0x80, {}, "load ../outside.bin", {} },
+    { 0x80, {}, "save 0 ffff b.bin", {} },
+    { 0x80, {}, "save 0 ffffffffff c.bin", {} },
+    { 0x80, {}, "save 0 100 ../d.bin", {} },
+    { 0x80, {}, "del a.bin", {} },
+    { 0x80, {}, "del ../outside.bin", {} },
+    { 0x80, {}, "del sub", {} },
+    { 0x80, {}, "move 0 ffffffffff 8000", {} },
+    { 0x80, {}, "0x200 1 2 3 #1234", {} },
+    { 0x80, {}, "list fffffff0", {} },
+    { 0x80, {}, "dir", {} },
+    { 0x80, {}, "reset", {} },
+    { 0x80, {}, "                                      ", {} },
+    { 0x80, {}, ",,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,", {} },
+    { 0x80, {}, "abcdefghijklmnopqrstuvwxyzabcdefghijkl", {} },
+    { 0x01, { 0x02 }, "", mailbox(name({ 0x00, 0x03, 0, 0 }, "a.bin")) },
+    { 0x01, { 0x02 }, "", mailbox(name({ 0xf0, 0xff, 0, 0 }, "big.bin")) },
+    { 0x01, { 0x02 }, "", mailbox(name({ 0, 0x80, 0, 0 }, "../outside.bin")) },
+    { 0x01, { 0x02 }, "", mailbox(std::vector<uint8_t>(200, 'x')) },
+    { 0x01, { 0x03 }, "", mailbox(name({ 0x00, 0x00, 0x00, 0x00 }, "e.bin")) },
+    { 0x01, { 0x03 }, "", mailbox(name({ 0x00, 0x80, 0xff, 0xff }, "f.bin")) },
+    { 0x01, { 0x03 }, "", mailbox(name({ 0x00, 0x00, 0x10, 0x00 }, "../g.bin")) },
+    { 0x01, { 0x04 }, "", mailbox(name({}, "a.bin")) },
+    { 0x01, { 0x04 }, "", mailbox(name({}, "../outside.bin")) },
+    { 0x01, { 0x04 }, "", mailbox(name({}, "..")) },
+    { 0x03, { 0x05, 0x06, 0x06 }, "", mailbox({}) },
+    { 0x03, { 0x06, 0x06, 0x06 }, "", mailbox({}) },
+    { 0x03, { 0x05, 0x05, 0x06 }, "", mailbox({}) },
+    { 0x02, { 0x07, 0x7e }, "", mailbox({}) },
+    { 0x01, { 0x7f }, "", mailbox({}) },
+    { 0x41, { 0x02 }, "", mailbox(name({ 0x05, 0x02, 0, 0 }, "a.bin")) },
+};
+
+static std::vector<uint8_t> encode(const seed_input& s)
+{
+    std::vector<uint8_t> input(HEADER);
+    input[0] = s.flags;
+    memcpy(&input[1], s.calls, 3);
+    memset(&input[4], ' ', 38);
+    memcpy(&input[4], s.line, strlen(s.line) < 38 ? strlen(s.line) : 38);
+    if (strlen(s.line) < 38)
+        input[4 + strlen(s.line)] = 0;
+    input.insert(input.end(), s.ram.begin(), s.ram.end());
+    return input;
+}
+
+static void mutate(std::vector<uint8_t>& input)
+{
+    int edits = 1 + rand() % 8;
+    for (int i = 0; i < edits; i++) {
+        size_t at = rand() % input.size();
+        switch (rand() % 4) {
+        case 0:
+            input[at] = rand();
+            break;
+        case 1:
+            input[at] ^= 1 << (rand() % 8);
+            break;
+        case 2:
+            input[at] = "\0 ,./x\xff"[rand() % 7];
+            break;
+        case 3:
+            if (at > HEADER)
+                input.resize(at);
+            break;
+        }
+    }
+}
+
+/* the built-in inputs as a starting corpus for libFuzzer */
+static bool write_corpus(const char* dir)
+{
+    mkdir(dir, 0755);
+    for (size_t i = 0; i < seeds.size(); i++) {
+        std::string path = std::string(dir) + "/seed" + std::to_string(i);
+        FILE* f = fopen(path.c_str(), "wb");
+        if (!f) {
+            perror(path.c_str());
+            return false;
+        }
+        std::vector<uint8_t> input = encode(seeds[i]);
+        fwrite(input.data(), 1, input.size(), f);
+        fclose(f);
+    }
+    return true;
+}
+
+static bool run_file(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    std::vector<uint8_t> input;
+    int c;
+    while ((c = fgetc(f)) != EOF)
+        input.push_back(c);
+    fclose(f);
+    LLVMFuzzerTestOneInput(input.data(), input.size());
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    int runs = 5000;
+    unsigned seed = 1;
+    const char* corpus = NULL;
+    int arg;
+
+    for (arg = 1; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "-runs") == 0 && arg + 1 < argc)
+            runs = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "-seed") == 0 && arg + 1 < argc)
+            seed = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "-corpus") == 0 && arg + 1 < argc)
+            corpus = argv[++arg];
+        else {
+            fprintf(stderr, "usage: %s [-runs N] [-seed S] [-corpus DIR] [FILE...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (corpus)
+        return write_corpus(corpus) ? 0 : 1;
+
+    LLVMFuzzerInitialize(&argc, &argv);
+    if (arg < argc) {
+        int files = argc - arg;
+        for (; arg < argc; arg++)
+            if (!run_file(argv[arg]))
+                return 1;
+        printf("fuzzcat: %d files\n", files);
+        return 0;
+    }
+
+    srand(seed);
+    for (const seed_input& s : seeds) {
+        std::vector<uint8_t> input = encode(s);
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+    for (int run = 0; run < runs; run++) {
+        std::vector<uint8_t> input = encode(seeds[rand() % seeds.size()]);
+        mutate(input);
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+    printf("fuzzcat: %zu built-in inputs and %d mutations\n", seeds.size(), runs);
+    return 0;
+}
+
+#endif
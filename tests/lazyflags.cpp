@@ -0,0 +1,190 @@
+/* Check of LAZYFLAGS: the 6502 core keeping Z, N, C and V lazily against the
+ * same core working them out at every instruction.
+ *
+ *   tests/lazyflags [-v] [-seeds N] [-seed S] [-steps N]
+ *
+ * The Makefile builds this file twice: tests/lazyflags with src/fake6502.o,
+ * and tests/lazyflags-eager with fake6502.c built with FAKE6502_EAGERFLAGS.
+ * The eager one writes the CPU state after every instruction to stdout. The
+ * lazy one starts it through a pipe with the same options, runs the same
+ * random programs and compares A, X, Y, S, PC, the whole status register and
+ * the cycles after every instruction, and the memory after each program.
+ * The first difference stops the run.
+ *
+ * Half the bytes of a program are instructions that set or use the flags:
+ * ADC and SBC, also in decimal mode, compares, shifts and rotates, BIT, the
+ * flag instructions, PHP, PLP, RTI and the branches. The rest are random, and
+ * an IRQ comes now and then. All of memory is RAM.
+ *
+ * Exits with 1 on a difference.
+ */
+
+#include "../src/bus.h"
+#include "../src/fake6502.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static uint8_t ram[65536];
+uint8_t* bus_read_map[256];
+uint8_t* bus_write_map[256];
+
+uint8_t bus_page_read(uint16_t addr) { return ram[addr]; }
+void bus_page_write(uint16_t addr, uint8_t value) { ram[addr] = value; }
+
+static fake6502_context cpu;
+static bool verbose;
+
+/* after each instruction, the same on both sides */
+struct state {
+    uint16_t pc;
+    uint8_t a, x, y, s, p;
+    uint8_t cycles;
+};
+
+static void generate(unsigned seed)
+{
+    static const uint8_t flag_ops[] = {
+        0x69, 0x65, 0x6d, 0xe9, 0xe5, 0xed, // adc, sbc # zp abs
+        0xc9, 0xc5, 0xe0, 0xe4, 0xc0, 0xc4, // cmp, cpx, cpy # zp
+        0x0a, 0x06, 0x4a, 0x46, 0x2a, 0x26, 0x6a, 0x66, // asl, lsr, rol, ror a zp
+        0x24, 0x2c, 0x89, // bit zp abs #
+        0x18, 0x38, 0xb8, 0xf8, 0xd8, // clc sec clv sed cld
+        0x08, 0x28, 0x40, // php plp rti
+        0x90, 0xb0, 0x50, 0x70, 0xd0, 0xf0, 0x10, 0x30, // bcc bcs bvc bvs bne beq bpl bmi
+    };
+    srand(seed);
+    for (int i = 0; i < 65536; i++)
+        ram[i] = rand() % 2 ? flag_ops[rand() % sizeof flag_ops] : rand();
+}
+
+static void setup(unsigned seed)
+{
+    generate(seed);
+    for (int page = 0; page < 256; page++)
+        bus_read_map[page] = bus_write_map[page] = &ram[page << 8];
+    memset(&cpu, 0, sizeof cpu);
+    fake6502_reset(&cpu);
+    cpu.cpu.a = rand();
+    cpu.cpu.x = rand();
+    cpu.cpu.y = rand();
+    fake6502_set_flags(&cpu, rand());
+}
+
+static uint64_t hash_ram()
+{
+    uint64_t h = 0xcbf29ce484222325ull; // FNV-1a
+    for (int i = 0; i < 65536; i++)
+        h = (h ^ ram[i]) * 0x100000001b3ull;
+    return h;
+}
+
+static void print_state(const char* side, const state* s)
+{
+    printf("  %-5s pc=%04x a=%02x x=%02x y=%02x s=%02x p=%02x cycles %d\n",
+        side, s->pc, s->a, s->x, s->y, s->s, s->p, s->cycles);
+}
+
+/* Runs a seed. Without eager this is the eager side and writes its states to
+ * stdout, with it the states are read from there and compared. */
+static bool run_seed(unsigned seed, int steps, FILE* eager)
+{
+    setup(seed);
+    for (int step = 0; step < steps; step++) {
+        uint16_t pc = cpu.cpu.pc;
+        if (rand() % 64 == 0)
+            fake6502_irq(&cpu);
+        cpu.emu.clockticks = 0;
+        fake6502_step(&cpu);
+
+        state s;
+        memset(&s, 0, sizeof s);
+        s.pc = cpu.cpu.pc;
+        s.a = cpu.cpu.a;
+        s.x = cpu.cpu.x;
+        s.y = cpu.cpu.y;
+        s.s = cpu.cpu.s;
+        s.p = fake6502_get_flags(&cpu);
+        s.cycles = cpu.emu.clockticks;
+        if (!eager) {
+            fwrite(&s, sizeof s, 1, stdout);
+            continue;
+        }
+        state e;
+        if (fread(&e, sizeof e, 1, eager) != 1) {
+            printf("seed %u step %d: the eager core stopped\n", seed, step);
+            return false;
+        }
+        if (memcmp(&s, &e, sizeof s) != 0) {
+            printf("seed %u step %d differs, instruction %02x at %04x\n", seed, step, ram[pc], pc);
+            print_state("lazy", &s);
+            print_state("eager", &e);
+            return false;
+        }
+    }
+
+    uint64_t h = hash_ram();
+    if (!eager) {
+        fwrite(&h, sizeof h, 1, stdout);
+        return true;
+    }
+    uint64_t e;
+    if (fread(&e, sizeof e, 1, eager) != 1 || e != h) {
+        printf("seed %u: memory differs after %d steps\n", seed, steps);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned first = 1, seeds = 200;
+    int steps = 20000;
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-v") == 0)
+            verbose = true;
+        else if (strcmp(argv[arg], "-seeds") == 0 && arg + 1 < argc)
+            seeds = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "-seed") == 0 && arg + 1 < argc)
+            first = atoi(argv[++arg]), seeds = 1;
+        else if (strcmp(argv[arg], "-steps") == 0 && arg + 1 < argc)
+            steps = atoi(argv[++arg]);
+        else {
+            fprintf(stderr, "usage: %s [-v] [-seeds N] [-seed S] [-steps N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // the debug NOPs print to stderr, the eager side inherits it
+    if (!verbose) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 2);
+        close(null);
+    }
+
+#ifndef LAZYFLAGS
+    for (unsigned seed = first; seed < first + seeds; seed++)
+        run_seed(seed, steps, NULL);
+    return 0;
+#else
+    char command[1024];
+    snprintf(command, sizeof command, "%s-eager -seed %u -seeds %u -steps %d", argv[0], first, seeds, steps);
+    FILE* eager = popen(command, "r");
+    if (!eager) {
+        fprintf(stderr, "could not run %s\n", command);
+        return 1;
+    }
+    bool ok = true;
+    for (unsigned seed = first; ok && seed < first + seeds; seed++) {
+        ok = run_seed(seed, steps, eager);
+        if (ok && verbose)
+            printf("seed %u ok\n", seed);
+    }
+    pclose(eager);
+    if (ok)
+        printf("lazyflags: %u seeds of %d steps match the eager flags\n", seeds, steps);
+    return ok ? 0 : 1;
+#endif
+}
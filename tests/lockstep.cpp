@@ -0,0 +1,466 @@
+/* Lockstep differential test of the fast CPU paths against the reference
+ * interpreters.
+ *
+ *   tests/lockstep [-v] [-z80 | -z80native | -z80fast | -z80fastnative | -6502 | -6502native]
+ *                  [-seeds N] [-seed S] [-units N]
+ *
+ * For each seed a random program and memory image are generated. Then, unit
+ * by unit, the fast engine runs one call with a random cycle budget:
+ * Z80::stepBlock() (block cache, pre-decoded operands, bulk block
+ * instructions) or block6502_step() (translated blocks). The machine is
+ * rewound and the reference engine, Z80::step() or fake6502_step(), runs
+ * single instructions until it has used the same number of cycles. The
+ * registers, flags, cycle count and the memory each engine wrote must match.
+ * The first divergence stops the run with a diff of both sides.
+ *
+ * Memory writes are collected through watch handlers on every page
+ * (watch.h), so they are seen whichever path made them. No devices are on
+ * the bus, the program may use any port or address: IN reads 0 and OUT is
+ * ignored on both sides.
+ *
+ * Z80Fast runs the way the emulator runs it with -z80fast, through
+ * cpu_clockcycles() with cpu_z80fast set, against Z80Fast::step(). It leaves
+ * the undocumented X and Y flags to chance, so they are not compared.
+ *
+ * z80native, z80fastnative and 6502native are the same again with the hot
+ * blocks compiled to host code (native.h), the other runs keep them decoded
+ * or threaded. Where there is no native code both test the same thing.
+ *
+ * Exits with 1 on a divergence. With no CPU option all of them are tested.
+ */
+
+#include "../src/Z80.h"
+#include "../src/block6502.h"
+#include "../src/bus.h"
+#include "../src/cerberus.h"
+#include "../src/fake6502.h"
+#include "../src/watch.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+extern Z80 z80;
+extern Z80Fast z80fast;
+extern fake6502_context m6502;
+
+int readKey() { return 0; }
+void platform_delay(int ms) { }
+uint64_t platform_micros() { return 0; }
+void debug_log(const char* format, ...) { }
+
+#define CODE_START 0x0205
+#define MAX_BUDGET 400 /* cycles per unit, at least one instruction */
+#define MAX_INSTRUCTIONS 100000 /* the reference gives up after this many */
+
+static bool verbose;
+
+// memory writes
+
+static uint8_t shadow[65536]; /* cerb_ram as it was before the current unit */
+static std::vector<uint16_t> written;
+static bool recording;
+
+static void record_write(void* ctx, int addr, int len)
+{
+    if (recording)
+        for (int i = 0; i < len; i++)
+            written.push_back(addr + i);
+}
+
+struct writes {
+    std::vector<uint16_t> addr; /* sorted, no duplicates */
+    std::vector<uint8_t> value;
+};
+
+static void take_writes(writes* w)
+{
+    std::sort(written.begin(), written.end());
+    written.erase(std::unique(written.begin(), written.end()), written.end());
+    w->addr = written;
+    w->value.clear();
+    for (uint16_t addr : written)
+        w->value.push_back(cerb_ram[addr]);
+    written.clear();
+}
+
+/* undo the writes of the unit, as writes, so the code caches see them */
+static void rewind_memory(const writes* w)
+{
+    recording = false;
+    for (uint16_t addr : w->addr)
+        cpoke(addr, shadow[addr]);
+    recording = true;
+}
+
+static void commit_memory(const writes* w)
+{
+    for (size_t i = 0; i < w->addr.size(); i++)
+        shadow[w->addr[i]] = w->value[i];
+}
+
+static bool same_writes(const writes* a, const writes* b)
+{
+    return a->addr == b->addr && a->value == b->value;
+}
+
+static void print_writes(const char* side, const writes* w)
+{
+    printf("  %s wrote %zu bytes:", side, w->addr.size());
+    for (size_t i = 0; i < w->addr.size() && i < 16; i++)
+        printf(" %04x=%02x", w->addr[i], w->value[i]);
+    printf(w->addr.size() > 16 ? " ...\n" : "\n");
+}
+
+static void print_code(uint16_t pc)
+{
+    printf("  at %04x:", pc);
+    for (int i = 0; i < 4; i++)
+        printf(" %02x", cpeek(pc + i));
+    printf("\n");
+}
+
+/* a random program of length bytes at CODE_START, with counted loops so the
+ * fast paths get to translate it */
+static void generate(bool z80, unsigned seed, int length)
+{
+    static const uint8_t common_6502[] = {
+        0xa9, 0xa5, 0xb5, 0xad, 0xbd, 0xb9, 0xb1, 0xa2, 0xa6, 0xb6, 0xae, 0xbe, 0xa0, 0xa4, 0xb4, 0xac,
+        0xbc, 0x85, 0x95, 0x8d, 0x9d, 0x99, 0x91, 0x86, 0x8e, 0x84, 0x8c, 0x64, 0x9c, 0x09, 0x05, 0x0d,
+        0x29, 0x25, 0x2d, 0x49, 0x45, 0x4d, 0x69, 0x65, 0x6d, 0x7d, 0x79, 0x71, 0xe9, 0xe5, 0xed, 0xfd,
+        0xf9, 0xf1, 0xc9, 0xc5, 0xcd, 0xdd, 0xd9, 0xd1, 0xe0, 0xe4, 0xec, 0xc0, 0xc4, 0xcc, 0xe6, 0xf6,
+        0xee, 0xc6, 0xd6, 0xce, 0xe8, 0xc8, 0xca, 0x88, 0xaa, 0x8a, 0xa8, 0x98, 0x18, 0x38, 0x10, 0x30,
+        0x50, 0x70, 0x90, 0xb0, 0xd0, 0xf0, 0x48, 0x68, 0xf8, 0xd8, 0x20, 0x60, 0x4c, 0x0a, 0x4a, 0x2a,
+        0x6a, 0x06, 0x46, 0x26, 0x66, 0x1e, 0x7e, 0x24, 0x2c, 0x89, 0x1a, 0x3a, 0xba, 0x9a, 0xda, 0xfa,
+        0x5a, 0x7a, 0xb8, 0x12, 0xb2, 0x92, 0xa1, 0x81, 0xa7
+    };
+    static const uint8_t common_z80[] = {
+        0x3e, 0x06, 0x0e, 0x16, 0x1e, 0x26, 0x2e, 0x7e, 0x77, 0x78, 0x79, 0x47, 0x4f, 0x23, 0x2b, 0x13,
+        0x1b, 0x03, 0x0b, 0x3c, 0x3d, 0x04, 0x05, 0x0c, 0x0d, 0x80, 0x81, 0x88, 0x90, 0x98, 0xa0, 0xa8,
+        0xb0, 0xb8, 0xc6, 0xd6, 0xe6, 0xf6, 0xfe, 0x20, 0x28, 0x30, 0x38, 0x18, 0x10, 0xc5, 0xc1, 0xd5,
+        0xd1, 0xe5, 0xe1, 0xcd, 0xc9, 0x21, 0x11, 0x01, 0x2a, 0x22, 0x3a, 0x32, 0x1a, 0x12, 0xeb, 0xd9,
+        0x08, 0x27, 0x2f, 0x37, 0x3f, 0xdd, 0xfd, 0xcb, 0xed
+    };
+    static const uint8_t prefix_z80[] = { 0xcb, 0xdd, 0xfd, 0xed };
+    static const uint8_t block_z80[] = { 0xa0, 0xa1, 0xa8, 0xa9, 0xb0, 0xb1, 0xb8, 0xb9 };
+    static const uint8_t ed_z80[] = {
+        0x42, 0x4a, 0x52, 0x5a, 0x62, 0x6a, 0x72, 0x7a, 0x43, 0x4b, 0x53, 0x5b, 0x73, 0x7b, 0x44
+    };
+    static const uint8_t indexed_z80[] = {
+        0x7e, 0x77, 0x36, 0x86, 0x8e, 0x96, 0x9e, 0xa6, 0xae, 0xb6, 0xbe, 0x34, 0x35, 0x21, 0x2a, 0x22,
+        0x09, 0x19, 0x29, 0x39, 0xe5, 0xe1, 0xf9, 0x23, 0x2b, 0x24, 0x2c, 0x26, 0x2e, 0x7c, 0x85, 0x46,
+        0x66, 0x70, 0x75
+    };
+
+    memset(cerb_ram, 0, sizeof cerb_ram);
+    srand(seed);
+    uint8_t* code = &cerb_ram[CODE_START];
+    for (int i = 0; i < length; i++) {
+        if (rand() % 2)
+            code[i] = z80 ? common_z80[rand() % sizeof common_z80] : common_6502[rand() % sizeof common_6502];
+        else
+            code[i] = rand();
+        // operands: addresses in low RAM, the code or the top page
+        if (rand() % 4 == 0)
+            code[i] = rand() % 3 == 0 ? 0xff : rand() % 8;
+        // the block instructions have a fast path of their own, and the
+        // prefixed ones are decoded in advance too: prefixes come often and
+        // are followed by opcodes that take them
+        if (z80 && rand() % 8 == 0)
+            code[i] = prefix_z80[rand() % sizeof prefix_z80];
+        if (z80 && i > 0 && code[i - 1] == 0xed && rand() % 2)
+            code[i] = rand() % 2 ? block_z80[rand() % sizeof block_z80] : ed_z80[rand() % sizeof ed_z80];
+        if (z80 && i > 0 && (code[i - 1] == 0xdd || code[i - 1] == 0xfd) && rand() % 2)
+            code[i] = rand() % 4 ? indexed_z80[rand() % sizeof indexed_z80] : 0xcb;
+    }
+    // random data for the rest of low RAM and the stack
+    for (int i = 0; i < CODE_START; i++)
+        cerb_ram[i] = rand();
+    for (int i = 0; i + 40 < length; i += 40) {
+        if (z80) {
+            code[i] = 0x06; // ld b,32
+            code[i + 1] = 0x20;
+            code[i + 36] = 0x10; // djnz
+            code[i + 37] = (uint8_t)-36;
+        } else {
+            code[i] = 0xa2; // ldx #32
+            code[i + 1] = 0x20;
+            code[i + 36] = 0xca; // dex
+            code[i + 37] = 0xd0; // bne
+            code[i + 38] = (uint8_t)-37;
+        }
+    }
+    // a Z80 that strays out of the program restarts it: rst 0 and jp CODE_START
+    if (z80) {
+        memset(&code[length], 0xc7, 0x10000 - CODE_START - length);
+        cerb_ram[0] = 0xc3;
+        cerb_ram[1] = CODE_START & 0xff;
+        cerb_ram[2] = CODE_START >> 8;
+    }
+    cerb_ram[0xfffc] = CODE_START & 0xff;
+    cerb_ram[0xfffd] = CODE_START >> 8;
+    cerb_ram[0xfffe] = CODE_START & 0xff;
+    cerb_ram[0xffff] = CODE_START >> 8;
+}
+
+static void setup(bool z80_mode, unsigned seed)
+{
+    mode = z80_mode;
+    cpurunning = true;
+    init_cpus();
+    // nothing on the bus, both engines must see the same RAM and ports
+    bus_reset();
+    generate(z80_mode, seed, 64 + seed % 4000);
+    cpu_reset();
+    bus_unregister_page(BUS_IO_PAGE);
+    // reset leaves most registers as they were, start every seed from its own
+    if (z80_mode) {
+        Z80_STATE state = z80.getState();
+        for (int reg = 0; reg < 7; reg++)
+            state.registers.word[reg] = rand();
+        for (int reg = 0; reg < 4; reg++)
+            state.alternates[reg] = rand();
+        state.pc = CODE_START;
+        z80.setState(state);
+    } else {
+        m6502.cpu.a = rand();
+        m6502.cpu.x = rand();
+        m6502.cpu.y = rand();
+        fake6502_set_flags(&m6502, FAKE6502_CONSTANT_FLAG | FAKE6502_INTERRUPT_FLAG);
+    }
+    memcpy(shadow, cerb_ram, sizeof shadow);
+    for (int page = 0; page < 256; page++)
+        watch_register(page, record_write, NULL);
+    written.clear();
+    recording = true;
+}
+
+// Z80
+
+static bool same_z80(const Z80_STATE* a, const Z80_STATE* b)
+{
+    return a->status == b->status && memcmp(&a->registers, &b->registers, sizeof a->registers) == 0
+        && memcmp(a->alternates, b->alternates, sizeof a->alternates) == 0 && a->i == b->i
+        && (a->r & 0x7f) == (b->r & 0x7f) && a->pc == b->pc && a->iff1 == b->iff1 && a->iff2 == b->iff2
+        && a->im == b->im;
+}
+
+static void print_z80(const char* side, const Z80_STATE* s, int cycles)
+{
+    printf("  %s: cycles %d pc %04x af %04x bc %04x de %04x hl %04x ix %04x iy %04x sp %04x"
+           " af' %04x bc' %04x de' %04x hl' %04x i %02x r %02x iff %d%d im %d status %d\n",
+        side, cycles, s->pc & 0xffff, s->registers.word[Z80_AF], s->registers.word[Z80_BC],
+        s->registers.word[Z80_DE], s->registers.word[Z80_HL], s->registers.word[Z80_IX],
+        s->registers.word[Z80_IY], s->registers.word[Z80_SP], s->alternates[Z80_AF],
+        s->alternates[Z80_BC], s->alternates[Z80_DE], s->alternates[Z80_HL], s->i, s->r & 0x7f,
+        s->iff1, s->iff2, s->im, s->status);
+}
+
+static bool unit_z80(unsigned seed, int unit)
+{
+    Z80_STATE start = z80.getState();
+    int budget = 1 + rand() % MAX_BUDGET;
+
+    int fast_cycles = z80.stepBlock(budget);
+    Z80_STATE fast = z80.getState();
+    writes fast_writes;
+    take_writes(&fast_writes);
+
+    rewind_memory(&fast_writes);
+    z80.setState(start);
+    int cycles = 0;
+    for (int i = 0; cycles < fast_cycles && i < MAX_INSTRUCTIONS; i++)
+        cycles += z80.step();
+    Z80_STATE ref = z80.getState();
+    writes ref_writes;
+    take_writes(&ref_writes);
+    cpu_cycles += cycles;
+
+    if (cycles == fast_cycles && same_z80(&fast, &ref) && same_writes(&fast_writes, &ref_writes)) {
+        commit_memory(&ref_writes);
+        return true;
+    }
+    printf("z80 seed %u unit %d diverges, budget %d\n", seed, unit, budget);
+    print_code(start.pc);
+    print_z80("stepBlock", &fast, fast_cycles);
+    print_z80("step     ", &ref, cycles);
+    print_writes("stepBlock", &fast_writes);
+    print_writes("step     ", &ref_writes);
+    return false;
+}
+
+static Z80_STATE without_xy(Z80_STATE s)
+{
+    s.registers.word[Z80_AF] &= ~(Z80_X_FLAG | Z80_Y_FLAG);
+    s.alternates[Z80_AF] &= ~(Z80_X_FLAG | Z80_Y_FLAG);
+    return s;
+}
+
+static bool unit_z80fast(unsigned seed, int unit)
+{
+    Z80_STATE start = z80.getState();
+    int budget = 1 + rand() % MAX_BUDGET;
+
+    uint64_t before = cpu_cycles;
+    cpu_z80fast = true;
+    cpu_clockcycles(budget);
+    cpu_z80fast = false;
+    int fast_cycles = cpu_cycles - before;
+    cpu_cycles = before;
+    Z80_STATE fast = z80.getState();
+    writes fast_writes;
+    take_writes(&fast_writes);
+
+    rewind_memory(&fast_writes);
+    z80fast.setState(start);
+    int cycles = 0;
+    for (int i = 0; cycles < fast_cycles && i < MAX_INSTRUCTIONS; i++)
+        cycles += z80fast.step();
+    Z80_STATE ref = z80fast.getState();
+    writes ref_writes;
+    take_writes(&ref_writes);
+    cpu_cycles += cycles;
+
+    Z80_STATE a = without_xy(fast), b = without_xy(ref);
+    if (cycles == fast_cycles && same_z80(&a, &b) && same_writes(&fast_writes, &ref_writes)) {
+        commit_memory(&ref_writes);
+        z80.setState(ref);
+        return true;
+    }
+    printf("z80fast seed %u unit %d diverges, budget %d\n", seed, unit, budget);
+    print_code(start.pc);
+    print_z80("cpu_clockcycles", &fast, fast_cycles);
+    print_z80("step           ", &ref, cycles);
+    print_writes("cpu_clockcycles", &fast_writes);
+    print_writes("step           ", &ref_writes);
+    return false;
+}
+
+// 6502
+
+static bool same_6502(fake6502_context* a, fake6502_context* b)
+{
+    return a->cpu.a == b->cpu.a && a->cpu.x == b->cpu.x && a->cpu.y == b->cpu.y && a->cpu.s == b->cpu.s
+        && a->cpu.pc == b->cpu.pc && fake6502_get_flags(a) == fake6502_get_flags(b);
+}
+
+static void print_6502(const char* side, fake6502_context* c, int cycles)
+{
+    printf("  %s: cycles %d pc %04x a %02x x %02x y %02x s %02x p %02x\n", side, cycles, c->cpu.pc,
+        c->cpu.a, c->cpu.x, c->cpu.y, c->cpu.s, fake6502_get_flags(c));
+}
+
+static bool unit_6502(unsigned seed, int unit)
+{
+    fake6502_context start = m6502;
+    int budget = 1 + rand() % MAX_BUDGET;
+
+    int fast_cycles = block6502_step(&m6502, budget);
+    fake6502_context fast = m6502;
+    writes fast_writes;
+    take_writes(&fast_writes);
+
+    rewind_memory(&fast_writes);
+    m6502 = start;
+    int cycles = 0;
+    for (int i = 0; cycles < fast_cycles && i < MAX_INSTRUCTIONS; i++) {
+        m6502.emu.clockticks = 0;
+        fake6502_step(&m6502);
+        cycles += m6502.emu.clockticks;
+    }
+    writes ref_writes;
+    take_writes(&ref_writes);
+    cpu_cycles += cycles;
+
+    if (cycles == fast_cycles && same_6502(&fast, &m6502) && same_writes(&fast_writes, &ref_writes)) {
+        commit_memory(&ref_writes);
+        return true;
+    }
+    printf("6502 seed %u unit %d diverges, budget %d\n", seed, unit, budget);
+    print_code(start.cpu.pc);
+    print_6502("block6502_step", &fast, fast_cycles);
+    print_6502("fake6502_step ", &m6502, cycles);
+    print_writes("block6502_step", &fast_writes);
+    print_writes("fake6502_step ", &ref_writes);
+    return false;
+}
+
+enum { CPU_Z80, CPU_Z80NATIVE, CPU_Z80FAST, CPU_Z80FASTNATIVE, CPU_6502, CPU_6502NATIVE, CPUS };
+static const char* cpu_names[] = { "z80", "z80native", "z80fast", "z80fastnative", "6502", "6502native" };
+
+static bool run_seed(int cpu, unsigned seed, int units)
+{
+    native_enabled = cpu == CPU_Z80NATIVE || cpu == CPU_Z80FASTNATIVE || cpu == CPU_6502NATIVE;
+    setup(cpu != CPU_6502 && cpu != CPU_6502NATIVE, seed);
+    for (int unit = 0; unit < units; unit++) {
+        bool same;
+        if (cpu == CPU_Z80 || cpu == CPU_Z80NATIVE)
+            same = unit_z80(seed, unit);
+        else if (cpu == CPU_Z80FAST || cpu == CPU_Z80FASTNATIVE)
+            same = unit_z80fast(seed, unit);
+        else
+            same = unit_6502(seed, unit);
+        if (!same)
+            return false;
+    }
+    return true;
+}
+
+static int cpu_named(const char* name)
+{
+    for (int cpu = 0; cpu < CPUS; cpu++)
+        if (strcmp(name, cpu_names[cpu]) == 0)
+            return cpu;
+    return -1;
+}
+
+int main(int argc, char** argv)
+{
+    bool tested[CPUS] = { true, true, true, true, true, true };
+    unsigned first = 1, seeds = 200;
+    int units = 2000;
+
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-v") == 0)
+            verbose = true;
+        else if (argv[arg][0] == '-' && cpu_named(argv[arg] + 1) >= 0)
+            for (int cpu = 0; cpu < CPUS; cpu++)
+                tested[cpu] = cpu == cpu_named(argv[arg] + 1);
+        else if (strcmp(argv[arg], "-seeds") == 0 && arg + 1 < argc)
+            seeds = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "-seed") == 0 && arg + 1 < argc)
+            first = atoi(argv[++arg]), seeds = 1;
+        else if (strcmp(argv[arg], "-units") == 0 && arg + 1 < argc)
+            units = atoi(argv[++arg]);
+        else {
+            fprintf(stderr, "usage: %s [-v] [-z80 | -z80native | -z80fast | -z80fastnative | -6502 | -6502native]"
+                            " [-seeds N] [-seed S] [-units N]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+
+    cat_setup();
+    // the debug NOPs print to stderr
+    if (!verbose) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 2);
+        close(null);
+    }
+
+    for (int cpu = 0; cpu < CPUS; cpu++) {
+        if (!tested[cpu])
+            continue;
+        for (unsigned seed = first; seed < first + seeds; seed++) {
+            if (!run_seed(cpu, seed, units))
+                return 1;
+            if (verbose)
+                printf("%s seed %u ok, %llu cycles\n", cpu_names[cpu], seed, (unsigned long long)cpu_cycles);
+        }
+        printf("%s: %u seeds of %d units in lockstep\n", cpu_names[cpu], seeds, units);
+    }
+    return 0;
+}
@@ -0,0 +1,105 @@
+/* Exporter for the video captures written by the emulator (see
+ * src/capture.h). Replays the changes of every frame onto a copy of the
+ * screen memory and writes each frame as raw RGB24, 320x240, or as a Y4M
+ * stream (4:4:4, BT.601) that encoders read directly:
+ *
+ *   tools/capexport [-y4m] capture.bin out
+ *   ffmpeg -i out.y4m out.mp4
+ *   ffmpeg -f rawvideo -pix_fmt rgb24 -s 320x240 -r 50 -i out.rgb out.mp4
+ *
+ * Frames missing from the capture (dropped while recording) repeat the frame
+ * before them, so the output keeps the emulated timing.
+ */
+
+#include "../src/capture.h"
+#include "../src/screen.h"
+#include <stdio.h>
+#include <string.h>
+
+/* what screen.cpp renders from */
+uint8_t cerb_ram[65536];
+
+static uint8_t rgb[SCREEN_WIDTH * SCREEN_HEIGHT * 3];
+static uint8_t yuv[SCREEN_WIDTH * SCREEN_HEIGHT * 3];
+
+static void write_frame(FILE* out, bool y4m)
+{
+    if (!y4m) {
+        fwrite(rgb, 1, sizeof rgb, out);
+        return;
+    }
+    const int n = SCREEN_WIDTH * SCREEN_HEIGHT;
+    for (int i = 0; i < n; i++) {
+        int r = rgb[i * 3], g = rgb[i * 3 + 1], b = rgb[i * 3 + 2];
+        yuv[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+        yuv[n + i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        yuv[2 * n + i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+    fputs("FRAME\n", out);
+    fwrite(yuv, 1, sizeof yuv, out);
+}
+
+int main(int argc, char* argv[])
+{
+    bool y4m = false;
+    int arg = 1;
+    if (arg < argc && strcmp(argv[arg], "-y4m") == 0) {
+        y4m = true;
+        arg++;
+    }
+    if (argc - arg != 2) {
+        fprintf(stderr, "usage: %s [-y4m] capture.bin out\n", argv[0]);
+        return 1;
+    }
+    FILE* in = fopen(argv[arg], "rb");
+    if (!in) {
+        perror(argv[arg]);
+        return 1;
+    }
+    capture_file_header h;
+    if (fread(&h, sizeof h, 1, in) != 1 || memcmp(h.magic, CAPTURE_MAGIC, sizeof h.magic) != 0
+        || h.version != CAPTURE_VERSION || h.cols != SCREEN_COLS || h.rows != SCREEN_ROWS) {
+        fprintf(stderr, "%s: not a capture this tool can read\n", argv[arg]);
+        return 1;
+    }
+    FILE* out = strcmp(argv[arg + 1], "-") == 0 ? stdout : fopen(argv[arg + 1], "wb");
+    if (!out) {
+        perror(argv[arg + 1]);
+        return 1;
+    }
+    if (y4m)
+        fprintf(out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", SCREEN_WIDTH, SCREEN_HEIGHT, h.fps);
+
+    uint32_t frames = 0; /* written so far */
+    capture_frame_header f;
+    while (fread(&f, sizeof f, 1, in) == 1) {
+        // dropped frames show the one before
+        for (; frames && frames < f.frame; frames++)
+            write_frame(out, y4m);
+        for (int i = 0; i < f.glyphs; i++) {
+            uint8_t g[9];
+            if (fread(g, sizeof g, 1, in) != 1)
+                goto truncated;
+            memcpy(&cerb_ram[SCREEN_GLYPHS + g[0] * 8], g + 1, 8);
+        }
+        for (int i = 0; i < f.tiles; i++) {
+            uint8_t t[3];
+            if (fread(t, sizeof t, 1, in) != 1)
+                goto truncated;
+            int index = t[0] | t[1] << 8;
+            if (index < SCREEN_COLS * SCREEN_ROWS)
+                cerb_ram[SCREEN_TILES + index] = t[2];
+        }
+        screen_render(rgb);
+        write_frame(out, y4m);
+        frames = f.frame + 1;
+    }
+    fprintf(stderr, "%u frames\n", frames);
+    fclose(out);
+    return 0;
+
+truncated:
+    fprintf(stderr, "capture cut short after %u frames\n", frames);
+    fclose(out);
+    return 1;
+}
@@ -0,0 +1,490 @@
+/* Offline decoder for the instruction trace written by the emulator (see
+ * src/trace.h). Prints the records oldest first with a disassembly of each
+ * instruction and the register state before it executed.
+ *
+ *   tools/tracedump [trace.bin]
+ */
+
+#include "../src/trace.h"
+#include <stdio.h>
+#include <string.h>
+
+/* 6502 (as executed by src/fake6502.c in CMOS6502 mode) */
+
+enum {
+    M_IMP,
+    M_ACC,
+    M_IMM,
+    M_ZP,
+    M_ZPX,
+    M_ZPY,
+    M_REL,
+    M_ABS,
+    M_ABSX,
+    M_ABSY,
+    M_IND,
+    M_ABSXI,
+    M_INDX,
+    M_INDY,
+    M_ZPI,
+};
+
+static const struct {
+    const char* mnemonic;
+    int mode;
+} op6502[256] = {
+    /* 00 */ { "brk", M_IMP }, { "ora", M_INDX }, { "nop", M_IMP }, { "slo", M_INDX },
+    /* 04 */ { "tsb", M_ZP }, { "ora", M_ZP }, { "asl", M_ZP }, { "slo", M_ZP },
+    /* 08 */ { "php", M_IMP }, { "ora", M_IMM }, { "asl", M_ACC }, { "nop", M_IMM },
+    /* 0C */ { "tsb", M_ABS }, { "ora", M_ABS }, { "asl", M_ABS }, { "slo", M_ABS },
+    /* 10 */ { "bpl", M_REL }, { "ora", M_INDY }, { "ora", M_ZPI }, { "slo", M_INDY },
+    /* 14 */ { "trb", M_ZP }, { "ora", M_ZPX }, { "asl", M_ZPX }, { "slo", M_ZPX },
+    /* 18 */ { "clc", M_IMP }, { "ora", M_ABSY }, { "inc", M_ACC }, { "slo", M_ABSY },
+    /* 1C */ { "trb", M_ABS }, { "ora", M_ABSX }, { "asl", M_ABSX }, { "slo", M_ABSX },
+    /* 20 */ { "jsr", M_ABS }, { "and", M_INDX }, { "nop", M_IMP }, { "rla", M_INDX },
+    /* 24 */ { "bit", M_ZP }, { "and", M_ZP }, { "rol", M_ZP }, { "rla", M_ZP },
+    /* 28 */ { "plp", M_IMP }, { "and", M_IMM }, { "rol", M_ACC }, { "nop", M_IMM },
+    /* 2C */ { "bit", M_ABS }, { "and", M_ABS }, { "rol", M_ABS }, { "rla", M_ABS },
+    /* 30 */ { "bmi", M_REL }, { "and", M_INDY }, { "adc", M_ZPI }, { "rla", M_INDY },
+    /* 34 */ { "bit", M_ZPX }, { "and", M_ZPX }, { "rol", M_ZPX }, { "rla", M_ZPX },
+    /* 38 */ { "sec", M_IMP }, { "and", M_ABSY }, { "dec", M_ACC }, { "rla", M_ABSY },
+    /* 3C */ { "bit", M_ABSX }, { "and", M_ABSX }, { "rol", M_ABSX }, { "rla", M_ABSX },
+    /* 40 */ { "rti", M_IMP }, { "eor", M_INDX }, { "nop", M_IMP }, { "sre", M_INDX },
+    /* 44 */ { "nop", M_ZP }, { "eor", M_ZP }, { "lsr", M_ZP }, { "sre", M_ZP },
+    /* 48 */ { "pha", M_IMP }, { "eor", M_IMM }, { "lsr", M_ACC }, { "nop", M_IMM },
+    /* 4C */ { "jmp", M_ABS }, { "eor", M_ABS }, { "lsr", M_ABS }, { "sre", M_ABS },
+    /* 50 */ { "bvc", M_REL }, { "eor", M_INDY }, { "eor", M_ZPI }, { "sre", M_INDY },
+    /* 54 */ { "nop", M_ZPX }, { "eor", M_ZPX }, { "lsr", M_ZPX }, { "sre", M_ZPX },
+    /* 58 */ { "cli", M_IMP }, { "eor", M_ABSY }, { "phy", M_IMP }, { "sre", M_ABSY },
+    /* 5C */ { "nop", M_ABSX }, { "eor", M_ABSX }, { "lsr", M_ABSX }, { "sre", M_ABSX },
+    /* 60 */ { "rts", M_IMP }, { "adc", M_INDX }, { "nop", M_IMP }, { "rra", M_INDX },
+    /* 64 */ { "stz", M_ZP }, { "adc", M_ZP }, { "ror", M_ZP }, { "rra", M_ZP },
+    /* 68 */ { "pla", M_IMP }, { "adc", M_IMM }, { "ror", M_ACC }, { "nop", M_IMM },
+    /* 6C */ { "jmp", M_IND }, { "adc", M_ABS }, { "ror", M_ABS }, { "rra", M_ABS },
+    /* 70 */ { "bvs", M_REL }, { "adc", M_INDY }, { "adc", M_ZPI }, { "rra", M_INDY },
+    /* 74 */ { "stz", M_ZPX }, { "adc", M_ZPX }, { "ror", M_ZPX }, { "rra", M_ZPX },
+    /* 78 */ { "sei", M_IMP }, { "adc", M_ABSY }, { "ply", M_IMP }, { "rra", M_ABSY },
+    /* 7C */ { "jmp", M_ABSXI }, { "adc", M_ABSX }, { "ror", M_ABSX }, { "rra", M_ABSX },
+    /* 80 */ { "bra", M_REL }, { "sta", M_INDX }, { "nop", M_IMM }, { "sax", M_INDX },
+    /* 84 */ { "sty", M_ZP }, { "sta", M_ZP }, { "stx", M_ZP }, { "sax", M_ZP },
+    /* 88 */ { "dey", M_IMP }, { "bit", M_IMM }, { "txa", M_IMP }, { "nop", M_IMM },
+    /* 8C */ { "sty", M_ABS }, { "sta", M_ABS }, { "stx", M_ABS }, { "sax", M_ABS },
+    /* 90 */ { "bcc", M_REL }, { "sta", M_INDY }, { "sta", M_ZPI }, { "nop", M_INDY },
+    /* 94 */ { "sty", M_ZPX }, { "sta", M_ZPX }, { "stx", M_ZPY }, { "sax", M_ZPY },
+    /* 98 */ { "tya", M_IMP }, { "sta", M_ABSY }, { "txs", M_IMP }, { "nop", M_ABSY },
+    /* 9C */ { "stz", M_ABS }, { "sta", M_ABSX }, { "stz", M_ABSX }, { "nop", M_ABSY },
+    /* A0 */ { "ldy", M_IMM }, { "lda", M_INDX }, { "ldx", M_IMM }, { "lax", M_INDX },
+    /* A4 */ { "ldy", M_ZP }, { "lda", M_ZP }, { "ldx", M_ZP }, { "lax", M_ZP },
+    /* A8 */ { "tay", M_IMP }, { "lda", M_IMM }, { "tax", M_IMP }, { "nop", M_IMM },
+    /* AC */ { "ldy", M_ABS }, { "lda", M_ABS }, { "ldx", M_ABS }, { "lax", M_ABS },
+    /* B0 */ { "bcs", M_REL }, { "lda", M_INDY }, { "lda", M_ZPI }, { "lax", M_INDY },
+    /* B4 */ { "ldy", M_ZPX }, { "lda", M_ZPX }, { "ldx", M_ZPY }, { "lax", M_ZPY },
+    /* B8 */ { "clv", M_IMP }, { "lda", M_ABSY }, { "tsx", M_IMP }, { "lax", M_ABSY },
+    /* BC */ { "ldy", M_ABSX }, { "lda", M_ABSX }, { "ldx", M_ABSY }, { "lax", M_ABSY },
+    /* C0 */ { "cpy", M_IMM }, { "cmp", M_INDX }, { "nop", M_IMM }, { "dcp", M_INDX },
+    /* C4 */ { "cpy", M_ZP }, { "cmp", M_ZP }, { "dec", M_ZP }, { "dcp", M_ZP },
+    /* C8 */ { "iny", M_IMP }, { "cmp", M_IMM }, { "dex", M_IMP }, { "nop", M_IMM },
+    /* CC */ { "cpy", M_ABS }, { "cmp", M_ABS }, { "dec", M_ABS }, { "dcp", M_ABS },
+    /* D0 */ { "bne", M_REL }, { "cmp", M_INDY }, { "cmp", M_ZPI }, { "dcp", M_INDY },
+    /* D4 */ { "nop", M_ZPX }, { "cmp", M_ZPX }, { "dec", M_ZPX }, { "dcp", M_ZPX },
+    /* D8 */ { "cld", M_IMP }, { "cmp", M_ABSY }, { "phx", M_IMP }, { "dcp", M_ABSY },
+    /* DC */ { "nop", M_ABSX }, { "cmp", M_ABSX }, { "dec", M_ABSX }, { "dcp", M_ABSX },
+    /* E0 */ { "cpx", M_IMM }, { "sbc", M_INDX }, { "nop", M_IMM }, { "isb", M_INDX },
+    /* E4 */ { "cpx", M_ZP }, { "sbc", M_ZP }, { "inc", M_ZP }, { "isb", M_ZP },
+    /* E8 */ { "inx", M_IMP }, { "sbc", M_IMM }, { "nop", M_IMP }, { "sbc", M_IMM },
+    /* EC */ { "cpx", M_ABS }, { "sbc", M_ABS }, { "inc", M_ABS }, { "isb", M_ABS },
+    /* F0 */ { "beq", M_REL }, { "sbc", M_INDY }, { "sbc", M_ZPI }, { "isb", M_INDY },
+    /* F4 */ { "nop", M_ZPX }, { "sbc", M_ZPX }, { "inc", M_ZPX }, { "isb", M_ZPX },
+    /* F8 */ { "sed", M_IMP }, { "sbc", M_ABSY }, { "plx", M_IMP }, { "isb", M_ABSY },
+    /* FC */ { "nop", M_ABSX }, { "sbc", M_ABSX }, { "inc", M_ABSX }, { "isb", M_ABSX },
+};
+
+static int disasm_6502(const uint8_t* op, uint16_t pc, char* out, size_t n)
+{
+    const char* m = op6502[op[0]].mnemonic;
+    uint16_t nn = op[1] | (op[2] << 8);
+    switch (op6502[op[0]].mode) {
+    case M_IMP:
+        snprintf(out, n, "%s", m);
+        return 1;
+    case M_ACC:
+        snprintf(out, n, "%s a", m);
+        return 1;
+    case M_IMM:
+        snprintf(out, n, "%s #$%02x", m, op[1]);
+        return 2;
+    case M_ZP:
+        snprintf(out, n, "%s $%02x", m, op[1]);
+        return 2;
+    case M_ZPX:
+        snprintf(out, n, "%s $%02x,x", m, op[1]);
+        return 2;
+    case M_ZPY:
+        snprintf(out, n, "%s $%02x,y", m, op[1]);
+        return 2;
+    case M_REL:
+        snprintf(out, n, "%s $%04x", m, (uint16_t)(pc + 2 + (int8_t)op[1]));
+        return 2;
+    case M_ABS:
+        snprintf(out, n, "%s $%04x", m, nn);
+        return 3;
+    case M_ABSX:
+        snprintf(out, n, "%s $%04x,x", m, nn);
+        return 3;
+    case M_ABSY:
+        snprintf(out, n, "%s $%04x,y", m, nn);
+        return 3;
+    case M_IND:
+        snprintf(out, n, "%s ($%04x)", m, nn);
+        return 3;
+    case M_ABSXI:
+        snprintf(out, n, "%s ($%04x,x)", m, nn);
+        return 3;
+    case M_INDX:
+        snprintf(out, n, "%s ($%02x,x)", m, op[1]);
+        return 2;
+    case M_INDY:
+        snprintf(out, n, "%s ($%02x),y", m, op[1]);
+        return 2;
+    case M_ZPI:
+    default:
+        snprintf(out, n, "%s ($%02x)", m, op[1]);
+        return 2;
+    }
+}
+
+/* Z80, decoded following the x/y/z/p/q opcode split used by src/Z80.cpp */
+
+static const char* const r8[8] = { "b", "c", "d", "e", "h", "l", "(hl)", "a" };
+static const char* const rp[4] = { "bc", "de", "hl", "sp" };
+static const char* const rp2[4] = { "bc", "de", "hl", "af" };
+static const char* const cc[8] = { "nz", "z", "nc", "c", "po", "pe", "p", "m" };
+static const char* const alu[8] = { "add a,", "adc a,", "sub ", "sbc a,", "and ", "xor ", "or ", "cp " };
+static const char* const rot[8] = { "rlc", "rrc", "rl", "rr", "sla", "sra", "sll", "srl" };
+static const char* const bli[4][4] = {
+    { "ldi", "cpi", "ini", "outi" },
+    { "ldd", "cpd", "ind", "outd" },
+    { "ldir", "cpir", "inir", "otir" },
+    { "lddr", "cpdr", "indr", "otdr" },
+};
+static const char* const im[8] = { "0", "0/1", "1", "2", "0", "0/1", "1", "2" };
+
+static int disasm_z80(const uint8_t* op, uint16_t pc, char* out, size_t n)
+{
+    const char* hl = "hl";
+    const char* ixh = "h";
+    const char* ixl = "l";
+    char ind[16] = "(hl)";
+    int len = 0;
+    int idx = 0;
+
+    if (op[0] == 0xdd || op[0] == 0xfd) {
+        idx = 1;
+        hl = op[0] == 0xdd ? "ix" : "iy";
+        ixh = op[0] == 0xdd ? "ixh" : "iyh";
+        ixl = op[0] == 0xdd ? "ixl" : "iyl";
+        if (op[1] == 0xdd || op[1] == 0xfd || op[1] == 0xed) {
+            snprintf(out, n, "db $%02x", op[0]);
+            return 1;
+        }
+        op++;
+        len = 1;
+    }
+
+    const int x = op[0] >> 6, y = (op[0] >> 3) & 7, z = op[0] & 7, p = y >> 1, q = y & 1;
+
+    // an indexed instruction takes its displacement right after the opcode,
+    // shifting any immediate operand along by one byte
+    int d = 0;
+    auto reg = [&](int r) -> const char* {
+        if (!idx)
+            return r8[r];
+        if (r == 4)
+            return ixh;
+        if (r == 5)
+            return ixl;
+        return r == 6 ? ind : r8[r];
+    };
+    auto uses_ind = [&](int r) { return idx && r == 6; };
+    auto set_ind = [&](int8_t disp) {
+        snprintf(ind, sizeof ind, "(%s%c$%02x)", hl, disp < 0 ? '-' : '+', disp < 0 ? -disp : disp);
+        d = 1;
+    };
+    auto imm8 = [&]() { return op[1 + d]; };
+    auto imm16 = [&]() { return (uint16_t)(op[1 + d] | (op[2 + d] << 8)); };
+
+    if (op[0] == 0xcb) {
+        const uint8_t* cb = op + 1;
+        const char* target;
+        char extra[8] = "";
+        if (idx) {
+            set_ind((int8_t)op[1]);
+            cb = op + 2;
+            target = ind;
+        }
+        const int cx = cb[0] >> 6, cy = (cb[0] >> 3) & 7, cz = cb[0] & 7;
+        if (!idx)
+            target = r8[cz];
+        else if (cz != 6)
+            snprintf(extra, sizeof extra, ",%s", r8[cz]);
+        if (cx == 0)
+            snprintf(out, n, "%s %s%s", rot[cy], target, extra);
+        else
+            snprintf(out, n, "%s %d,%s%s", cx == 1 ? "bit" : cx == 2 ? "res" : "set", cy, target, cx == 1 ? "" : extra);
+        return len + (idx ? 3 : 2);
+    }
+
+    if (op[0] == 0xed) {
+        const int ex = op[1] >> 6, ey = (op[1] >> 3) & 7, ez = op[1] & 7, ep = ey >> 1, eq = ey & 1;
+        const uint16_t nn = op[2] | (op[3] << 8);
+        if (ex == 1) {
+            switch (ez) {
+            case 0:
+                if (ey == 6)
+                    snprintf(out, n, "in (c)");
+                else
+                    snprintf(out, n, "in %s,(c)", r8[ey]);
+                return 2;
+            case 1:
+                if (ey == 6)
+                    snprintf(out, n, "out (c),0");
+                else
+                    snprintf(out, n, "out (c),%s", r8[ey]);
+                return 2;
+            case 2:
+                snprintf(out, n, "%s hl,%s", eq ? "adc" : "sbc", rp[ep]);
+                return 2;
+            case 3:
+                if (eq)
+                    snprintf(out, n, "ld %s,($%04x)", rp[ep], nn);
+                else
+                    snprintf(out, n, "ld ($%04x),%s", nn, rp[ep]);
+                return 4;
+            case 4:
+                snprintf(out, n, "neg");
+                return 2;
+            case 5:
+                snprintf(out, n, ey == 1 ? "reti" : "retn");
+                return 2;
+            case 6:
+                snprintf(out, n, "im %s", im[ey]);
+                return 2;
+            default: {
+                static const char* const misc[8] = { "ld i,a", "ld r,a", "ld a,i", "ld a,r", "rrd", "rld", "nop*", "nop*" };
+                snprintf(out, n, "%s", misc[ey]);
+                return 2;
+            }
+            }
+        }
+        if (ex == 2 && ez <= 3 && ey >= 4) {
+            snprintf(out, n, "%s", bli[ey - 4][ez]);
+            return 2;
+        }
+        snprintf(out, n, "nop* ; ed %02x", op[1]);
+        return 2;
+    }
+
+    switch (x) {
+    case 0:
+        switch (z) {
+        case 0:
+            if (y == 0)
+                snprintf(out, n, "nop");
+            else if (y == 1)
+                snprintf(out, n, "ex af,af'");
+            else {
+                uint16_t dest = pc + len + 2 + (int8_t)op[1];
+                if (y == 2)
+                    snprintf(out, n, "djnz $%04x", dest);
+                else if (y == 3)
+                    snprintf(out, n, "jr $%04x", dest);
+                else
+                    snprintf(out, n, "jr %s,$%04x", cc[y - 4], dest);
+                return len + 2;
+            }
+            return len + 1;
+        case 1:
+            if (q) {
+                snprintf(out, n, "add %s,%s", hl, p == 2 ? hl : rp[p]);
+                return len + 1;
+            }
+            snprintf(out, n, "ld %s,$%04x", p == 2 ? hl : rp[p], imm16());
+            return len + 3;
+        case 2: {
+            static const char* const fmt[2][4] = {
+                { "ld (bc),a", "ld (de),a", "ld ($%04x),%s", "ld ($%04x),a" },
+                { "ld a,(bc)", "ld a,(de)", "ld %s,($%04x)", "ld a,($%04x)" },
+            };
+            if (p < 2) {
+                snprintf(out, n, "%s", fmt[q][p]);
+                return len + 1;
+            }
+            if (p == 2) {
+                if (q)
+                    snprintf(out, n, fmt[q][p], hl, imm16());
+                else
+                    snprintf(out, n, fmt[q][p], imm16(), hl);
+            } else
+                snprintf(out, n, fmt[q][p], imm16());
+            return len + 3;
+        }
+        case 3:
+            snprintf(out, n, "%s %s", q ? "dec" : "inc", p == 2 ? hl : rp[p]);
+            return len + 1;
+        case 4:
+        case 5:
+            if (uses_ind(y))
+                set_ind((int8_t)op[1]);
+            snprintf(out, n, "%s %s", z == 4 ? "inc" : "dec", reg(y));
+            return len + 1 + d;
+        case 6:
+            if (uses_ind(y))
+                set_ind((int8_t)op[1]);
+            snprintf(out, n, "ld %s,$%02x", reg(y), imm8());
+            return len + 2 + d;
+        default: {
+            static const char* const misc[8] = { "rlca", "rrca", "rla", "rra", "daa", "cpl", "scf", "ccf" };
+            snprintf(out, n, "%s", misc[y]);
+            return len + 1;
+        }
+        }
+    case 1:
+        if (y == 6 && z == 6) {
+            snprintf(out, n, "halt");
+            return len + 1;
+        }
+        if (uses_ind(y) || uses_ind(z)) {
+            // "ld h,(ix+d)" keeps the plain h and l registers
+            set_ind((int8_t)op[1]);
+            snprintf(out, n, "ld %s,%s", y == 6 ? ind : r8[y], z == 6 ? ind : r8[z]);
+            return len + 2;
+        }
+        snprintf(out, n, "ld %s,%s", reg(y), reg(z));
+        return len + 1;
+    case 2:
+        if (uses_ind(z))
+            set_ind((int8_t)op[1]);
+        snprintf(out, n, "%s%s", alu[y], reg(z));
+        return len + 1 + d;
+    default:
+        switch (z) {
+        case 0:
+            snprintf(out, n, "ret %s", cc[y]);
+            return len + 1;
+        case 1:
+            if (!q)
+                snprintf(out, n, "pop %s", p == 2 ? hl : rp2[p]);
+            else if (p == 0)
+                snprintf(out, n, "ret");
+            else if (p == 1)
+                snprintf(out, n, "exx");
+            else if (p == 2)
+                snprintf(out, n, "jp (%s)", hl);
+            else
+                snprintf(out, n, "ld sp,%s", hl);
+            return len + 1;
+        case 2:
+            snprintf(out, n, "jp %s,$%04x", cc[y], imm16());
+            return len + 3;
+        case 3:
+            switch (y) {
+            case 0:
+                snprintf(out, n, "jp $%04x", imm16());
+                return len + 3;
+            case 2:
+                snprintf(out, n, "out ($%02x),a", imm8());
+                return len + 2;
+            case 3:
+                snprintf(out, n, "in a,($%02x)", imm8());
+                return len + 2;
+            case 4:
+                snprintf(out, n, "ex (sp),%s", hl);
+                return len + 1;
+            case 5:
+                snprintf(out, n, "ex de,hl");
+                return len + 1;
+            case 6:
+                snprintf(out, n, "di");
+                return len + 1;
+            default:
+                snprintf(out, n, "ei");
+                return len + 1;
+            }
+        case 4:
+            snprintf(out, n, "call %s,$%04x", cc[y], imm16());
+            return len + 3;
+        case 5:
+            if (!q) {
+                snprintf(out, n, "push %s", p == 2 ? hl : rp2[p]);
+                return len + 1;
+            }
+            snprintf(out, n, "call $%04x", imm16());
+            return len + 3;
+        case 6:
+            snprintf(out, n, "%s$%02x", alu[y], imm8());
+            return len + 2;
+        default:
+            snprintf(out, n, "rst $%02x", y * 8);
+            return len + 1;
+        }
+    }
+}
+
+static const char* const reasons[] = { "stopped (F12)", "unknown BIOS call", "trap address reached", "trace port snapshots" };
+
+int main(int argc, char* argv[])
+{
+    const char* filename = argc > 1 ? argv[1] : TRACE_FILENAME;
+    FILE* f = fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "could not open %s\n", filename);
+        return 1;
+    }
+
+    trace_file_header h;
+    if (fread(&h, sizeof h, 1, f) != 1 || memcmp(h.magic, TRACE_MAGIC, sizeof h.magic) != 0) {
+        fprintf(stderr, "%s is not a trace file\n", filename);
+        return 1;
+    }
+    if (h.version != TRACE_VERSION || h.record_size != sizeof(trace_record)) {
+        fprintf(stderr, "%s: unsupported trace version %d (record size %d)\n", filename, h.version, h.record_size);
+        return 1;
+    }
+
+    if (h.count == TRACE_COUNT_STREAM)
+        printf("; %s trace, streamed, %s from cycle %llu\n",
+            h.cpu == TRACE_CPU_Z80 ? "Z80" : "6502",
+            h.reason < sizeof reasons / sizeof *reasons ? reasons[h.reason] : "unknown reason",
+            (unsigned long long)h.cycles);
+    else
+        printf("; %s trace, %u records, %s at cycle %llu\n",
+            h.cpu == TRACE_CPU_Z80 ? "Z80" : "6502",
+            h.count,
+            h.reason < sizeof reasons / sizeof *reasons ? reasons[h.reason] : "unknown reason",
+            (unsigned long long)h.cycles);
+
+    trace_record t;
+    uint32_t prev_cycle = 0;
+    for (uint32_t i = 0; i < h.count && fread(&t, sizeof t, 1, f) == 1; i++) {
+        char text[32];
+        int len;
+        if (h.cpu == TRACE_CPU_Z80)
+            len = disasm_z80(t.op, t.pc, text, sizeof text);
+        else
+            len = disasm_6502(t.op, t.pc, text, sizeof text);
+
+        char bytes[16] = "";
+        for (int b = 0; b < len && b < 4; b++)
+            snprintf(bytes + b * 3, sizeof bytes - b * 3, "%02x ", t.op[b]);
+
+        printf("%10u %+5d  %04x  %-12s %-20s", t.cycle, i ? (int)(t.cycle - prev_cycle) : 0, t.pc, bytes, text);
+        if (h.cpu == TRACE_CPU_Z80)
+            printf("af=%04x bc=%04x de=%04x hl=%04x ix=%04x iy=%04x sp=%04x\n",
+                t.r[0], t.r[1], t.r[2], t.r[3], t.r[4], t.r[5], t.sp);
+        else
+            printf("a=%02x x=%02x y=%02x p=%02x s=%02x\n", t.r[0], t.r[1], t.r[2], trace_6502_flags(&t), t.sp);
+        prev_cycle = t.cycle;
+    }
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,142 @@
+/* Cost of the write tracking in src/watch.h.
+ *
+ * Runs a Z80 and a 6502 loop that store to a 16K buffer, once as the
+ * emulator does without anyone reading the dirty pages, once with
+ * watch_harvest() after every 20 ms frame, and once with a handler watching
+ * every page of the buffer. Also times cpoke() on its own. Each figure is the
+ * best of five runs. Build the same tool from an older tree, with the
+ * harvest and watch runs taken out, to compare against it.
+ *
+ *   make tools/watchbench && tools/watchbench
+ */
+
+#include "../src/cerberus.h"
+#include "../src/watch.h"
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+
+int readKey() { return 0; }
+void platform_delay(int ms) { }
+uint64_t platform_micros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+void debug_log(const char* format, ...) { }
+
+enum {
+    PLAIN,
+    HARVEST,
+    WATCH,
+};
+
+static const char* const run_names[] = { "plain", "harvest", "watch" };
+
+#define FRAMES 1000
+#define FRAME_CYCLES 160000 /* 8 MHz for 20 ms */
+#define BUFFER 0x4000 /* 16K at $4000 */
+
+/* ld hl,$4000; ld bc,$4000; loop: ld (hl),a; inc hl; inc a; dec bc; ld d,a;
+ * ld a,b; or c; ld a,d; jr nz,loop; jp $0205 */
+static const uint8_t z80_fill[] = {
+    0x21, 0x00, 0x40, 0x01, 0x00, 0x40, 0x77, 0x23, 0x3c, 0x0b, 0x57,
+    0x78, 0xb1, 0x7a, 0x20, 0xf6, 0xc3, 0x05, 0x02
+};
+
+/* lda #$40; sta $11; ldy #0; sty $10; loop: sta ($10),y; iny; bne loop;
+ * inc $11; ldx $11; cpx #$80; bne loop; jmp $0205 */
+static const uint8_t m6502_fill[] = {
+    0xa9, 0x40, 0x85, 0x11, 0xa0, 0x00, 0x84, 0x10, 0x91, 0x10, 0xc8, 0xd0,
+    0xfb, 0xe6, 0x11, 0xa6, 0x11, 0xe0, 0x80, 0xd0, 0xf3, 0x4c, 0x05, 0x02
+};
+
+static long watched_writes;
+
+static void count_write(void* ctx, int addr, int len)
+{
+    watched_writes += len;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point t0)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+/* emulated MHz */
+static double run_cpu(bool z80, int run)
+{
+    const uint8_t* code = z80 ? z80_fill : m6502_fill;
+    int length = z80 ? sizeof z80_fill : sizeof m6502_fill;
+    uint32_t dirty[8];
+
+    mode = z80;
+    init_cpus();
+    memset(cerb_ram, 0, sizeof cerb_ram);
+    memcpy(&cerb_ram[0x205], code, length);
+    cerb_ram[0xfffc] = 0x05;
+    cerb_ram[0xfffd] = 0x02;
+    cpu_reset();
+    if (run == WATCH)
+        for (int page = BUFFER >> 8; page < (2 * BUFFER) >> 8; page++)
+            watch_register(page, count_write, NULL);
+    cpurunning = true;
+
+    uint64_t start = cpu_cycles;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < FRAMES; frame++) {
+        cpu_clockcycles(FRAME_CYCLES);
+        if (run == HARVEST)
+            watch_harvest(dirty);
+    }
+    double s = seconds_since(t0);
+    cpurunning = false;
+    watch_reset();
+    return (cpu_cycles - start) / s / 1e6;
+}
+
+/* ns per cpoke() */
+static double run_cpoke(int run)
+{
+    uint32_t dirty[8];
+
+    init_cpus();
+    if (run == WATCH)
+        for (int page = BUFFER >> 8; page < (2 * BUFFER) >> 8; page++)
+            watch_register(page, count_write, NULL);
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < FRAMES * 16; frame++) {
+        for (int addr = BUFFER; addr < 2 * BUFFER; addr++)
+            cpoke(addr, addr + frame);
+        if (run == HARVEST)
+            watch_harvest(dirty);
+    }
+    double s = seconds_since(t0);
+    watch_reset();
+    return s * 1e9 / ((double)FRAMES * 16 * BUFFER);
+}
+
+static double best(double (*f)(int), int run, bool lowest)
+{
+    double b = f(run);
+    for (int i = 1; i < 5; i++) {
+        double v = f(run);
+        if (lowest ? v < b : v > b)
+            b = v;
+    }
+    return b;
+}
+
+static double run_z80(int run) { return run_cpu(true, run); }
+static double run_6502(int run) { return run_cpu(false, run); }
+
+int main(int argc, char** argv)
+{
+    cat_setup();
+    printf("%-8s %10s %10s %12s\n", "", "Z80 MHz", "6502 MHz", "cpoke ns");
+    for (int run = PLAIN; run <= WATCH; run++)
+        printf("%-8s %10.1f %10.1f %12.3f\n", run_names[run],
+            best(run_z80, run, false), best(run_6502, run, false), best(run_cpoke, run, true));
+    printf("watched writes: %ld\n", watched_writes);
+    return 0;
+}